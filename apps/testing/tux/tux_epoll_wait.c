@@ -0,0 +1,144 @@
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* epoll_wait callers must not wait on each other: a timeout of 0 returns
+ * at once and a timed one on time while another thread sleeps in
+ * epoll_wait(-1).  The interest list mixes a pipe, which NuttX serves, and
+ * a socket, which Linux does.  Edge-triggered fds report a change once,
+ * and poll() over both kinds sees the Linux one. */
+
+static int failed;
+static int ep;
+static int pipefd[2];
+static int sv[2];
+
+static void check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if(!ok)
+        failed = 1;
+}
+
+static long elapsed_ms(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void watchdog(int signo)
+{
+    (void)signo;
+    printf("FAIL: stuck\n");
+    _exit(1);
+}
+
+static void *blocked_waiter(void *arg)
+{
+    struct epoll_event ev;
+    long n;
+
+    (void)arg;
+    n = epoll_wait(ep, &ev, 1, -1);
+    return (void *)(n == 1 && ev.data.fd == pipefd[0] ? 1L : 0L);
+}
+
+static void test_concurrent(void)
+{
+    struct epoll_event ev[4];
+    struct timespec start;
+    pthread_t thread;
+    void *ret;
+    long ms;
+    int n;
+
+    pthread_create(&thread, NULL, blocked_waiter, NULL);
+    usleep(200000);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = epoll_wait(ep, ev, 4, 0);
+    ms = elapsed_ms(&start);
+    check(n == 0 && ms < 100, "epoll_wait(0) beside epoll_wait(-1)");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = epoll_wait(ep, ev, 4, 100);
+    ms = elapsed_ms(&start);
+    check(n == 0 && ms >= 90 && ms < 1000, "epoll_wait(100) beside epoll_wait(-1)");
+
+    write(pipefd[1], "x", 1);
+    pthread_join(thread, &ret);
+    check(ret != NULL, "epoll_wait(-1) woken by the pipe");
+
+    read(pipefd[0], ev, 1);
+}
+
+static void test_edge(void)
+{
+    struct epoll_event ev;
+    char c;
+    int et;
+
+    et = epoll_create1(0);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = pipefd[0];
+    epoll_ctl(et, EPOLL_CTL_ADD, pipefd[0], &ev);
+
+    write(pipefd[1], "x", 1);
+    check(epoll_wait(et, &ev, 1, 0) == 1, "EPOLLET reports new data");
+    check(epoll_wait(et, &ev, 1, 0) == 0, "EPOLLET reports it once");
+    check(epoll_wait(ep, &ev, 1, 0) == 1, "level-triggered keeps reporting");
+
+    read(pipefd[0], &c, 1);
+    close(et);
+}
+
+static void test_poll(void)
+{
+    struct pollfd fds[2];
+
+    fds[0].fd = pipefd[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = sv[0];
+    fds[1].events = POLLIN;
+
+    write(sv[1], "x", 1);
+    check(poll(fds, 2, 1000) == 1 && !fds[0].revents && (fds[1].revents & POLLIN),
+          "poll() over a pipe and a socket");
+}
+
+int main(void)
+{
+    struct epoll_event ev;
+
+    signal(SIGALRM, watchdog);
+    alarm(10);
+
+    if(pipe(pipefd) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    ep = epoll_create1(0);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = pipefd[0];
+    epoll_ctl(ep, EPOLL_CTL_ADD, pipefd[0], &ev);
+    ev.data.fd = sv[0];
+    epoll_ctl(ep, EPOLL_CTL_ADD, sv[0], &ev);
+
+    test_concurrent();
+    test_edge();
+    test_poll();
+
+    return failed;
+}
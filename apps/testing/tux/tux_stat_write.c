@@ -0,0 +1,66 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* stat() and fstat() must see every size change made through the fd.  The
+ * path is stat'ed before each change too, a cached result would show. */
+
+static int failed;
+
+static void check_size(const char *what, const char *path, int fd, off_t want)
+{
+    struct stat st;
+
+    if(stat(path, &st) < 0 || st.st_size != want) {
+        printf("FAIL: stat after %s: %lld, want %lld\n", what,
+               (long long)st.st_size, (long long)want);
+        failed = 1;
+    } else {
+        printf("PASS: stat after %s\n", what);
+    }
+
+    if(fstat(fd, &st) < 0 || st.st_size != want) {
+        printf("FAIL: fstat after %s: %lld, want %lld\n", what,
+               (long long)st.st_size, (long long)want);
+        failed = 1;
+    } else {
+        printf("PASS: fstat after %s\n", what);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "/tmp/tux_stat_write";
+    char buf[100];
+    int fd;
+
+    memset(buf, 'x', sizeof(buf));
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    check_size("open", path, fd, 0);
+
+    write(fd, buf, sizeof(buf));
+    check_size("write", path, fd, 100);
+
+    write(fd, buf, sizeof(buf));
+    check_size("second write", path, fd, 200);
+
+    pwrite(fd, buf, sizeof(buf), 1000);
+    check_size("pwrite", path, fd, 1100);
+
+    ftruncate(fd, 4096);
+    check_size("ftruncate", path, fd, 4096);
+
+    close(fd);
+    unlink(path);
+
+    return failed;
+}
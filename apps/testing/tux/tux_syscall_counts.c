@@ -0,0 +1,88 @@
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* The syscalls of all threads add up in one set of counters per process,
+ * /proc/self/tux_syscalls shows the same totals from every thread.
+ * umask is delegated to Linux, so it never takes the fast path, which is
+ * not counted. */
+
+#define NTHREADS 4
+#define NCALLS   1000
+
+static int failed;
+
+static void check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if(!ok)
+        failed = 1;
+}
+
+/* CALLS of syscall nr, -1 if the counters cannot be read */
+static long long calls_of(int nr)
+{
+    char line[256];
+    long long calls;
+    long long ret = 0;
+    FILE *f;
+    int n;
+
+    f = fopen("/proc/self/tux_syscalls", "r");
+    if(!f)
+        return -1;
+
+    while(fgets(line, sizeof(line), f))
+        if(sscanf(line, "%d %lld", &n, &calls) == 2 && n == nr)
+            ret = calls;
+
+    fclose(f);
+    return ret;
+}
+
+static void *caller(void *arg)
+{
+    int i;
+
+    (void)arg;
+    for(i = 0; i < NCALLS; i++)
+        syscall(SYS_umask, 022);
+
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    *(long long *)arg = calls_of(SYS_umask);
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[NTHREADS];
+    long long before;
+    long long after;
+    long long seen;
+    int i;
+
+    before = calls_of(SYS_umask);
+    if(before < 0) {
+        printf("SKIP: no /proc/self/tux_syscalls, CONFIG_TUX_SYSCALL_STATS is off\n");
+        return 0;
+    }
+
+    for(i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, caller, NULL);
+    for(i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    after = calls_of(SYS_umask);
+    check(after - before == NTHREADS * NCALLS, "calls of all threads counted once");
+
+    pthread_create(&threads[0], NULL, reader, &seen);
+    pthread_join(threads[0], NULL);
+    check(seen == after, "a thread sees the totals of the process");
+
+    return failed;
+}
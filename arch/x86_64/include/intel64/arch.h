@@ -127,7 +127,7 @@ static inline uint64_t rdtsc(void)
 {
 	uint32_t lo, hi;
 
-	asm volatile("rdtscp" : "=a" (lo), "=d" (hi)::"memory");
+	asm volatile("rdtscp" : "=a" (lo), "=d" (hi)::"ecx", "memory");
 	return (uint64_t)lo | (((uint64_t)hi) << 32);
 }
 
@@ -297,6 +297,7 @@ static inline uint32_t up_getgs()
  * Public Data
  ****************************************************************************/
 
+extern volatile uint64_t pml4[512];
 extern volatile uint64_t pdpt[512];
 extern volatile uint64_t pd[2048];
 extern volatile uint64_t pt[1048576];
@@ -59,6 +59,14 @@
  ****************************************************************************/
 
 #define X2APIC_ID		0x802
+#define X2APIC_ICR		0x830
+
+/* Interrupt command register, the destination x2APIC ID is in bits 32-63 */
+
+#define X2APIC_ICR_INIT		0x00000500
+#define X2APIC_ICR_SIPI		0x00000600
+#define X2APIC_ICR_ASSERT	0x00004000
+#define X2APIC_ICR_OTHERS	0x000c0000 /* All excluding self */
 
 /* ISR and IRQ numbers */
 
@@ -112,7 +120,17 @@
 #define IRQ14   46 /* Primary ATA channel */
 #define IRQ15   47 /* Secondary ATA channel */
 
-#define NR_IRQS 48
+/* Inter-processor interrupts, sent through the local x2APIC */
+
+#define IRQ16   48 /* Start a secondary CPU on its idle task */
+#define IRQ17   49 /* Pause a CPU while another changes its task list */
+#define IRQ18   50 /* Reload the TLB of a CPU sharing an address space */
+
+#define SMP_IPI_START_IRQ  IRQ16
+#define SMP_IPI_PAUSE_IRQ  IRQ17
+#define SMP_IPI_TLB_IRQ    IRQ18
+
+#define NR_IRQS 51
 
 /* Common register save structure created by up_saveusercontext() and by
  * ISR/IRQ interrupt processing.
@@ -181,8 +199,33 @@ struct vma_s {
     uintptr_t pa_start;
     char* _backing;
     uint64_t proto;
+    uint32_t flags;
 
     struct vma_s* next;
+
+    /* Balanced tree ordered by va_start, next/prev keep the address order */
+    struct vma_s* prev;
+    struct vma_s* parent;
+    struct vma_s* left;
+    struct vma_s* right;
+    uint64_t gap;       /* Largest hole in front of a mapping of this subtree */
+    int height;
+};
+
+struct vma_tree_s {
+    struct vma_s* root;
+    struct vma_s* first;
+};
+
+/* The address space, shared by the threads of a Linux process */
+struct vm_map_s {
+    struct vma_tree_s vmas;
+    struct vma_tree_s pdas;
+    uint32_t flags;
+
+    /* Pages faulted in but not yet mirrored in the shadow process */
+    uint64_t unmirrored_start;
+    uint64_t unmirrored_end;
 };
 
 extern struct vma_s g_vm_full_map;
@@ -190,6 +233,11 @@ extern struct vma_s g_vm_empty_map;
 
 #define VMA_SIZE(vma) (vma->va_end - vma->va_start)
 
+#define VMA_LAZY      0x1 /* Anonymous, pages are allocated on first touch */
+#define VMA_HUGE      0x2 /* Whole 2 MiB pages mapped by the page directory */
+
+#define VM_LOCKED     0x1 /* mlockall(MCL_FUTURE), new mappings are populated */
+
 /* This struct defines the way the registers are stored */
 struct xcptcontext
 {
@@ -236,8 +284,20 @@ struct xcptcontext
 
   struct vma_s* vma;
   struct vma_s* pda;
+  struct vm_map_s* vm;
   uint64_t* pd1;
 
+  sem_t* vfork_done; /* Posted when a vfork child lets go of the parent memory */
+
+  /* XSAVE area of the AVX and AVX-512 state, Linux tasks only */
+
+  uint8_t* xstate;
+  int xstate_cpu; /* The CPU which loaded it last */
+
+#ifdef CONFIG_TUX_SYSCALL_STATS
+  struct tux_sysstats_s* syscall_stats; /* Shared by the threads of a process */
+#endif
+
   /* Register save area */
 
   uint64_t regs[XCPTCONTEXT_REGS] __attribute__((aligned (16)));
@@ -272,6 +272,9 @@ void vector_irq12(void);
 void vector_irq13(void);
 void vector_irq14(void);
 void vector_irq15(void);
+void vector_irq16(void);
+void vector_irq17(void);
+void vector_irq18(void);
 
 #undef EXTERN
 #if defined(__cplusplus)
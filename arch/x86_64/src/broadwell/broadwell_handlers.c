@@ -49,6 +49,7 @@
 
 #include "up_internal.h"
 #include "sched/sched.h"
+#include "tux.h"
 
 /****************************************************************************
  * Pre-processor Definitions
@@ -87,13 +88,13 @@ static uint64_t *common_handler(int irq, uint64_t *regs)
   board_autoled_on(LED_INIRQ);
 
   /* Current regs non-zero indicates that we are processing an interrupt;
-   * g_current_regs is also used to manage interrupt level context switches.
+   * CURRENT_REGS is also used to manage interrupt level context switches.
    *
    * Nested interrupts are not supported.
    */
 
-  DEBUGASSERT(g_current_regs == NULL);
-  g_current_regs = regs;
+  DEBUGASSERT(CURRENT_REGS == NULL);
+  CURRENT_REGS = regs;
 
   /* Deliver the IRQ */
 
@@ -101,18 +102,18 @@ static uint64_t *common_handler(int irq, uint64_t *regs)
 
 #if defined(CONFIG_ARCH_FPU) || defined(CONFIG_ARCH_ADDRENV)
   /* Check for a context switch.  If a context switch occurred, then
-   * g_current_regs will have a different value than it did on entry.  If an
+   * CURRENT_REGS will have a different value than it did on entry.  If an
    * interrupt level context switch has occurred, then restore the floating
    * point state and the establish the correct address environment before
    * returning from the interrupt.
    */
 
-  if (regs != g_current_regs)
+  if (regs != CURRENT_REGS)
     {
 #ifdef CONFIG_ARCH_FPU
       /* Restore floating point registers */
 
-      up_restorefpu((uint64_t*)g_current_regs);
+      up_restorefpu((uint64_t*)CURRENT_REGS);
 #endif
 
 #ifdef CONFIG_ARCH_ADDRENV
@@ -128,18 +129,18 @@ static uint64_t *common_handler(int irq, uint64_t *regs)
 #endif
 
   /* If a context switch occurred while processing the interrupt then
-   * g_current_regs may have change value.  If we return any value different
+   * CURRENT_REGS may have change value.  If we return any value different
    * from the input regs, then the lower level will know that a context
    * switch occurred during interrupt processing.
    */
 
-  regs = (uint64_t*)g_current_regs;
+  regs = (uint64_t*)CURRENT_REGS;
 
-  /* Set g_current_regs to NULL to indicate that we are no longer in an
+  /* Set CURRENT_REGS to NULL to indicate that we are no longer in an
    * interrupt handler.
    */
 
-  g_current_regs = NULL;
+  CURRENT_REGS = NULL;
   return regs;
 }
 #endif
@@ -167,8 +168,8 @@ uint64_t *isr_handler(uint64_t *regs, uint64_t irq)
 #else
   uint64_t *ret;
 
-  DEBUGASSERT(g_current_regs == NULL);
-  g_current_regs = regs;
+  DEBUGASSERT(CURRENT_REGS == NULL);
+  CURRENT_REGS = regs;
 
   switch(irq) {
       case 0:
@@ -178,6 +179,20 @@ uint64_t *isr_handler(uint64_t *regs, uint64_t irq)
           _alert("Task: %d Floating point exception occurred\n", this_task()->pid);
           nxsig_kill(this_task()->pid, SIGFPE);
           break;
+      case 14:
+          /* Demand paging and protection faults of Linux processes,
+           * anything else is fatal */
+          if(tux_mm_fault(regs) == OK)
+              break;
+
+          _alert("PANIC:\n");
+          _alert("Page fault occurred with error code %lld:\n", regs[REG_ERRCODE]);
+
+          up_registerdump(regs);
+
+          up_trash_cpu();
+          PANIC();
+          break;
       deafult:
         /* Let's say, all ISR are asserted when REALLY BAD things happended */
         /* Don't even brother to recover, just dump the regs and PANIC*/
@@ -193,13 +208,13 @@ uint64_t *isr_handler(uint64_t *regs, uint64_t irq)
   }
 
   // Maybe we need a context switch
-  regs = (uint64_t*)g_current_regs;
+  regs = (uint64_t*)CURRENT_REGS;
 
-  /* Set g_current_regs to NULL to indicate that we are no longer in an
+  /* Set CURRENT_REGS to NULL to indicate that we are no longer in an
    * interrupt handler.
    */
 
-  g_current_regs = NULL;
+  CURRENT_REGS = NULL;
   return regs;
 #endif
 }
@@ -77,6 +77,10 @@ void up_lowsetup(void)
    * 2MiB of physical ram to virtual ram
    */
 
+  /* The per-CPU data of the boot CPU, everything below may use it */
+
+  up_cpu_setup(0);
+  up_xstate_initialize();
 
   /* perform board-specific initializations
    * This includes the inititlization of PCI-e serial cards*/
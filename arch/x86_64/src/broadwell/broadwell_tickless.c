@@ -96,11 +96,14 @@ unsigned long tsc_freq;
 
 static struct timespec g_goal_time_ts;
 static uint64_t g_last_stop_time;
-static uint64_t g_start_tsc;
+uint64_t g_start_tsc;
 static uint32_t g_timer_active;
 
-static irqstate_t g_tmr_sync_count;
-static irqstate_t g_tmr_flags;
+/* The TSC deadline is per CPU, the timer belongs to the CPU which started
+ * it last.  A deadline left behind on another CPU may still fire there.
+ */
+
+static int g_timer_cpu;
 
 /****************************************************************************
  * Private Functions
@@ -152,25 +155,6 @@ static inline void up_tick2ts(uint64_t tick, FAR struct timespec *ts)
   ts->tv_nsec = (uint64_t)(ROUND_INT_DIV((tick % tsc_freq) * NSEC_PER_SEC, tsc_freq));
 }
 
-static inline void up_tmr_sync_up(void)
-{
-  if(!g_tmr_sync_count){
-    g_tmr_flags = enter_critical_section();
-  }
-  g_tmr_sync_count++;
-}
-
-static inline void up_tmr_sync_down(void)
-{
-  if(g_tmr_sync_count == 1){
-    leave_critical_section(g_tmr_flags);
-  }
-
-  if(g_tmr_sync_count > 0){
-    g_tmr_sync_count--;
-  }
-}
-
 /****************************************************************************
  * Name: up_timer_gettime
  *
@@ -246,7 +230,9 @@ int up_timer_gettime(FAR struct timespec *ts)
 
 int up_timer_cancel(FAR struct timespec *ts)
 {
-  up_tmr_sync_up();
+  irqstate_t flags;
+
+  flags = enter_critical_section();
 
   up_mask_tmr();
 
@@ -264,7 +250,7 @@ int up_timer_cancel(FAR struct timespec *ts)
 
   g_timer_active = 0;
 
-  up_tmr_sync_down();
+  leave_critical_section(flags);
 
   return OK;
 }
@@ -297,12 +283,14 @@ int up_timer_cancel(FAR struct timespec *ts)
 int up_timer_start(FAR const struct timespec *ts)
 {
   uint64_t ticks;
+  irqstate_t flags;
 
-  up_tmr_sync_up();
+  flags = enter_critical_section();
 
   ticks = up_ts2tick(ts) + rdtsc();
 
   g_timer_active = 1;
+  g_timer_cpu = up_cpu_index();
 
   write_msr(IA32_TSC_DEADLINE, ticks);
 
@@ -310,7 +298,7 @@ int up_timer_start(FAR const struct timespec *ts)
 
   up_unmask_tmr();
 
-  up_tmr_sync_down();
+  leave_critical_section(flags);
   return OK;
 }
 
@@ -330,9 +318,15 @@ int up_timer_start(FAR const struct timespec *ts)
 
 void up_timer_expire(void)
 {
+  up_mask_tmr();
+
+  if (!g_timer_active || g_timer_cpu != up_cpu_index())
+    {
+      return;
+    }
+
   g_timer_active = 0;
 
-  up_mask_tmr();
   sched_timer_expiration();
 
   return;
@@ -373,7 +367,9 @@ void up_timer_expire(void)
 
 int up_alarm_cancel(FAR struct timespec *ts)
 {
-  up_tmr_sync_up();
+  irqstate_t flags;
+
+  flags = enter_critical_section();
 
   up_mask_tmr();
 
@@ -391,7 +387,7 @@ int up_alarm_cancel(FAR struct timespec *ts)
 
   g_timer_active = 0;
 
-  up_tmr_sync_down();
+  leave_critical_section(flags);
 
   return OK;
 }
@@ -424,8 +420,9 @@ int up_alarm_cancel(FAR struct timespec *ts)
 int up_alarm_start(FAR const struct timespec *ts)
 {
   uint64_t ticks;
+  irqstate_t flags;
 
-  up_tmr_sync_up();
+  flags = enter_critical_section();
 
   up_unmask_tmr();
 
@@ -434,11 +431,12 @@ int up_alarm_start(FAR const struct timespec *ts)
   write_msr(IA32_TSC_DEADLINE, ticks);
 
   g_timer_active = 1;
+  g_timer_cpu = up_cpu_index();
 
   g_goal_time_ts.tv_sec = ts->tv_sec;
   g_goal_time_ts.tv_nsec = ts->tv_nsec;
 
-  up_tmr_sync_down();
+  leave_critical_section(flags);
 
   tmrinfo("%d.%09d\n", ts->tv_sec, ts->tv_nsec);
   tmrinfo("start\n");
@@ -467,6 +465,11 @@ void up_alarm_expire(void)
   up_mask_tmr();
   tmrinfo("expire\n");
 
+  if (!g_timer_active || g_timer_cpu != up_cpu_index())
+    {
+      return;
+    }
+
   g_timer_active = 0;
 
   up_timer_gettime(&now);
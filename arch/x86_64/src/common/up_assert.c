@@ -204,9 +204,9 @@ static void up_dumpstate(void)
 
   /* Then dump the registers (if available) */
 
-  if (g_current_regs != NULL)
+  if (CURRENT_REGS != NULL)
     {
-      up_registerdump((uint64_t*)g_current_regs);
+      up_registerdump((uint64_t*)CURRENT_REGS);
     }
 
 #ifdef CONFIG_ARCH_USBDUMP
@@ -228,7 +228,7 @@ static void _up_assert(int errorcode)
 {
   /* Are we in an interrupt handler or the idle task? */
 
-  if (g_current_regs || (this_task())->pid == 0)
+  if (CURRENT_REGS || (this_task())->pid == 0)
     {
        (void)up_irq_save();
         for (;;)
@@ -87,55 +87,30 @@ void up_checktasks(void)//struct tcb_s *from, struct tcb_* to)
 
     shadow_proc_receive(gshadow, buf);
 
-    rtcb = (struct tcb_s *)buf[1];
+    rtcb = shadow_proc_dispatch(gshadow, buf);
 
-    if(buf[1] & (1ULL << 63)) {
-      // It is a signal
-      buf[1] &= ~(1ULL << 63);
+    if(rtcb){
+      // The sem to unblock, either the poll sem or the syscall_lock sem
+      sem_t* to_unlock = rtcb->waitsem;
 
-      if(buf[0]){
-        int lpid;
-        lpid = get_nuttx_pid(buf[1]);
-        if(lpid > 0)
-        nxsig_kill(lpid, buf[0]);
-      }
+      /* It is, let the task take the semaphore */
+      rtcb->waitsem = NULL;
 
-    } else {
-      buf[1] &= ~(1ULL << 63);
+      nxsem_releaseholder(to_unlock);
+      to_unlock->semcount++;
 
-      rtcb = (struct tcb_s *)buf[1];
+      /* The task will be the new holder of the semaphore when
+       * it is awakened.
+       */
+      nxsem_addholder_tcb(rtcb, to_unlock);
 
-      if(rtcb){
-        // Write the return value
-        rtcb->xcp.syscall_ret = buf[0];
+      sched_removeblocked(rtcb);
 
-        if(rtcb->xcp.syscall_pollfd) {
-          // Someone is waiting
-          rtcb->xcp.syscall_pollfd->revents |= POLLIN;
-        }
-
-        // The sem to unblock, either the poll sem or the syscall_lock sem
-        sem_t* to_unlock = rtcb->waitsem;
-
-        /* It is, let the task take the semaphore */
-        rtcb->waitsem = NULL;
-
-        nxsem_releaseholder(to_unlock);
-        to_unlock->semcount++;
-
-        /* The task will be the new holder of the semaphore when
-         * it is awakened.
-         */
-        nxsem_addholder_tcb(rtcb, to_unlock);
-
-        sched_removeblocked(rtcb);
-
-        /* Add the task in the correct location in the prioritized
-         * ready-to-run task list
-         */
-        sched_addprioritized(rtcb, (FAR dq_queue_t *)&g_pendingtasks);
-        rtcb->task_state = TSTATE_TASK_PENDING;
-      }
+      /* Add the task in the correct location in the prioritized
+       * ready-to-run task list
+       */
+      sched_addprioritized(rtcb, (FAR dq_queue_t *)&g_pendingtasks);
+      rtcb->task_state = TSTATE_TASK_PENDING;
     }
   }
 
@@ -112,7 +112,28 @@
  * referenced is passed to get the state from the TCB.
  */
 
-#define up_restorestate(regs) (g_current_regs = regs)
+#define up_restorestate(regs) (CURRENT_REGS = regs)
+
+/* Each CPU finds its own struct intel64_cpu_s at the GS base.  The syscall
+ * entry reaches the first fields from assembly, these offsets must follow
+ * the structure.
+ */
+
+#define X86_64_CPU_USTACK 0   /* User stack pointer during the syscall entry */
+#define X86_64_CPU_KSTACK 8   /* Top of the kernel stack of the running task */
+#define X86_64_CPU_ID     16  /* NuttX index of the CPU */
+
+/* Linux syscalls below this number may have a handler in tux_fast_table,
+ * called by syscall_entry without going through syscall_handler().
+ */
+
+#define TUX_FAST_NR       320
+
+#ifdef CONFIG_SMP
+#  define X86_64_NCPUS CONFIG_SMP_NCPUS
+#else
+#  define X86_64_NCPUS 1
+#endif
 
 /****************************************************************************
  * Public Types
@@ -120,6 +141,20 @@
 
 #ifndef __ASSEMBLY__
 typedef void (*up_vector_t)(void);
+
+struct intel64_cpu_s
+{
+  uint64_t ustack;
+  uint64_t kstack;
+  int      id;
+  uint32_t apic_id;            /* x2APIC ID, where IPIs are sent */
+  volatile uint64_t *pdpt;     /* Entry 0 maps the memory of the running task */
+  volatile uint64_t *pd1;      /* That memory, compared by TLB shootdowns */
+  volatile uint32_t tlb_gen;   /* Shootdowns serviced so far */
+  volatile bool online;        /* Waiting in up_cpu_boot() or running */
+  struct tcb_s *xstate_owner;  /* Whose XSAVE area the extended registers hold */
+  bool xstate_live;            /* The owner runs, its area may be out of date */
+};
 #endif
 
 /****************************************************************************
@@ -131,7 +166,17 @@ typedef void (*up_vector_t)(void);
  * structure.  If is non-NULL only during interrupt processing.
  */
 
-extern volatile uint64_t *g_current_regs;
+#ifdef CONFIG_SMP
+extern volatile uint64_t *g_current_regs[CONFIG_SMP_NCPUS];
+#  define CURRENT_REGS (g_current_regs[up_cpu_index()])
+#else
+extern volatile uint64_t *g_current_regs[1];
+#  define CURRENT_REGS (g_current_regs[0])
+#endif
+
+/* The per-CPU data, indexed by NuttX CPU index */
+
+extern struct intel64_cpu_s g_cpu[X86_64_NCPUS];
 
 /* This is the beginning of heap as provided from up_head.S. This is the first
  * address in DRAM after the loaded program+bss+idle stack.  The end of the
@@ -171,6 +216,30 @@ extern uint64_t _ebss;            /* End+1 of .bss */
  * Inline Functions
  ****************************************************************************/
 
+#ifndef __ASSEMBLY__
+
+/* The per-CPU data of the CPU we run on.  Unless interrupts are disabled,
+ * the task may move to another CPU right after.
+ */
+
+static inline struct intel64_cpu_s *up_this_cpu(void)
+{
+  struct intel64_cpu_s *cpu;
+
+  asm volatile("rdgsbase %0" : "=r" (cpu));
+  return cpu;
+}
+
+/* Record the kernel stack of the running task for the syscall entry */
+
+static inline void up_set_kstack(void *kstack)
+{
+  asm volatile("movq %0, %%gs:%c1"
+               : : "r" (kstack), "i" (X86_64_CPU_KSTACK) : "memory");
+}
+
+#endif
+
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
@@ -194,6 +263,17 @@ void up_copystate(uint64_t *dest, uint64_t *src);
 void up_savestate(uint64_t *regs);
 void up_decodeirq(uint64_t *regs);
 void up_irqinitialize(void);
+#ifdef CONFIG_SMP
+void up_cpu_boot(int cpu) noreturn_function;
+void up_cpu_irqinitialize(int cpu);
+void up_send_ipi(int cpu, int irq);
+void up_tlb_shootdown(void);
+int up_cpu_start_handler(int irq, FAR void *context, FAR void *arg);
+int up_pause_handler(int irq, FAR void *context, FAR void *arg);
+int up_tlb_handler(int irq, FAR void *context, FAR void *arg);
+#else
+#  define up_tlb_shootdown()
+#endif
 #ifdef CONFIG_ARCH_DMA
 void weak_function up_dmainitialize(void);
 #endif
@@ -205,6 +285,14 @@ void up_lowputc(char ch);
 void up_puts(const char *str);
 void up_lowputs(const char *str);
 void up_restore_auxstate(struct tcb_s *rtcb);
+void up_cpu_setup(int cpu);
+void up_xstate_initialize(void);
+int  up_xstate_alloc(struct tcb_s *tcb, bool inherit);
+void up_xstate_free(struct tcb_s *tcb);
+void up_xstate_save(void);
+void up_xstate_restore(struct tcb_s *tcb);
+FAR void *up_xstate_push(void);
+void up_xstate_pop(FAR void *saved);
 void up_checktasks(void);
 
 void up_syscall(uint64_t *regs);
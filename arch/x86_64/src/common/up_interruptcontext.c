@@ -68,5 +68,16 @@
 
 bool up_interrupt_context(void)
 {
-   return g_current_regs != NULL;
+#ifdef CONFIG_SMP
+  /* The task may move to another CPU between reading the index and
+   * reading the regs of that CPU.
+   */
+
+  irqstate_t flags = up_irq_save();
+  bool ret = CURRENT_REGS != NULL;
+  up_irq_restore(flags);
+  return ret;
+#else
+   return CURRENT_REGS != NULL;
+#endif
 }
@@ -142,10 +142,10 @@ void up_reprioritize_rtr(struct tcb_s *tcb, uint8_t priority)
 
          /* Are we in an interrupt handler? */
 
-          if (g_current_regs)
+          if (CURRENT_REGS)
             {
               /* Yes, then we have to do things differently.
-               * Just copy the g_current_regs into the OLD rtcb.
+               * Just copy the CURRENT_REGS into the OLD rtcb.
                */
 
                up_savestate(rtcb->xcp.regs);
@@ -0,0 +1,253 @@
+/****************************************************************************
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name NuttX nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <debug.h>
+
+#include <nuttx/arch.h>
+#include <nuttx/sched.h>
+#include <nuttx/sched_note.h>
+#include <arch/arch.h>
+#include <arch/irq.h>
+#include <arch/io.h>
+#include <arch/board/board.h>
+
+#include "up_internal.h"
+#include "sched/sched.h"
+
+#ifdef CONFIG_SMP
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* How long up_cpu_start() waits for a CPU to reach up_cpu_boot() */
+
+#define CPU_BOOT_POLL_US   100
+#define CPU_BOOT_TIMEOUT   1000  /* In polls, 100ms */
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* Read by broadwell_head.S.  Once set, the reset vector belongs to the
+ * secondary CPUs, each takes the next index in g_ap_next.
+ */
+
+volatile uint32_t g_ap_boot;
+volatile uint32_t g_ap_next = 1;
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* Each CPU maps the memory of its own running task at entry 0 of its
+ * PDPT, the rest are the same as the boot CPU.
+ */
+
+static uint64_t g_ap_pml4[CONFIG_SMP_NCPUS][512]
+  __attribute__((aligned(PAGE_SIZE)));
+static uint64_t g_ap_pdpt[CONFIG_SMP_NCPUS][512]
+  __attribute__((aligned(PAGE_SIZE)));
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: up_cpu_boot
+ *
+ * Description:
+ *   The C entry of the secondary CPUs, reached from broadwell_head.S on
+ *   the stack of the IDLE task.  Sets up the CPU and waits for the start
+ *   IPI of up_cpu_start() to switch to the IDLE task.
+ *
+ * Input Parameters:
+ *   cpu - The index of this CPU
+ *
+ * Returned Value:
+ *   This function does not return.
+ *
+ ****************************************************************************/
+
+void up_cpu_boot(int cpu)
+{
+  /* Switch to the page tables of this CPU */
+
+  memcpy(g_ap_pdpt[cpu], (void *)pdpt, sizeof(g_ap_pdpt[cpu]));
+  g_ap_pml4[cpu][0] = (uintptr_t)g_ap_pdpt[cpu] | (pml4[0] & 0xfff);
+
+  asm volatile("mov %0, %%cr3" : : "r" (g_ap_pml4[cpu]) : "memory");
+
+  up_cpu_setup(cpu);
+  up_xstate_initialize();
+  g_cpu[cpu].pdpt = g_ap_pdpt[cpu];
+
+  up_cpu_irqinitialize(cpu);
+
+#ifdef CONFIG_LIB_SYSCALL
+  enable_syscall();
+#endif
+
+  g_cpu[cpu].online = true;
+
+  up_irq_enable();
+
+  for (; ; )
+    {
+      asm volatile("hlt");
+    }
+}
+
+/****************************************************************************
+ * Name: up_cpu_start_handler
+ *
+ * Description:
+ *   This is the handler for the start IPI.  This handler simply returns
+ *   from the interrupt, restoring the state of the new task at the head of
+ *   the ready to run list.
+ *
+ * Input Parameters:
+ *   Standard interrupt handling
+ *
+ * Returned Value:
+ *   Zero on success; a negated errno value on failure.
+ *
+ ****************************************************************************/
+
+int up_cpu_start_handler(int irq, FAR void *context, FAR void *arg)
+{
+  FAR struct tcb_s *tcb = this_task();
+
+  sinfo("CPU%d Started\n", this_cpu());
+
+#ifdef CONFIG_SCHED_INSTRUMENTATION
+  /* Notify that this CPU has started */
+
+  sched_note_cpu_started(tcb);
+#endif
+
+  /* Reset scheduler parameters */
+
+  sched_resume_scheduler(tcb);
+
+  /* Then switch contexts. This instantiates the exception context of the
+   * tcb at the head of the assigned task list.  In this case, this should
+   * be the CPUs IDLE task.
+   */
+
+  up_restore_auxstate(tcb);
+  up_restorestate(tcb->xcp.regs);
+
+  return OK;
+}
+
+/****************************************************************************
+ * Name: up_cpu_start
+ *
+ * Description:
+ *   In an SMP configution, only one CPU is initially active (CPU 0). System
+ *   initialization occurs on that single thread. At the completion of the
+ *   initialization of the OS, just before beginning normal multitasking,
+ *   the additional CPUs would be started by calling this function.
+ *
+ *   The first call wakes every other CPU of the cell with INIT and SIPI.
+ *   They come up through the reset vector and wait in up_cpu_boot(), until
+ *   the start IPI sends each to its IDLE task.
+ *
+ * Input Parameters:
+ *   cpu - The index of the CPU being started.  This will be a numeric
+ *         value in the range of from one to (CONFIG_SMP_NCPUS-1).  (CPU
+ *         0 is already active)
+ *
+ * Returned Value:
+ *   Zero on success; a negated errno value on failure.
+ *
+ ****************************************************************************/
+
+int up_cpu_start(int cpu)
+{
+  int timeout;
+
+  sinfo("Starting CPU%d\n", cpu);
+
+  DEBUGASSERT(cpu >= 0 && cpu < CONFIG_SMP_NCPUS && cpu != this_cpu());
+
+  if (cpu >= comm_region->num_cpus)
+    {
+      serr("ERROR: The cell has only %d CPUs\n", comm_region->num_cpus);
+      return -ENODEV;
+    }
+
+  if (!g_ap_boot)
+    {
+      g_ap_boot = 1;
+
+      /* SIPI vector 0, the reset vector is at address 0 */
+
+      asm volatile("mfence" : : : "memory");
+      write_msr(X2APIC_ICR, X2APIC_ICR_OTHERS | X2APIC_ICR_ASSERT |
+                            X2APIC_ICR_INIT);
+      up_mdelay(10);
+      write_msr(X2APIC_ICR, X2APIC_ICR_OTHERS | X2APIC_ICR_ASSERT |
+                            X2APIC_ICR_SIPI);
+    }
+
+  for (timeout = 0; !g_cpu[cpu].online; timeout++)
+    {
+      if (timeout >= CPU_BOOT_TIMEOUT)
+        {
+          serr("ERROR: CPU%d did not come up\n", cpu);
+          return -ENODEV;
+        }
+
+      up_udelay(CPU_BOOT_POLL_US);
+    }
+
+#ifdef CONFIG_SCHED_INSTRUMENTATION
+  /* Notify of the start event */
+
+  sched_note_cpu_start(this_task(), cpu);
+#endif
+
+  up_send_ipi(cpu, SMP_IPI_START_IRQ);
+  return OK;
+}
+
+#endif /* CONFIG_SMP */
@@ -127,6 +127,7 @@ void up_initial_state(struct tcb_s *tcb)
         {
           xcp->vma = NULL;
           xcp->pda = NULL;
+          xcp->vm = NULL;
           xcp->pd1 = NULL;
 
           xcp->is_linux = 1;
@@ -144,12 +145,17 @@ void up_initial_state(struct tcb_s *tcb)
           xcp->fd[2] = rtcb->xcp.fd[2];
 
           xcp->signal_stack_flag = 2;
+
+          /* Threads and forks start with the registers of the parent */
+
+          (void)up_xstate_alloc(tcb, true);
         }
       else
         {
           xcp->is_linux = 0;
           xcp->vma = &g_vm_full_map;
           xcp->pda = &g_vm_full_map;
+          xcp->vm = NULL;
           xcp->pd1 = NULL;
         }
     }
@@ -158,6 +164,7 @@ void up_initial_state(struct tcb_s *tcb)
       xcp->is_linux = 0;
       xcp->vma = &g_vm_full_map;
       xcp->pda = &g_vm_full_map;
+      xcp->vm = NULL;
       xcp->pd1 = NULL;
     }
 
@@ -84,7 +84,7 @@ static inline void up_idtinit(void);
  * Public Data
  ****************************************************************************/
 
-volatile uint64_t *g_current_regs;
+volatile uint64_t *g_current_regs[X86_64_NCPUS];
 
 uint8_t g_interrupt_stack[IRQ_STACK_SIZE];
 uint8_t* g_interrupt_stack_end = g_interrupt_stack + IRQ_STACK_SIZE;
@@ -92,6 +92,19 @@ uint8_t* g_interrupt_stack_end = g_interrupt_stack + IRQ_STACK_SIZE;
 uint8_t g_isr_stack[IRQ_STACK_SIZE];
 uint8_t* g_isr_stack_end = g_isr_stack + IRQ_STACK_SIZE;
 
+#ifdef CONFIG_SMP
+/* Every CPU needs a TSS of its own for its IST, and thus a GDT of its own.
+ * ltr marks the TSS descriptor busy, it can not be loaded twice.
+ */
+
+static uint64_t g_ap_gdt[CONFIG_SMP_NCPUS][8] __attribute__((aligned(16)));
+static uint32_t g_ap_tss[CONFIG_SMP_NCPUS][26] __attribute__((aligned(16)));
+static uint8_t g_ap_interrupt_stack[CONFIG_SMP_NCPUS][IRQ_STACK_SIZE]
+  __attribute__((aligned(16)));
+static uint8_t g_ap_isr_stack[CONFIG_SMP_NCPUS][IRQ_STACK_SIZE]
+  __attribute__((aligned(16)));
+#endif
+
 /****************************************************************************
  * Private Data
  ****************************************************************************/
@@ -168,24 +181,25 @@ void up_ioapic_unmask_pin(unsigned int pin)
  *
  ****************************************************************************/
 
-static void up_ist_init(void)
+static void up_ist_init(volatile uint64_t *gdt_ist, volatile void *tss,
+                        uint8_t *irq_stack_end, uint8_t *isr_stack_end)
 {
     uint64_t tss_l = 0;
     uint64_t tss_h = 0;
-    volatile uint64_t* ist_IST1 = (void*)&ist64 + 0x24;
-    volatile uint64_t* ist_IST2 = (void*)&ist64 + 0x2C;
+    volatile uint64_t* ist_IST1 = tss + 0x24;
+    volatile uint64_t* ist_IST2 = tss + 0x2C;
 
     tss_l |= (((104 - 1) & 0xffff)); // Segment limit = TSS size - 1
-    tss_l |= (((uintptr_t)&ist64 & 0x00ffffff) << 16);          // Low address 1
-    tss_l |= (((uintptr_t)&ist64 & 0xff000000) << (56 - 24));   // Low address 2
+    tss_l |= (((uintptr_t)tss & 0x00ffffff) << 16);          // Low address 1
+    tss_l |= (((uintptr_t)tss & 0xff000000) << (56 - 24));   // Low address 2
     tss_l |= (((uint64_t)0b10001001 & 0xff) << 40);             // Present | Type = TSS
-    tss_h |= (((uintptr_t)&ist64 >> 32) & 0xffffffff);          // High address
+    tss_h |= (((uintptr_t)tss >> 32) & 0xffffffff);          // High address
 
-    gdt64_ist[0] = tss_l;
-    gdt64_ist[1] = tss_h;
+    gdt_ist[0] = tss_l;
+    gdt_ist[1] = tss_h;
 
-    *ist_IST1 = (uintptr_t)g_interrupt_stack_end;
-    *ist_IST2 = (uintptr_t)g_isr_stack_end;
+    *ist_IST1 = (uintptr_t)irq_stack_end;
+    *ist_IST2 = (uintptr_t)isr_stack_end;
 
     asm volatile ("mov $0x30, %%ax; ltr %%ax":::"memory", "rax");
 }
@@ -338,6 +352,9 @@ static inline void up_idtinit(void)
   up_idtentry(IRQ13, (uint64_t)vector_irq13, 0x08, 0x8e, 0x1);
   up_idtentry(IRQ14, (uint64_t)vector_irq14, 0x08, 0x8e, 0x1);
   up_idtentry(IRQ15, (uint64_t)vector_irq15, 0x08, 0x8e, 0x1);
+  up_idtentry(IRQ16, (uint64_t)vector_irq16, 0x08, 0x8e, 0x1);
+  up_idtentry(IRQ17, (uint64_t)vector_irq17, 0x08, 0x8e, 0x1);
+  up_idtentry(IRQ18, (uint64_t)vector_irq18, 0x08, 0x8e, 0x1);
 
   /* Then program the IDT */
 
@@ -356,11 +373,11 @@ void up_irqinitialize(void)
 {
   /* currents_regs is non-NULL only while processing an interrupt */
 
-  g_current_regs = NULL;
+  CURRENT_REGS = NULL;
 
   /* Initialize the IST */
 
-  up_ist_init();
+  up_ist_init(gdt64_ist, &ist64, g_interrupt_stack_end, g_isr_stack_end);
 
   /* Initialize the APIC */
 
@@ -374,6 +391,14 @@ void up_irqinitialize(void)
 
   up_idtinit();
 
+#ifdef CONFIG_SMP
+  /* Attach the inter-processor interrupts */
+
+  (void)irq_attach(SMP_IPI_START_IRQ, up_cpu_start_handler, NULL);
+  (void)irq_attach(SMP_IPI_PAUSE_IRQ, up_pause_handler, NULL);
+  (void)irq_attach(SMP_IPI_TLB_IRQ, up_tlb_handler, NULL);
+#endif
+
   /* And finally, enable interrupts */
 
 #ifndef CONFIG_SUPPRESS_INTERRUPTS
@@ -381,6 +406,58 @@ void up_irqinitialize(void)
 #endif
 }
 
+#ifdef CONFIG_SMP
+/****************************************************************************
+ * Name: up_cpu_irqinitialize
+ *
+ * Description:
+ *   The part of up_irqinitialize() each secondary CPU repeats for itself.
+ *   The IDT and the interrupt handlers are shared, the descriptor tables
+ *   and the local APIC are not.  Interrupts are left disabled.
+ *
+ ****************************************************************************/
+
+void up_cpu_irqinitialize(int cpu)
+{
+  struct idt_ptr_s gdt_ptr;
+
+  /* The same segments as gdt64, followed by the TSS of this CPU */
+
+  memcpy(g_ap_gdt[cpu], (void *)&gdt64, 6 * sizeof(uint64_t));
+
+  gdt_ptr.limit = sizeof(g_ap_gdt[cpu]) - 1;
+  gdt_ptr.base  = (uint64_t)g_ap_gdt[cpu];
+  asm volatile("lgdt %0" : : "m" (gdt_ptr) : "memory");
+
+  up_ist_init(&g_ap_gdt[cpu][6], g_ap_tss[cpu],
+              g_ap_interrupt_stack[cpu] + IRQ_STACK_SIZE,
+              g_ap_isr_stack[cpu] + IRQ_STACK_SIZE);
+
+  up_apic_init();
+
+  idt_flush((uint64_t)&idt_ptr);
+}
+
+/****************************************************************************
+ * Name: up_send_ipi
+ *
+ * Description:
+ *   Raise 'irq' on 'cpu' through the x2APIC interrupt command register.
+ *   Fixed delivery, physical destination.
+ *
+ ****************************************************************************/
+
+void up_send_ipi(int cpu, int irq)
+{
+  /* Stores to normal memory may pass the wrmsr, make them visible to the
+   * target before it takes the interrupt.
+   */
+
+  asm volatile("mfence" : : : "memory");
+  write_msr(X2APIC_ICR, ((uint64_t)g_cpu[cpu].apic_id << 32) | irq);
+}
+#endif
+
 /****************************************************************************
  * Name: up_disable_irq
  *
@@ -97,6 +97,7 @@
 void up_release_stack(FAR struct tcb_s *dtcb, uint8_t ttype)
 {
   struct vma_s* ptr;
+  struct vma_s* next;
   int i;
 
   /* Is there a stack allocated? */
@@ -127,12 +128,16 @@ void up_release_stack(FAR struct tcb_s *dtcb, uint8_t ttype)
 
   dtcb->adj_stack_size = 0;
 
+// A vfork child only borrowed the memory, hand it back to the parent
+  if(dtcb->xcp.vfork_done) {
+    nxsem_post(dtcb->xcp.vfork_done);
+    dtcb->xcp.vfork_done = NULL;
+  }
 // Clean up the mmaped virtual memories
-  if(dtcb->xcp.is_linux == 2) {
-    for(ptr = dtcb->xcp.vma; ptr; ptr = ptr->next) {
-      if(ptr == &g_vm_full_map) continue;
-      if(ptr->pa_start == 0xffffffffffffffff) continue;
-      gran_free(tux_mm_hnd, (void*)(ptr->pa_start), ptr->va_end - ptr->va_start);
+  else if(dtcb->xcp.is_linux == 2) {
+    for(ptr = dtcb->xcp.vm ? dtcb->xcp.vm->vmas.first : NULL; ptr; ptr = next) {
+      next = ptr->next;
+      tux_mm_release(dtcb, ptr, ptr->va_start, ptr->va_end);
       gran_free(tux_mm_hnd, (void*)tux_mm_del_pd1, PAGE_SIZE);
 #ifdef CONFIG_DEBUG_SYSCALL_INFO
       if(ptr->_backing[0] != '[')
@@ -140,12 +145,18 @@ void up_release_stack(FAR struct tcb_s *dtcb, uint8_t ttype)
 #endif
       sched_kfree(ptr);
     }
-    for(ptr = dtcb->xcp.pda; ptr; ptr = ptr->next) {
-      if(ptr == &g_vm_full_map) continue;
+    for(ptr = dtcb->xcp.vm ? dtcb->xcp.vm->pdas.first : NULL; ptr; ptr = next) {
+      next = ptr->next;
       gran_free(tux_mm_hnd, (void*)(ptr->pa_start), VMA_SIZE(ptr) / HUGE_PAGE_SIZE * PAGE_SIZE);
       sched_kfree(ptr);
     }
+    sched_kfree(dtcb->xcp.vm);
+    dtcb->xcp.vm = NULL;
   }
 
   timer_delete(dtcb->xcp.alarm_timer);
+
+  up_xstate_free(dtcb);
+
+  tux_stats_release(dtcb);
 }
@@ -78,6 +78,7 @@ extern uint64_t full_map_pd1[512];
 
 void up_restore_auxstate(struct tcb_s *rtcb)
 {
+  struct intel64_cpu_s *cpu = up_this_cpu();
   struct vma_s* ptr;
   uint64_t i, j;
 
@@ -91,16 +92,19 @@ void up_restore_auxstate(struct tcb_s *rtcb)
           }
           cached = 1;
       }
-      pdpt[0] = (uintptr_t)full_map_pd1 | 0x23;
+      cpu->pdpt[0] = (uintptr_t)full_map_pd1 | 0x23;
   } else {
-    pdpt[0] = (uintptr_t)rtcb->xcp.pd1 | 0x23;
+    cpu->pdpt[0] = (uintptr_t)rtcb->xcp.pd1 | 0x23;
   }
 
+  // Published before the TLB is reloaded, see up_tlb_shootdown
+  cpu->pd1 = rtcb->xcp.pd1;
+
   // set PCID, avoid TLB flush
   set_pcid(rtcb->pid);
 
-  // The kernel stack cache, GS BASE
-  write_gsbase((uintptr_t)rtcb->adj_stack_ptr);
+  // The kernel stack cache, in the per-CPU data at GS BASE
+  up_set_kstack(rtcb->adj_stack_ptr);
 
   // If user space set the FS BASE, recover it
   if(rtcb->xcp.fs_base_set){
@@ -109,6 +113,8 @@ void up_restore_auxstate(struct tcb_s *rtcb)
     write_fsbase(0);
   }
 
+  up_xstate_restore(rtcb);
+
   sinfo("resuming %d\n", rtcb->pid);
 
 }
@@ -41,6 +41,8 @@
 
 #include <debug.h>
 
+#include <nuttx/arch.h>
+
 #include <arch/arch.h>
 #include <arch/irq.h>
 
@@ -72,5 +74,6 @@
 
 void up_savestate(uint64_t *regs)
 {
-  up_copystate(regs, (uint64_t*)g_current_regs);
+  up_copystate(regs, (uint64_t*)CURRENT_REGS);
+  up_xstate_save();
 }
@@ -103,6 +103,10 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
 {
   irqstate_t flags;
   uint64_t curr_rsp, new_rsp, kstack;
+#ifdef CONFIG_SMP
+  bool paused;
+  int cpu;
+#endif
 
   sinfo("tcb=0x%p sigdeliver=0x%p\n", tcb, sigdeliver);
 
@@ -118,7 +122,7 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
        * to the currently executing task.
        */
 
-      sinfo("rtcb=0x%p g_current_regs=0x%p\n", this_task(), g_current_regs);
+      sinfo("rtcb=0x%p CURRENT_REGS=0x%p\n", this_task(), CURRENT_REGS);
 
       if (tcb == this_task())
         {
@@ -126,7 +130,7 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
            * signalling itself for some reason.
            */
 
-          if (!g_current_regs)
+          if (!CURRENT_REGS)
             {
               /* In this case just deliver the signal with a function call now. */
 
@@ -151,9 +155,9 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
                       tcb->xcp.saved_rsp = curr_rsp;
                       tcb->xcp.saved_kstack = kstack;
 
-                      // Update the kernel stack, also update GS BASE, which is the cache of kernel stack
+                      // Update the kernel stack, also update its per-CPU copy used by the syscall entry
                       tcb->adj_stack_ptr = (void*)(curr_rsp - 8);
-                      write_gsbase(tcb->adj_stack_ptr);
+                      up_set_kstack(tcb->adj_stack_ptr);
 
                       if(tcb->xcp.signal_stack_flag & TUX_SS_DISABLE) { // SS_DISABLE, not using signal stack
                           new_rsp = *((uint64_t*)kstack - 1) - 8; // Read out the user stack address
@@ -172,9 +176,9 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
                           tcb->xcp.signal_stack_flag = 0; // !SS_DISABLED
 
 
-                      // Restore the kernel stack, also update GS BASE, which is the cache of kernel stack
+                      // Restore the kernel stack, also update its per-CPU copy used by the syscall entry
                       tcb->adj_stack_ptr = (void*)tcb->xcp.saved_kstack;
-                      write_gsbase(tcb->adj_stack_ptr);
+                      up_set_kstack(tcb->adj_stack_ptr);
                       tcb->xcp.saved_rsp = 0;
                       tcb->xcp.saved_kstack = 0;
                   }else{
@@ -203,7 +207,7 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
            * Hmmm... there looks like a latent bug here: The following logic
            * would fail in the strange case where we are in an interrupt
            * handler, the thread is signalling itself, but a context switch to
-           * another task has occurred so that g_current_regs does not refer to
+           * another task has occurred so that CURRENT_REGS does not refer to
            * the thread of this_task()!
            */
 
@@ -215,31 +219,31 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
                */
 
               tcb->xcp.sigdeliver       = sigdeliver;
-              tcb->xcp.saved_rip        = g_current_regs[REG_RIP];
+              tcb->xcp.saved_rip        = CURRENT_REGS[REG_RIP];
               tcb->xcp.saved_rsp        = 0;
-              tcb->xcp.saved_rflags     = g_current_regs[REG_RFLAGS];
+              tcb->xcp.saved_rflags     = CURRENT_REGS[REG_RFLAGS];
 
               if(tcb->xcp.is_linux) {
                   /* 1. move to the user stack */
                   /* 2. if currently in kernel stack, we need to prevent an overwrite */
                   /* 3. if signal stack is set use it instead */
                   kstack = (uint64_t)tcb->adj_stack_ptr;
-                  curr_rsp = g_current_regs[REG_RSP];
+                  curr_rsp = CURRENT_REGS[REG_RSP];
 
-                  if((g_current_regs[REG_RSP] < kstack) && (g_current_regs[REG_RSP] > kstack - tcb->adj_stack_size)) {
+                  if((CURRENT_REGS[REG_RSP] < kstack) && (CURRENT_REGS[REG_RSP] > kstack - tcb->adj_stack_size)) {
                       tcb->xcp.saved_rsp = curr_rsp;
                       tcb->xcp.saved_kstack = kstack;
 
                       tcb->adj_stack_ptr = (void*)(curr_rsp - 8);
-                      write_gsbase(tcb->adj_stack_ptr);
-                      g_current_regs[REG_RSP] = *((uint64_t*)kstack - 1) - 8; // Read out the user stack address
+                      up_set_kstack(tcb->adj_stack_ptr);
+                      CURRENT_REGS[REG_RSP] = *((uint64_t*)kstack - 1) - 8; // Read out the user stack address
                   }
 
                   if(!(tcb->xcp.signal_stack_flag & TUX_SS_DISABLE)) { // !SS_DISABLE
                       tcb->xcp.saved_rsp = curr_rsp;
 
                       tcb->xcp.signal_stack_flag |= 1;
-                      g_current_regs[REG_RSP] =  (tcb->xcp.signal_stack + tcb->xcp.signal_stack_size) & (-0x10);
+                      CURRENT_REGS[REG_RSP] =  (tcb->xcp.signal_stack + tcb->xcp.signal_stack_size) & (-0x10);
                   }
               }
 
@@ -247,8 +251,8 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
                * disabled
                */
 
-              g_current_regs[REG_RIP]     = (uint64_t)up_sigdeliver;
-              g_current_regs[REG_RFLAGS]  = 0;
+              CURRENT_REGS[REG_RIP]     = (uint64_t)up_sigdeliver;
+              CURRENT_REGS[REG_RFLAGS]  = 0;
 
               /* And make sure that the saved context in the TCB
                * is the same as the interrupt return context.
@@ -266,6 +270,21 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
 
       else
         {
+#ifdef CONFIG_SMP
+          /* A task running on another CPU is paused first.  That leaves
+           * its context in the TCB, like the context of any task that is
+           * not running.
+           */
+
+          cpu    = tcb->cpu;
+          paused = (tcb->task_state == TSTATE_TASK_RUNNING);
+
+          if (paused)
+            {
+              DEBUGVERIFY(up_cpu_pause(cpu));
+            }
+#endif
+
           /* Save the return lr and cpsr and one scratch register
            * These will be restored by the signal trampoline after
            * the signals have been delivered.
@@ -293,7 +312,7 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
                   tcb->xcp.regs[REG_RSP] = *((uint64_t*)kstack - 1) - 8; // Read out the user stack address
 
                   /* move the kstack starting point to somewhere unused */
-                  /* No need to update the GS cache, CTX will do that */
+                  /* No need to update the per-CPU copy, CTX will do that */
                   tcb->adj_stack_ptr = (void*)(curr_rsp - 8);
               }
 
@@ -311,6 +330,13 @@ void up_schedule_sigaction(struct tcb_s *tcb, sig_deliver_t sigdeliver)
 
           tcb->xcp.regs[REG_RIP]    = (uint64_t)up_sigdeliver;
           tcb->xcp.regs[REG_RFLAGS]  = 0;
+
+#ifdef CONFIG_SMP
+          if (paused)
+            {
+              DEBUGVERIFY(up_cpu_resume(cpu));
+            }
+#endif
         }
     }
 
@@ -89,6 +89,7 @@ void up_sigdeliver(void)
   uint64_t* regs;
   regs = (uint64_t*)(((uint64_t)(regs_area) + 15) & (~(uint64_t)15)); // align regs to 16byte boundary for SSE instrucitons
   sig_deliver_t sigdeliver;
+  void* xstate;
 
   /* Save the errno.  This must be preserved throughout the signal handling
    * so that the user code final gets the correct errno value (probably
@@ -121,6 +122,10 @@ void up_sigdeliver(void)
   sigdeliver           = rtcb->xcp.sigdeliver;
   rtcb->xcp.sigdeliver = NULL;
 
+  /* The handler may use AVX as well */
+
+  xstate = up_xstate_push();
+
   /* Then restore the task interrupt state */
 
   up_irq_restore(regs[REG_RFLAGS]);
@@ -138,6 +143,8 @@ void up_sigdeliver(void)
   (void)up_irq_save();
   rtcb->pterrno = saved_errno;
 
+  up_xstate_pop(xstate);
+
   shadow_proc_set_prio(gshadow, saved_prio);
 
   if(rtcb->xcp.saved_rsp){
@@ -147,7 +154,7 @@ void up_sigdeliver(void)
 
   if(rtcb->xcp.saved_kstack){
     rtcb->adj_stack_ptr = rtcb->xcp.saved_kstack;
-    write_gsbase(rtcb->adj_stack_ptr);
+    up_set_kstack(rtcb->adj_stack_ptr);
     rtcb->xcp.saved_kstack = 0;
   }
 
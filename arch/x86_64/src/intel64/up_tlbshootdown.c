@@ -0,0 +1,138 @@
+/****************************************************************************
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name NuttX nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <nuttx/arch.h>
+#include <nuttx/irq.h>
+#include <arch/arch.h>
+#include <arch/irq.h>
+
+#include "up_internal.h"
+#include "sched/sched.h"
+
+#ifdef CONFIG_SMP
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: up_tlb_handler
+ *
+ * Description:
+ *   This is the handler for the TLB shootdown IPI.  Reloading CR3 with
+ *   the PCID of the running task drops its TLB entries.
+ *
+ ****************************************************************************/
+
+int up_tlb_handler(int irq, FAR void *context, FAR void *arg)
+{
+  struct intel64_cpu_s *cpu = up_this_cpu();
+
+  set_pcid(this_task()->pid);
+  cpu->tlb_gen++;
+
+  return OK;
+}
+
+/****************************************************************************
+ * Name: up_tlb_shootdown
+ *
+ * Description:
+ *   The caller changed the page tables of the running task, and has
+ *   already reloaded its own TLB.  Make every other CPU running a task of
+ *   the same address space reload theirs.
+ *
+ *   A CPU switching to such a task afterwards reloads its TLB anyway.
+ *   Switching away does too, the PCID is flushed when next loaded.
+ *
+ *   With interrupts enabled, this returns after every CPU has done so and
+ *   the memory unmapped may be reused.  Inside a critical section the
+ *   other CPUs may be spinning for it with interrupts disabled, the IPIs
+ *   are sent but not waited for.
+ *
+ ****************************************************************************/
+
+void up_tlb_shootdown(void)
+{
+  uint32_t gen[CONFIG_SMP_NCPUS];
+  uint32_t sent = 0;
+  irqstate_t flags;
+  uint64_t *pd1;
+  int self;
+  int i;
+
+  flags = up_irq_save();
+
+  pd1 = this_task()->xcp.pd1;
+  self = up_cpu_index();
+
+  /* The page table updates must be visible before pd1 is compared, see
+   * up_restore_auxstate
+   */
+
+  asm volatile("mfence" : : : "memory");
+
+  for (i = 0; pd1 && i < CONFIG_SMP_NCPUS; i++)
+    {
+      if (i == self || !g_cpu[i].online || g_cpu[i].pd1 != pd1)
+        {
+          continue;
+        }
+
+      gen[i] = g_cpu[i].tlb_gen;
+      sent |= 1 << i;
+
+      up_send_ipi(i, SMP_IPI_TLB_IRQ);
+    }
+
+  up_irq_restore(flags);
+
+  if (!up_irq_enabled(flags))
+    {
+      return;
+    }
+
+  for (i = 0; i < CONFIG_SMP_NCPUS; i++)
+    {
+      while ((sent & (1 << i)) && g_cpu[i].tlb_gen == gen[i]);
+    }
+}
+
+#endif /* CONFIG_SMP */
@@ -0,0 +1,424 @@
+/****************************************************************************
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name NuttX nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <nuttx/arch.h>
+#include <nuttx/irq.h>
+#include <nuttx/kmalloc.h>
+#include <arch/arch.h>
+#include <arch/irq.h>
+
+#include "up_internal.h"
+#include "sched/sched.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define X86_CPUID_01_XSAVE     (1 << 26) /* ECX of leaf 1 */
+#define X86_CPUID_0D_XSAVEOPT  (1 << 0)  /* EAX of leaf 0xd, sub-leaf 1 */
+#define X86_CPUID_0D_XSAVES    (1 << 3)
+
+#define X86_CR4_OSXSAVE        0x00040000
+
+/* State components, as bits of XCR0 and of the XSAVE masks */
+
+#define XSTATE_X87             (1 << 0)
+#define XSTATE_SSE             (1 << 1)
+#define XSTATE_AVX             (1 << 2)
+#define XSTATE_OPMASK          (1 << 5)
+#define XSTATE_ZMM_HI256       (1 << 6)
+#define XSTATE_HI16_ZMM        (1 << 7)
+
+#define XSTATE_LEGACY          (XSTATE_X87 | XSTATE_SSE)
+#define XSTATE_AVX512          (XSTATE_OPMASK | XSTATE_ZMM_HI256 | XSTATE_HI16_ZMM)
+
+/* Layout of the XSAVE area, the header follows the 512 byte legacy region */
+
+#define XSAVE_ALIGN            64
+#define XSAVE_MXCSR            24
+#define XSAVE_XCOMP_BV         520
+#define XSAVE_COMPACTED        (1ULL << 63)
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+enum xstate_insn_e
+{
+  XSTATE_XSAVE = 0,  /* Saves every component in use */
+  XSTATE_XSAVEOPT,   /* Skips those not modified since the XRSTOR */
+  XSTATE_XSAVES,     /* Same, into the smaller compacted format */
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* Components switched through the XSAVE areas.  x87 and SSE stay in the
+ * fxsave area of the register frame, the kernel itself uses SSE.  Zero if
+ * the CPU has nothing more, then none of the below does anything.
+ */
+
+static uint64_t g_xstate_mask;
+static uint32_t g_xstate_size;
+static enum xstate_insn_e g_xstate_insn;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static inline void up_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                            uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+  asm volatile("cpuid"
+               : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+               : "a" (leaf), "c" (subleaf));
+}
+
+static inline void up_xsave(uint8_t *area)
+{
+  uint32_t lo = g_xstate_mask;
+  uint32_t hi = g_xstate_mask >> 32;
+
+  switch (g_xstate_insn)
+    {
+      case XSTATE_XSAVES:
+        asm volatile("xsaves64 (%0)"
+                     : : "r" (area), "a" (lo), "d" (hi) : "memory");
+        break;
+
+      case XSTATE_XSAVEOPT:
+        asm volatile("xsaveopt64 (%0)"
+                     : : "r" (area), "a" (lo), "d" (hi) : "memory");
+        break;
+
+      default:
+        asm volatile("xsave64 (%0)"
+                     : : "r" (area), "a" (lo), "d" (hi) : "memory");
+        break;
+    }
+}
+
+static inline void up_xrstor(uint8_t *area)
+{
+  uint32_t lo = g_xstate_mask;
+  uint32_t hi = g_xstate_mask >> 32;
+
+  if (g_xstate_insn == XSTATE_XSAVES)
+    {
+      asm volatile("xrstors64 (%0)"
+                   : : "r" (area), "a" (lo), "d" (hi) : "memory");
+    }
+  else
+    {
+      asm volatile("xrstor64 (%0)"
+                   : : "r" (area), "a" (lo), "d" (hi) : "memory");
+    }
+}
+
+/* Make the registers of this CPU hold the area of the TCB */
+
+static void up_xstate_load(struct intel64_cpu_s *cpu, struct tcb_s *tcb)
+{
+  up_xrstor(tcb->xcp.xstate);
+
+  cpu->xstate_owner   = tcb;
+  tcb->xcp.xstate_cpu = cpu->id;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: up_xstate_initialize
+ *
+ * Description:
+ *   Enable XSAVE and the AVX and AVX-512 state on the calling CPU.  Every
+ *   CPU calls this, the boot CPU also sizes the areas for all of them.
+ *
+ ****************************************************************************/
+
+void up_xstate_initialize(void)
+{
+  uint32_t eax, ebx, ecx, edx;
+  uint64_t xcr0;
+  uint64_t cr4;
+
+  up_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+  if (!(ecx & X86_CPUID_01_XSAVE))
+    {
+      return;
+    }
+
+  asm volatile("mov %%cr4, %0" : "=r" (cr4));
+  asm volatile("mov %0, %%cr4" : : "r" (cr4 | X86_CR4_OSXSAVE));
+
+  up_cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+  xcr0 = XSTATE_LEGACY | (eax & (XSTATE_AVX | XSTATE_AVX512));
+
+  /* The AVX-512 components only come all together, on top of AVX */
+
+  if ((xcr0 & XSTATE_AVX512) != XSTATE_AVX512 || !(xcr0 & XSTATE_AVX))
+    {
+      xcr0 &= ~XSTATE_AVX512;
+    }
+
+  asm volatile("xsetbv"
+               : : "c" (0), "a" ((uint32_t)xcr0),
+                   "d" ((uint32_t)(xcr0 >> 32)));
+
+  if (up_cpu_index() != 0)
+    {
+      return;
+    }
+
+  /* Sizes are reported for the components enabled just now.  IA32_XSS is
+   * left at 0, XSAVES only manages the user components here.
+   */
+
+  up_cpuid(0xd, 1, &eax, &ebx, &ecx, &edx);
+  if (eax & X86_CPUID_0D_XSAVES)
+    {
+      g_xstate_insn = XSTATE_XSAVES;
+      g_xstate_size = ebx;
+    }
+  else
+    {
+      g_xstate_insn = (eax & X86_CPUID_0D_XSAVEOPT) ?
+                      XSTATE_XSAVEOPT : XSTATE_XSAVE;
+
+      up_cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+      g_xstate_size = ebx;
+    }
+
+  g_xstate_mask = xcr0 & ~(uint64_t)XSTATE_LEGACY;
+}
+
+/****************************************************************************
+ * Name: up_xstate_alloc
+ *
+ * Description:
+ *   Give a Linux task its XSAVE area, in the initial state or inheriting
+ *   the registers of the calling task.  Tasks without one, all of the NuttX
+ *   ones, never pay for saving the extended state.
+ *
+ ****************************************************************************/
+
+int up_xstate_alloc(struct tcb_s *tcb, bool inherit)
+{
+  struct intel64_cpu_s *cpu;
+  irqstate_t flags;
+  uint8_t *area;
+
+  if (!g_xstate_mask)
+    {
+      return OK;
+    }
+
+  area = kmm_memalign(XSAVE_ALIGN, g_xstate_size);
+  if (!area)
+    {
+      return -ENOMEM;
+    }
+
+  /* An empty header is every component in its initial state.  XRSTOR still
+   * loads MXCSR from the legacy region, keep it valid.
+   */
+
+  memset(area, 0, g_xstate_size);
+  *(uint32_t *)(area + XSAVE_MXCSR) = 0x1f80;
+
+  if (g_xstate_insn == XSTATE_XSAVES)
+    {
+      *(uint64_t *)(area + XSAVE_XCOMP_BV) = XSAVE_COMPACTED | g_xstate_mask;
+    }
+
+  if (inherit)
+    {
+      flags = up_irq_save();
+
+      cpu = up_this_cpu();
+      if (cpu->xstate_live && cpu->xstate_owner == this_task())
+        {
+          up_xsave(area);
+        }
+
+      up_irq_restore(flags);
+    }
+
+  tcb->xcp.xstate = area;
+  return OK;
+}
+
+/****************************************************************************
+ * Name: up_xstate_free
+ *
+ * Description:
+ *   Release the XSAVE area of a defunct task.  CPUs only compare their
+ *   owner against the TCB, but the TCB may be reused by the next task.
+ *
+ ****************************************************************************/
+
+void up_xstate_free(struct tcb_s *tcb)
+{
+  int i;
+
+  if (!tcb->xcp.xstate)
+    {
+      return;
+    }
+
+  for (i = 0; i < X86_64_NCPUS; i++)
+    {
+      (void)__sync_bool_compare_and_swap(&g_cpu[i].xstate_owner, tcb, NULL);
+    }
+
+  sched_kfree(tcb->xcp.xstate);
+  tcb->xcp.xstate = NULL;
+}
+
+/****************************************************************************
+ * Name: up_xstate_save
+ *
+ * Description:
+ *   The running task is switched out, store its extended state.  Called
+ *   with interrupts disabled.  Components still in their initial state, or
+ *   not modified since the area was loaded, are not written at all.
+ *
+ ****************************************************************************/
+
+void up_xstate_save(void)
+{
+  struct intel64_cpu_s *cpu = up_this_cpu();
+
+  if (cpu->xstate_live && cpu->xstate_owner)
+    {
+      up_xsave(cpu->xstate_owner->xcp.xstate);
+    }
+}
+
+/****************************************************************************
+ * Name: up_xstate_restore
+ *
+ * Description:
+ *   The task is switched in.  NuttX tasks leave the extended registers
+ *   alone, if nobody else loaded them on this CPU since the task left, they
+ *   are still the ones in its area.
+ *
+ ****************************************************************************/
+
+void up_xstate_restore(struct tcb_s *tcb)
+{
+  struct intel64_cpu_s *cpu = up_this_cpu();
+
+  if (!tcb->xcp.xstate)
+    {
+      cpu->xstate_live = false;
+      return;
+    }
+
+  if (cpu->xstate_owner != tcb || tcb->xcp.xstate_cpu != cpu->id)
+    {
+      up_xstate_load(cpu, tcb);
+    }
+
+  cpu->xstate_live = true;
+}
+
+/****************************************************************************
+ * Name: up_xstate_push
+ *
+ * Description:
+ *   Keep a copy of the extended state of the running task, while it runs a
+ *   signal handler.  Returns NULL if there is nothing to keep.
+ *
+ ****************************************************************************/
+
+FAR void *up_xstate_push(void)
+{
+  struct tcb_s *rtcb = this_task();
+  irqstate_t flags;
+  uint8_t *saved;
+
+  if (!rtcb->xcp.xstate)
+    {
+      return NULL;
+    }
+
+  saved = kmm_memalign(XSAVE_ALIGN, g_xstate_size);
+  if (saved)
+    {
+      flags = up_irq_save();
+      up_xstate_save();
+      memcpy(saved, rtcb->xcp.xstate, g_xstate_size);
+      up_irq_restore(flags);
+    }
+
+  return saved;
+}
+
+/****************************************************************************
+ * Name: up_xstate_pop
+ *
+ * Description:
+ *   Return to the state kept by up_xstate_push().
+ *
+ ****************************************************************************/
+
+void up_xstate_pop(FAR void *saved)
+{
+  struct tcb_s *rtcb = this_task();
+  irqstate_t flags;
+
+  if (!saved)
+    {
+      return;
+    }
+
+  flags = up_irq_save();
+  memcpy(rtcb->xcp.xstate, saved, g_xstate_size);
+  up_xstate_load(up_this_cpu(), rtcb);
+  up_irq_restore(flags);
+
+  kmm_free(saved);
+}
@@ -60,13 +60,13 @@ syscall_t linux_syscall_action_table[500] = {
     tux_file_delegate, // SYS_write
     tux_open_delegate, // SYS_open
     tux_file_delegate, // SYS_close
-    tux_delegate, // SYS_stat
+    tux_path_delegate, // SYS_stat
     tux_file_delegate, // SYS_fstat
-    tux_delegate, // sys_lstat
+    tux_path_delegate, // sys_lstat
     (syscall_t)tux_poll, // SYS_poll,
     tux_file_delegate, // SYS_lseek,
     (syscall_t)tux_mmap,
-    (syscall_t)tux_success_stub, // XXX: SYS_mprotect Missing logic, how to protect flat memory space
+    (syscall_t)tux_mprotect,
     (syscall_t)tux_munmap,
     (syscall_t)tux_brk,
     (syscall_t)tux_rt_sigaction, // SYS_rt_sigaction
@@ -77,7 +77,7 @@ syscall_t linux_syscall_action_table[500] = {
     tux_file_delegate, // SYS_pwrite,
     tux_file_delegate, // sys_readv
     tux_file_delegate, // sys_writev
-    tux_delegate, // sys_access
+    tux_path_delegate, // sys_access
     (syscall_t)tux_pipe, // sys_pipe
     (syscall_t)tux_select, // sys_select
     tux_local,
@@ -131,19 +131,19 @@ syscall_t linux_syscall_action_table[500] = {
     tux_file_delegate, // SYS_fcntl,
     tux_delegate, // SYS_flock,
     tux_file_delegate, // SYS_fsync,
-    tux_delegate, // SYS_fdatasync,
+    tux_file_delegate, // SYS_fdatasync,
     tux_delegate, // SYS_truncate,
     tux_file_delegate, // SYS_ftruncate,
     tux_delegate, // SYS_getdents,
     tux_delegate, // SYS_getcwd,
     tux_delegate, // SYS_chdir,
     tux_delegate, // SYS_fchdir,
-    tux_delegate, // SYS_rename,
-    tux_delegate, // SYS_mkdir,
-    tux_delegate, // SYS_rmdir,
+    tux_path_delegate, // SYS_rename,
+    tux_path_delegate, // SYS_mkdir,
+    tux_path_delegate, // SYS_rmdir,
     tux_delegate, // SYS_creat,
     tux_delegate, // SYS_link, Only peusdo pilesystem are supported, not useful, disabled for now
-    tux_delegate, // SYS_unlink,
+    tux_path_delegate, // SYS_unlink,
     tux_delegate, // SYS_symlink,
     tux_delegate, // SYS_readlink,
     tux_delegate, // SYS_chmod,
@@ -205,10 +205,10 @@ syscall_t linux_syscall_action_table[500] = {
     (syscall_t)tux_sched_get_priority_max, // SYS_sched_get_priority_max,
     (syscall_t)tux_sched_get_priority_min, // SYS_sched_get_priority_min,
     (syscall_t)tux_pidhook, // SYS_sched_rr_get_interval,
-    (syscall_t)tux_success_stub, // SYS_mlock,
+    (syscall_t)tux_mlock, // SYS_mlock,
     (syscall_t)tux_success_stub, // SYS_munlock,
-    (syscall_t)tux_success_stub, // SYS_mlockall,
-    (syscall_t)tux_success_stub, // SYS_munlockall,
+    (syscall_t)tux_mlockall, // SYS_mlockall,
+    (syscall_t)tux_munlockall, // SYS_munlockall,
     tux_no_impl, // SYS_vhangup,
     tux_no_impl, // SYS_modify_ldt,
     tux_no_impl, // SYS_pivot_root,
@@ -257,9 +257,9 @@ syscall_t linux_syscall_action_table[500] = {
     tux_delegate, // SYS_lremovexattr,
     tux_delegate, // SYS_fremovexattr,
     tux_no_impl, // SYS_tkill,
-    tux_delegate,//tux_no_impl, // SYS_time,
+    (syscall_t)tux_time, // SYS_time,
     (syscall_t)tux_futex,
-    (syscall_t)tux_success_stub, // SYS_sched_setaffinity, // Only if we expend to SMP
+    (syscall_t)tux_sched_setaffinity, // SYS_sched_setaffinity,
     (syscall_t)tux_sched_getaffinity, // SYS_sched_getaffinity,
     tux_no_impl, // SYS_set_thread_area,
     tux_no_impl, // SYS_io_setup,
@@ -269,11 +269,11 @@ syscall_t linux_syscall_action_table[500] = {
     tux_no_impl, // SYS_io_cancel,
     tux_no_impl, // SYS_get_thread_area,
     tux_no_impl, // SYS_lookup_dcookie,
-    tux_delegate, // SYS_epoll_create,
+    tux_epoll_create, // SYS_epoll_create,
     tux_delegate, // SYS_epoll_ctl_old,
     tux_delegate, // SYS_epoll_wait_old,
     tux_no_impl, // SYS_remap_file_pages,
-    tux_delegate, // SYS_getdents64,
+    tux_file_delegate, // SYS_getdents64,
     (syscall_t)tux_set_tid_address,
     tux_no_impl, // SYS_restart_syscall,
     (syscall_t)tux_semtimedop, // SYS_semtimedop,
@@ -284,12 +284,12 @@ syscall_t linux_syscall_action_table[500] = {
     tux_local, // SYS_timer_getoverrun,
     tux_local, // SYS_timer_delete,
     tux_local, // SYS_clock_settime,
-    tux_local, // SYS_clock_gettime,
-    tux_local, // SYS_clock_getres,
+    (syscall_t)tux_clock_gettime, // SYS_clock_gettime,
+    (syscall_t)tux_clock_getres, // SYS_clock_getres,
     tux_local, // SYS_clock_nanosleep,
     (syscall_t)tux_exit, //sys_exit_group
-    tux_delegate, // SYS_epoll_wait,
-    tux_delegate, // SYS_epoll_ctl,
+    (syscall_t)tux_epoll_wait, // SYS_epoll_wait,
+    (syscall_t)tux_epoll_ctl, // SYS_epoll_ctl,
     tux_no_impl, // SYS_tgkill,
     tux_no_impl, // SYS_utimes,
     tux_no_impl, // SYS_vserver,
@@ -313,19 +313,19 @@ syscall_t linux_syscall_action_table[500] = {
     tux_delegate, // SYS_inotify_add_watch,
     tux_delegate, // SYS_inotify_rm_watch,
     tux_no_impl, // SYS_migrate_pages,
-    tux_delegate, // SYS_openat,
+    tux_open_delegate, // SYS_openat,
     tux_delegate, // SYS_mkdirat,
     tux_delegate, // SYS_mknodat,
     tux_delegate, // SYS_fchownat,
     tux_delegate, // SYS_futimesat,
-    tux_delegate, // SYS_newfstatat,
+    tux_path_delegate, // SYS_newfstatat,
     tux_delegate, // SYS_unlinkat,
     tux_delegate, // SYS_renameat,
     tux_delegate, // SYS_linkat,
     tux_delegate, // SYS_symlinkat,
     tux_delegate, // SYS_readlinkat,
     tux_delegate, // SYS_fchmodat,
-    tux_delegate, // SYS_faccessat,
+    tux_path_delegate, // SYS_faccessat,
     tux_delegate, // SYS_pselect6,
     tux_delegate, // SYS_ppoll,
     tux_no_impl, // SYS_unshare,
@@ -337,7 +337,7 @@ syscall_t linux_syscall_action_table[500] = {
     tux_no_impl, // SYS_vmsplice,
     tux_no_impl, // SYS_move_pages,
     tux_no_impl, // SYS_utimensat,
-    tux_delegate, // SYS_epoll_pwait,
+    (syscall_t)tux_epoll_wait, // SYS_epoll_pwait,
     tux_no_impl, // SYS_signalfd,
     tux_no_impl, // SYS_timerfd_create,
     tux_delegate, // SYS_eventfd,
@@ -347,15 +347,15 @@ syscall_t linux_syscall_action_table[500] = {
     tux_delegate, // SYS_accept4,
     tux_no_impl, // SYS_signalfd4,
     tux_delegate, // SYS_eventfd2,
-    tux_delegate, // SYS_epoll_create1,
+    tux_epoll_create, // SYS_epoll_create1,
     tux_delegate, // SYS_dup3,
     (syscall_t)tux_pipe, // SYS_pipe2,
     tux_delegate, // SYS_inotify_init1,
-    tux_delegate, // SYS_preadv,
-    tux_delegate, // SYS_pwritev,
+    tux_file_delegate, // SYS_preadv,
+    tux_file_delegate, // SYS_pwritev,
     tux_no_impl, // SYS_rt_tgsigqueueinfo,
     tux_no_impl, // SYS_perf_event_open,
-    tux_delegate, // SYS_recvmmsg,
+    tux_file_delegate, // SYS_recvmmsg,
     tux_delegate, // SYS_fanotify_init,
     tux_delegate, // SYS_fanotify_mark,
     tux_no_impl, // SYS_prlimit64,
@@ -363,7 +363,7 @@ syscall_t linux_syscall_action_table[500] = {
     tux_delegate, // SYS_open_by_handle_at,
     tux_no_impl, // SYS_clock_adjtime,
     tux_delegate, // SYS_syncfs,
-    tux_delegate, // SYS_sendmmsg,
+    tux_file_delegate, // SYS_sendmmsg,
     tux_no_impl, // SYS_setns,
     (syscall_t)tux_getcpu, // SYS_getcpu,
     tux_no_impl, // SYS_process_vm_readv,
@@ -381,10 +381,10 @@ syscall_t linux_syscall_action_table[500] = {
     tux_no_impl, // SYS_execveat,
     tux_no_impl, // SYS_userfaultfd,
     tux_no_impl, // SYS_membarrier,
-    (syscall_t)tux_success_stub, // SYS_mlock2,
-    tux_no_impl, // SYS_copy_file_range,
-    tux_delegate, // SYS_preadv2,
-    tux_delegate, // SYS_pwritev2,
+    (syscall_t)tux_mlock2, // SYS_mlock2,
+    (syscall_t)tux_copy_file_range, // SYS_copy_file_range,
+    tux_file_delegate, // SYS_preadv2,
+    tux_file_delegate, // SYS_pwritev2,
     tux_delegate, // SYS_pkey_mprotect,
     tux_delegate, // SYS_pkey_alloc,
     tux_delegate, // SYS_pkey_free,
@@ -594,7 +594,7 @@ uint64_t linux_syscall_number_table[500] = {
     -1, // SYS_tkill,
     -1, // SYS_time,
     -1,
-    -1, // SYS_sched_setaffinity, // Only if we expend to SMP
+    -1, // SYS_sched_setaffinity,
     -1, // SYS_sched_getaffinity,
     -1, // SYS_set_thread_area,
     -1, // SYS_io_setup,
@@ -741,12 +741,17 @@ linux_interface(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
                           uintptr_t parm6)
 {
   uint64_t ret;
+  uint64_t tsc;
 
   svcinfo("Linux Subsystem call: %d\n", nbr);
 
+  tsc = tux_stats_tsc();
+
   /* Call syscall from table. */
   ret = linux_syscall_action_table[nbr](nbr, parm1, parm2, parm3, parm4, parm5, parm6);
 
+  tux_stats_syscall(nbr, tsc);
+
   svcinfo("ret = %llx\n", ret);
 
   return ret;
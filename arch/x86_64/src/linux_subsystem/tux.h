@@ -24,11 +24,19 @@
 #define FUTEX_WAKE_OP 0x5
 #define FUTEX_REQUEUE		3
 #define FUTEX_CMP_REQUEUE	4
+#define FUTEX_LOCK_PI		6
+#define FUTEX_UNLOCK_PI		7
+#define FUTEX_TRYLOCK_PI	8
 #define FUTEX_WAIT_BITSET	9
 #define FUTEX_WAKE_BITSET	10
 #define FUTEX_PRIVATE_FLAG 0x80
 #define FUTEX_CLOCK_REALTIME	256
 
+#define FUTEX_WAITERS       0x80000000
+#define FUTEX_OWNER_DIED    0x40000000
+#define FUTEX_TID_MASK      0x3fffffff
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
+
 #define FUTEX_OP_SET        0  /* uaddr2 = oparg; */
 #define FUTEX_OP_ADD        1  /* uaddr2 += oparg; */
 #define FUTEX_OP_OR         2  /* uaddr2 |= oparg; */
@@ -97,6 +105,13 @@
 #define TUX_POLLHUP         0x010        /* Hung up.  */
 #define TUX_POLLNVAL        0x020        /* Invalid polling request.  */
 
+#define TUX_EPOLLONESHOT    (1U << 30)
+#define TUX_EPOLLET         (1U << 31)
+
+#define TUX_EPOLL_CTL_ADD   1
+#define TUX_EPOLL_CTL_DEL   2
+#define TUX_EPOLL_CTL_MOD   3
+
 #define TUX_IPC_CREAT	01000		/* create key if key does not exist. */
 #define TUX_IPC_EXCL	02000		/* fail if key exists.  */
 
@@ -171,6 +186,17 @@ enum
 
 extern GRAN_HANDLE tux_mm_hnd;
 
+struct vm_map_s* tux_mm_vm(struct tcb_s *tcb);
+bool tux_mm_lookup(struct tcb_s *tcb, uint64_t va, struct vma_s* copy);
+uintptr_t tux_mm_fault_in(struct tcb_s *tcb, uint64_t va, bool write);
+int tux_mm_fault(uint64_t *regs);
+void tux_mm_mirror(struct tcb_s *tcb);
+int tux_mm_fork(struct tcb_s *child);
+void tux_mm_release(struct tcb_s *tcb, struct vma_s* vma, uint64_t start, uint64_t end);
+uintptr_t tux_mm_huge_pa(struct tcb_s *tcb, uint64_t va);
+bool tux_mm_page_get(uintptr_t page);
+void tux_mm_page_put(uintptr_t page);
+
 struct rlimit {
   unsigned long rlim_cur;  /* Soft limit */
   unsigned long rlim_max;  /* Hard limit (ceiling for rlim_cur) */
@@ -196,6 +222,70 @@ struct tux_pollfd
     short int revents;		/* Types of events that actually occurred.  */
   };
 
+struct tux_epoll_event {
+    uint32_t events;
+    uint64_t data;
+} __attribute__((packed));
+
+/* Linux x86_64 struct stat, 144 bytes */
+struct tux_stat {
+    uint64_t st_dev;
+    uint64_t st_ino;
+    uint64_t st_nlink;
+    uint32_t st_mode;
+    uint32_t st_uid;
+    uint32_t st_gid;
+    uint32_t __pad0;
+    uint64_t st_rdev;
+    int64_t  st_size;
+    int64_t  st_blksize;
+    int64_t  st_blocks;
+    uint64_t st_atime_sec;
+    uint64_t st_atime_nsec;
+    uint64_t st_mtime_sec;
+    uint64_t st_mtime_nsec;
+    uint64_t st_ctime_sec;
+    uint64_t st_ctime_nsec;
+    int64_t  __unused[3];
+};
+
+/* Linux x86_64 struct timespec and struct timeval, time_t is 32 bits here */
+struct tux_timespec {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+};
+
+struct tux_timeval {
+    int64_t tv_sec;
+    int64_t tv_usec;
+};
+
+struct tux_dirent64 {
+    uint64_t d_ino;
+    int64_t  d_off;
+    uint16_t d_reclen;
+    uint8_t  d_type;
+    char     d_name[];
+};
+
+/* Linux x86_64 struct iovec and struct msghdr */
+struct tux_iovec {
+    uint64_t iov_base;
+    uint64_t iov_len;
+};
+
+struct tux_msghdr {
+    uint64_t msg_name;
+    uint32_t msg_namelen;
+    uint32_t __pad0;
+    uint64_t msg_iov;
+    uint64_t msg_iovlen;
+    uint64_t msg_control;
+    uint64_t msg_controllen;
+    int32_t  msg_flags;
+    uint32_t __pad1;
+};
+
 struct ipc_perm {
    uint32_t       __key;    /* Key supplied to shmget(2) */
    uint64_t       uid;      /* Effective UID of owner */
@@ -346,42 +436,84 @@ static inline uint64_t unset_msr(unsigned long nbr){
     return 0;
 }
 
+/* Page tables are edited through a window of huge pages at 0xc0000000,
+ * one per CPU so that they can do so at the same time.  Interrupts must be
+ * disabled while it is in use. */
+#define TUX_MM_WINDOW         0xc0000000
+#define TUX_MM_WINDOW_SIZE    0x4000000
+
+static inline uintptr_t tux_mm_window_base(void)
+{
+  return TUX_MM_WINDOW + up_cpu_index() * TUX_MM_WINDOW_SIZE;
+}
+
 static inline uint64_t* temp_map_at_0xc0000000(uintptr_t start, uintptr_t end)
 {
+  uintptr_t window = tux_mm_window_base();
   uintptr_t k;
   uintptr_t lsb = start & ~HUGE_PAGE_MASK;
   start &= HUGE_PAGE_MASK;
 
-  svcinfo("Temp map %llx - %llx at 0xc0000000\n", start, end);
+  svcinfo("Temp map %llx - %llx at %llx\n", start, end, window);
+
+  DEBUGASSERT(end - start <= TUX_MM_WINDOW_SIZE);
 
   // Temporary map the new pdas at high memory 0xc000000 ~
   for(k = start; k < end; k += HUGE_PAGE_SIZE)
     {
-      pd[((0xc0000000 + k - start) >> 21) & 0x7ffffff] = k | 0x9b; // No cache
+      pd[((window + k - start) >> 21) & 0x7ffffff] = k | 0x9b; // No cache
+      up_invalid_TLB(window + k - start, window + k - start + 1);
     }
 
-  up_invalid_TLB(start, end);
-
-  return (uint64_t*)(0xc0000000 + lsb);
+  return (uint64_t*)(window + lsb);
 }
 
+void vma_tree_insert(struct vma_tree_s *t, struct vma_s *vma);
+void vma_tree_remove(struct vma_tree_s *t, struct vma_s *vma);
+void vma_tree_update(struct vma_tree_s *t, struct vma_s *vma);
+struct vma_s *vma_tree_lookup(struct vma_tree_s *t, uint64_t addr);
+struct vma_s *vma_tree_next(struct vma_tree_s *t, uint64_t addr);
+struct vma_s *vma_tree_last(struct vma_tree_s *t);
+int vma_tree_find_gap(struct vma_tree_s *t, uint64_t size, uint64_t low,
+                      uint64_t high, uint64_t *addr);
+
 static inline void* virt_to_phys(void* vaddr)
 {
   struct tcb_s *tcb = this_task();
   struct vma_s* ptr;
+  struct vma_s copy;
   irqstate_t flags;
 
   if(vaddr > 0x40000000) return (void*)-1;
 
-  for(ptr = tcb->xcp.vma; ptr; ptr = ptr->next)
+  if(tcb->xcp.vm)
+    {
+      // Other threads may unmap it meanwhile, work on a copy
+      ptr = tux_mm_lookup(tcb, (uintptr_t)vaddr, &copy) ? &copy : NULL;
+    }
+  else
     {
-      if((uintptr_t)vaddr >= ptr->va_start && (uintptr_t)vaddr < ptr->va_end && ptr->pa_start != 0xffffffff)
+      for(ptr = tcb->xcp.vma; ptr; ptr = ptr->next)
         {
-          break;
+          if((uintptr_t)vaddr >= ptr->va_start && (uintptr_t)vaddr < ptr->va_end)
+            break;
         }
     }
 
-  if((uintptr_t)vaddr >= ptr->va_start && (uintptr_t)vaddr < ptr->va_end && ptr->pa_start != 0xffffffff)
+  if(ptr && (ptr->flags & VMA_LAZY))
+    {
+      // Futexes are keyed by this, it must not change on the next write
+      uintptr_t pa = tux_mm_fault_in(tcb, (uintptr_t)vaddr, true);
+      return pa ? (void*)(pa + ((uintptr_t)vaddr & ~PAGE_MASK)) : (void*)-1;
+    }
+
+  if(ptr && (ptr->flags & VMA_HUGE))
+    {
+      uintptr_t pa = tux_mm_huge_pa(tcb, (uintptr_t)vaddr);
+      return pa ? (void*)pa : (void*)-1;
+    }
+
+  if(ptr && ptr->pa_start != 0xffffffff)
     {
       return (void*)(ptr->pa_start + (uintptr_t)vaddr - ptr->va_start);
     }
@@ -406,6 +538,9 @@ static inline void* virt_to_phys(void* vaddr)
 
 int insert_proc_node(int lpid, int rpid);
 int delete_proc_node(int rpid);
+long get_nuttx_pid(int rpid);
+long get_linux_pid(int lpid);
+long search_linux_pid(int lpid);
 
 typedef long (*syscall_t)(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
                           uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
@@ -442,6 +577,42 @@ long tux_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
                           uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
                           uintptr_t parm6);
 
+struct shadow_proc_req;
+
+int  tux_delegate_submit(struct shadow_proc_req *req, unsigned long nbr,
+                         uintptr_t parm1, uintptr_t parm2, uintptr_t parm3,
+                         uintptr_t parm4, uintptr_t parm5, uintptr_t parm6);
+void tux_delegate_flush(void);
+long tux_delegate_wait(struct shadow_proc_req *req);
+void tux_delegate_fork(struct tcb_s *parent, struct tcb_s *child);
+void tux_delegate_release(struct tcb_s *tcb);
+
+int  tux_cache_lookup(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                      uintptr_t parm3, uintptr_t parm4, long *ret);
+void tux_cache_insert(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                      uintptr_t parm3, uintptr_t parm4, long ret);
+void tux_cache_mutate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                      uintptr_t parm3, uintptr_t parm4);
+void tux_cache_invalidate(int linux_pid);
+
+/* A version of a file, as far as the page cache can tell */
+struct tux_pgcache_file {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    int64_t  size;
+};
+
+int       tux_pgcache_file(int fd, struct tux_pgcache_file *file);
+uintptr_t tux_pgcache_lookup(struct tux_pgcache_file *file, uint64_t pgoff);
+void      tux_pgcache_insert(struct tux_pgcache_file *file, uint64_t pgoff, uintptr_t page);
+
+int  tux_mm_map_cached(struct tcb_s *tcb, struct vma_s* vma, struct tux_pgcache_file *file,
+                       uint64_t pgoff, uint64_t npages);
+void tux_mm_cache_pages(struct tcb_s *tcb, struct vma_s* vma, struct tux_pgcache_file *file,
+                        uint64_t pgoff, uint64_t npages);
+
 long tux_file_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
                           uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
                           uintptr_t parm6);
@@ -454,6 +625,23 @@ long tux_open_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
                           uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
                           uintptr_t parm6);
 
+bool tux_is_local_path(const char *path);
+uint64_t tux_open_flags(uint64_t flags);
+long tux_local_open(const char *path, uint64_t flags, uint64_t mode);
+long tux_file_local(unsigned long nbr, int fd, uintptr_t parm2,
+                    uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
+                    uintptr_t parm6);
+void tux_file_dup(int oldfd, int newfd);
+void tux_file_fork(struct tcb_s *parent, struct tcb_s *child);
+void tux_file_release(struct tcb_s *tcb, int lowfd);
+
+long tux_path_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                          uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
+                          uintptr_t parm6);
+
+long tux_copy_file_range(unsigned long nbr, int fd_in, int64_t *off_in, int fd_out,
+                         int64_t *off_out, size_t len, unsigned int flags);
+
 long tux_dup2_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
                           uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
                           uintptr_t parm6);
@@ -461,10 +649,62 @@ long tux_dup2_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
 void add_remote_on_exit(struct tcb_s* tcb, void (*func)(int, void *), void *arg);
 void tux_on_exit(int val, void* arg);
 
+extern int tux_errno[__ELASTERROR];
 void tux_errno_sanitaizer(int *ret);
 
+#ifdef CONFIG_TUX_SYSCALL_STATS
+#define TUX_STATS_BUCKETS 32
+
+/* What one process did with one Linux syscall, all times in TSC cycles */
+struct tux_sysstat_s {
+  uint16_t key;                     /* Syscall number + 1, 0 if unused */
+  uint64_t calls;                   /* Through linux_interface() */
+  uint64_t local;                   /* Of which through tux_local() */
+  uint64_t delegated;               /* Round trips to Linux */
+  uint64_t cycles;
+  uint64_t max;
+  uint64_t delegate_cycles;
+  uint32_t hist[TUX_STATS_BUCKETS]; /* Calls taking [2^i, 2^(i+1)) */
+};
+
+struct tux_sysstats_s {
+  int refs;                         /* Threads of the process */
+  uint64_t dropped;                 /* Calls finding no free slot */
+  struct tux_sysstat_s slot[CONFIG_TUX_SYSCALL_STATS_SLOTS];
+};
+
+static inline uint64_t tux_stats_tsc(void) {
+  return rdtsc();
+}
+
+void tux_stats_syscall(unsigned long nbr, uint64_t tsc);
+void tux_stats_local(unsigned long nbr);
+void tux_stats_delegate(unsigned long nbr, uint64_t cycles);
+int  tux_stats_alloc(struct tcb_s *tcb);
+void tux_stats_share(struct tcb_s *parent, struct tcb_s *tcb);
+void tux_stats_release(struct tcb_s *tcb);
+#else
+#define tux_stats_tsc() 0
+#define tux_stats_syscall(nbr, tsc) ((void)(tsc))
+#define tux_stats_local(nbr)
+#define tux_stats_delegate(nbr, cycles)
+#define tux_stats_alloc(tcb) OK
+#define tux_stats_share(parent, tcb)
+#define tux_stats_release(tcb)
+#endif
+
 long     tux_nanosleep   (unsigned long nbr, const struct timespec *rqtp, struct timespec *rmtp);
-long     tux_gettimeofday   (unsigned long nbr, struct timeval *tv, struct timezone *tz);
+long     tux_gettimeofday   (unsigned long nbr, struct tux_timeval *tv, struct timezone *tz);
+long     tux_clock_gettime  (unsigned long nbr, int clk, struct tux_timespec *ts);
+long     tux_clock_getres   (unsigned long nbr, int clk, struct tux_timespec *res);
+long     tux_time           (unsigned long nbr, int64_t *t);
+
+uintptr_t tux_vdso_base     (void);
+long     tux_vdso_clock_gettime (int clk, struct tux_timespec *ts);
+long     tux_vdso_clock_getres  (int clk, struct tux_timespec *res);
+long     tux_vdso_gettimeofday  (struct tux_timeval *tv, struct timezone *tz);
+long     tux_vdso_time          (int64_t *t);
+long     tux_vdso_getcpu        (unsigned *cpu, unsigned *node, void *unused);
 
 long     tux_clone       (unsigned long nbr, unsigned long flags, void *child_stack,
                          void *ptid, void *ctid, unsigned long tls);
@@ -476,6 +716,11 @@ uint64_t*    tux_mm_new_pd1     (void);
 void    tux_mm_del_pd1     (uint64_t*);
 void*   tux_mmap        (unsigned long nbr, void* addr, long length, int prot, int flags, int fd, off_t offset);
 long     tux_munmap      (unsigned long nbr, void* addr, size_t length);
+long     tux_mprotect    (unsigned long nbr, void* addr, size_t len, int prot);
+long     tux_mlock       (unsigned long nbr, void* addr, size_t len);
+long     tux_mlock2      (unsigned long nbr, void* addr, size_t len, int flags);
+long     tux_mlockall    (unsigned long nbr, int flags);
+long     tux_munlockall  (unsigned long nbr);
 void*    tux_mremap(unsigned long nbr, void *old_address, size_t old_size, size_t new_size, int flags, void *new_address);
 
 long     tux_shmget      (unsigned long nbr, uint32_t key, uint32_t size, uint32_t flags);
@@ -513,6 +758,18 @@ long     tux_select           (unsigned long nbr, int fd, struct tux_fd_set *r,
 
 long      tux_poll(unsigned long nbr, struct tux_pollfd *fds, tux_nfds_t nfds, int timeout);
 
+long      tux_epoll_create(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                           uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
+                           uintptr_t parm6);
+long      tux_epoll_ctl(unsigned long nbr, int epfd, int op, int fd, struct tux_epoll_event *event);
+long      tux_epoll_wait(unsigned long nbr, int epfd, struct tux_epoll_event *events,
+                         int maxevents, int timeout, uintptr_t sigmask, uintptr_t sigsetsize);
+void      tux_epoll_close(int fd);
+void      tux_epoll_drop(int fd);
+void      tux_epoll_exit(int linux_pid);
+long      tux_epoll_poll(struct tux_pollfd *fds, tux_nfds_t nfds, int timeout);
+void      tux_epoll_notify(uint64_t cookie);
+
 long     tux_getpid      (unsigned long nbr);
 long     tux_gettid      (unsigned long nbr);
 long     tux_getppid     (unsigned long nbr);
@@ -528,6 +785,7 @@ static inline long     tux_sched_get_priority_max(unsigned long nbr, uint64_t p)
 static inline long     tux_sched_get_priority_min(unsigned long nbr, uint64_t p) { return sched_get_priority_min(p); };
 
 long tux_sched_getaffinity(unsigned long nbr, long pid, unsigned int len, unsigned long *mask);
+long tux_sched_setaffinity(unsigned long nbr, long pid, unsigned int len, unsigned long *mask);
 
 long tux_exit(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
                           uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
@@ -541,11 +799,7 @@ static inline long tux_pipe(unsigned long nbr, int pipefd[2], int flags){
 };
 
 static inline long tux_getcpu(unsigned long nbr, unsigned *cpu, unsigned *node){
-    if(node)
-        *node = 0;
-    if(cpu)
-        *cpu = 0;
-    return 0;
+    return tux_vdso_getcpu(cpu, node, NULL);
 };
 
 #endif//__LINUX_SUBSYSTEM_TUX_H
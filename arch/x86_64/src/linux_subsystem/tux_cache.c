@@ -0,0 +1,395 @@
+#include <nuttx/arch.h>
+#include <string.h>
+
+#include "tux.h"
+#include "up_internal.h"
+#include "sched/sched.h"
+
+#ifndef CONFIG_TUX_SYSCALL_CACHE_ENTRIES
+#  define CONFIG_TUX_SYSCALL_CACHE_ENTRIES 64
+#endif
+
+#define TUX_CACHE_PATH_MAX 128
+#define TUX_CACHE_DATA_MAX 400
+
+#define TUX_AT_FDCWD -100
+
+#define TUX_S_IFMT  0170000
+#define TUX_S_IFREG 0100000
+
+/* Results are grouped by what may change them */
+
+#define TUX_CACHE_ID   (1 << 0) /* getuid() and friends */
+#define TUX_CACHE_UTS  (1 << 1) /* uname() */
+#define TUX_CACHE_PATH (1 << 2) /* stat(), access(), readlink() of a path */
+#define TUX_CACHE_CWD  (1 << 3) /* getcwd() */
+#define TUX_CACHE_ALL  (TUX_CACHE_ID | TUX_CACHE_UTS | TUX_CACHE_PATH | TUX_CACHE_CWD)
+
+struct tux_cache_entry {
+    uint32_t valid;
+    uint32_t class;
+    uint32_t hash;
+    uint32_t nbr;
+    int pid;
+    uint64_t key[2];
+    char path[TUX_CACHE_PATH_MAX];
+    long ret;
+    uint32_t len;
+    uint8_t data[TUX_CACHE_DATA_MAX];
+};
+
+/* What a cacheable call looks like */
+struct tux_cache_desc {
+    uint32_t class;
+    const char *path;
+    uint64_t key[2];
+    void *out;
+    uint32_t outlen;
+};
+
+#if CONFIG_TUX_SYSCALL_CACHE_ENTRIES > 0
+
+static struct tux_cache_entry tux_cache_table[CONFIG_TUX_SYSCALL_CACHE_ENTRIES];
+
+static int tux_cache_describe(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                              uintptr_t parm3, uintptr_t parm4, struct tux_cache_desc *d)
+{
+    memset(d, 0, sizeof(*d));
+
+    switch(nbr) {
+        case 4:   // stat
+        case 6:   // lstat
+            d->class = TUX_CACHE_PATH;
+            d->path = (const char *)parm1;
+            d->out = (void *)parm2;
+            d->outlen = 144;
+            break;
+
+        case 262: // newfstatat
+            if((int)parm1 != TUX_AT_FDCWD && ((char *)parm2)[0] != '/')
+                return -1;
+            d->class = TUX_CACHE_PATH;
+            d->path = (const char *)parm2;
+            d->key[0] = parm4;
+            d->out = (void *)parm3;
+            d->outlen = 144;
+            break;
+
+        case 21:  // access
+            d->class = TUX_CACHE_PATH;
+            d->path = (const char *)parm1;
+            d->key[0] = parm2;
+            break;
+
+        case 269: // faccessat
+            if((int)parm1 != TUX_AT_FDCWD && ((char *)parm2)[0] != '/')
+                return -1;
+            d->class = TUX_CACHE_PATH;
+            d->path = (const char *)parm2;
+            d->key[0] = parm3;
+            d->key[1] = parm4;
+            break;
+
+        case 89:  // readlink
+            d->class = TUX_CACHE_PATH;
+            d->path = (const char *)parm1;
+            d->key[0] = parm3;
+            d->out = (void *)parm2;
+            d->outlen = parm3;
+            break;
+
+        case 102: // getuid
+        case 104: // getgid
+        case 107: // geteuid
+        case 108: // getegid
+            d->class = TUX_CACHE_ID;
+            break;
+
+        case 63:  // uname
+            d->class = TUX_CACHE_UTS;
+            d->out = (void *)parm1;
+            d->outlen = 390;
+            break;
+
+        case 79:  // getcwd
+            d->class = TUX_CACHE_CWD;
+            d->out = (void *)parm1;
+            d->outlen = parm2;
+            break;
+
+        default:
+            return -1;
+    }
+
+    if(d->path && strnlen(d->path, TUX_CACHE_PATH_MAX) >= TUX_CACHE_PATH_MAX)
+        return -1;
+
+    return 0;
+}
+
+static uint32_t tux_cache_hash(unsigned long nbr, int pid, struct tux_cache_desc *d)
+{
+    uint32_t h = 2166136261u;
+    const char *p;
+
+    h = (h ^ nbr) * 16777619u;
+    h = (h ^ pid) * 16777619u;
+    h = (h ^ d->key[0]) * 16777619u;
+    h = (h ^ d->key[1]) * 16777619u;
+
+    if(d->path)
+        for(p = d->path; *p; p++)
+            h = (h ^ *p) * 16777619u;
+
+    return h;
+}
+
+static struct tux_cache_entry *tux_cache_slot(uint32_t hash)
+{
+    return &tux_cache_table[hash % CONFIG_TUX_SYSCALL_CACHE_ENTRIES];
+}
+
+static bool tux_cache_match(struct tux_cache_entry *e, uint32_t hash, unsigned long nbr,
+                            int pid, struct tux_cache_desc *d)
+{
+    if(!e->valid || e->hash != hash || e->nbr != nbr || e->pid != pid)
+        return false;
+
+    if(e->key[0] != d->key[0] || e->key[1] != d->key[1])
+        return false;
+
+    if(d->path && strcmp(e->path, d->path))
+        return false;
+
+    return true;
+}
+
+int tux_cache_lookup(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                     uintptr_t parm3, uintptr_t parm4, long *ret)
+{
+    struct tcb_s *rtcb = this_task();
+    struct tux_cache_desc d;
+    struct tux_cache_entry *e;
+    uint8_t data[TUX_CACHE_DATA_MAX];
+    irqstate_t flags;
+    uint32_t hash;
+    uint32_t len = 0;
+    int found = -1;
+
+    if(tux_cache_describe(nbr, parm1, parm2, parm3, parm4, &d))
+        return -1;
+
+    hash = tux_cache_hash(nbr, rtcb->xcp.linux_pid, &d);
+    e = tux_cache_slot(hash);
+
+    flags = enter_critical_section();
+
+    if(tux_cache_match(e, hash, nbr, rtcb->xcp.linux_pid, &d)) {
+        found = 0;
+        *ret = e->ret;
+
+        if(e->len) {
+            if(e->len > d.outlen) {
+                // Only getcwd may ask with a smaller buffer
+                *ret = -34; // Linux ERANGE
+            } else {
+                len = e->len;
+                memcpy(data, e->data, len);
+            }
+        }
+    }
+
+    leave_critical_section(flags);
+
+    // The user buffer may fault, not while holding the table
+    if(len)
+        memcpy(d.out, data, len);
+
+    return found;
+}
+
+void tux_cache_insert(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                      uintptr_t parm3, uintptr_t parm4, long ret)
+{
+    struct tcb_s *rtcb = this_task();
+    struct tux_cache_desc d;
+    struct tux_cache_entry *e;
+    uint8_t data[TUX_CACHE_DATA_MAX];
+    irqstate_t flags;
+    uint32_t hash;
+    uint32_t len = 0;
+
+    if(tux_cache_describe(nbr, parm1, parm2, parm3, parm4, &d))
+        return;
+
+    // Remember missing files as well, they are probed a lot at startup
+    if(ret < 0 && !(d.class == TUX_CACHE_PATH && ret == -2))
+        return;
+
+    // The size and times of a file change with every write through any
+    // fd, those are not worth tracking, directories and the rest are
+    if((nbr == 4 || nbr == 6 || nbr == 262) && ret >= 0 &&
+       (((struct tux_stat *)d.out)->st_mode & TUX_S_IFMT) == TUX_S_IFREG)
+        return;
+
+    if(d.out && ret >= 0) {
+        len = d.outlen;
+        if(nbr == 89 || nbr == 79) // readlink and getcwd return the length
+            len = ret;
+        if(len > TUX_CACHE_DATA_MAX)
+            return;
+
+        // The user buffer may fault, not while holding the table
+        memcpy(data, d.out, len);
+    }
+
+    hash = tux_cache_hash(nbr, rtcb->xcp.linux_pid, &d);
+    e = tux_cache_slot(hash);
+
+    flags = enter_critical_section();
+
+    e->valid = 1;
+    e->class = d.class;
+    e->hash = hash;
+    e->nbr = nbr;
+    e->pid = rtcb->xcp.linux_pid;
+    e->key[0] = d.key[0];
+    e->key[1] = d.key[1];
+    if(d.path)
+        strcpy(e->path, d.path);
+    else
+        e->path[0] = '\0';
+    e->ret = ret;
+    e->len = len;
+    if(len)
+        memcpy(e->data, data, len);
+
+    leave_critical_section(flags);
+}
+
+/* Drop the results of class in pid, or in every process if pid is 0 */
+static void tux_cache_drop(int pid, uint32_t class)
+{
+    irqstate_t flags;
+    int i;
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < CONFIG_TUX_SYSCALL_CACHE_ENTRIES; i++) {
+        if(!tux_cache_table[i].valid)
+            continue;
+        if(pid && tux_cache_table[i].pid != pid)
+            continue;
+        if(tux_cache_table[i].class & class)
+            tux_cache_table[i].valid = 0;
+    }
+
+    leave_critical_section(flags);
+}
+
+/* Invalidate what a delegated call is about to change */
+void tux_cache_mutate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                      uintptr_t parm3, uintptr_t parm4)
+{
+    struct tcb_s *rtcb = this_task();
+
+    switch(nbr) {
+        case 80:  // chdir
+        case 81:  // fchdir
+            // Relative lookups of this process change meaning
+            tux_cache_drop(rtcb->xcp.linux_pid, TUX_CACHE_PATH | TUX_CACHE_CWD);
+            break;
+
+        case 105: // setuid
+        case 106: // setgid
+        case 113: // setreuid
+        case 114: // setregid
+        case 116: // setgroups
+        case 117: // setresuid
+        case 119: // setresgid
+        case 122: // setfsuid
+        case 123: // setfsgid
+            // access() results depend on the credentials as well
+            tux_cache_drop(rtcb->xcp.linux_pid, TUX_CACHE_ID | TUX_CACHE_PATH);
+            break;
+
+        case 2:   // open
+            if(!(parm2 & (TUX_O_CREAT | TUX_O_TRUNC)))
+                break;
+            tux_cache_drop(0, TUX_CACHE_PATH);
+            break;
+
+        case 257: // openat
+            if(!(parm3 & (TUX_O_CREAT | TUX_O_TRUNC)))
+                break;
+            tux_cache_drop(0, TUX_CACHE_PATH);
+            break;
+
+        // Data written through an fd does not change what paths resolve
+        // to, and stat() of regular files is never cached
+        case 76:  // truncate
+        case 82:  // rename
+        case 83:  // mkdir
+        case 84:  // rmdir
+        case 85:  // creat
+        case 86:  // link
+        case 87:  // unlink
+        case 88:  // symlink
+        case 90:  // chmod
+        case 91:  // fchmod
+        case 92:  // chown
+        case 93:  // fchown
+        case 94:  // lchown
+        case 132: // utime
+        case 133: // mknod
+        case 165: // mount
+        case 166: // umount2
+        case 235: // utimes
+        case 258: // mkdirat
+        case 259: // mknodat
+        case 260: // fchownat
+        case 261: // futimesat
+        case 263: // unlinkat
+        case 264: // renameat
+        case 265: // linkat
+        case 266: // symlinkat
+        case 268: // fchmodat
+        case 280: // utimensat
+            // Files are shared, so is the damage
+            tux_cache_drop(0, TUX_CACHE_PATH);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* Called by the shadow channel when Linux reports a change behind our back */
+void tux_cache_invalidate(int linux_pid)
+{
+    tux_cache_drop(linux_pid > 0 ? linux_pid : 0, TUX_CACHE_ALL);
+}
+
+#else
+
+int tux_cache_lookup(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                     uintptr_t parm3, uintptr_t parm4, long *ret)
+{
+    return -1;
+}
+
+void tux_cache_insert(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                      uintptr_t parm3, uintptr_t parm4, long ret)
+{
+}
+
+void tux_cache_mutate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                      uintptr_t parm3, uintptr_t parm4)
+{
+}
+
+void tux_cache_invalidate(int linux_pid)
+{
+}
+
+#endif
@@ -10,6 +10,7 @@
 #include "sched/sched.h"
 
 #include <arch/irq.h>
+#include <arch/board/shadow.h>
 #include <sys/mman.h>
 
 #define STR(x) #x
@@ -20,6 +21,8 @@
 # define CLONE_FS      0x00000200 /* Set if fs info shared between processes.  */
 # define CLONE_FILES   0x00000400 /* Set if open files shared between processes.  */
 # define CLONE_SIGHAND 0x00000800 /* Set if signal handlers shared.  */
+# define CLONE_VFORK   0x00004000 /* Set if the parent wants the child to
+				     wake it up on mm_release.  */
 # define CLONE_THREAD  0x00010000 /* Set to add to same thread group.  */
 # define CLONE_SETTLS  0x00080000 /* Set TLS info.  */
 # define CLONE_PARENT_SETTID 0x00100000 /* Store TID in userlevel buffer
@@ -29,18 +32,6 @@
 # define CLONE_CHILD_SETTID 0x01000000 /* Store TID in userlevel buffer in
 					  the child.  */
 
-static inline void* new_memory_block(uint64_t size, void** virt) {
-    irqstate_t flags;
-    void* ret;
-
-    ret = gran_alloc(tux_mm_hnd, size);
-    flags = enter_critical_section();
-    *virt = temp_map_at_0xc0000000((uintptr_t)ret, (uintptr_t)ret + size);
-    memset(*virt, 0, size);
-    leave_critical_section(flags);
-    return ret;
-}
-
 extern void fork_kickstart(void*);
 
 void clone_trampoline(void* regs, uint32_t* ctid) {
@@ -48,11 +39,10 @@ void clone_trampoline(void* regs, uint32_t* ctid) {
     svcinfo("Entering Clone Trampoline\n");
 
     struct tcb_s *rtcb = this_task();
-    struct vma_s *ptr;
-    for(ptr = rtcb->xcp.vma; ptr; ptr = ptr->next){
-        tux_delegate(9, (((uint64_t)ptr->pa_start) << 32) | (uint64_t)(ptr->va_start), VMA_SIZE(ptr),
-                     0, MAP_ANONYMOUS, 0, 0);
-    }
+
+    // The shadow process inherited the mirror of the shared pages, only
+    // those the parent had not told about yet are missing
+    tux_mm_mirror(rtcb);
 
     if(ctid) {
         *ctid = this_task()->xcp.linux_tid;
@@ -74,22 +64,19 @@ long tux_fork(unsigned long nbr) {
 }
 
 long tux_vfork(unsigned long nbr) {
-    return tux_clone(56, SIGCHLD, NULL, NULL, NULL, 0);
+    return tux_clone(58, CLONE_VM | CLONE_VFORK | SIGCHLD, NULL, NULL, NULL, 0);
 }
 
 long tux_clone(unsigned long nbr, unsigned long flags, void *child_stack,
               void *ptid, void *ctid,
               unsigned long tls){
 
-  irqstate_t irqflags;
   int ret;
   struct task_tcb_s *tcb;
   struct tcb_s *rtcb = this_task();
   void* stack;
-  struct vma_s *ptr, *ptr2, *pptr, *pda_ptr;
-  uint64_t i, j;
-  void* virt_mem;
   uint64_t *regs;
+  sem_t vfork_done;
 
   tcb = (FAR struct task_tcb_s *)kmm_zalloc(sizeof(struct task_tcb_s));
   if (!tcb)
@@ -121,7 +108,8 @@ long tux_clone(unsigned long nbr, unsigned long flags, void *child_stack,
 
 
   /* Clone the VM */
-  if(flags & CLONE_VM){
+  if((flags & CLONE_VM) && !(flags & CLONE_VFORK)){
+    tcb->cmn.xcp.vm = tux_mm_vm(rtcb);
     tcb->cmn.xcp.vma = rtcb->xcp.vma;
     tcb->cmn.xcp.pda = rtcb->xcp.pda;
     tcb->cmn.xcp.pd1 = rtcb->xcp.pd1;
@@ -148,6 +136,8 @@ long tux_clone(unsigned long nbr, unsigned long flags, void *child_stack,
         goto errout_with_tcbinit;
     }
 
+    tux_stats_share(rtcb, (struct tcb_s*)tcb);
+
     uint64_t tid_slot = tux_delegate(56, 0, 0, 0, 0, 0, 0);
     tcb->cmn.xcp.linux_tid = tid_slot >> 48;
     tcb->cmn.xcp.linux_tcb = tid_slot & ~(0xffffULL << 48);
@@ -166,88 +156,31 @@ long tux_clone(unsigned long nbr, unsigned long flags, void *child_stack,
 
   }else{
 
-    /* copy our mapped memory, including stack, to the new process */
-
-    struct vma_s* mapping = NULL;
-    struct vma_s* curr;
-
-    for(ptr = rtcb->xcp.vma; ptr; ptr = ptr->next){
-        if(ptr->pa_start != 0xffffffff) {
-            curr = kmm_zalloc(sizeof(struct vma_s));
-            curr->next = mapping;
-            mapping = curr;
-        }
-    }
-
-    tcb->cmn.xcp.vma = mapping;
-
-    svcinfo("Copy mappings\n");
-    for(ptr = rtcb->xcp.vma, curr = tcb->cmn.xcp.vma; ptr; ptr = ptr->next){
-        if(ptr->pa_start == 0xffffffff){
-            continue;
-        }
-
-        curr->va_start = ptr->va_start;
-        curr->va_end = ptr->va_end;
-        curr->proto = ptr->proto;
-
-        curr->_backing = kmm_zalloc(strlen(ptr->_backing) + 1);
-        strcpy(curr->_backing, ptr->_backing);
-
-        curr->pa_start = (uintptr_t)new_memory_block(VMA_SIZE(ptr), &virt_mem);
-        memcpy(virt_mem, (void*)ptr->va_start, VMA_SIZE(ptr));
-
-        svcinfo("Mapping: %llx - %llx: %llx %s\n", ptr->va_start, ptr->va_end, curr->pa_start, curr->_backing);
-
-        curr = curr->next;
+    if(flags & CLONE_VM){
+      /* vfork, borrow our memory until the child calls execve or exits */
+      tcb->cmn.xcp.vm = tux_mm_vm(rtcb);
+      tcb->cmn.xcp.vma = rtcb->xcp.vma;
+      tcb->cmn.xcp.pda = rtcb->xcp.pda;
+      tcb->cmn.xcp.pd1 = rtcb->xcp.pd1;
+    }else{
+      /* share our mapped memory, including stack, copy-on-write */
+      svcinfo("Share mappings\n");
+      if(tux_mm_fork((struct tcb_s*)tcb) < 0){
+        tcb->cmn.xcp.is_linux = 2; /* Drop whatever got shared on release */
+        ret = -ENOMEM;
+        goto errout_with_tcbinit;
+      }
     }
 
-    svcinfo("Create new page table\n");
-
-    tcb->cmn.xcp.pd1 = tux_mm_new_pd1();
-
-    svcinfo("Copy pdas\n");
-    tcb->cmn.xcp.pda = pda_ptr = kmm_zalloc(sizeof(struct vma_s));
-
-    for(ptr = tcb->cmn.xcp.vma; ptr;){
-        // Scan hole with continuous addressing and same proto
-        for(pptr = ptr, ptr2 = ptr->next; ptr2 && (((pptr->va_end + HUGE_PAGE_SIZE - 1) & HUGE_PAGE_MASK) >= (ptr2->va_start & HUGE_PAGE_MASK)) && (pptr->proto == ptr2->proto); pptr = ptr2, ptr2 = ptr2->next){
-            svcinfo("Boundary: %llx and %llx\n", ((pptr->va_end + HUGE_PAGE_SIZE - 1) & HUGE_PAGE_MASK), (ptr2->va_start & HUGE_PAGE_MASK));
-            svcinfo("Merge: %llx - %llx and %llx - %llx\n", pptr->va_start, pptr->va_end, ptr2->va_start, ptr2->va_end);
-
-        }
-
-        svcinfo("PDA Mapping: %llx - %llx\n", ptr->va_start, pptr->va_end);
-
-        pda_ptr->va_start = ptr->va_start & HUGE_PAGE_MASK;
-        pda_ptr->va_end = (pptr->va_end + HUGE_PAGE_SIZE - 1) & HUGE_PAGE_MASK; //Align up
-        pda_ptr->proto = ptr->proto; // All proto are the same
-        pda_ptr->_backing = "";
-
-        pda_ptr->pa_start = (uintptr_t)new_memory_block(VMA_SIZE(pda_ptr) / HUGE_PAGE_SIZE * PAGE_SIZE, &virt_mem);
-        do{
-            for(i = ptr->va_start; i < ptr->va_end; i += PAGE_SIZE){
-                ((uint64_t*)(virt_mem))[((i - pda_ptr->va_start) >> 12) & 0x3ffff] = (ptr->pa_start + i - ptr->va_start) | ptr->proto;
-            }
-            ptr = ptr->next;
-        }while(ptr != pptr->next);
-
-        irqflags = enter_critical_section();
-        uint64_t* tmp_pd = temp_map_at_0xc0000000((uintptr_t)tcb->cmn.xcp.pd1, (uintptr_t)tcb->cmn.xcp.pd1 + PAGE_SIZE);
-
-        // Map it via page directories
-        for(j = pda_ptr->va_start; j < pda_ptr->va_end; j += HUGE_PAGE_SIZE) {
-        tmp_pd[(j >> 21) & 0x7ffffff] = (((j - pda_ptr->va_start) >> 9) + pda_ptr->pa_start) | pda_ptr->proto;
-        }
-        leave_critical_section(irqflags);
-
-        if(ptr){
-            pda_ptr->next = kmm_zalloc(sizeof(struct vma_s));
-            pda_ptr = pda_ptr->next;
-        }
+    if(tux_stats_alloc((struct tcb_s*)tcb) < 0){
+      tcb->cmn.xcp.is_linux = 2;
+      ret = -ENOMEM;
+      goto errout_with_tcbinit;
     }
 
-    svcinfo("All mapped\n");
+    // The child got copies of our fds
+    tux_file_fork(rtcb, (struct tcb_s*)tcb);
+    tux_delegate_fork(rtcb, (struct tcb_s*)tcb);
 
     // set brk
     tcb->cmn.xcp.__min_brk = rtcb->xcp.__min_brk;
@@ -273,9 +206,17 @@ long tux_clone(unsigned long nbr, unsigned long flags, void *child_stack,
 
     /*add_remote_on_exit((struct tcb_s*)tcb, tux_on_exit, NULL);*/
 
+    if(flags & CLONE_VFORK){
+      /* Wait for the child to let go of our memory */
+      nxsem_init(&vfork_done, 0, 0);
+      tcb->cmn.xcp.vfork_done = &vfork_done;
+    }
+
     /* manual set the instruction pointer */
     regs = kmm_zalloc(sizeof(uint64_t) * 16);
     memcpy(regs, (uint64_t*)(get_kernel_stack_ptr()) - 16, sizeof(uint64_t) * 16);
+    if(child_stack)
+        regs[15] = (uint64_t)child_stack; // posix_spawn hands the vfork child its own stack
     tcb->cmn.xcp.regs[REG_RDI] = (uintptr_t)regs;
     tcb->cmn.xcp.regs[REG_RSI] = 0;
     tcb->cmn.xcp.regs[REG_RIP] = (uintptr_t)clone_trampoline; // We need to manage the memory mapping
@@ -312,7 +253,14 @@ long tux_clone(unsigned long nbr, unsigned long flags, void *child_stack,
     goto errout_with_tcbinit;
   }
 
-  return tcb->cmn.xcp.linux_tid;
+  ret = tcb->cmn.xcp.linux_tid;
+
+  if(flags & CLONE_VFORK){
+    nxsem_wait_uninterruptible(&vfork_done);
+    nxsem_destroy(&vfork_done);
+  }
+
+  return ret;
 
 errout_with_tcbinit:
     sched_releasetcb(&tcb->cmn, TCB_FLAG_TTYPE_TASK);
@@ -11,6 +11,7 @@
 #include <nuttx/irq.h>
 #include <arch/io.h>
 #include <syscall.h>
+#include <string.h>
 #include <fcntl.h>
 #include <semaphore.h>
 #include <errno.h>
@@ -22,6 +23,35 @@
 #include "tux.h"
 #include "tux_syscall_table.h"
 
+#include <arch/board/shadow.h>
+
+#ifndef CONFIG_TUX_DELEGATE_POLL_NS
+#  define CONFIG_TUX_DELEGATE_POLL_NS 10000
+#endif
+
+#ifndef CONFIG_TUX_STREAM_PROCS
+#  define CONFIG_TUX_STREAM_PROCS 32
+#endif
+
+#define TUX_DELEGATE_NR 512
+
+#define TUX_F_DUPFD         0
+#define TUX_F_DUPFD_CLOEXEC 1030
+#define TUX_F_GETLK         5
+#define TUX_F_SETLK         6
+#define TUX_F_SETLKW        7
+#define TUX_F_OFD_SETLKW    38
+
+extern unsigned long tsc_freq;
+
+/* Moving average of the completion time of each delegated syscall, in TSC
+ * cycles, used to decide whether spinning for the reply is worth it.
+ * Samples are saturated, a call blocked for minutes or a TSC read on a
+ * skewed CPU must not throw the average off for good. */
+#define TUX_DELEGATE_EWMA_MAX (1LL << 40)
+
+static uint64_t g_delegate_ewma[TUX_DELEGATE_NR];
+
 int tux_errno[__ELASTERROR] = {
     0,   //                     0
     1,   // EPERM               1
@@ -189,6 +219,8 @@ long tux_local(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
     PANIC();
   }
 
+  tux_stats_local(nbr);
+
   errno = 0;
   ret = ((syscall_t) \
          (g_stublookup[linux_syscall_number_table[nbr] - CONFIG_SYS_RESERVED])) \
@@ -202,34 +234,894 @@ long tux_local(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
   return ret;
 }
 
-long tux_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
-                          uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
-                          uintptr_t parm6)
+/* Append a buffer argument to the scatter-gather list of a request.
+ * User memory is split at VMA boundaries and passed by physical address,
+ * everything outside the user window is mapped 1:1. */
+static int tux_delegate_sg(struct shadow_proc_req *req, uintptr_t buf,
+                           size_t len, uint32_t flags)
 {
   struct tcb_s *rtcb = this_task();
-  uint64_t params[7];
-  uint64_t syscall_ret;
-  int ret;
-  svcinfo("Delegating syscall %d to linux\n", nbr);
+  struct shadow_proc_sg *sg;
+  struct vma_s copy;
+  struct vma_s *ptr = &copy;
+  uintptr_t pa;
+  size_t seg;
 
-  if(rtcb->xcp.is_linux && rtcb->xcp.linux_sock)
+  while(len)
   {
-    params[0] = nbr;
-    params[1] = parm1;
-    params[2] = parm2;
-    params[3] = parm3;
-    params[4] = parm4;
-    params[5] = parm5;
-    params[6] = parm6;
+    if(buf >= 0x1000000 && buf < 0x34000000)
+    {
+      if(!tux_mm_lookup(rtcb, buf, ptr))
+        return -EFAULT;
 
-    ret = write(rtcb->xcp.linux_sock, params, sizeof(params));
-    ret = read(rtcb->xcp.linux_sock, &syscall_ret, sizeof(uint64_t));
+      if(ptr->flags & VMA_LAZY)
+      {
+        /* Backed page by page, contiguous only by chance */
+        pa = tux_mm_fault_in(rtcb, buf, flags & SHADOW_PROC_SG_OUT);
+        if(!pa)
+          return -EFAULT;
 
-  } else {
+        pa += buf & ~PAGE_MASK;
+        seg = PAGE_SIZE - (buf & ~PAGE_MASK);
+      }
+      else if(ptr->flags & VMA_HUGE)
+      {
+        pa = tux_mm_huge_pa(rtcb, buf);
+        if(!pa)
+          return -EFAULT;
+
+        seg = HUGE_PAGE_SIZE - (buf & ~HUGE_PAGE_MASK);
+      }
+      else
+      {
+        if(ptr->pa_start == 0xffffffff)
+          return -EFAULT;
+
+        pa = ptr->pa_start + buf - ptr->va_start;
+        seg = ptr->va_end - buf;
+      }
+
+      if(seg > len)
+        seg = len;
+    }
+    else
+    {
+      pa = buf;
+      seg = len;
+    }
+
+    /* Merge with the previous entry if physically contiguous */
+    sg = req->nsg ? &req->sg[req->nsg - 1] : NULL;
+    if(sg && sg->flags == flags && sg->addr + sg->len == pa &&
+       sg->len + seg <= UINT32_MAX)
+    {
+      sg->len += seg;
+    }
+    else
+    {
+      if(req->nsg >= SHADOW_PROC_MAX_SG)
+        return -E2BIG;
+
+      sg = &req->sg[req->nsg++];
+      sg->addr = pa;
+      sg->len = seg;
+      sg->flags = flags;
+    }
+
+    buf += seg;
+    len -= seg;
+  }
+
+  return OK;
+}
+
+/* Pass a data buffer, bouncing it through the bulk region if it is too
+ * fragmented to be described by physical address */
+static void tux_delegate_sg_data(struct shadow_proc_req *req, uintptr_t buf,
+                                 size_t len, uint32_t flags)
+{
+  uint32_t nsg = req->nsg;
+  int off;
+
+  if(!len || tux_delegate_sg(req, buf, len, flags) == OK)
+    return;
+
+  req->nsg = nsg;
+
+  off = shadow_proc_bulk_alloc(gshadow, len);
+  if(off < 0)
+  {
+    /* Nothing we can do, Linux will have to resolve it by itself */
+    req->nsg = 0;
+    return;
+  }
+
+  if(flags & SHADOW_PROC_SG_IN)
+    memcpy(shadow_proc_bulk_tx(gshadow, off), (void *)buf, len);
+
+  req->stage_off = off;
+  req->stage_len = len;
+  req->stage_buf = (void *)buf;
+
+  req->sg[req->nsg].addr = off;
+  req->sg[req->nsg].len = len;
+  req->sg[req->nsg].flags = flags | SHADOW_PROC_SG_BULK;
+  req->nsg++;
+}
+
+static void tux_delegate_sg_path(struct shadow_proc_req *req, uintptr_t path)
+{
+  if(!path || tux_delegate_sg(req, path, strlen((char *)path) + 1,
+                              SHADOW_PROC_SG_IN) != OK)
+    req->nsg = 0;
+}
+
+/* Describe the buffer arguments of the calls we know about explicitly */
+static void tux_delegate_marshal(struct shadow_proc_req *req)
+{
+  uint64_t *p = req->params;
+
+  req->nsg = 0;
+  req->stage_off = -1;
+
+  switch(p[0])
+  {
+    case 0:  // read
+    case 17: // pread64
+    case 45: // recvfrom
+      tux_delegate_sg_data(req, p[2], p[3], SHADOW_PROC_SG_OUT);
+      break;
+
+    case 1:  // write
+    case 18: // pwrite64
+    case 44: // sendto
+      tux_delegate_sg_data(req, p[2], p[3], SHADOW_PROC_SG_IN);
+      break;
+
+    case 2:  // open
+      tux_delegate_sg_path(req, p[1]);
+      break;
+
+    case 4:  // stat
+    case 6:  // lstat
+      tux_delegate_sg_path(req, p[1]);
+      if(req->nsg && tux_delegate_sg(req, p[2], 144, SHADOW_PROC_SG_OUT) != OK)
+        req->nsg = 0;
+      break;
+
+    case 5:  // fstat
+      if(tux_delegate_sg(req, p[2], 144, SHADOW_PROC_SG_OUT) != OK)
+        req->nsg = 0;
+      break;
+
+    default:
+      break;
+  }
+}
+
+/* Back every page of [buf, buf + len) Linux may touch through its mirror
+ * of our memory.  Pages it writes to are unshared from forked processes
+ * first, or the write would land in the page of the other process too.
+ * Returns false if some of it is not mapped, we must not read it then. */
+static bool tux_delegate_touch_range(struct tcb_s *rtcb, uintptr_t buf,
+                                     size_t len, bool write)
+{
+  struct vma_s copy;
+  struct vma_s *ptr = NULL;
+  uintptr_t va;
+
+  if(!buf || !len)
+    return false;
+
+  for(va = buf & PAGE_MASK; va < buf + len; va += PAGE_SIZE)
+  {
+    if(va < 0x1000000 || va >= 0x34000000)
+      continue;
+
+    if(!ptr || va < ptr->va_start || va >= ptr->va_end)
+    {
+      if(!tux_mm_lookup(rtcb, va, &copy))
+        return false; /* Linux fails with EFAULT by itself */
+      ptr = &copy;
+    }
+
+    if((ptr->flags & VMA_LAZY) && !tux_mm_fault_in(rtcb, va, write))
+      return false;
+  }
+
+  return true;
+}
+
+static void tux_delegate_touch_iov(struct tcb_s *rtcb, uintptr_t iov,
+                                   uint64_t cnt, bool write)
+{
+  struct tux_iovec *v = (struct tux_iovec *)iov;
+  uint64_t i;
+
+  if(cnt > 1024 ||
+     !tux_delegate_touch_range(rtcb, iov, cnt * sizeof(struct tux_iovec), false))
+    return;
+
+  for(i = 0; i < cnt; i++)
+    tux_delegate_touch_range(rtcb, v[i].iov_base, v[i].iov_len, write);
+}
+
+static void tux_delegate_touch_msg(struct tcb_s *rtcb, uintptr_t msg,
+                                   bool write)
+{
+  struct tux_msghdr *m = (struct tux_msghdr *)msg;
+
+  if(!tux_delegate_touch_range(rtcb, msg, sizeof(struct tux_msghdr), write))
+    return;
+  tux_delegate_touch_range(rtcb, m->msg_name, m->msg_namelen, write);
+  tux_delegate_touch_iov(rtcb, m->msg_iov, m->msg_iovlen, write);
+  tux_delegate_touch_range(rtcb, m->msg_control, m->msg_controllen, write);
+}
+
+/* A string Linux reads up to its NUL, a path mostly */
+static void tux_delegate_touch_str(struct tcb_s *rtcb, uintptr_t str)
+{
+  size_t seg;
+
+  while(tux_delegate_touch_range(rtcb, str, 1, false))
+  {
+    seg = PAGE_SIZE - (str & ~PAGE_MASK);
+    if(strnlen((char *)str, seg) < seg)
+      return;
+    str += seg;
+  }
+}
+
+/* Sizes of the Linux x86_64 structures passed by pointer below */
+#define TUX_SIZEOF_STAT       144
+#define TUX_SIZEOF_STATFS     120
+#define TUX_SIZEOF_UTSNAME    390
+#define TUX_SIZEOF_SYSINFO    112
+#define TUX_SIZEOF_RUSAGE     144
+#define TUX_SIZEOF_FLOCK      32
+#define TUX_SIZEOF_ITIMERSPEC 32
+#define TUX_SIZEOF_TERMIOS    60
+
+/* Linux resolves any pointer we did not describe through its mirror of our
+ * memory.  Back the buffers of the calls we know over their whole length,
+ * following iovecs and message headers: what Linux writes to is faulted in
+ * for writing, what it only reads is faulted in for reading.  Arguments of
+ * other calls are left alone, they need not be addresses at all. */
+static void tux_delegate_touch(struct shadow_proc_req *req)
+{
+  struct tcb_s *rtcb = this_task();
+  uint64_t *p = req->params;
+  size_t len;
+  int i;
+
+  if(!rtcb->xcp.vm)
+    return;
+
+  switch(p[0])
+  {
+    case 0:   // read
+    case 17:  // pread64
+      if(!req->nsg)
+        tux_delegate_touch_range(rtcb, p[2], p[3], true);
+      return;
+
+    case 1:   // write
+    case 18:  // pwrite64
+      if(!req->nsg)
+        tux_delegate_touch_range(rtcb, p[2], p[3], false);
+      return;
+
+    case 19:  // readv
+    case 295: // preadv
+    case 327: // preadv2
+      tux_delegate_touch_iov(rtcb, p[2], p[3], true);
+      return;
+
+    case 20:  // writev
+    case 296: // pwritev
+    case 328: // pwritev2
+      tux_delegate_touch_iov(rtcb, p[2], p[3], false);
+      return;
+
+    case 7:   // poll
+      tux_delegate_touch_range(rtcb, p[1], p[2] * sizeof(struct tux_pollfd), true);
+      return;
+
+    case 271: // ppoll
+      tux_delegate_touch_range(rtcb, p[1], p[2] * sizeof(struct tux_pollfd), true);
+      tux_delegate_touch_range(rtcb, p[3], sizeof(struct tux_timespec), true);
+      tux_delegate_touch_range(rtcb, p[4], p[5], false);
+      return;
+
+    case 23:  // select
+    case 270: // pselect6
+      len = (p[1] + 7) / 8;
+      tux_delegate_touch_range(rtcb, p[2], len, true);
+      tux_delegate_touch_range(rtcb, p[3], len, true);
+      tux_delegate_touch_range(rtcb, p[4], len, true);
+      tux_delegate_touch_range(rtcb, p[5], sizeof(struct tux_timespec), true);
+      if(p[0] == 270)
+        tux_delegate_touch_range(rtcb, p[6], 2 * sizeof(uint64_t), false);
+      return;
+
+    case 232: // epoll_wait
+    case 281: // epoll_pwait
+      tux_delegate_touch_range(rtcb, p[2], p[3] * sizeof(struct tux_epoll_event), true);
+      if(p[0] == 281)
+        tux_delegate_touch_range(rtcb, p[5], p[6], false);
+      return;
+
+    case 233: // epoll_ctl
+      tux_delegate_touch_range(rtcb, p[4], sizeof(struct tux_epoll_event), false);
+      return;
+
+    case 78:  // getdents
+    case 217: // getdents64
+      tux_delegate_touch_range(rtcb, p[2], p[3], true);
+      return;
+
+    case 44:  // sendto
+      if(!req->nsg)
+        tux_delegate_touch_range(rtcb, p[2], p[3], false);
+      tux_delegate_touch_range(rtcb, p[5], p[6], false);
+      return;
+
+    case 45:  // recvfrom
+      if(!req->nsg)
+        tux_delegate_touch_range(rtcb, p[2], p[3], true);
+      if(tux_delegate_touch_range(rtcb, p[6], sizeof(uint32_t), true))
+        tux_delegate_touch_range(rtcb, p[5], *(uint32_t *)p[6], true);
+      return;
+
+    case 46:  // sendmsg
+      tux_delegate_touch_msg(rtcb, p[2], false);
+      return;
+
+    case 47:  // recvmsg
+      tux_delegate_touch_msg(rtcb, p[2], true);
+      return;
+
+    case 42:  // connect
+    case 49:  // bind
+      tux_delegate_touch_range(rtcb, p[2], p[3], false);
+      return;
+
+    case 54:  // setsockopt
+      tux_delegate_touch_range(rtcb, p[4], p[5], false);
+      return;
+
+    case 55:  // getsockopt
+    case 51:  // getsockname
+    case 52:  // getpeername
+    case 43:  // accept
+    case 288: // accept4
+      i = p[0] == 55 ? 4 : 2;
+      if(tux_delegate_touch_range(rtcb, p[i + 1], sizeof(uint32_t), true))
+        tux_delegate_touch_range(rtcb, p[i], *(uint32_t *)p[i + 1], true);
+      return;
+
+    case 53:  // socketpair
+      tux_delegate_touch_range(rtcb, p[4], 2 * sizeof(int32_t), true);
+      return;
+
+    case 16:  // ioctl, the size and direction are encoded in the request
+      len = (p[2] >> 16) & 0x3fff;
+      if(len)
+        tux_delegate_touch_range(rtcb, p[3], len, (p[2] >> 31) & 1);
+      else if(p[2] == 0x5401)  // TCGETS, predates the encoding
+        tux_delegate_touch_range(rtcb, p[3], TUX_SIZEOF_TERMIOS, true);
+      else if(p[2] == 0x5413)  // TIOCGWINSZ
+        tux_delegate_touch_range(rtcb, p[3], 4 * sizeof(uint16_t), true);
+      else if(p[2] == 0x541b)  // FIONREAD
+        tux_delegate_touch_range(rtcb, p[3], sizeof(int32_t), true);
+      return;
+
+    case 72:  // fcntl
+      if(p[2] == TUX_F_GETLK || p[2] == TUX_F_SETLK || p[2] == TUX_F_SETLKW)
+        tux_delegate_touch_range(rtcb, p[3], TUX_SIZEOF_FLOCK, p[2] == TUX_F_GETLK);
+      return;
+
+    case 40:  // sendfile
+      tux_delegate_touch_range(rtcb, p[3], sizeof(uint64_t), true);
+      return;
+
+    case 4:   // stat
+    case 6:   // lstat
+    case 262: // newfstatat
+      i = p[0] == 262 ? 2 : 1;
+      tux_delegate_touch_str(rtcb, p[i]);
+      if(!req->nsg)
+        tux_delegate_touch_range(rtcb, p[i + 1], TUX_SIZEOF_STAT, true);
+      return;
+
+    case 5:   // fstat
+      if(!req->nsg)
+        tux_delegate_touch_range(rtcb, p[2], TUX_SIZEOF_STAT, true);
+      return;
+
+    case 137: // statfs
+      tux_delegate_touch_str(rtcb, p[1]);
+      tux_delegate_touch_range(rtcb, p[2], TUX_SIZEOF_STATFS, true);
+      return;
+
+    case 138: // fstatfs
+      tux_delegate_touch_range(rtcb, p[2], TUX_SIZEOF_STATFS, true);
+      return;
+
+    case 89:  // readlink
+      tux_delegate_touch_str(rtcb, p[1]);
+      tux_delegate_touch_range(rtcb, p[2], p[3], true);
+      return;
+
+    case 267: // readlinkat
+      tux_delegate_touch_str(rtcb, p[2]);
+      tux_delegate_touch_range(rtcb, p[3], p[4], true);
+      return;
+
+    case 79:  // getcwd
+      tux_delegate_touch_range(rtcb, p[1], p[2], true);
+      return;
+
+    case 2:   // open
+    case 21:  // access
+    case 76:  // truncate
+    case 80:  // chdir
+    case 83:  // mkdir
+    case 84:  // rmdir
+    case 85:  // creat
+    case 87:  // unlink
+    case 90:  // chmod
+    case 92:  // chown
+    case 94:  // lchown
+    case 133: // mknod
+    case 166: // umount2
+      tux_delegate_touch_str(rtcb, p[1]);
+      return;
+
+    case 254: // inotify_add_watch
+    case 257: // openat
+    case 258: // mkdirat
+    case 259: // mknodat
+    case 260: // fchownat
+    case 263: // unlinkat
+    case 268: // fchmodat
+    case 269: // faccessat
+      tux_delegate_touch_str(rtcb, p[2]);
+      return;
+
+    case 82:  // rename
+    case 86:  // link
+    case 88:  // symlink
+      tux_delegate_touch_str(rtcb, p[1]);
+      tux_delegate_touch_str(rtcb, p[2]);
+      return;
+
+    case 264: // renameat
+    case 265: // linkat
+    case 316: // renameat2
+      tux_delegate_touch_str(rtcb, p[2]);
+      tux_delegate_touch_str(rtcb, p[4]);
+      return;
+
+    case 266: // symlinkat
+      tux_delegate_touch_str(rtcb, p[1]);
+      tux_delegate_touch_str(rtcb, p[3]);
+      return;
+
+    case 165: // mount
+      tux_delegate_touch_str(rtcb, p[1]);
+      tux_delegate_touch_str(rtcb, p[2]);
+      tux_delegate_touch_str(rtcb, p[3]);
+      return;
+
+    case 63:  // uname
+      tux_delegate_touch_range(rtcb, p[1], TUX_SIZEOF_UTSNAME, true);
+      return;
+
+    case 99:  // sysinfo
+      tux_delegate_touch_range(rtcb, p[1], TUX_SIZEOF_SYSINFO, true);
+      return;
+
+    case 98:  // getrusage
+      tux_delegate_touch_range(rtcb, p[2], TUX_SIZEOF_RUSAGE, true);
+      return;
+
+    case 61:  // wait4
+      tux_delegate_touch_range(rtcb, p[2], sizeof(int32_t), true);
+      tux_delegate_touch_range(rtcb, p[4], TUX_SIZEOF_RUSAGE, true);
+      return;
+
+    case 115: // getgroups
+      tux_delegate_touch_range(rtcb, p[2], p[1] * sizeof(uint32_t), true);
+      return;
+
+    case 116: // setgroups
+      tux_delegate_touch_range(rtcb, p[2], p[1] * sizeof(uint32_t), false);
+      return;
+
+    case 118: // getresuid
+    case 120: // getresgid
+      tux_delegate_touch_range(rtcb, p[1], sizeof(uint32_t), true);
+      tux_delegate_touch_range(rtcb, p[2], sizeof(uint32_t), true);
+      tux_delegate_touch_range(rtcb, p[3], sizeof(uint32_t), true);
+      return;
+
+    case 286: // timerfd_settime
+      tux_delegate_touch_range(rtcb, p[3], TUX_SIZEOF_ITIMERSPEC, false);
+      tux_delegate_touch_range(rtcb, p[4], TUX_SIZEOF_ITIMERSPEC, true);
+      return;
+
+    case 287: // timerfd_gettime
+      tux_delegate_touch_range(rtcb, p[2], TUX_SIZEOF_ITIMERSPEC, true);
+      return;
+
+    case 318: // getrandom
+      tux_delegate_touch_range(rtcb, p[1], p[2], true);
+      return;
+
+    default:
+      return;
+  }
+}
+
+/****************************************************************************
+ * Stream fds
+ ****************************************************************************/
+
+/* The Linux fds of a process reads and writes may wait on indefinitely:
+ * sockets, eventfds, inotify and the terminal handed down as stdio.  The
+ * peer may be another process of ours with its call queued behind.
+ * Everything else is file I/O.  Pipes are NuttX ones, never delegated. */
+struct tux_streams {
+  void *owner;        /* The task group, NULL if free */
+  uint64_t fds[(CONFIG_TUX_FD_RESERVE + 63) / 64];
+};
+
+static struct tux_streams g_streams[CONFIG_TUX_STREAM_PROCS];
+
+/* Must be called in a critical section */
+static struct tux_streams *tux_streams_get(void *owner, bool alloc)
+{
+  struct tux_streams *slot = NULL;
+  int i;
+
+  for(i = 0; i < CONFIG_TUX_STREAM_PROCS; i++)
+  {
+    if(g_streams[i].owner == owner)
+      return &g_streams[i];
+    if(!g_streams[i].owner && !slot)
+      slot = &g_streams[i];
+  }
+
+  if(!alloc || !slot)
+    return NULL;
+
+  // Until told otherwise, only stdio is a terminal
+  memset(slot->fds, 0, sizeof(slot->fds));
+  slot->fds[0] = 0x7;
+  slot->owner = owner;
+
+  return slot;
+}
+
+static bool tux_streams_test(struct tux_streams *st, int fd)
+{
+  if(fd < 0 || fd >= CONFIG_TUX_FD_RESERVE)
+    return false;
+
+  if(!st)
+    return fd <= 2;
+
+  return st->fds[fd / 64] & (1ULL << (fd % 64));
+}
+
+static void tux_streams_set(struct tux_streams *st, int fd, bool stream)
+{
+  if(!st || fd < 0 || fd >= CONFIG_TUX_FD_RESERVE)
+    return;
+
+  if(stream)
+    st->fds[fd / 64] |= 1ULL << (fd % 64);
+  else
+    st->fds[fd / 64] &= ~(1ULL << (fd % 64));
+}
+
+static bool tux_delegate_stream(int fd)
+{
+  irqstate_t flags;
+  bool ret;
+
+  flags = enter_critical_section();
+  ret = tux_streams_test(tux_streams_get(this_task()->group, false), fd);
+  leave_critical_section(flags);
+
+  return ret;
+}
+
+/* Follow the fds a completed call created, copied or closed */
+static void tux_delegate_track(unsigned long nbr, uintptr_t parm1,
+                               uintptr_t parm2, uintptr_t parm4, long ret)
+{
+  struct tux_streams *st;
+  irqstate_t flags;
+  int *sv;
+
+  if(ret < 0)
+    return;
+
+  flags = enter_critical_section();
+
+  switch(nbr)
+  {
+    case 41:  // socket
+    case 43:  // accept
+    case 253: // inotify_init
+    case 284: // eventfd
+    case 288: // accept4
+    case 290: // eventfd2
+    case 294: // inotify_init1
+      tux_streams_set(tux_streams_get(this_task()->group, true), ret, true);
+      break;
+
+    case 53:  // socketpair
+      sv = (int *)parm4;
+      st = tux_streams_get(this_task()->group, true);
+      tux_streams_set(st, sv[0], true);
+      tux_streams_set(st, sv[1], true);
+      break;
+
+    case 32:  // dup
+      st = tux_streams_get(this_task()->group, true);
+      tux_streams_set(st, ret, tux_streams_test(st, parm1));
+      break;
+
+    case 33:  // dup2
+    case 292: // dup3
+      st = tux_streams_get(this_task()->group, true);
+      tux_streams_set(st, parm2, tux_streams_test(st, parm1));
+      break;
+
+    case 72:  // fcntl
+      if(parm2 != TUX_F_DUPFD && parm2 != TUX_F_DUPFD_CLOEXEC)
+        break;
+      st = tux_streams_get(this_task()->group, true);
+      tux_streams_set(st, ret, tux_streams_test(st, parm1));
+      break;
+
+    case 2:   // open
+    case 257: // openat
+      tux_streams_set(tux_streams_get(this_task()->group, false), ret, false);
+      break;
+
+    case 3:   // close
+      tux_streams_set(tux_streams_get(this_task()->group, false), parm1, false);
+      break;
+
+    default:
+      break;
+  }
+
+  leave_critical_section(flags);
+}
+
+/* The child got copies of all our Linux fds */
+void tux_delegate_fork(struct tcb_s *parent, struct tcb_s *child)
+{
+  struct tux_streams *pst;
+  struct tux_streams *cst;
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+
+  pst = tux_streams_get(parent->group, false);
+  cst = pst ? tux_streams_get(child->group, true) : NULL;
+  if(cst)
+    memcpy(cst->fds, pst->fds, sizeof(cst->fds));
+
+  leave_critical_section(flags);
+}
+
+/* The process of tcb is gone */
+void tux_delegate_release(struct tcb_s *tcb)
+{
+  struct tux_streams *st;
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+
+  st = tux_streams_get(tcb->group, false);
+  if(st)
+    st->owner = NULL;
+
+  leave_critical_section(flags);
+}
+
+/* Calls which may sleep in Linux until another call, maybe one of ours
+ * queued behind them, makes progress.  They are not held back by the
+ * in-flight cap, file I/O is. */
+static bool tux_delegate_may_block(unsigned long nbr, uintptr_t parm1,
+                                   uintptr_t parm2)
+{
+  switch(nbr)
+  {
+    case 0:   // read
+    case 1:   // write
+    case 19:  // readv
+    case 20:  // writev
+    case 44:  // sendto
+    case 45:  // recvfrom
+    case 46:  // sendmsg
+    case 47:  // recvmsg
+    case 299: // recvmmsg
+    case 307: // sendmmsg
+      return tux_delegate_stream(parm1);
+
+    case 72:  // fcntl
+      return parm2 == TUX_F_SETLKW || parm2 == TUX_F_OFD_SETLKW;
+
+    case 7:   // poll
+    case 23:  // select
+    case 34:  // pause
+    case 43:  // accept
+    case 61:  // wait4
+    case 65:  // semop
+    case 69:  // msgsnd
+    case 70:  // msgrcv
+    case 73:  // flock
+    case 128: // rt_sigtimedwait
+    case 130: // rt_sigsuspend
+    case 202: // futex
+    case 232: // epoll_wait
+    case 247: // waitid
+    case 270: // pselect6
+    case 271: // ppoll
+    case 281: // epoll_pwait
+    case 288: // accept4
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+/* Queue a delegated syscall on the shadow tx ring without notifying Linux.
+ * Several calls may be queued and published at once by tux_delegate_flush,
+ * each one is then reaped with tux_delegate_wait. */
+int tux_delegate_submit(struct shadow_proc_req *req, unsigned long nbr,
+                        uintptr_t parm1, uintptr_t parm2, uintptr_t parm3,
+                        uintptr_t parm4, uintptr_t parm5, uintptr_t parm6)
+{
+  struct tcb_s *rtcb = this_task();
+
+  if(!(rtcb->xcp.is_linux && rtcb->xcp.linux_sock) || !gshadow)
+  {
     _err("Non-linux process calling linux syscall or invalid sock fd %d, %d\n", rtcb->xcp.is_linux, rtcb->xcp.linux_sock);
     PANIC();
   }
-  return syscall_ret;
+
+  req->params[0] = nbr;
+  req->params[1] = parm1;
+  req->params[2] = parm2;
+  req->params[3] = parm3;
+  req->params[4] = parm4;
+  req->params[5] = parm5;
+  req->params[6] = parm6;
+  req->tcb = rtcb;
+  req->blocking = tux_delegate_may_block(nbr, parm1, parm2);
+
+  tux_delegate_marshal(req);
+  tux_delegate_touch(req);
+
+  /* Linux may follow pointers into pages we faulted in lately */
+  tux_mm_mirror(rtcb);
+
+  return shadow_proc_submit(gshadow, req);
+}
+
+void tux_delegate_flush(void)
+{
+  shadow_proc_kick(gshadow);
+}
+
+/* Spin on the rx ring with its interrupt suppressed, for calls which are
+ * expected to complete sooner than a sleep/wakeup round trip */
+static bool tux_delegate_spin(struct shadow_proc_req *req)
+{
+  uint64_t budget;
+  uint32_t nbr = req->params[0] % TUX_DELEGATE_NR;
+
+  budget = (uint64_t)CONFIG_TUX_DELEGATE_POLL_NS * tsc_freq / 1000000000ULL;
+  if(!budget || g_delegate_ewma[nbr] > budget)
+    return req->done;
+
+  shadow_proc_disable_rx_irq(gshadow);
+
+  while(!req->done && rdtsc() - req->submit_tsc < budget)
+  {
+    if(shadow_proc_rx_avail(gshadow))
+      shadow_proc_reap(gshadow);
+    else
+      asm volatile("pause");
+  }
+
+  shadow_proc_enable_rx_irq(gshadow);
+
+  /* A reply may have landed before the event index was re-armed */
+  shadow_proc_reap(gshadow);
+
+  return req->done;
+}
+
+long tux_delegate_wait(struct shadow_proc_req *req)
+{
+  struct tcb_s *rtcb = this_task();
+  irqstate_t flags;
+  uint32_t nbr = req->params[0] % TUX_DELEGATE_NR;
+  uint64_t cycles;
+  int64_t delta;
+
+  tux_delegate_spin(req);
+
+  /* The completion might be reaped by another task's interrupt before we
+   * get here, only sleep if it has not arrived yet */
+  flags = enter_critical_section();
+
+  while(!req->done)
+  {
+    req->waiting = 1;
+    nxsem_wait(&rtcb->xcp.syscall_lock);
+  }
+
+  leave_critical_section(flags);
+
+  cycles = rdtsc() - req->submit_tsc;
+
+  delta = cycles < TUX_DELEGATE_EWMA_MAX ? (int64_t)cycles : TUX_DELEGATE_EWMA_MAX;
+  delta = (int64_t)g_delegate_ewma[nbr] + (delta - (int64_t)g_delegate_ewma[nbr]) / 8;
+  if(delta < 0)
+    delta = 0;
+  if(delta > TUX_DELEGATE_EWMA_MAX)
+    delta = TUX_DELEGATE_EWMA_MAX;
+  g_delegate_ewma[nbr] = delta;
+
+  tux_stats_delegate(req->params[0], cycles);
+  shadow_proc_trace_wakeup(gshadow, req);
+
+  if(req->stage_off >= 0)
+  {
+    if((int64_t)req->ret > 0 && (req->sg[req->nsg - 1].flags & SHADOW_PROC_SG_OUT))
+      memcpy(req->stage_buf, shadow_proc_bulk_rx(gshadow, req->stage_off),
+             req->ret < req->stage_len ? req->ret : req->stage_len);
+
+    shadow_proc_bulk_free(gshadow, req->stage_off, req->stage_len);
+    req->stage_off = -1;
+  }
+
+  return req->ret;
+}
+
+long tux_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                          uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
+                          uintptr_t parm6)
+{
+  struct shadow_proc_req req;
+  long ret;
+  svcinfo("Delegating syscall %d to linux\n", nbr);
+
+  if(!tux_cache_lookup(nbr, parm1, parm2, parm3, parm4, &ret))
+    return ret;
+
+  tux_cache_mutate(nbr, parm1, parm2, parm3, parm4);
+
+  tux_delegate_submit(&req, nbr, parm1, parm2, parm3, parm4, parm5, parm6);
+  tux_delegate_flush();
+
+  ret = tux_delegate_wait(&req);
+
+  tux_delegate_track(nbr, parm1, parm2, parm4, ret);
+  tux_cache_insert(nbr, parm1, parm2, parm3, parm4, ret);
+
+  return ret;
 }
 
 long tux_file_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
@@ -242,20 +1134,21 @@ long tux_file_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
 
   if(parm1 >= 0 && parm1 <= 2) {
       if(rtcb->xcp.fd[parm1] != parm1) {
-        if(linux_syscall_number_table[nbr] != (uint64_t)-1){
-          svcinfo("Facking: %d\n", rtcb->xcp.fd[parm1]);
-          ret = tux_local(nbr, rtcb->xcp.fd[parm1], parm2, parm3, parm4, parm5, parm6);
-        }
+        svcinfo("Facking: %d\n", rtcb->xcp.fd[parm1]);
+        if(nbr == 3)
+          tux_epoll_drop(parm1);
+        ret = tux_file_local(nbr, rtcb->xcp.fd[parm1], parm2, parm3, parm4, parm5, parm6);
       } else {
         ret = tux_delegate(nbr, parm1, parm2, parm3, parm4, parm5, parm6);
       }
   } else if(parm1 < CONFIG_TUX_FD_RESERVE) { // Lower parts should be delegated
+    if(nbr == 3)
+      tux_epoll_close(parm1);
     ret = tux_delegate(nbr, parm1, parm2, parm3, parm4, parm5, parm6);
   }else{
-    ret = -1;
-    if(linux_syscall_number_table[nbr] != (uint64_t)-1){
-      ret = tux_local(nbr, parm1 - CONFIG_TUX_FD_RESERVE, parm2, parm3, parm4, parm5, parm6);
-    }
+    if(nbr == 3)
+      tux_epoll_drop(parm1);
+    ret = tux_file_local(nbr, parm1 - CONFIG_TUX_FD_RESERVE, parm2, parm3, parm4, parm5, parm6);
   }
 
   return ret;
@@ -267,32 +1160,19 @@ long tux_open_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
 {
   int ret;
   uint64_t new_flags;
+  const char *path;
 
   svcinfo("Open/Socket syscall %d, path: %s, flag: %llx\n", nbr, (char*)parm1, parm2);
   if(nbr == 2){
-      // Nuttx has different Bit pattern in flags, we have to decode them
-      new_flags = 0;
-      if(parm2 & TUX_O_ACCMODE)     new_flags |= O_ACCMODE;
-
-      if(parm2 & TUX_O_WRONLY)      new_flags |= O_WRONLY;
-      else if(parm2 & TUX_O_RDWR)        new_flags |= O_RDWR;
-      else new_flags |= O_RDONLY;  // TUX_O_RDONLY == 0
-
-      if(parm2 & TUX_O_CREAT)       new_flags |= O_CREAT;
-      if(parm2 & TUX_O_EXCL)        new_flags |= O_EXCL;
-      if(parm2 & TUX_O_NOCTTY)      new_flags |= O_NOCTTY;
-      if(parm2 & TUX_O_TRUNC)       new_flags |= O_TRUNC;
-      if(parm2 & TUX_O_APPEND)      new_flags |= O_APPEND;
-      if(parm2 & TUX_O_NONBLOCK)    new_flags |= O_NONBLOCK;
-      if(parm2 & TUX_O_DSYNC)       new_flags |= O_DSYNC;
-      if((parm2 & TUX_O_SYNC) == TUX_O_SYNC)        new_flags |= O_SYNC;
-      if(parm2 & TUX_O_DIRECT)      new_flags |= O_DIRECT;
-      /*if(parm2 & TUX_O_LARGEFILE)   new_flags |= O_LARGEFILE;*/
-      /*if(parm2 & TUX_O_DIRECTORY)   new_flags |= O_DIRECTORY;*/
-      /*if(parm2 & TUX_O_NOFOLLOW)    new_flags |= O_NOFOLLOW;*/
-      /*if(parm2 & TUX_O_NOATIME)     new_flags |= O_NOATIME;*/
-      /*if(parm2 & TUX_O_CLOEXEC)     new_flags |= O_CLOEXEC;*/
+      path = (const char *)parm1;
+
+      // Files on the local mounts never reach Linux
+      if(tux_is_local_path(path))
+          return tux_local_open(path, parm2, parm3);
+
       if((parm2 & TUX_O_TMPFILE) == TUX_O_TMPFILE)     return -1;
+
+      new_flags = tux_open_flags(parm2);
       if(parm2 & TUX_O_NDELAY)      new_flags |= O_NDELAY;
       svcinfo("Local open Flags: 0x%llx\n", new_flags);
       ret = tux_local(nbr, parm1, new_flags, parm3, parm4, parm5, parm6);
@@ -304,6 +1184,17 @@ long tux_open_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
       ret = tux_delegate(nbr, parm1, parm2, parm3, parm4, parm5, parm6);
       svcinfo("Open/Socket fd: %d\n", ret);
 
+      return ret;
+  }else if(nbr == 257){
+      path = (const char *)parm2;
+
+      // Only when the directory fd does not matter
+      if(((int)parm1 == -100 || path[0] == '/') && tux_is_local_path(path))
+          return tux_local_open(path, parm3, parm4);
+
+      ret = tux_delegate(nbr, parm1, parm2, parm3, parm4, parm5, parm6);
+      svcinfo("Open/Socket fd: %d\n", ret);
+
       return ret;
   }else{
 
@@ -328,6 +1219,8 @@ long tux_dup2_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
   } else if(parm1 >= CONFIG_TUX_FD_RESERVE && parm2 >= CONFIG_TUX_FD_RESERVE) {
     ret = -1;
     ret = tux_local(nbr, parm1 - CONFIG_TUX_FD_RESERVE, parm2 - CONFIG_TUX_FD_RESERVE, parm3, parm4, parm5, parm6) + CONFIG_TUX_FD_RESERVE;
+    if(ret >= CONFIG_TUX_FD_RESERVE)
+      tux_file_dup(parm1 - CONFIG_TUX_FD_RESERVE, ret - CONFIG_TUX_FD_RESERVE);
   } else if(parm1 < CONFIG_TUX_FD_RESERVE && parm2 >= CONFIG_TUX_FD_RESERVE){
     ret = -EINVAL;
   } else {
@@ -335,6 +1228,8 @@ long tux_dup2_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
           // dup first and assign to the xcp;
           ret = dup(parm1 - CONFIG_TUX_FD_RESERVE);
           svcinfo("Fake DUPED as %d\n", ret);
+          if(ret >= 0)
+            tux_file_dup(parm1 - CONFIG_TUX_FD_RESERVE, ret);
           rtcb->xcp.fd[parm2] = ret;
           ret = parm2;
       } else {
@@ -355,6 +1250,10 @@ long tux_exit(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
       tux_delegate(nbr, parm1, parm2, parm3, parm4, parm5, parm6);
 
   if(rtcb->xcp.is_linux == 2) {
+    tux_cache_invalidate(rtcb->xcp.linux_pid);
+    tux_epoll_exit(rtcb->xcp.linux_pid);
+    tux_file_release(rtcb, 0);
+    tux_delegate_release(rtcb);
     delete_proc_node(rtcb->xcp.linux_pid);
     close(rtcb->xcp.linux_sock);
   }else{
@@ -0,0 +1,729 @@
+#include <nuttx/config.h>
+#include <nuttx/arch.h>
+#include <nuttx/kmalloc.h>
+#include <nuttx/semaphore.h>
+#include <nuttx/signal.h>
+#include <nuttx/clock.h>
+#include <nuttx/fs/fs.h>
+#include <nuttx/net/net.h>
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "tux.h"
+#include "up_internal.h"
+#include "sched/sched.h"
+
+#include <arch/board/shadow.h>
+
+#ifndef CONFIG_TUX_EPOLL_INSTANCES
+#  define CONFIG_TUX_EPOLL_INSTANCES 16
+#endif
+
+#define TUX_EPOLL_IN  (TUX_POLLIN | TUX_POLLPRI | TUX_POLLRDNORM | TUX_POLLRDBAND)
+#define TUX_EPOLL_OUT (TUX_POLLOUT | TUX_POLLWRNORM | TUX_POLLWRBAND)
+
+/* An epoll instance is a Linux epoll fd holding the delegated fds of the
+ * interest list, and a list of our own fds kept here.  The shadow process
+ * watches the Linux one and pushes a SHADOW_PROC_TAG_EVENT frame when it
+ * becomes ready, epoll_wait sleeps on that and on our fds together.
+ *
+ * Our fds stay polled from epoll_ctl until they leave the list, the drivers
+ * post the instance whenever they change.  poll() and select() over a mix of
+ * our fds and Linux ones run on a throwaway instance, see tux_epoll_poll. */
+
+struct tux_epoll_item {
+    struct pollfd pfd;       /* Set up unless disabled */
+    int fd;                  /* As the Linux process knows it */
+    uint32_t events;
+    uint64_t data;
+    bool disabled;           /* EPOLLONESHOT fired or the fd went away */
+    struct tux_epoll_item *flink;
+};
+
+struct tux_epoll {
+    int pid;                 /* Linux pid of the owner, 0 if free */
+    int epfd;                /* -1 once closed */
+    int refs;                /* The fd and the callers inside */
+    int waiters;             /* Callers inside epoll_wait */
+    uint16_t gen;            /* Tells stale notifications apart */
+    sem_t lock;              /* Protects the items */
+    sem_t sem;               /* Posted by our fds and by the shadow process */
+    volatile bool armed;     /* The shadow process will notify us */
+    volatile bool ready;     /* Linux has events for us */
+    int nlinux;
+    struct tux_epoll_item *items;
+};
+
+static struct tux_epoll tux_epoll_table[CONFIG_TUX_EPOLL_INSTANCES];
+
+static inline uint64_t tux_epoll_cookie(struct tux_epoll *ep)
+{
+    return ((uint64_t)ep->gen << 16) | (ep - tux_epoll_table);
+}
+
+/* Find the instance of epfd and hold it, tux_epoll_put lets go */
+static struct tux_epoll *tux_epoll_get(int epfd)
+{
+    int pid = this_task()->xcp.linux_pid;
+    struct tux_epoll *ep = NULL;
+    irqstate_t flags;
+    int i;
+
+    if(epfd < 0)
+        return NULL;
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < CONFIG_TUX_EPOLL_INSTANCES; i++) {
+        if(tux_epoll_table[i].pid == pid && tux_epoll_table[i].epfd == epfd) {
+            ep = &tux_epoll_table[i];
+            ep->refs++;
+            break;
+        }
+    }
+
+    leave_critical_section(flags);
+
+    return ep;
+}
+
+/* The NuttX fd behind a Linux fd number, -1 if Linux owns it */
+static int tux_epoll_local_fd(int fd)
+{
+    struct tcb_s *rtcb = this_task();
+
+    if(fd >= CONFIG_TUX_FD_RESERVE)
+        return fd - CONFIG_TUX_FD_RESERVE;
+
+    if(fd >= 0 && fd <= 2 && rtcb->xcp.fd[fd] != fd)
+        return rtcb->xcp.fd[fd];
+
+    return -1;
+}
+
+static int tux_epoll_fdsetup(struct pollfd *pfd, bool setup)
+{
+    if((unsigned int)pfd->fd >= CONFIG_NFILE_DESCRIPTORS) {
+#if defined(CONFIG_NET) && CONFIG_NSOCKET_DESCRIPTORS > 0
+        return net_poll(pfd->fd, pfd, setup);
+#else
+        return -EBADF;
+#endif
+    }
+
+    return fdesc_poll(pfd->fd, pfd, setup);
+}
+
+static int tux_epoll_item_setup(struct tux_epoll *ep, struct tux_epoll_item *item)
+{
+    int ret;
+
+    item->pfd.sem = &ep->sem;
+    item->pfd.revents = 0;
+    item->pfd.priv = NULL;
+
+    // A closed fd leaves the interest list, as on Linux
+    ret = tux_epoll_fdsetup(&item->pfd, true);
+    item->disabled = ret < 0;
+
+    return ret;
+}
+
+static void tux_epoll_item_teardown(struct tux_epoll_item *item)
+{
+    if(!item->disabled)
+        tux_epoll_fdsetup(&item->pfd, false);
+
+    item->pfd.sem = NULL;
+    item->disabled = true;
+}
+
+static pollevent_t tux_epoll_events2local(uint32_t events)
+{
+    pollevent_t ret = POLLFD;
+
+    if(events & TUX_EPOLL_IN)
+        ret |= POLLIN;
+    if(events & TUX_EPOLL_OUT)
+        ret |= POLLOUT;
+
+    return ret;
+}
+
+static uint32_t tux_epoll_revents2tux(struct tux_epoll_item *item)
+{
+    pollevent_t revents = item->pfd.revents;
+    uint32_t ret = 0;
+
+    if(revents & POLLIN)
+        ret |= item->events & TUX_EPOLL_IN;
+    if(revents & POLLOUT)
+        ret |= item->events & TUX_EPOLL_OUT;
+    if(revents & POLLERR)
+        ret |= TUX_POLLERR;
+    if(revents & POLLHUP)
+        ret |= TUX_POLLHUP;
+
+    return ret;
+}
+
+long tux_epoll_create(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                      uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
+                      uintptr_t parm6)
+{
+    struct tux_epoll *ep = NULL;
+    irqstate_t flags;
+    long epfd;
+    int i;
+
+    epfd = tux_delegate(nbr, parm1, parm2, parm3, parm4, parm5, parm6);
+    if(epfd < 0)
+        return epfd;
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < CONFIG_TUX_EPOLL_INSTANCES; i++) {
+        if(!tux_epoll_table[i].pid) {
+            ep = &tux_epoll_table[i];
+            ep->pid = this_task()->xcp.linux_pid;
+            break;
+        }
+    }
+
+    leave_critical_section(flags);
+
+    // Without a slot the instance holds Linux fds only
+    if(!ep)
+        return epfd;
+
+    ep->epfd = epfd;
+    ep->refs = 1;
+    ep->waiters = 0;
+    ep->gen++;
+    ep->armed = false;
+    ep->ready = false;
+    ep->nlinux = 0;
+    ep->items = NULL;
+
+    nxsem_init(&ep->lock, 0, 1);
+    nxsem_init(&ep->sem, 0, 0);
+    nxsem_setprotocol(&ep->sem, SEM_PRIO_NONE);
+
+    return epfd;
+}
+
+static void tux_epoll_free(struct tux_epoll *ep)
+{
+    struct tux_epoll_item *item;
+    irqstate_t flags;
+
+    while(ep->items) {
+        item = ep->items;
+        ep->items = item->flink;
+
+        tux_epoll_item_teardown(item);
+        kmm_free(item);
+    }
+
+    nxsem_destroy(&ep->lock);
+    nxsem_destroy(&ep->sem);
+
+    flags = enter_critical_section();
+    ep->pid = 0;
+    leave_critical_section(flags);
+}
+
+/* The last one out frees the instance */
+static void tux_epoll_put(struct tux_epoll *ep)
+{
+    irqstate_t flags;
+    bool last;
+
+    flags = enter_critical_section();
+    last = --ep->refs == 0;
+    leave_critical_section(flags);
+
+    if(last)
+        tux_epoll_free(ep);
+}
+
+/* Nobody may find the instance anymore, the waiters still sleeping on it
+ * are woken up one after the other and leave, then the fd reference is
+ * dropped */
+static void tux_epoll_shut(struct tux_epoll *ep)
+{
+    irqstate_t flags;
+
+    flags = enter_critical_section();
+    ep->epfd = -1;
+    ep->gen++;
+    leave_critical_section(flags);
+
+    nxsem_post(&ep->sem);
+
+    tux_epoll_put(ep);
+}
+
+/* fd is being closed, drop the instance behind it if any */
+void tux_epoll_close(int fd)
+{
+    struct tux_epoll *ep = tux_epoll_get(fd);
+
+    if(ep) {
+        tux_epoll_shut(ep);
+        tux_epoll_put(ep);
+    }
+}
+
+/* The process is gone, so are its instances */
+void tux_epoll_exit(int linux_pid)
+{
+    struct tux_epoll *ep;
+    irqstate_t flags;
+    bool open;
+    int i;
+
+    for(i = 0; i < CONFIG_TUX_EPOLL_INSTANCES; i++) {
+        ep = &tux_epoll_table[i];
+
+        flags = enter_critical_section();
+        open = ep->pid == linux_pid && ep->epfd >= 0;
+        if(open)
+            ep->refs++;
+        leave_critical_section(flags);
+
+        if(open) {
+            tux_epoll_shut(ep);
+            tux_epoll_put(ep);
+        }
+    }
+}
+
+/* Our fd is being closed, it leaves every interest list of the process
+ * before the number can be reused */
+void tux_epoll_drop(int fd)
+{
+    int pid = this_task()->xcp.linux_pid;
+    struct tux_epoll_item **pp;
+    struct tux_epoll_item *item;
+    struct tux_epoll *ep;
+    irqstate_t flags;
+    bool open;
+    int i;
+
+    for(i = 0; i < CONFIG_TUX_EPOLL_INSTANCES; i++) {
+        ep = &tux_epoll_table[i];
+
+        flags = enter_critical_section();
+        open = ep->pid == pid && ep->epfd >= 0;
+        if(open)
+            ep->refs++;
+        leave_critical_section(flags);
+
+        if(!open)
+            continue;
+
+        nxsem_wait_uninterruptible(&ep->lock);
+
+        for(pp = &ep->items; *pp; pp = &(*pp)->flink) {
+            if((*pp)->fd == fd) {
+                item = *pp;
+                *pp = item->flink;
+                tux_epoll_item_teardown(item);
+                kmm_free(item);
+                break;
+            }
+        }
+
+        nxsem_post(&ep->lock);
+
+        tux_epoll_put(ep);
+    }
+}
+
+/* From the shadow interrupt: Linux has events for the instance */
+void tux_epoll_notify(uint64_t cookie)
+{
+    struct tux_epoll *ep;
+    uint32_t idx = cookie & 0xffff;
+
+    if(idx >= CONFIG_TUX_EPOLL_INSTANCES)
+        return;
+
+    ep = &tux_epoll_table[idx];
+    if(!ep->pid || ep->epfd < 0 || ep->gen != (uint16_t)(cookie >> 16))
+        return;
+
+    ep->armed = false;
+    ep->ready = true;
+    nxsem_post(&ep->sem);
+}
+
+long tux_epoll_ctl(unsigned long nbr, int epfd, int op, int fd, struct tux_epoll_event *event)
+{
+    struct tux_epoll_item **pp;
+    struct tux_epoll_item *item;
+    struct tux_epoll *ep;
+    long ret = 0;
+    int lfd;
+
+    ep = tux_epoll_get(epfd);
+    lfd = tux_epoll_local_fd(fd);
+
+    if(lfd < 0) {
+        ret = tux_delegate(nbr, epfd, op, fd, (uintptr_t)event, 0, 0);
+        if(ep && !ret && op == TUX_EPOLL_CTL_ADD)
+            ep->nlinux++;
+        if(ep && !ret && op == TUX_EPOLL_CTL_DEL)
+            ep->nlinux--;
+        if(ep)
+            tux_epoll_put(ep);
+        return ret;
+    }
+
+    if(!ep)
+        return -ENOMEM;
+
+    if(op != TUX_EPOLL_CTL_DEL && !event) {
+        tux_epoll_put(ep);
+        return -EFAULT;
+    }
+
+    nxsem_wait_uninterruptible(&ep->lock);
+
+    for(pp = &ep->items; *pp; pp = &(*pp)->flink)
+        if((*pp)->fd == fd)
+            break;
+
+    item = *pp;
+
+    switch(op) {
+        case TUX_EPOLL_CTL_ADD:
+            if(item) {
+                ret = -EEXIST;
+                break;
+            }
+
+            item = kmm_zalloc(sizeof(struct tux_epoll_item));
+            if(!item) {
+                ret = -ENOMEM;
+                break;
+            }
+
+            item->fd = fd;
+            item->events = event->events;
+            item->data = event->data;
+            item->pfd.fd = lfd;
+            item->pfd.events = tux_epoll_events2local(event->events);
+
+            // A driver without poll support, Linux refuses those too
+            ret = tux_epoll_item_setup(ep, item);
+            if(ret < 0) {
+                kmm_free(item);
+                if(ret == -ENOSYS)
+                    ret = -EPERM;
+                break;
+            }
+
+            item->flink = ep->items;
+            ep->items = item;
+            break;
+
+        case TUX_EPOLL_CTL_MOD:
+            if(!item) {
+                ret = -ENOENT;
+                break;
+            }
+
+            tux_epoll_item_teardown(item);
+
+            item->events = event->events;
+            item->data = event->data;
+            item->pfd.events = tux_epoll_events2local(event->events);
+
+            ret = tux_epoll_item_setup(ep, item);
+            if(ret == -ENOSYS)
+                ret = -EPERM;
+            break;
+
+        case TUX_EPOLL_CTL_DEL:
+            if(!item) {
+                ret = -ENOENT;
+                break;
+            }
+
+            tux_epoll_item_teardown(item);
+
+            *pp = item->flink;
+            kmm_free(item);
+            break;
+
+        default:
+            ret = -EINVAL;
+            break;
+    }
+
+    nxsem_post(&ep->lock);
+
+    tux_epoll_put(ep);
+
+    return ret;
+}
+
+/* Move the events of our fds to the user.  A level-triggered fd is polled
+ * again so that it keeps reporting for as long as it stays ready, an
+ * edge-triggered one waits for its driver to post the next change. */
+static int tux_epoll_collect(struct tux_epoll *ep, struct tux_epoll_event *events, int maxevents)
+{
+    struct tux_epoll_item *item;
+    irqstate_t flags;
+    uint32_t revents;
+    int n = 0;
+
+    for(item = ep->items; item && n < maxevents; item = item->flink) {
+        if(item->disabled)
+            continue;
+
+        flags = enter_critical_section();
+        revents = tux_epoll_revents2tux(item);
+        if(item->events & TUX_EPOLLET)
+            item->pfd.revents = 0;
+        leave_critical_section(flags);
+
+        if(!revents)
+            continue;
+
+        events[n].events = revents;
+        events[n].data = item->data;
+        n++;
+
+        if(item->events & TUX_EPOLLONESHOT) {
+            tux_epoll_item_teardown(item);
+        } else if(!(item->events & TUX_EPOLLET)) {
+            tux_epoll_item_teardown(item);
+            tux_epoll_item_setup(ep, item);
+        }
+    }
+
+    return n;
+}
+
+/* Take the readiness reported by the shadow process, if any */
+static bool tux_epoll_take_ready(struct tux_epoll *ep)
+{
+    irqstate_t flags;
+    bool ready;
+
+    flags = enter_critical_section();
+    ready = ep->ready;
+    ep->ready = false;
+    leave_critical_section(flags);
+
+    return ready;
+}
+
+/* Have the shadow process tell us when Linux has events */
+static void tux_epoll_arm(struct tux_epoll *ep, int epfd)
+{
+    irqstate_t flags;
+    bool arm;
+
+    flags = enter_critical_section();
+    arm = ep->nlinux && !ep->armed && !ep->ready;
+    if(arm)
+        ep->armed = true;
+    leave_critical_section(flags);
+
+    if(arm && tux_delegate(SHADOW_PROC_EPOLL_ARM, epfd, tux_epoll_cookie(ep), 0, 0, 0, 0) < 0)
+        ep->armed = false;
+}
+
+long tux_epoll_wait(unsigned long nbr, int epfd, struct tux_epoll_event *events,
+                    int maxevents, int timeout, uintptr_t sigmask, uintptr_t sigsetsize)
+{
+    struct tux_epoll *ep;
+    sigset_t lset;
+    sigset_t loset;
+    clock_t start;
+    long ret;
+    bool masked = false;
+    int n = 0;
+
+    ep = tux_epoll_get(epfd);
+
+    // Nothing of ours to watch, Linux blocks on its own
+    if(!ep || !ep->items) {
+        if(ep)
+            tux_epoll_put(ep);
+        return tux_delegate(nbr, epfd, (uintptr_t)events, maxevents, timeout, sigmask, sigsetsize);
+    }
+
+    if(maxevents <= 0) {
+        tux_epoll_put(ep);
+        return -EINVAL;
+    }
+
+    // epoll_pwait, the mask holds for the wait only, as Linux does it
+    if(nbr == 281 && sigmask) {
+        if(sigsetsize != sizeof(uint64_t)) {
+            tux_epoll_put(ep);
+            return -EINVAL;
+        }
+
+        lset = *(uint64_t *)sigmask << 1;
+        nxsig_procmask(SIG_SETMASK, &lset, &loset);
+        masked = true;
+    }
+
+    nxsem_wait_uninterruptible(&ep->lock);
+    ep->waiters++;
+    nxsem_post(&ep->lock);
+
+    start = clock_systimer();
+
+    for(;;) {
+        // Everything a post stands for is looked at below
+        while(nxsem_trywait(&ep->sem) == OK);
+
+        // Closed while we slept, wake the next waiter to leave as well
+        if(ep->epfd != epfd) {
+            nxsem_post(&ep->sem);
+            ret = -EBADF;
+            break;
+        }
+
+        nxsem_wait_uninterruptible(&ep->lock);
+        n = tux_epoll_collect(ep, events, maxevents);
+        nxsem_post(&ep->lock);
+
+        ret = OK;
+        if(n < maxevents && tux_epoll_take_ready(ep)) {
+            ret = tux_delegate(nbr, epfd, (uintptr_t)(events + n), maxevents - n, 0, 0, 0);
+            if(ret > 0)
+                n += ret;
+        }
+
+        if(n || ret < 0 || !timeout)
+            break;
+
+        tux_epoll_arm(ep, epfd);
+
+        // Interrupted by a signal or timed out, the caller sees -EINTR or 0
+        if(timeout < 0)
+            ret = nxsem_wait(&ep->sem);
+        else
+            ret = nxsem_tickwait(&ep->sem, start, MSEC2TICK(timeout));
+
+        if(ret < 0)
+            break;
+    }
+
+    nxsem_wait_uninterruptible(&ep->lock);
+
+    // The others may sleep on events we drained but left behind, let one
+    // of them look again and arm the shadow process for itself
+    if(--ep->waiters && n)
+        nxsem_post(&ep->sem);
+
+    nxsem_post(&ep->lock);
+
+    if(masked)
+        nxsig_procmask(SIG_SETMASK, &loset, NULL);
+
+    tux_epoll_put(ep);
+
+    if(n)
+        return n;
+
+    return ret == -ETIMEDOUT ? 0 : (ret < 0 ? ret : 0);
+}
+
+/* poll() over a mix of our fds and Linux ones, on a throwaway instance so
+ * that both sides wake the caller the same way epoll_wait is woken */
+long tux_epoll_poll(struct tux_pollfd *fds, tux_nfds_t nfds, int timeout)
+{
+    struct tux_epoll_event *events;
+    struct tux_epoll *ep;
+    uint32_t mask;
+    long epfd;
+    long ret;
+    int ready = 0;
+    int i, j, k;
+
+    events = kmm_malloc(sizeof(struct tux_epoll_event) * nfds);
+    if(!events)
+        return -ENOMEM;
+
+    epfd = tux_epoll_create(291, TUX_O_CLOEXEC, 0, 0, 0, 0, 0);
+    if(epfd < 0) {
+        kmm_free(events);
+        return epfd;
+    }
+
+    ep = tux_epoll_get(epfd);
+    if(!ep) {
+        tux_delegate(3, epfd, 0, 0, 0, 0, 0);
+        kmm_free(events);
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+
+        if(fds[i].fd < 0)
+            continue;
+
+        // The same fd twice, watch the union under the first entry
+        for(j = 0; j < i; j++)
+            if(fds[j].fd == fds[i].fd)
+                break;
+
+        for(mask = 0, k = j; k <= i; k++)
+            if(fds[k].fd == fds[i].fd)
+                mask |= (uint16_t)fds[k].events;
+
+        events[i].events = mask;
+        events[i].data = j;
+
+        ret = tux_epoll_ctl(233, epfd, j < i ? TUX_EPOLL_CTL_MOD : TUX_EPOLL_CTL_ADD,
+                            fds[i].fd, &events[i]);
+
+        // Regular files are always ready, anything else bad is reported
+        if(ret == -EPERM)
+            fds[i].revents = fds[i].events & (TUX_POLLIN | TUX_POLLOUT | TUX_POLLRDNORM | TUX_POLLWRNORM);
+        else if(ret < 0)
+            fds[i].revents = TUX_POLLNVAL;
+
+        if(fds[i].revents)
+            ready++;
+    }
+
+    ret = tux_epoll_wait(232, epfd, events, nfds, ready ? 0 : timeout, 0, 0);
+
+    for(i = 0; i < ret; i++) {
+        for(j = events[i].data; j < nfds; j++) {
+            if(fds[j].fd != fds[events[i].data].fd)
+                continue;
+
+            mask = (uint16_t)fds[j].events | TUX_POLLERR | TUX_POLLHUP;
+            fds[j].revents |= events[i].events & mask;
+        }
+    }
+
+    tux_epoll_shut(ep);
+    tux_epoll_put(ep);
+    tux_delegate(3, epfd, 0, 0, 0, 0, 0);
+    kmm_free(events);
+
+    if(ret < 0 && !ready)
+        return ret;
+
+    for(ready = 0, i = 0; i < nfds; i++)
+        if(fds[i].revents)
+            ready++;
+
+    return ready;
+}
@@ -7,6 +7,8 @@
 #include "tux.h"
 #include "elf64.h"
 
+#include <arch/board/shadow.h>
+
 #include "up_internal.h"
 #include "sched/sched.h"
 #include <sched/sched.h>
@@ -19,6 +21,28 @@
 #define TUX_HEAP_START (123 * HUGE_PAGE_SIZE)
 #define TUX_HEAP_SIZE (1 * HUGE_PAGE_SIZE)
 
+#ifndef CONFIG_TUX_EXEC_IMAGES
+#  define CONFIG_TUX_EXEC_IMAGES 4
+#endif
+
+#define TUX_EXEC_HEAD_SIZE   1024  /* Read up front, the headers usually fit */
+#define TUX_EXEC_CHUNK       (SHADOW_PROC_MAX_SG * PAGE_SIZE)
+#define TUX_EXEC_PATH_MAX    128
+
+/* Pages of prepared images are cached above any file offset */
+#define TUX_EXEC_IMAGE_PGOFF (1ULL << 52)
+
+/* A static binary as it was right after loading, its pages are kept in
+ * the page cache.  Restarting it maps them copy-on-write. */
+struct tux_exec_image {
+    char path[TUX_EXEC_PATH_MAX];
+    struct tux_pgcache_file file;
+    uint64_t start;
+    uint64_t end;
+    uintptr_t entry;
+    uint32_t stamp;
+};
+
 #ifndef __ASSEMBLY__
 typedef struct
 {
@@ -110,7 +134,7 @@ void* exec_setupargs(uint64_t stack, int argc, char* argv[], int envc, char* env
     auxptr[1].a_un.a_val = (uint64_t)(sp + total_size - argv_size - envp_size - 16 - stack + TUX_STACK_START);
 
     auxptr[2].a_type = AT_SYSINFO_EHDR;
-    auxptr[2].a_un.a_val = 0x0;
+    auxptr[2].a_un.a_val = tux_vdso_base();
 
     auxptr[3].a_type = AT_SECURE;
     auxptr[3].a_un.a_val = 0x0;
@@ -127,14 +151,187 @@ void* exec_setupargs(uint64_t stack, int argc, char* argv[], int envc, char* env
     return sp;
 }
 
+/* Read len bytes at offset of the binary into buf.  User memory is read in
+ * pieces small enough for Linux to reach them by physical address. */
+static int tux_exec_read(int fd, uintptr_t buf, uint64_t len, uint64_t offset)
+{
+    uint64_t seg;
+    long ret;
+
+    while(len) {
+        seg = TUX_EXEC_CHUNK - (buf & ~PAGE_MASK);
+        if(seg > len)
+            seg = len;
+
+        ret = tux_file_delegate(17, fd, buf, seg, offset, 0, 0);
+        if(ret <= 0)
+            return ret < 0 ? ret : -EIO;
+
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+#if CONFIG_TUX_EXEC_IMAGES > 0
+
+static struct tux_exec_image tux_exec_images[CONFIG_TUX_EXEC_IMAGES];
+static uint32_t tux_exec_image_clock;
+
+static bool tux_exec_image_find(const char* path, struct tux_pgcache_file *file, struct tux_exec_image *out)
+{
+    irqstate_t flags;
+    bool found = false;
+    int i;
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < CONFIG_TUX_EXEC_IMAGES; i++) {
+        if(tux_exec_images[i].path[0] && !strcmp(tux_exec_images[i].path, path) &&
+           !memcmp(&tux_exec_images[i].file, file, sizeof(*file))) {
+            tux_exec_images[i].stamp = ++tux_exec_image_clock;
+            *out = tux_exec_images[i];
+            found = true;
+            break;
+        }
+    }
+
+    leave_critical_section(flags);
+
+    return found;
+}
+
+static void tux_exec_image_drop(const char* path)
+{
+    irqstate_t flags;
+    int i;
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < CONFIG_TUX_EXEC_IMAGES; i++)
+        if(!strcmp(tux_exec_images[i].path, path))
+            tux_exec_images[i].path[0] = '\0';
+
+    leave_critical_section(flags);
+}
+
+/* Keep the image just loaded at [start, end) for the next start of path.
+ * Its pages go to the page cache and are copied on write from now on. */
+static void tux_exec_image_save(const char* path, struct tux_pgcache_file *file,
+                                uint64_t start, uint64_t end, uintptr_t entry)
+{
+    struct tcb_s *rtcb = this_task();
+    struct tux_exec_image *img;
+    struct vma_s *vma;
+    irqstate_t flags;
+    int i;
+
+    if(strlen(path) >= TUX_EXEC_PATH_MAX)
+        return;
+
+    // Kept whole, a page missing from the cache means the image is gone
+    if(tux_mlock(149, (void*)start, end - start))
+        return;
+
+    vma = vma_tree_lookup(&tux_mm_vm(rtcb)->vmas, start);
+    if(!vma || vma->va_end < end)
+        return;
+
+    tux_mm_cache_pages(rtcb, vma, file, TUX_EXEC_IMAGE_PGOFF + start / PAGE_SIZE, (end - start) / PAGE_SIZE);
+
+    flags = enter_critical_section();
+
+    img = &tux_exec_images[0];
+    for(i = 0; i < CONFIG_TUX_EXEC_IMAGES; i++) {
+        if(!strcmp(tux_exec_images[i].path, path)) {
+            img = &tux_exec_images[i];
+            break;
+        }
+
+        if((int32_t)(tux_exec_images[i].stamp - img->stamp) < 0)
+            img = &tux_exec_images[i];
+    }
+
+    strcpy(img->path, path);
+    img->file = *file;
+    img->start = start;
+    img->end = end;
+    img->entry = entry;
+    img->stamp = ++tux_exec_image_clock;
+
+    leave_critical_section(flags);
+}
+
+/* Map a prepared image, fails if the page cache let some of it go */
+static int tux_exec_image_map(struct tux_exec_image *img)
+{
+    struct tcb_s *rtcb = this_task();
+    struct vma_s *vma;
+    void* ptr;
+
+    // Inaccessible until the pages are in, so that none is backed meanwhile
+    ptr = tux_mmap(9, (void*)img->start, img->end - img->start, PROT_NONE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, 0, 0);
+    if(ptr == MAP_FAILED)
+        return -ENOMEM;
+
+    vma = vma_tree_lookup(&tux_mm_vm(rtcb)->vmas, img->start);
+    if(!vma || tux_mm_map_cached(rtcb, vma, &img->file, TUX_EXEC_IMAGE_PGOFF + img->start / PAGE_SIZE,
+                                 (img->end - img->start) / PAGE_SIZE))
+        return -ENOENT;
+
+    return tux_mprotect(10, (void*)img->start, img->end - img->start, PROT_READ | PROT_WRITE | PROT_EXEC);
+}
+
+#else
+
+static bool tux_exec_image_find(const char* path, struct tux_pgcache_file *file, struct tux_exec_image *out)
+{
+    return false;
+}
+
+static void tux_exec_image_drop(const char* path)
+{
+}
+
+static void tux_exec_image_save(const char* path, struct tux_pgcache_file *file,
+                                uint64_t start, uint64_t end, uintptr_t entry)
+{
+}
+
+static int tux_exec_image_map(struct tux_exec_image *img)
+{
+    return -ENOENT;
+}
+
+#endif
+
 long _tux_exec(char* path, char *argv[], char* envp[]){
     int argc, envc;
-    int i, j;
+    int i;
     int ret;
     void* tmp_ptr;
 
     struct tcb_s *rtcb = this_task();
     struct vma_s *ptr, *to_free;
+    struct vm_map_s *vm = NULL;
+    irqstate_t irqflags;
+
+    struct tux_pgcache_file file;
+    struct tux_exec_image image;
+    struct tux_stat st;
+    Elf64_Ehdr* header = NULL;
+    Elf64_Phdr* phdr = NULL;
+    char* head = NULL;
+    char* interpreter = NULL;
+    uint64_t head_len;
+    uint64_t start, end;
+    uintptr_t min_seg_addr = 0xffffffff;
+    uintptr_t entry;
+    int elf_fd = -1;
+    bool cached;
 
     svcinfo("ARGV:\n");
     for(i = 0; argv[i] != NULL; i++) {
@@ -146,54 +343,73 @@ long _tux_exec(char* path, char *argv[], char* envp[]){
     for(i = 0; envp[i] != NULL; i++);
     envc = i;
 
-    // Hack use of fstat, hard code the linux struct stat size
-    uint64_t filesz;
+    // The size and modification time tell whether a prepared image is stale
+    ret = tux_path_delegate(4, (uintptr_t)path, (uintptr_t)&st, 0, 0, 0, 0);
+    if(ret < 0)
+        return ret;
 
-    tmp_ptr = kmm_zalloc(144);
-    tux_delegate(4, (uintptr_t)path, (uintptr_t)tmp_ptr, 0, 0, 0, 0);
-    filesz = ((uint64_t*)tmp_ptr)[6];
-    kmm_free(tmp_ptr);
+    file.dev = st.st_dev;
+    file.ino = st.st_ino;
+    file.mtime_sec = st.st_mtime_sec;
+    file.mtime_nsec = st.st_mtime_nsec;
+    file.size = st.st_size;
 
-    svcinfo("Path: %s, size: 0x%llx\n", path, filesz);
+    svcinfo("Path: %s, size: 0x%llx\n", path, file.size);
+
+    // Started before, nothing to read or parse
+    cached = tux_exec_image_find(path, &file, &image);
+    if(cached) {
+        svcinfo("Prepared image of %s found\n", path);
+
+        start = image.start;
+        end = image.end;
+        entry = image.entry;
+        goto point_of_no_return;
+    }
 
     // We are in a linux context, so free to use remote system calls
-    // Get the ELF header
-    int elf_fd = tux_open_delegate(2, (uintptr_t)path, TUX_O_RDONLY, 0, 0, 0, 0);
+    // Only the headers are read up front, the segments go straight to
+    // their final place once the old memory map is gone
+    elf_fd = tux_open_delegate(2, (uintptr_t)path, TUX_O_RDONLY, 0, 0, 0, 0);
     if(elf_fd < 0)
         return elf_fd;
 
-    // The mapping might be overwrite during loading
-    // Extra care should be taken
-    // Map it to a section not used by usual Linux application
-    // Or copy it on to the kernel heap
-    void* binary = kmm_zalloc(filesz);
-
-    /* use a read instead of mmap
-     * This retains the pristine pda and vma in TCB */
-    tmp_ptr = tux_delegate(0, elf_fd, binary, filesz, 0, 0, 0);
-    if(tmp_ptr != filesz) {
+    head_len = file.size < TUX_EXEC_HEAD_SIZE ? file.size : TUX_EXEC_HEAD_SIZE;
+    head = kmm_zalloc(TUX_EXEC_HEAD_SIZE + 1);
+    if(!head) {
         ret = -ENOMEM;
-        tux_file_delegate(3, elf_fd, 0, 0, 0, 0, 0);
-        goto err_binary_mem;
+        goto err_fd;
     }
 
-    /* We got everything in memory, not needed any more */
-    tux_file_delegate(3, elf_fd, 0, 0, 0, 0, 0);
+    ret = tux_exec_read(elf_fd, (uintptr_t)head, head_len, 0);
+    if(ret)
+        goto err_head;
 
     svcinfo("Testing header...\n");
     /* Test script */
-    if(((char*)binary)[0] == '#' && ((char*)binary)[1] == '!') {
+    if(head[0] == '#' && head[1] == '!') {
         /* This is a script */
         /* Use the scripting program as interpreter */
         svcinfo("Oh! a script is found\n");
 
+        // The file is not needed any more
+        tux_file_delegate(3, elf_fd, 0, 0, 0, 0, 0);
+
         char* holder[16]; // at max 16 arguments for the interpreter
         int hidx = 0;
         memset(holder, 0, sizeof(char*) * 16);
 
-        char* scan_ptr = binary + 2;
-        char* prev_ptr = binary + 2;
+        // The line must end within what we read
+        char* scan_ptr = head + 2;
+        char* prev_ptr = head + 2;
         while(*scan_ptr != '\n') {
+            if(*scan_ptr == '\0') {
+                for(hidx--; hidx >= 0; hidx--){
+                    kmm_free(holder[hidx]);
+                }
+                kmm_free(head);
+                return -ENOEXEC;
+            }
             if(*scan_ptr == ' ') {
                 *scan_ptr = '\0';
                 if(prev_ptr != scan_ptr) {
@@ -202,6 +418,7 @@ long _tux_exec(char* path, char *argv[], char* envp[]){
                         for(hidx--; hidx >= 0; hidx--){
                             kmm_free(holder[hidx]);
                         }
+                        kmm_free(head);
                         return -EINVAL;
                     }
                     holder[hidx++] = strdup(prev_ptr);
@@ -218,11 +435,14 @@ long _tux_exec(char* path, char *argv[], char* envp[]){
                 for(hidx--; hidx >= 0; hidx--){
                     kmm_free(holder[hidx]);
                 }
+                kmm_free(head);
                 return -EINVAL;
             }
             holder[hidx++] = strdup(prev_ptr);
         }
 
+        kmm_free(head);
+
         /* No interpreter given */
         if(hidx < 1)
             return -EINVAL;
@@ -243,26 +463,24 @@ long _tux_exec(char* path, char *argv[], char* envp[]){
         for(; i >= 0; i--)
             argv[i] = holder[i];
 
-        // We will never return, clear the resource now
-        kmm_free(binary);
-
         for(i = 0; i < argc + hidx; i++){
             svcinfo("new argv[%d] %s\n", i, argv[i]);
         }
 
         // Now we load again with Interpreter
-        ret = _tux_exec(strdup(holder[0]), argv, envp);
+        return _tux_exec(strdup(holder[0]), argv, envp);
     }
 
-    Elf64_Ehdr* header = binary;
+    header = (Elf64_Ehdr*)head;
 
     /* Test ELF */
-    if((header->e_ident[EI_MAG0] != ELFMAG0) &&
-       (header->e_ident[EI_MAG1] != ELFMAG1)  &&
-       (header->e_ident[EI_MAG2] != ELFMAG2)  &&
+    if((head_len < sizeof(Elf64_Ehdr)) ||
+       (header->e_ident[EI_MAG0] != ELFMAG0) ||
+       (header->e_ident[EI_MAG1] != ELFMAG1) ||
+       (header->e_ident[EI_MAG2] != ELFMAG2) ||
        (header->e_ident[EI_MAG3] != ELFMAG3)) {
         ret = -EINVAL;
-        goto err_binary_mem;
+        goto err_head;
     }
 
     svcinfo("ELF magic verified\n");
@@ -270,59 +488,17 @@ long _tux_exec(char* path, char *argv[], char* envp[]){
     if((header->e_ident[EI_CLASS] != ELFCLASS64)) {
         svcerr("Only 64bit ELF is supported!");
         ret = -EINVAL;
-        goto err_binary_mem;
+        goto err_head;
     }
 
     if((header->e_machine != EM_X86_64)) {
         svcerr("Only x86-64 ELF is supported!");
         ret = -EINVAL;
-        goto err_binary_mem;
+        goto err_head;
     }
 
     svcinfo("x86-64 ELF verified\n");
 
-    /* free all the resource of the previous task now */
-    /* We have the binary in memory and verified*/
-    /* fds we assume 4096 is the max
-     * let stdin, stdout, stderr and shadow process retain*/
-    /* Skip Linux part, we do it in a single execve call */
-    for(i = 3; i < _POSIX_OPEN_MAX; i++)
-        if(i != rtcb->xcp.linux_sock)
-            close(i);
-
-    /* memory */
-    svcinfo("Wiping Memory Map: \n");
-    ptr = rtcb->xcp.vma;
-    while(ptr) {
-        if(ptr == &g_vm_full_map) continue;
-
-        svcinfo("0x%08llx - 0x%08llx : backed by 0x%08llx 0x%08llx %s\n", ptr->va_start, ptr->va_end, ptr->pa_start, ptr->pa_start + VMA_SIZE(ptr), ptr->_backing);
-
-        to_free = ptr;
-        ptr = ptr->next;
-
-        gran_free(tux_mm_hnd, (void*)(to_free->pa_start), VMA_SIZE(to_free));
-        kmm_free(to_free);
-    }
-    rtcb->xcp.vma = NULL;
-
-    svcinfo("Wiping PDAs: \n");
-    ptr = rtcb->xcp.pda;
-    while(ptr) {
-        if(ptr == &g_vm_full_map) continue;
-
-        svcinfo("0x%08llx - 0x%08llx : 0x%08llx 0x%08llx\n", ptr->va_start, ptr->va_end, ptr->pa_start, ptr->pa_start + VMA_SIZE(ptr));
-
-        to_free = ptr;
-        ptr = ptr->next;
-
-        kmm_free(to_free);
-    }
-    rtcb->xcp.pda = NULL;
-
-    /* delegate a execve to notify Linux to do some cleaning */
-    tux_delegate(59, 0, 0, 0, 0, 0, 0);
-
     // print basic info
     svcinfo("Entry point: 0x%lx\n", header->e_entry);
     svcinfo("ELF header size: 0x%lx\n", header->e_ehsize);
@@ -330,32 +506,44 @@ long _tux_exec(char* path, char *argv[], char* envp[]){
     svcinfo("Program header size: 0x%lx\n", header->e_phentsize);
     svcinfo("Program count: 0x%lx\n", header->e_phnum);
 
-    svcinfo("Section header: 0x%lx\n", header->e_shoff);
-    svcinfo("Section header size: 0x%lx\n", header->e_shentsize);
-    svcinfo("Section count: 0x%lx\n", header->e_shnum);
+    // The program headers are usually read with the ELF header already
+    phdr = kmm_malloc(sizeof(Elf64_Phdr) * header->e_phnum);
+    if(!phdr) {
+        ret = -ENOMEM;
+        goto err_head;
+    }
 
-    // Map the Segments and Sections
-    Elf64_Phdr *phdr = binary + header->e_phoff;
-    Elf64_Shdr *shdr = binary + header->e_shoff;
+    if(header->e_phoff + sizeof(Elf64_Phdr) * header->e_phnum <= head_len)
+        memcpy(phdr, head + header->e_phoff, sizeof(Elf64_Phdr) * header->e_phnum);
+    else if((ret = tux_exec_read(elf_fd, (uintptr_t)phdr, sizeof(Elf64_Phdr) * header->e_phnum, header->e_phoff)))
+        goto err_phdr;
 
     // Search for PT_INTPR, if found it's a dynamic binary
-    int is_dynamic = 0;
-    char* interpreter;
-
     for (i = 0; i < header->e_phnum; i++) {
-        if (phdr[i].p_type == PT_INTERP) {
-            is_dynamic = 1;
-            interpreter = binary + phdr[i].p_offset;
-        }
+        if (phdr[i].p_type == PT_INTERP && !interpreter) {
+            interpreter = kmm_zalloc(phdr[i].p_filesz + 1);
+            if(!interpreter) {
+                ret = -ENOMEM;
+                goto err_phdr;
+            }
+
+            ret = tux_exec_read(elf_fd, (uintptr_t)interpreter, phdr[i].p_filesz, phdr[i].p_offset);
+            if(ret) {
+                kmm_free(interpreter);
+                goto err_phdr;
+            }
         }
+    }
 
-    if (is_dynamic) {
+    if (interpreter) {
         svcinfo("Dynamic linked ELF detected!\n");
         svcinfo("The interpreter is %s\n", interpreter);
         svcinfo("Loading the interpreter instead of %s\n", path);
 
-        // Put the interpreter string on to the stack
-        tmp_ptr = strdup(interpreter);
+        // The dynamic loader maps the binary by itself
+        tux_file_delegate(3, elf_fd, 0, 0, 0, 0, 0);
+        kmm_free(phdr);
+        kmm_free(head);
 
         // Insert the interpreter as argv[0]
         argv = kmm_realloc(argv, sizeof(char*) * (argc + 2));
@@ -364,97 +552,152 @@ long _tux_exec(char* path, char *argv[], char* envp[]){
             argv[i] = argv[i - 1];
         kmm_free(argv[1]);
         argv[1] = path;
-        argv[0] = tmp_ptr;
-
-        // We will never return, clear the resource now
-        kmm_free(binary);
+        argv[0] = strdup(interpreter);
 
         // Now we load again with statically linked dynamic loader
-        ret = _tux_exec(tmp_ptr, argv, envp);
+        return _tux_exec(interpreter, argv, envp);
+    }
 
-    } else {
-        svcinfo("Static linked ELF detected!\n");
-        svcinfo("Start loading...\n");
+    svcinfo("Static linked ELF detected!\n");
 
-        uintptr_t min_seg_addr = 0xffffffff;
+    // The segments are loaded into a single mapping, pages shared by two
+    // of them are not lost that way
+    start = ~0ULL;
+    end = 0;
+    for (i = 0; i < header->e_phnum; i++) {
+        if (phdr[i].p_type != PT_LOAD)
+            continue;
+
+        if((phdr[i].p_vaddr & PAGE_MASK) < start)
+            start = phdr[i].p_vaddr & PAGE_MASK;
+        if(((phdr[i].p_vaddr + phdr[i].p_memsz + PAGE_SIZE - 1) & PAGE_MASK) > end)
+            end = (phdr[i].p_vaddr + phdr[i].p_memsz + PAGE_SIZE - 1) & PAGE_MASK;
+        if(phdr[i].p_vaddr < min_seg_addr)
+            min_seg_addr = phdr[i].p_vaddr;
+    }
 
-        // Load the Segments with PT_LOAD
-        // At this point we should have a clean memory map
-        for (i = 0; i < header->e_phnum; i++) {
-            if (phdr[i].p_type == PT_LOAD) {
-                svcinfo("Loading Segment #%d/%d...\n", i, header->e_phnum);
-
-                // First populate the pages
-                tmp_ptr = tux_mmap(9, (void*)phdr[i].p_vaddr, phdr[i].p_memsz,
-                        PROT_READ | PROT_WRITE | PROT_EXEC,
-                        MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, 0, 0);
-
-                if(tmp_ptr == MAP_FAILED) {
-                    ret = -ENOMEM;
-                    // We don't brother reverting the mmap upon error
-                    // up_release stack will do this for us
-                    // But the original process mmap will be trashed
-                    goto static_err;
-                }
+    if(start >= end) {
+        ret = -EINVAL;
+        goto err_phdr;
+    }
 
-                if(phdr[i].p_vaddr < min_seg_addr)
-                    min_seg_addr = phdr[i].p_vaddr;
+    entry = header->e_entry;
 
-                for (j = 0; j < header->e_shnum; j++) {
+point_of_no_return:
+    /* A vfork child needs a memory map of its own, nothing is undone yet */
+    if(rtcb->xcp.vfork_done) {
+        vm = kmm_zalloc(sizeof(struct vm_map_s));
+        if(!vm) {
+            if(cached)
+                return -ENOMEM;
+            ret = -ENOMEM;
+            goto err_phdr;
+        }
+    }
 
-                    // Only sections belongs to this segmenta
-                    // Use file offset to map section to segment
-                    // Memory address are unreliable, e.g. debug information will be loaded
-                    if (!((shdr[j].sh_offset >= phdr[i].p_offset) &&
-                          (shdr[j].sh_offset < phdr[i].p_offset + phdr[i].p_filesz)))
-                        continue;
+    /* free all the resource of the previous task now */
+    /* We have the binary verified*/
+    /* fds we assume 4096 is the max
+     * let stdin, stdout, stderr and shadow process retain*/
+    /* Skip Linux part, we do it in a single execve call */
+    for(i = 3; i < _POSIX_OPEN_MAX; i++)
+        if(i != rtcb->xcp.linux_sock && i != elf_fd - CONFIG_TUX_FD_RESERVE)
+            close(i);
+    tux_file_release(rtcb, 3);
 
-                    svcinfo("Section [%02d] %-16s \t Virtual address: 0x%016llx \t size: 0x%016llx\n", j, (binary + shdr[header->e_shstrndx].sh_offset) + shdr[j].sh_name, (void*)shdr[j].sh_addr, shdr[j].sh_size);
+    /* memory */
+    if(rtcb->xcp.vfork_done) {
+        /* A vfork child gives the memory back to its parent and starts afresh */
+        svcinfo("Leaving vfork parent memory\n");
 
-                    if (shdr[j].sh_type == SHT_NOBITS) {
-                        memset((void*)shdr[j].sh_addr, 0, shdr[j].sh_size);
-                    } else {
-                        memcpy((void*)shdr[j].sh_addr, binary + shdr[j].sh_offset, shdr[j].sh_size);
-                    }
-                }
+        rtcb->xcp.vm = vm;
+        rtcb->xcp.pd1 = tux_mm_new_pd1();
+        rtcb->xcp.vma = NULL;
+        rtcb->xcp.pda = NULL;
 
-            }
-        }
+        irqflags = enter_critical_section();
+        up_this_cpu()->pdpt[0] = (uintptr_t)rtcb->xcp.pd1 | 0x23;
+        up_this_cpu()->pd1 = rtcb->xcp.pd1;
+        set_pcid(rtcb->pid);
+        leave_critical_section(irqflags);
 
-        /*set stack*/
-        svcinfo("Setting up stack\n");
+        nxsem_post(rtcb->xcp.vfork_done);
+        rtcb->xcp.vfork_done = NULL;
 
-        tmp_ptr = tux_mmap(9, (void*)TUX_STACK_START, TUX_STACK_SIZE,
-                PROT_READ | PROT_WRITE | PROT_EXEC,
-                MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, 0, 0);
+        goto memory_ready;
+    }
 
-        if(tmp_ptr == MAP_FAILED) {
-            ret = -ENOMEM;
-            goto static_err;
-        }
+    svcinfo("Wiping Memory Map: \n");
+    ptr = tux_mm_vm(rtcb)->vmas.first;
+    while(ptr) {
 
-        void* sp = exec_setupargs((uintptr_t)tmp_ptr, argc, argv, envc, envp);
-        if (sp < 0)
-        {
-            ret = -get_errno();
-            svcerr("execvs_setupargs() failed: %d\n", ret);
-            goto static_err;
-        }
+        svcinfo("0x%08llx - 0x%08llx : backed by 0x%08llx 0x%08llx %s\n", ptr->va_start, ptr->va_end, ptr->pa_start, ptr->pa_start + VMA_SIZE(ptr), ptr->_backing);
+
+        to_free = ptr;
+        ptr = ptr->next;
+
+        tux_mm_release(rtcb, to_free, to_free->va_start, to_free->va_end);
+        kmm_free(to_free);
+    }
+    rtcb->xcp.vm->vmas.root = NULL;
+    rtcb->xcp.vm->vmas.first = NULL;
+    rtcb->xcp.vm->unmirrored_start = 0;
+    rtcb->xcp.vm->unmirrored_end = 0;
+    rtcb->xcp.vma = NULL;
+
+    svcinfo("Wiping PDAs: \n");
+    ptr = rtcb->xcp.vm->pdas.first;
+    while(ptr) {
+
+        svcinfo("0x%08llx - 0x%08llx : 0x%08llx 0x%08llx\n", ptr->va_start, ptr->va_end, ptr->pa_start, ptr->pa_start + VMA_SIZE(ptr));
 
-        /*set brk*/
-        svcinfo("Setting up heap\n");
+        to_free = ptr;
+        ptr = ptr->next;
+
+        kmm_free(to_free);
+    }
+    rtcb->xcp.vm->pdas.root = NULL;
+    rtcb->xcp.vm->pdas.first = NULL;
+    rtcb->xcp.pda = NULL;
+
+memory_ready:
+
+    /* delegate a execve to notify Linux to do some cleaning */
+    tux_delegate(59, 0, 0, 0, 0, 0, 0);
+
+    if (cached) {
+        if(tux_exec_image_map(&image) != OK) {
+            // The page cache let part of it go, load it again
+            tux_exec_image_drop(path);
+            return _tux_exec(path, argv, envp);
+        }
+    } else {
+        svcinfo("Start loading...\n");
 
-        tmp_ptr = tux_mmap(9, (void*)TUX_HEAP_START, TUX_HEAP_SIZE,
+        // Fresh anonymous memory, whatever is not loaded is already zero
+        tmp_ptr = tux_mmap(9, (void*)start, end - start,
                 PROT_READ | PROT_WRITE | PROT_EXEC,
                 MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, 0, 0);
 
         if(tmp_ptr == MAP_FAILED) {
             ret = -ENOMEM;
+            // We don't brother reverting the mmap upon error
+            // up_release stack will do this for us
+            // But the original process mmap will be trashed
             goto static_err;
         }
 
-        this_task()->xcp.__min_brk = tmp_ptr;
-        this_task()->xcp.__brk = tmp_ptr;
+        // Stream the Segments with PT_LOAD
+        for (i = 0; i < header->e_phnum; i++) {
+            if (phdr[i].p_type != PT_LOAD || !phdr[i].p_filesz)
+                continue;
+
+            svcinfo("Loading Segment #%d/%d: 0x%llx bytes at 0x%llx\n", i, header->e_phnum, phdr[i].p_filesz, phdr[i].p_vaddr);
+
+            ret = tux_exec_read(elf_fd, phdr[i].p_vaddr, phdr[i].p_filesz, phdr[i].p_offset);
+            if(ret)
+                goto static_err;
+        }
 
         svcinfo("Preparing _ehdr\n");
 
@@ -462,65 +705,114 @@ long _tux_exec(char* path, char *argv[], char* envp[]){
          * The evil glibc and binutils not only assume
          * Linux will map the Ehdr but also the Phdr during exec */
         memcpy((void*)min_seg_addr, header, sizeof(Elf64_Ehdr));
-        memcpy((void*)(min_seg_addr + header->e_phoff), binary + header->e_phoff, sizeof(Elf64_Phdr) * header->e_phnum);
+        memcpy((void*)(min_seg_addr + header->e_phoff), phdr, sizeof(Elf64_Phdr) * header->e_phnum);
+
+        tux_file_delegate(3, elf_fd, 0, 0, 0, 0, 0);
+        elf_fd = -1;
 
-        /* record the entry point before we free header*/
-        uintptr_t entry = header->e_entry;
+        kmm_free(phdr);
+        kmm_free(head);
 
-        /* reclaim some resources */
-        kmm_free(binary);
-        kmm_free(path);
-        for(i = 0; argv[i] != NULL; i++);
-            kmm_free(argv[i]);
-        for(i = 0; envp[i] != NULL; i++)
-            kmm_free(envp[i]);
+        // The next start of the binary maps this as it is now
+        tux_exec_image_save(path, &file, start, end, entry);
+    }
+
+    /*set stack*/
+    svcinfo("Setting up stack\n");
+
+    tmp_ptr = tux_mmap(9, (void*)TUX_STACK_START, TUX_STACK_SIZE,
+            PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, 0, 0);
+
+    if(tmp_ptr == MAP_FAILED) {
+        ret = -ENOMEM;
+        goto static_err;
+    }
+
+    void* sp = exec_setupargs((uintptr_t)tmp_ptr, argc, argv, envc, envp);
+    if (sp < 0)
+    {
+        ret = -get_errno();
+        svcerr("execvs_setupargs() failed: %d\n", ret);
+        goto static_err;
+    }
+
+    /*set brk*/
+    svcinfo("Setting up heap\n");
+
+    tmp_ptr = tux_mmap(9, (void*)TUX_HEAP_START, TUX_HEAP_SIZE,
+            PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, 0, 0);
+
+    if(tmp_ptr == MAP_FAILED) {
+        ret = -ENOMEM;
+        goto static_err;
+    }
+
+    this_task()->xcp.__min_brk = tmp_ptr;
+    this_task()->xcp.__brk = tmp_ptr;
+
+    /* reclaim some resources */
+    kmm_free(path);
+    for(i = 0; argv[i] != NULL; i++);
+        kmm_free(argv[i]);
+    for(i = 0; envp[i] != NULL; i++)
+        kmm_free(envp[i]);
 
 #ifdef CONFIG_SIG_DEFAULT
-        /* Set up default signal actions */
-        nxsig_default_initialize(this_task());
+    /* Set up default signal actions */
+    nxsig_default_initialize(this_task());
 
-        struct sigaction sa;
+    struct sigaction sa;
 
-        /* Attach the signal handler.
-        *
-        * NOTE: nxsig_action will call nxsig_default(tcb, action, false).
-        * Don't be surprised.
-        */
+    /* Attach the signal handler.
+    *
+    * NOTE: nxsig_action will call nxsig_default(tcb, action, false).
+    * Don't be surprised.
+    */
 
-        memset(&sa, 0, sizeof(sa));
-        sa.sa_handler = tux_abnormal_termination;
-        sa.sa_flags   = SA_SIGINFO;
-        (void)nxsig_action(SIGKILL, &sa, NULL, true);
-        (void)sigaddset(&this_task()->group->tg_sigdefault, (int)SIGKILL);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = tux_abnormal_termination;
+    sa.sa_flags   = SA_SIGINFO;
+    (void)nxsig_action(SIGKILL, &sa, NULL, true);
+    (void)sigaddset(&this_task()->group->tg_sigdefault, (int)SIGKILL);
 
-        (void)nxsig_action(SIGINT,  &sa, NULL, true);
-        (void)sigaddset(&this_task()->group->tg_sigdefault, (int)SIGINT);
+    (void)nxsig_action(SIGINT,  &sa, NULL, true);
+    (void)sigaddset(&this_task()->group->tg_sigdefault, (int)SIGINT);
 
 #endif
 
-        /* We probelly need to close all fds */
-        svcinfo("Starting, jumping to: 0x%llx\n", entry);
+    /* We probelly need to close all fds */
+    svcinfo("Starting, jumping to: 0x%llx\n", entry);
 
-        /* enter the new program */
-        /* Somehow, glibc take rdx as the address of rtld_fini, clear it */
-        asm volatile ("mov %0, %%rsp; \t\n\
-                       mov $0, %%rdx; \t\n\
-                       jmpq %1"::"g"(sp), "g"(entry));
+    /* enter the new program */
+    /* Somehow, glibc take rdx as the address of rtld_fini, clear it */
+    asm volatile ("mov %0, %%rsp; \t\n\
+                   mov $0, %%rdx; \t\n\
+                   jmpq %1"::"g"(sp), "g"(entry));
 
 static_err:
-        // Resource is only reclaimed in static loading
-        // This prevent double free in recursive use of _tux_exec
-        kmm_free(path);
-        for(i = 0; argv[i] != NULL; i++)
-            kmm_free(argv[i]);
-        for(i = 0; envp[i] != NULL; i++)
-            kmm_free(envp[i]);
+    // Resource is only reclaimed in static loading
+    // This prevent double free in recursive use of _tux_exec
+    if(elf_fd >= 0) {
+        tux_file_delegate(3, elf_fd, 0, 0, 0, 0, 0);
+        kmm_free(phdr);
+        kmm_free(head);
     }
+    kmm_free(path);
+    for(i = 0; argv[i] != NULL; i++)
+        kmm_free(argv[i]);
+    for(i = 0; envp[i] != NULL; i++)
+        kmm_free(envp[i]);
 
-    return -EINVAL;
+    return ret;
 
-err_binary_mem:
-    kmm_free(binary);
+err_phdr:
+    kmm_free(phdr);
+err_head:
+    kmm_free(head);
+err_fd:
+    tux_file_delegate(3, elf_fd, 0, 0, 0, 0, 0);
 
     return ret;
 };
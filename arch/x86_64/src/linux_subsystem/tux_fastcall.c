@@ -0,0 +1,70 @@
+#include <nuttx/arch.h>
+#include <nuttx/sched.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+
+#include "tux.h"
+#include "tux_syscall_table.h"
+#include "up_internal.h"
+#include "sched/sched.h"
+
+/* Linux calls served straight from syscall_entry.  The handlers take the
+ * Linux arguments as they come and return Linux values, there is no
+ * linux_interface(), tux_local() or tux_errno[] in between, and only the
+ * registers a C function may clobber are saved around them.  They must not
+ * look at the register frame of the caller, there is none. */
+
+#ifdef CONFIG_TUX_FAST_SYSCALL
+
+/* A NuttX call failing with -1 and errno, as Linux would fail */
+static inline long tux_fast_ret(int ret)
+{
+  return ret < 0 ? -tux_errno[get_errno()] : ret;
+}
+
+static long tux_fast_sched_yield(void)
+{
+  return tux_fast_ret(sched_yield());
+}
+
+static long tux_fast_getpid(void)
+{
+  return this_task()->xcp.linux_pid;
+}
+
+static long tux_fast_gettid(void)
+{
+  return this_task()->xcp.linux_tid;
+}
+
+static long tux_fast_getppid(void)
+{
+  return tux_getppid(0);
+}
+
+static long tux_fast_sched_get_priority_max(int policy)
+{
+  return tux_fast_ret(sched_get_priority_max(policy));
+}
+
+static long tux_fast_sched_get_priority_min(int policy)
+{
+  return tux_fast_ret(sched_get_priority_min(policy));
+}
+
+tux_fast_t tux_fast_table[TUX_FAST_NR] = {
+  [24]  = (tux_fast_t)tux_fast_sched_yield,             // SYS_sched_yield
+  [39]  = (tux_fast_t)tux_fast_getpid,                  // SYS_getpid
+  [96]  = (tux_fast_t)tux_vdso_gettimeofday,            // SYS_gettimeofday
+  [110] = (tux_fast_t)tux_fast_getppid,                 // SYS_getppid
+  [146] = (tux_fast_t)tux_fast_sched_get_priority_max,  // SYS_sched_get_priority_max
+  [147] = (tux_fast_t)tux_fast_sched_get_priority_min,  // SYS_sched_get_priority_min
+  [186] = (tux_fast_t)tux_fast_gettid,                  // SYS_gettid
+  [201] = (tux_fast_t)tux_vdso_time,                    // SYS_time
+  [228] = (tux_fast_t)tux_vdso_clock_gettime,           // SYS_clock_gettime
+  [229] = (tux_fast_t)tux_vdso_clock_getres,            // SYS_clock_getres
+  [309] = (tux_fast_t)tux_vdso_getcpu,                  // SYS_getcpu
+};
+
+#endif
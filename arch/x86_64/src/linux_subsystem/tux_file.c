@@ -0,0 +1,910 @@
+#include <nuttx/arch.h>
+#include <nuttx/kmalloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "tux.h"
+#include "tux_syscall_table.h"
+#include "up_internal.h"
+#include "sched/sched.h"
+
+#ifndef CONFIG_TUX_LOCAL_MOUNTS
+#  define CONFIG_TUX_LOCAL_MOUNTS "/tmp"
+#endif
+
+#ifndef CONFIG_TUX_LOCAL_DIRS
+#  define CONFIG_TUX_LOCAL_DIRS 16
+#endif
+
+#ifndef CONFIG_TUX_LOCAL_FILES
+#  define CONFIG_TUX_LOCAL_FILES 64
+#endif
+
+/* Directory streams opened for getdents64 are handed out as fds above the
+ * range of the NuttX file descriptors */
+#define TUX_DIR_FD_BASE CONFIG_NFILE_DESCRIPTORS
+
+#define TUX_AT_FDCWD -100
+
+#define TUX_R_OK 4
+#define TUX_W_OK 2
+#define TUX_X_OK 1
+
+#define TUX_S_IFSOCK 0140000
+#define TUX_S_IFLNK  0120000
+#define TUX_S_IFREG  0100000
+#define TUX_S_IFBLK  0060000
+#define TUX_S_IFDIR  0040000
+#define TUX_S_IFCHR  0020000
+#define TUX_S_IFIFO  0010000
+
+#define TUX_DT_UNKNOWN 0
+#define TUX_DT_CHR     2
+#define TUX_DT_DIR     4
+#define TUX_DT_BLK     6
+#define TUX_DT_REG     8
+#define TUX_DT_LNK     10
+
+#define TUX_IOV_MAX    1024
+#define TUX_COPY_CHUNK 4096
+
+#define TUX_RWF_HIPRI  0x1
+#define TUX_RWF_DSYNC  0x2
+#define TUX_RWF_SYNC   0x4
+
+#define TUX_MSG_WAITFORONE 0x10000
+
+struct tux_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+struct tux_dir {
+    DIR *dir;
+    void *owner;       /* The task group it belongs to */
+    char *path;
+    uint64_t ino;
+};
+
+static struct tux_dir tux_dirs[CONFIG_TUX_LOCAL_DIRS];
+
+/* The inode number of a local NuttX fd, derived from the path it was
+ * opened with, NuttX cannot tell the path of an fd afterwards */
+struct tux_file {
+    void *owner;       /* The task group it belongs to, NULL if free */
+    int fd;
+    uint64_t ino;
+};
+
+static struct tux_file tux_files[CONFIG_TUX_LOCAL_FILES];
+
+/* NuttX calls report through errno, hand Linux its own errno instead */
+static long tux_file_ret(long ret)
+{
+    int err;
+
+    if(ret >= 0)
+        return ret;
+
+    err = -get_errno();
+    tux_errno_sanitaizer(&err);
+
+    return err;
+}
+
+static long tux_file_err(int err)
+{
+    err = -err;
+    tux_errno_sanitaizer(&err);
+    return err;
+}
+
+bool tux_is_local_path(const char *path)
+{
+    const char *m = CONFIG_TUX_LOCAL_MOUNTS;
+    const char *e;
+    size_t len;
+
+    if(!path || path[0] != '/')
+        return false;
+
+    while(*m) {
+        e = strchr(m, ':');
+        len = e ? e - m : strlen(m);
+
+        if(len && !strncmp(path, m, len) && (path[len] == '/' || path[len] == '\0'))
+            return true;
+
+        if(!e)
+            break;
+        m = e + 1;
+    }
+
+    return false;
+}
+
+uint64_t tux_open_flags(uint64_t flags)
+{
+    // Nuttx has different Bit pattern in flags, we have to decode them
+    uint64_t new_flags = 0;
+
+    if(flags & TUX_O_WRONLY)      new_flags |= O_WRONLY;
+    else if(flags & TUX_O_RDWR)   new_flags |= O_RDWR;
+    else new_flags |= O_RDONLY;  // TUX_O_RDONLY == 0
+
+    if(flags & TUX_O_CREAT)       new_flags |= O_CREAT;
+    if(flags & TUX_O_EXCL)        new_flags |= O_EXCL;
+    if(flags & TUX_O_NOCTTY)      new_flags |= O_NOCTTY;
+    if(flags & TUX_O_TRUNC)       new_flags |= O_TRUNC;
+    if(flags & TUX_O_APPEND)      new_flags |= O_APPEND;
+    if(flags & TUX_O_NONBLOCK)    new_flags |= O_NONBLOCK;
+    if(flags & TUX_O_DSYNC)       new_flags |= O_DSYNC;
+    if((flags & TUX_O_SYNC) == TUX_O_SYNC)        new_flags |= O_SYNC;
+    if(flags & TUX_O_DIRECT)      new_flags |= O_DIRECT;
+
+    return new_flags;
+}
+
+static void tux_stat_convert(struct stat *st, struct tux_stat *lst, uint64_t ino)
+{
+    uint32_t mode = st->st_mode & 0777;
+
+    if(S_ISLNK(st->st_mode))       mode |= TUX_S_IFLNK;
+    else if(S_ISDIR(st->st_mode))  mode |= TUX_S_IFDIR;
+    else if(S_ISREG(st->st_mode))  mode |= TUX_S_IFREG;
+    else if(S_ISCHR(st->st_mode))  mode |= TUX_S_IFCHR;
+    else if(S_ISBLK(st->st_mode))  mode |= TUX_S_IFBLK;
+    else if(S_ISSOCK(st->st_mode)) mode |= TUX_S_IFSOCK;
+    else                           mode |= TUX_S_IFIFO;
+
+    memset(lst, 0, sizeof(*lst));
+
+    lst->st_dev = 0x4e58; // Anything not colliding with a Linux device
+    lst->st_ino = ino;
+    lst->st_nlink = 1;
+    lst->st_mode = mode;
+    lst->st_size = st->st_size;
+    lst->st_blksize = st->st_blksize;
+    lst->st_blocks = st->st_blocks;
+    lst->st_atime_sec = st->st_atime;
+    lst->st_mtime_sec = st->st_mtime;
+    lst->st_ctime_sec = st->st_ctime;
+}
+
+/* A stable non-zero inode number, some programs compare them */
+static uint64_t tux_path_ino(const char *path)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while(*path)
+        h = (h ^ *path++) * 1099511628211ULL;
+
+    return h ? h : 1;
+}
+
+static long tux_local_stat(const char *path, struct tux_stat *buf)
+{
+    struct stat st;
+    int ret;
+
+    ret = stat(path, &st);
+    if(ret < 0)
+        return tux_file_ret(ret);
+
+    tux_stat_convert(&st, buf, tux_path_ino(path));
+
+    return 0;
+}
+
+/****************************************************************************
+ * Inode records
+ ****************************************************************************/
+
+static uint64_t tux_file_ino(void *owner, int fd)
+{
+    irqstate_t flags;
+    uint64_t ino = 0;
+    int i;
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < CONFIG_TUX_LOCAL_FILES; i++) {
+        if(tux_files[i].owner == owner && tux_files[i].fd == fd) {
+            ino = tux_files[i].ino;
+            break;
+        }
+    }
+
+    leave_critical_section(flags);
+
+    return ino;
+}
+
+/* Record ino for fd of owner, an ino of 0 drops the record */
+static void tux_file_set(void *owner, int fd, uint64_t ino)
+{
+    struct tux_file *slot = NULL;
+    irqstate_t flags;
+    int i;
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < CONFIG_TUX_LOCAL_FILES; i++) {
+        if(tux_files[i].owner == owner && tux_files[i].fd == fd) {
+            slot = &tux_files[i];
+            break;
+        }
+        if(!tux_files[i].owner && !slot)
+            slot = &tux_files[i];
+    }
+
+    // Without a slot fstat() falls back to a per fd number
+    if(slot) {
+        slot->owner = ino ? owner : NULL;
+        slot->fd = fd;
+        slot->ino = ino;
+    }
+
+    leave_critical_section(flags);
+}
+
+/****************************************************************************
+ * Directory streams
+ ****************************************************************************/
+
+static struct tux_dir *tux_dir_get(int fd)
+{
+    struct tux_dir *d;
+
+    fd -= TUX_DIR_FD_BASE;
+    if(fd < 0 || fd >= CONFIG_TUX_LOCAL_DIRS)
+        return NULL;
+
+    d = &tux_dirs[fd];
+    if(!d->dir || d->owner != this_task()->group)
+        return NULL;
+
+    return d;
+}
+
+static long tux_dir_open(const char *path)
+{
+    irqstate_t flags;
+    char *kpath;
+    DIR *dir;
+    int i;
+
+    dir = opendir(path);
+    if(!dir)
+        return tux_file_ret(-1);
+
+    // Freed by whichever task closes the fd, keep it off the user heap
+    kpath = kmm_malloc(strlen(path) + 1);
+    if(!kpath) {
+        closedir(dir);
+        return tux_file_err(ENOMEM);
+    }
+
+    strcpy(kpath, path);
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < CONFIG_TUX_LOCAL_DIRS; i++) {
+        if(!tux_dirs[i].dir) {
+            tux_dirs[i].dir = dir;
+            break;
+        }
+    }
+
+    leave_critical_section(flags);
+
+    if(i == CONFIG_TUX_LOCAL_DIRS) {
+        kmm_free(kpath);
+        closedir(dir);
+        return tux_file_err(EMFILE);
+    }
+
+    tux_dirs[i].owner = this_task()->group;
+    tux_dirs[i].path = kpath;
+    tux_dirs[i].ino = tux_path_ino(path);
+
+    return TUX_DIR_FD_BASE + i;
+}
+
+static long tux_dir_close(struct tux_dir *d)
+{
+    closedir(d->dir);
+    kmm_free(d->path);
+    d->path = NULL;
+    d->owner = NULL;
+    d->dir = NULL;
+
+    return 0;
+}
+
+static long tux_getdents64(struct tux_dir *d, uint8_t *buf, size_t count)
+{
+    struct tux_dirent64 *lde;
+    struct dirent *de;
+    size_t pos = 0;
+    size_t namelen;
+    size_t reclen;
+    off_t loc;
+
+    while(1) {
+        loc = telldir(d->dir);
+
+        de = readdir(d->dir);
+        if(!de)
+            break;
+
+        namelen = strlen(de->d_name);
+        reclen = (offsetof(struct tux_dirent64, d_name) + namelen + 1 + 7) & ~7;
+
+        if(pos + reclen > count) {
+            // Does not fit, hand it out next time
+            seekdir(d->dir, loc);
+            if(!pos)
+                return tux_file_err(EINVAL);
+            break;
+        }
+
+        lde = (struct tux_dirent64 *)(buf + pos);
+        lde->d_ino = d->ino + loc + 1;
+        lde->d_off = telldir(d->dir);
+        lde->d_reclen = reclen;
+
+        if(DIRENT_ISDIRECTORY(de->d_type))  lde->d_type = TUX_DT_DIR;
+        else if(DIRENT_ISFILE(de->d_type))  lde->d_type = TUX_DT_REG;
+        else if(DIRENT_ISLINK(de->d_type))  lde->d_type = TUX_DT_LNK;
+        else if(DIRENT_ISCHR(de->d_type))   lde->d_type = TUX_DT_CHR;
+        else if(DIRENT_ISBLK(de->d_type))   lde->d_type = TUX_DT_BLK;
+        else                                lde->d_type = TUX_DT_UNKNOWN;
+
+        memcpy(lde->d_name, de->d_name, namelen + 1);
+
+        pos += reclen;
+    }
+
+    return pos;
+}
+
+static long tux_dir_local(unsigned long nbr, struct tux_dir *d, uintptr_t parm2,
+                          uintptr_t parm3)
+{
+    switch(nbr) {
+        case 3:   // close
+            return tux_dir_close(d);
+
+        case 5:   // fstat
+            return tux_local_stat(d->path, (struct tux_stat *)parm2);
+
+        case 8:   // lseek, only rewinding is meaningful
+            if(parm2 != 0 || parm3 != SEEK_SET)
+                return tux_file_err(EINVAL);
+            rewinddir(d->dir);
+            return 0;
+
+        case 217: // getdents64
+            return tux_getdents64(d, (uint8_t *)parm2, parm3);
+
+        case 0:   // read
+        case 1:   // write
+        case 17:  // pread64
+        case 18:  // pwrite64
+        case 19:  // readv
+        case 20:  // writev
+            return tux_file_err(EISDIR);
+
+        case 74:  // fsync
+        case 75:  // fdatasync
+            return 0;
+
+        default:
+            return tux_file_err(EBADF);
+    }
+}
+
+/****************************************************************************
+ * Vectored and batched I/O
+ ****************************************************************************/
+
+static size_t tux_iov_len(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int i;
+
+    for(i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    return len;
+}
+
+/* NuttX has no preadv, walk the vector with pread */
+static long tux_preadv(int fd, const struct iovec *iov, int iovcnt, off_t off, bool wr)
+{
+    ssize_t ret;
+    size_t total = 0;
+    int i;
+
+    if(iovcnt < 0 || iovcnt > TUX_IOV_MAX)
+        return tux_file_err(EINVAL);
+
+    for(i = 0; i < iovcnt; i++) {
+        if(!iov[i].iov_len)
+            continue;
+
+        if(wr)
+            ret = pwrite(fd, iov[i].iov_base, iov[i].iov_len, off + total);
+        else
+            ret = pread(fd, iov[i].iov_base, iov[i].iov_len, off + total);
+
+        if(ret < 0)
+            return total ? total : tux_file_ret(ret);
+
+        total += ret;
+        if(ret < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+static long tux_preadv2(int fd, const struct iovec *iov, int iovcnt, off_t off,
+                        int flags, bool wr)
+{
+    long ret;
+
+    if(flags & ~(TUX_RWF_HIPRI | TUX_RWF_DSYNC | TUX_RWF_SYNC))
+        return tux_file_err(EOPNOTSUPP);
+
+    // An offset of -1 means the current file position
+    if(off == -1)
+        ret = tux_file_ret(wr ? writev(fd, iov, iovcnt) : readv(fd, iov, iovcnt));
+    else
+        ret = tux_preadv(fd, iov, iovcnt, off, wr);
+
+    if(wr && ret > 0 && (flags & (TUX_RWF_DSYNC | TUX_RWF_SYNC)))
+        fsync(fd);
+
+    return ret;
+}
+
+/* NuttX sockets only know sendto/recvfrom, datagrams spread over several
+ * iovecs are gathered into a bounce buffer.  struct msghdr agrees with Linux. */
+static long tux_sendmsg(int fd, struct msghdr *msg, int flags)
+{
+    size_t len;
+    uint8_t *buf;
+    uint8_t *p;
+    long ret;
+    int i;
+
+    if(msg->msg_iovlen == 1)
+        return tux_file_ret(sendto(fd, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len,
+                                   flags, msg->msg_name, msg->msg_namelen));
+
+    len = tux_iov_len(msg->msg_iov, msg->msg_iovlen);
+    buf = kmm_malloc(len ? len : 1);
+    if(!buf)
+        return tux_file_err(ENOMEM);
+
+    for(i = 0, p = buf; i < msg->msg_iovlen; i++) {
+        memcpy(p, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        p += msg->msg_iov[i].iov_len;
+    }
+
+    ret = tux_file_ret(sendto(fd, buf, len, flags, msg->msg_name, msg->msg_namelen));
+
+    kmm_free(buf);
+
+    return ret;
+}
+
+static long tux_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    socklen_t namelen = msg->msg_namelen;
+    size_t len;
+    size_t seg;
+    uint8_t *buf;
+    uint8_t *p;
+    long ret;
+    int i;
+
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+
+    if(msg->msg_iovlen == 1) {
+        ret = tux_file_ret(recvfrom(fd, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len,
+                                    flags, msg->msg_name, msg->msg_name ? &namelen : NULL));
+        if(ret >= 0)
+            msg->msg_namelen = msg->msg_name ? namelen : 0;
+        return ret;
+    }
+
+    len = tux_iov_len(msg->msg_iov, msg->msg_iovlen);
+    buf = kmm_malloc(len ? len : 1);
+    if(!buf)
+        return tux_file_err(ENOMEM);
+
+    ret = tux_file_ret(recvfrom(fd, buf, len, flags, msg->msg_name,
+                                msg->msg_name ? &namelen : NULL));
+
+    if(ret >= 0) {
+        msg->msg_namelen = msg->msg_name ? namelen : 0;
+
+        for(i = 0, p = buf, len = ret; i < msg->msg_iovlen && len; i++) {
+            seg = len < msg->msg_iov[i].iov_len ? len : msg->msg_iov[i].iov_len;
+            memcpy(msg->msg_iov[i].iov_base, p, seg);
+            p += seg;
+            len -= seg;
+        }
+    }
+
+    kmm_free(buf);
+
+    return ret;
+}
+
+/* The count of messages done is returned as soon as one of them fails */
+static long tux_sendmmsg(int fd, struct tux_mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    unsigned int i;
+    long ret;
+
+    if(vlen > TUX_IOV_MAX)
+        vlen = TUX_IOV_MAX;
+
+    for(i = 0; i < vlen; i++) {
+        ret = tux_sendmsg(fd, &msgvec[i].msg_hdr, flags);
+        if(ret < 0)
+            return i ? i : ret;
+
+        msgvec[i].msg_len = ret;
+    }
+
+    return i;
+}
+
+/* The timeout is only checked between datagrams, as Linux does */
+static long tux_recvmmsg(int fd, struct tux_mmsghdr *msgvec, unsigned int vlen, int flags,
+                         struct timespec *timeout)
+{
+    struct timespec deadline;
+    struct timespec now;
+    unsigned int i;
+    long ret;
+
+    if(vlen > TUX_IOV_MAX)
+        vlen = TUX_IOV_MAX;
+
+    if(timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    for(i = 0; i < vlen; i++) {
+        ret = tux_recvmsg(fd, &msgvec[i].msg_hdr, flags & ~TUX_MSG_WAITFORONE);
+        if(ret < 0)
+            return i ? i : ret;
+
+        msgvec[i].msg_len = ret;
+
+        if(flags & TUX_MSG_WAITFORONE)
+            flags |= MSG_DONTWAIT;
+
+        if(timeout) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if(now.tv_sec > deadline.tv_sec ||
+               (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+                return i + 1;
+        }
+    }
+
+    return i;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/* Open a file of a local mount, never falls back to Linux */
+long tux_local_open(const char *path, uint64_t flags, uint64_t mode)
+{
+    long ret;
+
+    if(flags & TUX_O_DIRECTORY) {
+        ret = tux_dir_open(path);
+    } else {
+        ret = tux_file_ret(open(path, tux_open_flags(flags), mode));
+
+        // Linux allows opening directories read only
+        if(ret == tux_file_err(EISDIR) && !(flags & TUX_O_ACCMODE))
+            ret = tux_dir_open(path);
+        else if(ret >= 0)
+            tux_file_set(this_task()->group, ret, tux_path_ino(path));
+    }
+
+    if(ret < 0)
+        return ret;
+
+    return ret + CONFIG_TUX_FD_RESERVE;
+}
+
+/* Serve a file syscall on a local NuttX fd, with Linux ABI translation */
+long tux_file_local(unsigned long nbr, int fd, uintptr_t parm2,
+                    uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
+                    uintptr_t parm6)
+{
+    struct tux_dir *d;
+    struct stat st;
+    uint64_t ino;
+    long ret;
+
+    d = tux_dir_get(fd);
+    if(d)
+        return tux_dir_local(nbr, d, parm2, parm3);
+
+    switch(nbr) {
+        case 3:   // close
+            tux_file_set(this_task()->group, fd, 0);
+            return tux_file_ret(close(fd));
+
+        case 5:   // fstat, the same inode number stat() gives
+            ret = fstat(fd, &st);
+            if(ret < 0)
+                return tux_file_ret(ret);
+            ino = tux_file_ino(this_task()->group, fd);
+            if(!ino)
+                ino = ((uint64_t)this_task()->pid << 32) | fd;
+            tux_stat_convert(&st, (struct tux_stat *)parm2, ino);
+            return 0;
+
+        case 32:  // dup, stays a local fd
+            ret = tux_file_ret(dup(fd));
+            if(ret < 0)
+                return ret;
+            tux_file_dup(fd, ret);
+            return ret + CONFIG_TUX_FD_RESERVE;
+
+        case 8:   // lseek, the whence values agree
+            return tux_file_ret(lseek(fd, parm2, parm3));
+
+        case 17:  // pread64
+            return tux_file_ret(pread(fd, (void *)parm2, parm3, parm4));
+
+        case 18:  // pwrite64
+            return tux_file_ret(pwrite(fd, (void *)parm2, parm3, parm4));
+
+        case 19:  // readv, struct iovec agrees
+            return tux_file_ret(readv(fd, (struct iovec *)parm2, parm3));
+
+        case 20:  // writev
+            return tux_file_ret(writev(fd, (struct iovec *)parm2, parm3));
+
+        case 74:  // fsync
+        case 75:  // fdatasync
+            return tux_file_ret(fsync(fd));
+
+        case 217: // getdents64
+            return tux_file_err(ENOTDIR);
+
+        case 44:  // sendto, struct sockaddr agrees
+            return tux_file_ret(sendto(fd, (void *)parm2, parm3, parm4,
+                                       (struct sockaddr *)parm5, parm6));
+
+        case 45:  // recvfrom
+            return tux_file_ret(recvfrom(fd, (void *)parm2, parm3, parm4,
+                                         (struct sockaddr *)parm5, (socklen_t *)parm6));
+
+        case 46:  // sendmsg
+            return tux_sendmsg(fd, (struct msghdr *)parm2, parm3);
+
+        case 47:  // recvmsg
+            return tux_recvmsg(fd, (struct msghdr *)parm2, parm3);
+
+        case 295: // preadv
+            return tux_preadv(fd, (struct iovec *)parm2, parm3, parm4, false);
+
+        case 296: // pwritev
+            return tux_preadv(fd, (struct iovec *)parm2, parm3, parm4, true);
+
+        case 327: // preadv2
+            return tux_preadv2(fd, (struct iovec *)parm2, parm3, parm4, parm6, false);
+
+        case 328: // pwritev2
+            return tux_preadv2(fd, (struct iovec *)parm2, parm3, parm4, parm6, true);
+
+        case 299: // recvmmsg
+            return tux_recvmmsg(fd, (struct tux_mmsghdr *)parm2, parm3, parm4,
+                                (struct timespec *)parm5);
+
+        case 307: // sendmmsg
+            return tux_sendmmsg(fd, (struct tux_mmsghdr *)parm2, parm3, parm4);
+
+        default:
+            if(linux_syscall_number_table[nbr] == (uint64_t)-1)
+                return tux_file_err(ENOSYS);
+            return tux_local(nbr, fd, parm2, parm3, parm4, parm5, parm6);
+    }
+}
+
+/* newfd of this process now refers to what the local fd oldfd does */
+void tux_file_dup(int oldfd, int newfd)
+{
+    void *owner = this_task()->group;
+
+    tux_file_set(owner, newfd, tux_file_ino(owner, oldfd));
+}
+
+/* The child got copies of all our NuttX fds, at the same numbers */
+void tux_file_fork(struct tcb_s *parent, struct tcb_s *child)
+{
+    int i;
+
+    for(i = 0; i < CONFIG_TUX_LOCAL_FILES; i++)
+        if(tux_files[i].owner == parent->group)
+            tux_file_set(child->group, tux_files[i].fd, tux_files[i].ino);
+}
+
+/* Forget the local directory streams and the inode records of the fds from
+ * lowfd on of the process of tcb, when it exits or execs.  The NuttX fds
+ * themselves are closed by the caller. */
+void tux_file_release(struct tcb_s *tcb, int lowfd)
+{
+    struct tux_dir *d;
+    int i;
+
+    for(i = 0; i < CONFIG_TUX_LOCAL_DIRS; i++) {
+        d = &tux_dirs[i];
+        if(d->dir && d->owner == tcb->group)
+            tux_dir_close(d);
+    }
+
+    for(i = 0; i < CONFIG_TUX_LOCAL_FILES; i++)
+        if(tux_files[i].owner == tcb->group && tux_files[i].fd >= lowfd)
+            tux_file_set(tcb->group, tux_files[i].fd, 0);
+}
+
+/* Path based syscalls, served locally for the local mounts */
+long tux_path_delegate(unsigned long nbr, uintptr_t parm1, uintptr_t parm2,
+                       uintptr_t parm3, uintptr_t parm4, uintptr_t parm5,
+                       uintptr_t parm6)
+{
+    const char *path = (const char *)parm1;
+    struct stat st;
+    int mode;
+    int ret;
+
+    // The *at variants only when they do not depend on a directory fd
+    if(nbr == 262 || nbr == 269) {
+        path = (const char *)parm2;
+        if((int)parm1 != TUX_AT_FDCWD && path[0] != '/')
+            path = NULL;
+    }
+
+    if(!tux_is_local_path(path))
+        return tux_delegate(nbr, parm1, parm2, parm3, parm4, parm5, parm6);
+
+    switch(nbr) {
+        case 4:   // stat
+        case 6:   // lstat
+            return tux_local_stat(path, (struct tux_stat *)parm2);
+
+        case 262: // newfstatat
+            return tux_local_stat(path, (struct tux_stat *)parm3);
+
+        case 21:  // access
+        case 269: // faccessat
+            ret = stat(path, &st);
+            if(ret < 0)
+                return tux_file_ret(ret);
+
+            // Anyone may do what any of the permission bits grant
+            mode = nbr == 21 ? parm2 : parm3;
+            if(((mode & TUX_R_OK) && !(st.st_mode & 0444)) ||
+               ((mode & TUX_W_OK) && !(st.st_mode & 0222)) ||
+               ((mode & TUX_X_OK) && !(st.st_mode & 0111)))
+                return tux_file_err(EACCES);
+            return 0;
+
+        case 82:  // rename
+            if(!tux_is_local_path((const char *)parm2))
+                return tux_file_err(EXDEV);
+            return tux_file_ret(rename(path, (const char *)parm2));
+
+        case 83:  // mkdir
+            return tux_file_ret(mkdir(path, parm2));
+
+        case 84:  // rmdir
+            return tux_file_ret(rmdir(path));
+
+        case 87:  // unlink
+            return tux_file_ret(unlink(path));
+
+        default:
+            return tux_file_err(ENOSYS);
+    }
+}
+
+/* Files on both sides of Linux are copied through a kernel heap buffer,
+ * which Linux reaches by physical address.  If both fds are delegated the
+ * whole copy is done by Linux in a single call. */
+long tux_copy_file_range(unsigned long nbr, int fd_in, int64_t *off_in, int fd_out,
+                         int64_t *off_out, size_t len, unsigned int flags)
+{
+    struct tcb_s *rtcb = this_task();
+    bool in_remote;
+    bool out_remote;
+    uint8_t *buf;
+    size_t total = 0;
+    size_t chunk;
+    long rret;
+    long wret;
+
+    if(flags)
+        return tux_file_err(EINVAL);
+
+    in_remote = fd_in >= 0 && fd_in < CONFIG_TUX_FD_RESERVE &&
+                (fd_in > 2 || rtcb->xcp.fd[fd_in] == fd_in);
+    out_remote = fd_out >= 0 && fd_out < CONFIG_TUX_FD_RESERVE &&
+                 (fd_out > 2 || rtcb->xcp.fd[fd_out] == fd_out);
+
+    if(in_remote && out_remote)
+        return tux_delegate(nbr, fd_in, (uintptr_t)off_in, fd_out, (uintptr_t)off_out, len, flags);
+
+    buf = kmm_malloc(TUX_COPY_CHUNK);
+    if(!buf)
+        return tux_file_err(ENOMEM);
+
+    while(total < len) {
+        chunk = len - total < TUX_COPY_CHUNK ? len - total : TUX_COPY_CHUNK;
+
+        if(off_in)
+            rret = tux_file_delegate(17, fd_in, (uintptr_t)buf, chunk, *off_in, 0, 0);
+        else
+            rret = tux_file_delegate(0, fd_in, (uintptr_t)buf, chunk, 0, 0, 0);
+
+        if(rret <= 0) {
+            if(!total)
+                total = rret;
+            break;
+        }
+
+        if(off_out)
+            wret = tux_file_delegate(18, fd_out, (uintptr_t)buf, rret, *off_out, 0, 0);
+        else
+            wret = tux_file_delegate(1, fd_out, (uintptr_t)buf, rret, 0, 0, 0);
+
+        if(wret <= 0) {
+            // The input has been consumed, but nothing written
+            if(!total)
+                total = wret;
+            break;
+        }
+
+        if(off_in)
+            *off_in += wret;
+        if(off_out)
+            *off_out += wret;
+        total += wret;
+
+        if(wret < rret)
+            break;
+    }
+
+    kmm_free(buf);
+
+    return total;
+}
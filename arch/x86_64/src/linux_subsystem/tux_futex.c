@@ -1,325 +1,685 @@
 #include <nuttx/arch.h>
+#include <nuttx/spinlock.h>
+#include <nuttx/semaphore.h>
 
 #include "tux.h"
 #include "up_internal.h"
 #include "sched/sched.h"
 
-#define FUTEX_HT_SIZE 256
+#ifndef CONFIG_TUX_FUTEX_BUCKETS
+#  define CONFIG_TUX_FUTEX_BUCKETS 256
+#endif
 
-struct futex_q{
-  sem_t sem;
+/* Each waiter sleeps on its own semaphore, queued in the bucket of the
+ * physical address it waits on, highest priority first */
+struct futex_waiter{
+  struct futex_waiter *flink;
   uint64_t key;
   uint32_t bitmask;
+  uint8_t prio;
+  bool pi;
+  volatile bool queued;
+  pid_t owner;                 /* PI: who holds the futex */
+  struct tcb_s *tcb;
+  sem_t sem;
 };
 
-struct futex_q futex_hash_table[FUTEX_HT_SIZE];
+struct futex_bucket{
+  struct futex_waiter *head;
+#ifdef CONFIG_SPINLOCK
+  spinlock_t lock;
+#endif
+};
 
-long tux_futex(unsigned long nbr, int32_t* uaddr, int opcode, uint32_t val, uintptr_t val2, int32_t* uaddr2, uint32_t val3){
-  struct tcb_s *tcb = this_task();
-  int32_t* paddr = virt_to_phys(uaddr);
-  int32_t* paddr2 = virt_to_phys(uaddr2);
-  uint32_t s_head = (uint64_t)paddr % FUTEX_HT_SIZE;
-  uint32_t s_head2 = (uint64_t)paddr2 % FUTEX_HT_SIZE;
-  uint32_t hv = s_head;
-  uint32_t hv2 = s_head2;
-  const struct timespec *timeout = (const struct timespec *)val2;
+static struct futex_bucket futex_hash_table[CONFIG_TUX_FUTEX_BUCKETS];
+
+static struct futex_bucket *futex_bucket(uint64_t key){
+  // Futex words are 4 bytes aligned, the low bits are useless
+  uint64_t h = (key >> 2) * 0x9e3779b97f4a7c15ull;
+
+  return &futex_hash_table[(h >> 32) % CONFIG_TUX_FUTEX_BUCKETS];
+}
+
+static irqstate_t futex_lock(struct futex_bucket *b){
+  irqstate_t flags = up_irq_save();
+#ifdef CONFIG_SPINLOCK
+  spin_lock(&b->lock);
+#endif
+  return flags;
+}
+
+static void futex_unlock(struct futex_bucket *b, irqstate_t flags){
+#ifdef CONFIG_SPINLOCK
+  spin_unlock(&b->lock);
+#endif
+  up_irq_restore(flags);
+}
+
+/* Always take two buckets in the same order */
+static irqstate_t futex_lock2(struct futex_bucket *b1, struct futex_bucket *b2){
+  irqstate_t flags;
+
+  if(b1 > b2){
+    struct futex_bucket *t = b1;
+    b1 = b2;
+    b2 = t;
+  }
+
+  flags = futex_lock(b1);
+#ifdef CONFIG_SPINLOCK
+  if(b2 != b1) spin_lock(&b2->lock);
+#endif
+  return flags;
+}
+
+static void futex_unlock2(struct futex_bucket *b1, struct futex_bucket *b2, irqstate_t flags){
+#ifdef CONFIG_SPINLOCK
+  if(b2 != b1) spin_unlock(&b2->lock);
+#endif
+  futex_unlock(b1, flags);
+}
+
+/* FIFO among waiters of the same priority */
+static void futex_enqueue(struct futex_bucket *b, struct futex_waiter *w){
+  struct futex_waiter **pp = &b->head;
+
+  while(*pp && (*pp)->prio >= w->prio)
+    pp = &(*pp)->flink;
+
+  w->flink = *pp;
+  *pp = w;
+  w->queued = true;
+}
+
+static void futex_dequeue(struct futex_bucket *b, struct futex_waiter *w){
+  struct futex_waiter **pp = &b->head;
+
+  while(*pp && *pp != w)
+    pp = &(*pp)->flink;
+
+  if(*pp) *pp = w->flink;
+  w->flink = NULL;
+  w->queued = false;
+}
+
+/* Unlink up to nr waiters of key into a private list, to be posted once
+ * the bucket is unlocked */
+static int futex_collect(struct futex_bucket *b, uint64_t key, uint32_t bitmask,
+                         int nr, struct futex_waiter **list){
+  struct futex_waiter **pp = &b->head;
+  struct futex_waiter *w;
+  int ret = 0;
+
+  while(*pp && ret < nr){
+    w = *pp;
+    if(w->key == key && !w->pi && (w->bitmask & bitmask)){
+      *pp = w->flink;
+      w->queued = false;
+      w->flink = *list;
+      *list = w;
+      ret++;
+    }else{
+      pp = &w->flink;
+    }
+  }
+
+  return ret;
+}
+
+static void futex_post(struct futex_waiter *list){
+  struct futex_waiter *next;
+
+  // The waiter may be gone as soon as it is posted
+  for(; list; list = next){
+    next = list->flink;
+    nxsem_post(&list->sem);
+  }
+}
+
+/* Move up to nr waiters of key to key2 */
+static int futex_move(struct futex_bucket *b, uint64_t key, struct futex_bucket *b2,
+                      uint64_t key2, int nr){
+  struct futex_waiter **pp = &b->head;
+  struct futex_waiter *w;
+  int ret = 0;
+
+  while(*pp && ret < nr){
+    w = *pp;
+    if(w->key == key && !w->pi){
+      *pp = w->flink;
+      w->key = key2;
+      futex_enqueue(b2, w);
+      ret++;
+    }else{
+      pp = &w->flink;
+    }
+  }
+
+  return ret;
+}
+
+/* NuttX semaphores time out on CLOCK_REALTIME */
+static void futex_deadline(const struct timespec *timeout, bool absolute,
+                           clockid_t clock, struct timespec *deadline){
   struct timespec now;
+  int64_t ns;
+
+  if(absolute){
+    clock_gettime(clock, &now);
+    ns = (timeout->tv_sec - now.tv_sec) * NSEC_PER_SEC + timeout->tv_nsec - now.tv_nsec;
+    if(ns < 0) ns = 0;
+  }else{
+    ns = timeout->tv_sec * NSEC_PER_SEC + timeout->tv_nsec;
+  }
+
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += ns / NSEC_PER_SEC;
+  deadline->tv_nsec += ns % NSEC_PER_SEC;
+  if(deadline->tv_nsec >= NSEC_PER_SEC){
+    deadline->tv_nsec -= NSEC_PER_SEC;
+    deadline->tv_sec++;
+  }
+}
+
+/* Sleep until posted, the waiter has to be queued already. A waiter
+ * unlinked by a waker is always posted, so we stay until that happens. */
+static int futex_sleep(struct futex_waiter *w, const struct timespec *deadline){
+  struct futex_bucket *b;
+  irqstate_t flags;
+  uint64_t key;
   int ret;
+
+  if(deadline)
+    ret = nxsem_timedwait(&w->sem, deadline);
+  else
+    ret = nxsem_wait(&w->sem);
+
+  if(ret < 0){
+    // Requeue may have moved us in the meantime
+    do{
+      key = w->key;
+      b = futex_bucket(key);
+      flags = futex_lock(b);
+      if(key == w->key) break;
+      futex_unlock(b, flags);
+    }while(1);
+
+    if(w->queued){
+      futex_dequeue(b, w);
+    }else{
+      ret = 0;
+    }
+
+    futex_unlock(b, flags);
+
+    if(!ret) nxsem_wait_uninterruptible(&w->sem);
+  }
+
+  nxsem_destroy(&w->sem);
+
+  return ret;
+}
+
+static void futex_init_waiter(struct futex_waiter *w, uint64_t key, uint32_t bitmask, bool pi){
+  struct tcb_s *tcb = this_task();
+
+  w->flink = NULL;
+  w->key = key;
+  w->bitmask = bitmask;
+  w->prio = tcb->sched_priority;
+  w->pi = pi;
+  w->queued = false;
+  w->owner = -1;
+  w->tcb = tcb;
+  nxsem_init(&w->sem, 0, 0);
+  nxsem_setprotocol(&w->sem, SEM_PRIO_NONE);
+}
+
+static int futex_wait(uint64_t key, int32_t *uaddr, uint32_t val, uint32_t bitmask,
+                      const struct timespec *deadline){
+  struct futex_bucket *b = futex_bucket(key);
+  struct futex_waiter w;
   irqstate_t flags;
 
-  if(paddr == (void*)-1) return -1;
+  if(!bitmask) return -EINVAL;
 
-  // XXX: At the mean time only per process futex
-  /*if(!(opcode & FUTEX_PRIVATE_FLAG)) return -1;*/
+  futex_init_waiter(&w, key, bitmask, false);
 
-  // Discard the private flag
-  opcode &= ~FUTEX_PRIVATE_FLAG;
+  flags = futex_lock(b);
 
-  switch(opcode){
-    case FUTEX_WAIT:
-      svcinfo("T: %d LT: %d FUTEX_WAIT at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, uaddr, paddr);
+  if(*(volatile int32_t *)uaddr != val){
+    futex_unlock(b, flags);
+    nxsem_destroy(&w.sem);
+    return -EAGAIN;
+  }
 
-      flags = enter_critical_section();
+  futex_enqueue(b, &w);
 
-      while((futex_hash_table[hv].key != 0) && (futex_hash_table[hv].key != ((uint64_t)paddr))){
-          hv++;
-          hv %= FUTEX_HT_SIZE;
-          if(hv == s_head) {
-            leave_critical_section(flags);
-            return -1; // Out of free futex
-          }
-      }
+  futex_unlock(b, flags);
 
-      if(*uaddr == val){
-        if(futex_hash_table[hv].key == 0) sem_init(&(futex_hash_table[hv].sem), 0, 0);
-
-        futex_hash_table[hv].key = (uint64_t)paddr;
-        futex_hash_table[hv].bitmask = 0;
-
-        ret = 0;
-        if(timeout) {
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            now.tv_nsec += timeout->tv_nsec;
-            now.tv_sec += timeout->tv_sec;
-            if(now.tv_nsec >= NSEC_PER_SEC) {
-                now.tv_nsec -= NSEC_PER_SEC;
-                now.tv_sec++;
-            }
-
-            ret = nxsem_timedwait(&(futex_hash_table[hv].sem), &now);
-        } else {
-            nxsem_wait(&(futex_hash_table[hv].sem));
-        }
-      }
+  return futex_sleep(&w, deadline);
+}
 
-      leave_critical_section(flags);
+static int futex_wake(uint64_t key, int nr, uint32_t bitmask){
+  struct futex_bucket *b = futex_bucket(key);
+  struct futex_waiter *list = NULL;
+  irqstate_t flags;
+  int ret;
 
-      tux_errno_sanitaizer(&ret);
-      return ret; // Either not blocked or waken
+  if(!bitmask) return -EINVAL;
 
-      break;
-    case FUTEX_WAKE:
-      svcinfo("T: %d LT: %d FUTEX_WAKE at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, uaddr, paddr);
-      while(futex_hash_table[hv].key != ((uint64_t)paddr)){
-          hv++;
-          hv %= FUTEX_HT_SIZE;
-          if(hv == s_head) {
-            svcinfo("No such key: %llx\n", paddr);
-            return 0; // ? No such key, wake no one
-          }
-      }
+  flags = futex_lock(b);
+  ret = futex_collect(b, key, bitmask, nr, &list);
+  futex_unlock(b, flags);
 
-      int svalue;
-      sem_getvalue(&(futex_hash_table[hv].sem), &svalue);
-      val = val > -svalue ? -svalue : val;
-      ret = val;
-      for(;val > 0; val--){
-        nxsem_post(&(futex_hash_table[hv].sem));
-      }
+  futex_post(list);
 
-      flags = enter_critical_section();
-      sem_getvalue(&(futex_hash_table[hv].sem), &svalue);
-      if(svalue == 0) {
-          nxsem_destroy(&(futex_hash_table[hv].sem));
-          futex_hash_table[hv].key = 0;
-          futex_hash_table[hv].bitmask = 0;
-      }
-      leave_critical_section(flags);
+  return ret;
+}
 
-      return ret;
+static int futex_requeue(uint64_t key, int32_t *uaddr, uint64_t key2, int nr_wake,
+                         int nr_requeue, bool cmp, uint32_t val3){
+  struct futex_bucket *b = futex_bucket(key);
+  struct futex_bucket *b2 = futex_bucket(key2);
+  struct futex_waiter *list = NULL;
+  irqstate_t flags;
+  int ret;
 
-      break;
-    case FUTEX_WAIT_BITSET:
-    case FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME:
-      svcinfo("T: %d LT: %d FUTEX_WAIT_BITSET 0x%lx at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, val3, uaddr, paddr);
+  flags = futex_lock2(b, b2);
 
-      flags = enter_critical_section();
+  if(cmp && *(volatile int32_t *)uaddr != val3){
+    futex_unlock2(b, b2, flags);
+    return -EAGAIN;
+  }
 
-      while((futex_hash_table[hv].key != 0) && (futex_hash_table[hv].key != ((uint64_t)paddr)) && (futex_hash_table[hv].bitmask != val3)){
-          hv++;
-          hv %= FUTEX_HT_SIZE;
-          if(hv == s_head) {
-            leave_critical_section(flags);
-            return -1; // Out of free futex
-          }
-      }
+  ret = futex_collect(b, key, FUTEX_BITSET_MATCH_ANY, nr_wake, &list);
+  ret += futex_move(b, key, b2, key2, nr_requeue);
 
-      if(*uaddr == val){
-        if(futex_hash_table[hv].key == 0) sem_init(&(futex_hash_table[hv].sem), 0, 0);
-
-        futex_hash_table[hv].key = (uint64_t)paddr;
-        futex_hash_table[hv].bitmask = val3;
-
-        if(timeout && !(opcode & FUTEX_CLOCK_REALTIME)) {
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            now.tv_nsec += timeout->tv_nsec;
-            now.tv_sec += timeout->tv_sec;
-            if(now.tv_nsec >= NSEC_PER_SEC) {
-                now.tv_nsec -= NSEC_PER_SEC;
-                now.tv_sec++;
-            }
-        }else{
-            now.tv_nsec = timeout->tv_nsec;
-            now.tv_sec = timeout->tv_sec + 120;
-        }
-
-        ret = 0;
-        if(timeout){
-            ret = nxsem_timedwait(&(futex_hash_table[hv].sem), &now);
-        } else {
-            nxsem_wait(&(futex_hash_table[hv].sem));
-        }
-      }
+  futex_unlock2(b, b2, flags);
 
-      leave_critical_section(flags);
+  futex_post(list);
 
-      tux_errno_sanitaizer(&ret);
-      return ret; // Either not blocked or waken
+  return ret;
+}
 
-      break;
-    case FUTEX_WAKE_BITSET:
-    case FUTEX_WAKE_BITSET | FUTEX_CLOCK_REALTIME:
-      svcinfo("T: %d LT: %d FUTEX_WAKE_BITSET 0x%lx at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, val3, uaddr, paddr);
+static int futex_wake_op(uint64_t key, int32_t *uaddr, uint64_t key2, int32_t *uaddr2,
+                         int nr_wake, int nr_wake2, uint32_t val3){
+  struct futex_bucket *b = futex_bucket(key);
+  struct futex_bucket *b2 = futex_bucket(key2);
+  struct futex_waiter *list = NULL;
+  int32_t oparg = FUTEX_GET_OPARG(val3);
+  int32_t cmparg = FUTEX_GET_CMPARG(val3);
+  int op = FUTEX_GET_OP(val3);
+  int32_t oldval;
+  int cmpflag = 0;
+  irqstate_t flags;
+  int ret;
 
-      ret = 0;
-      for(int i = 0; i < FUTEX_HT_SIZE; i++) {
-          if(futex_hash_table[hv].key == ((uint64_t)paddr) && (futex_hash_table[hv].bitmask & val3)) {
-              /* wake this */
-              int svalue;
-              sem_getvalue(&(futex_hash_table[hv].sem), &svalue);
-              val = val > -svalue ? -svalue : val;
-              ret += val;
-              for(;val > 0; val--){
-                nxsem_post(&(futex_hash_table[hv].sem));
-              }
-
-              flags = enter_critical_section();
-              sem_getvalue(&(futex_hash_table[hv].sem), &svalue);
-              if(svalue == 0) {
-                  nxsem_destroy(&(futex_hash_table[hv].sem));
-                  futex_hash_table[hv].key = 0;
-                  futex_hash_table[hv].bitmask = 0;
-              }
-              leave_critical_section(flags);
-          }
+  if(op & FUTEX_OP_ARG_SHIFT){
+    op &= ~FUTEX_OP_ARG_SHIFT;
+    oparg = 1 << (oparg & 31);
+  }
+
+  svcinfo("op: 0x%x, arg: 0x%x\n", op, oparg);
+  svcinfo("cmp: 0x%x, arg: 0x%x\n", FUTEX_GET_CMP(val3), cmparg);
+
+  flags = futex_lock2(b, b2);
+
+  oldval = *(volatile int32_t *)uaddr2;
+  switch(op) {
+      case FUTEX_OP_SET:
+          *(volatile int32_t *) uaddr2 = oparg;
+          break;
+      case FUTEX_OP_ADD:
+          *(volatile int32_t *) uaddr2 += oparg;
+          break;
+      case FUTEX_OP_OR:
+          *(volatile int32_t *) uaddr2 |= oparg;
+          break;
+      case FUTEX_OP_ANDN:
+          *(volatile int32_t *) uaddr2 &= ~oparg;
+          break;
+      case FUTEX_OP_XOR:
+          *(volatile int32_t *) uaddr2 ^= oparg;
+          break;
+      default:
+          futex_unlock2(b, b2, flags);
+          return -ENOSYS;
+  }
+
+  switch(FUTEX_GET_CMP(val3)) {
+      case FUTEX_OP_CMP_EQ:
+          cmpflag = (oldval == cmparg);
+          break;
+      case FUTEX_OP_CMP_NE:
+          cmpflag = (oldval != cmparg);
+          break;
+      case FUTEX_OP_CMP_LT:
+          cmpflag = (oldval < cmparg);
+          break;
+      case FUTEX_OP_CMP_LE:
+          cmpflag = (oldval <= cmparg);
+          break;
+      case FUTEX_OP_CMP_GT:
+          cmpflag = (oldval > cmparg);
+          break;
+      case FUTEX_OP_CMP_GE:
+          cmpflag = (oldval >= cmparg);
+          break;
+  }
+
+  ret = futex_collect(b, key, FUTEX_BITSET_MATCH_ANY, nr_wake, &list);
+  if(cmpflag)
+    ret += futex_collect(b2, key2, FUTEX_BITSET_MATCH_ANY, nr_wake2, &list);
+
+  futex_unlock2(b, b2, flags);
+
+  futex_post(list);
+
+  return ret;
+}
+
+/****************************************************************************
+ * Priority inheritance
+ ****************************************************************************/
+
+struct futex_owner_search{
+  uint32_t tid;
+  pid_t pid;
+};
+
+static void futex_owner_cb(struct tcb_s *tcb, void *arg){
+  struct futex_owner_search *s = arg;
+
+  if(tcb->xcp.linux_tid == s->tid)
+    s->pid = tcb->pid;
+}
+
+/* Walks the task list, never call it with a bucket locked */
+static pid_t futex_owner(uint32_t tid){
+  struct futex_owner_search s = { tid, -1 };
+
+  sched_foreach(futex_owner_cb, &s);
+
+  return s.pid;
+}
+
+/* The owner runs at our priority until it unlocks.  Changing priorities
+ * may switch context right away, so this and futex_pi_adjust() are only
+ * called once the bucket is unlocked, the owner is looked up again in
+ * case it exited meanwhile. */
+static void futex_boost(pid_t pid, uint8_t prio){
+  struct tcb_s *tcb;
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+
+  tcb = sched_gettcb(pid);
+  if(tcb && tcb->sched_priority < prio)
+    nxsched_setpriority(tcb, prio);
+
+  leave_critical_section(flags);
+}
+
+/* Drop a boost the task no longer needs.  It may still hold other PI
+ * futexes, it keeps the priority of the most urgent of their waiters. */
+static void futex_pi_adjust(pid_t pid){
+#ifdef CONFIG_PRIORITY_INHERITANCE
+  struct futex_bucket *b;
+  struct futex_waiter *w;
+  struct tcb_s *tcb;
+  irqstate_t flags;
+  irqstate_t bflags;
+  uint8_t prio;
+  int i;
+
+  flags = enter_critical_section();
+
+  tcb = sched_gettcb(pid);
+  if(!tcb || tcb->sched_priority == tcb->base_priority){
+    leave_critical_section(flags);
+    return;
+  }
+
+  prio = tcb->base_priority;
+
+  for(i = 0; i < CONFIG_TUX_FUTEX_BUCKETS; i++){
+    b = &futex_hash_table[i];
+    bflags = futex_lock(b);
+    for(w = b->head; w; w = w->flink)
+      if(w->pi && w->owner == pid && w->prio > prio)
+        prio = w->prio;
+    futex_unlock(b, bflags);
+  }
+
+  if(tcb->sched_priority != prio)
+    nxsched_setpriority(tcb, prio);
+
+  leave_critical_section(flags);
+#endif
+}
+
+/* The first PI waiter of key, the most urgent one */
+static struct futex_waiter *futex_pi_first(struct futex_bucket *b, uint64_t key){
+  struct futex_waiter *w;
+
+  for(w = b->head; w; w = w->flink)
+    if(w->key == key && w->pi) break;
+
+  return w;
+}
+
+static int futex_lock_pi(uint64_t key, int32_t *uaddr, const struct timespec *deadline, bool try){
+  struct futex_bucket *b = futex_bucket(key);
+  struct tcb_s *rtcb = this_task();
+  uint32_t tid = rtcb->xcp.linux_tid;
+  struct futex_waiter w;
+  irqstate_t flags;
+  uint32_t otid = 0;
+  uint32_t uval;
+  pid_t owner = -1;
+  int ret;
+
+  flags = futex_lock(b);
+
+  for(;;){
+    uval = *(volatile uint32_t *)uaddr;
+
+    if(!(uval & FUTEX_TID_MASK)){
+      // Free, keep a stale WAITERS bit so the next unlock comes to us
+      if(__sync_bool_compare_and_swap((uint32_t *)uaddr, uval, (uval & FUTEX_WAITERS) | tid)){
+        futex_unlock(b, flags);
+        return 0;
       }
+      continue;
+    }
 
-      return ret;
+    if((uval & FUTEX_TID_MASK) == tid){
+      futex_unlock(b, flags);
+      return -EDEADLK;
+    }
 
+    if(try){
+      futex_unlock(b, flags);
+      return -EAGAIN;
+    }
+
+    // Look the owner up unlocked, then see whether it still holds it
+    if((uval & FUTEX_TID_MASK) != otid){
+      otid = uval & FUTEX_TID_MASK;
+      futex_unlock(b, flags);
+      owner = futex_owner(otid);
+      flags = futex_lock(b);
+      continue;
+    }
+
+    if(owner < 0){
+      futex_unlock(b, flags);
+      return -ESRCH;
+    }
+
+    if((uval & FUTEX_WAITERS) ||
+       __sync_bool_compare_and_swap((uint32_t *)uaddr, uval, uval | FUTEX_WAITERS))
       break;
+  }
+
+  futex_init_waiter(&w, key, FUTEX_BITSET_MATCH_ANY, true);
+  w.owner = owner;
+  futex_enqueue(b, &w);
+
+  futex_unlock(b, flags);
+
+  futex_boost(owner, w.prio);
+
+  // Unlock hands the futex over to the waiter it posts
+  ret = futex_sleep(&w, deadline);
+  if(ret == 0)
+    return 0;
+
+  // We gave up, the owner no longer needs our priority
+  flags = futex_lock(b);
+
+  if(!futex_pi_first(b, key)){
+    do{
+      uval = *(volatile uint32_t *)uaddr;
+    }while((uval & FUTEX_WAITERS) &&
+           !__sync_bool_compare_and_swap((uint32_t *)uaddr, uval, uval & ~FUTEX_WAITERS));
+  }
+
+  futex_unlock(b, flags);
+
+  futex_pi_adjust(w.owner);
+
+  return ret;
+}
+
+static int futex_unlock_pi(uint64_t key, int32_t *uaddr){
+  struct futex_bucket *b = futex_bucket(key);
+  struct tcb_s *rtcb = this_task();
+  uint32_t tid = rtcb->xcp.linux_tid;
+  struct futex_waiter *w;
+  struct futex_waiter *next;
+  irqstate_t flags;
+  uint8_t prio = 0;
+
+  flags = futex_lock(b);
+
+  if((*(volatile uint32_t *)uaddr & FUTEX_TID_MASK) != tid){
+    futex_unlock(b, flags);
+    return -EPERM;
+  }
+
+  w = futex_pi_first(b, key);
+  if(w){
+    futex_dequeue(b, w);
+
+    // The ones still waiting wait for the new owner now
+    for(next = b->head; next; next = next->flink)
+      if(next->key == key && next->pi) next->owner = w->tcb->pid;
+
+    next = futex_pi_first(b, key);
+    if(next) prio = next->prio;
+
+    *(volatile uint32_t *)uaddr = w->tcb->xcp.linux_tid | (next ? FUTEX_WAITERS : 0);
+  }else{
+    *(volatile uint32_t *)uaddr = 0;
+  }
+
+  futex_unlock(b, flags);
+
+  // The new owner inherits from the ones still waiting
+  if(prio) futex_boost(w->tcb->pid, prio);
+
+  futex_pi_adjust(rtcb->pid);
+
+  if(w) nxsem_post(&w->sem);
+
+  return 0;
+}
+
+long tux_futex(unsigned long nbr, int32_t* uaddr, int opcode, uint32_t val, uintptr_t val2, int32_t* uaddr2, uint32_t val3){
+  struct tcb_s *tcb = this_task();
+  int32_t* paddr = virt_to_phys(uaddr);
+  int32_t* paddr2 = NULL;
+  const struct timespec *timeout = (const struct timespec *)val2;
+  struct timespec deadline;
+  int ret;
+
+  if(paddr == (void*)-1) return -EFAULT;
+
+  if(opcode & FUTEX_CLOCK_REALTIME){
+    if((opcode & ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)) != FUTEX_WAIT_BITSET &&
+       (opcode & ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)) != FUTEX_WAKE_BITSET)
+      return -ENOSYS;
+  }
+
+  switch(opcode & ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)){
+    case FUTEX_REQUEUE:
     case FUTEX_CMP_REQUEUE:
+    case FUTEX_WAKE_OP:
+      paddr2 = virt_to_phys(uaddr2);
+      if(paddr2 == (void*)-1) return -EFAULT;
+      break;
+  }
 
-      flags = enter_critical_section();
-
-      if(*uaddr != val3) {
-        ret = -EAGAIN;
-        leave_critical_section(flags);
-      } else {
-        while(futex_hash_table[hv].key != ((uint64_t)paddr)) {
-          hv++;
-          hv %= FUTEX_HT_SIZE;
-          if(hv == s_head) {
-            svcinfo("No such key: %llx\n", paddr);
-            leave_critical_section(flags);
-            return 0; // ? No such key, wake no one
-          }
-        }
-
-        while((futex_hash_table[hv2].key != 0) && (futex_hash_table[hv2].key != ((uint64_t)paddr2))){
-          hv2++;
-          hv2 %= FUTEX_HT_SIZE;
-          if(hv2 == s_head2) {
-            leave_critical_section(flags);
-            return -ENOMEM; // Out of free futex
-          }
-        }
-
-        /* wake val threads */
-        int svalue;
-        sem_getvalue(&(futex_hash_table[hv].sem), &svalue);
-        val = val > -svalue ? -svalue : val;
-        for(;val > 0; val--){
-          nxsem_post(&(futex_hash_table[hv].sem));
-        }
-
-        /* Requeue val2 threads */
-        sem_getvalue(&(futex_hash_table[hv].sem), &svalue);
-        val2 = val2 > -svalue ? -svalue : val2;
-
-        if(futex_hash_table[hv2].key == 0) {
-          sem_init(&(futex_hash_table[hv2].sem), 0, 0);
-          futex_hash_table[hv2].key = (uint64_t)paddr2;
-          futex_hash_table[hv2].bitmask = 0;
-        }
-
-        /* HACK: Move the task to wait on another semaphore */
-        struct tcb_s *stcb;
-        for (stcb = (FAR struct tcb_s *)g_waitingforsemaphore.head;
-             (stcb && stcb->waitsem == &(futex_hash_table[hv].sem) && val2 > 0);
-             stcb = stcb->flink, val2--) {
-
-            futex_hash_table[hv].sem.semcount++;
-            futex_hash_table[hv2].sem.semcount--;
-            stcb->waitsem = &(futex_hash_table[hv2].sem);
-
-            /* maybe a good time to biist the priority for PI to work properly*/
-            /*nxsem_boostholderprio(FAR struct semholder_s *pholder,*/
-        }
-      }
+  // Keys are physical, shared and private futexes are treated alike
+  switch(opcode & ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)){
+    case FUTEX_WAIT:
+      svcinfo("T: %d LT: %d FUTEX_WAIT at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, uaddr, paddr);
+      if(timeout) futex_deadline(timeout, false, CLOCK_MONOTONIC, &deadline);
+      ret = futex_wait((uint64_t)paddr, uaddr, val, FUTEX_BITSET_MATCH_ANY, timeout ? &deadline : NULL);
+      break;
+
+    case FUTEX_WAIT_BITSET:
+      svcinfo("T: %d LT: %d FUTEX_WAIT_BITSET 0x%lx at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, val3, uaddr, paddr);
+      if(timeout)
+        futex_deadline(timeout, true, (opcode & FUTEX_CLOCK_REALTIME) ? CLOCK_REALTIME : CLOCK_MONOTONIC, &deadline);
+      ret = futex_wait((uint64_t)paddr, uaddr, val, val3, timeout ? &deadline : NULL);
+      break;
 
-      leave_critical_section(flags);
+    case FUTEX_WAKE:
+      svcinfo("T: %d LT: %d FUTEX_WAKE at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, uaddr, paddr);
+      ret = futex_wake((uint64_t)paddr, val, FUTEX_BITSET_MATCH_ANY);
+      break;
 
-      ret = 0;
+    case FUTEX_WAKE_BITSET:
+      svcinfo("T: %d LT: %d FUTEX_WAKE_BITSET 0x%lx at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, val3, uaddr, paddr);
+      ret = futex_wake((uint64_t)paddr, val, val3);
+      break;
 
-      tux_errno_sanitaizer(&ret);
-      return ret;
+    case FUTEX_REQUEUE:
+      ret = futex_requeue((uint64_t)paddr, uaddr, (uint64_t)paddr2, val, val2, false, 0);
+      break;
+
+    case FUTEX_CMP_REQUEUE:
+      ret = futex_requeue((uint64_t)paddr, uaddr, (uint64_t)paddr2, val, val2, true, val3);
       break;
+
     case FUTEX_WAKE_OP:
       svcinfo("T: %d FUTEX_WAKE_OP at %llx -> %llx and %llx -> %llx\n", tcb->xcp.linux_pid, uaddr, paddr, uaddr2, paddr2);
+      ret = futex_wake_op((uint64_t)paddr, uaddr, (uint64_t)paddr2, uaddr2, val, val2, val3);
+      break;
 
-      int32_t oparg = FUTEX_GET_OPARG(val3);
-      if(FUTEX_GET_OP(val3) & FUTEX_OP_ARG_SHIFT)
-          if(oparg < 0 || oparg > 31)
-              oparg &= 31;
-          oparg <<= 1;
-
-      svcinfo("op: 0x%x, arg: 0x%x\n", FUTEX_GET_OP(val3), oparg);
-      svcinfo("cmp: 0x%x, arg: 0x%x\n", FUTEX_GET_CMP(val3), FUTEX_GET_CMPARG(val3));
-
-      flags = enter_critical_section();
-
-      int32_t oldval = *(int *) uaddr2;
-      switch(FUTEX_GET_OP(val3)) {
-          case FUTEX_OP_SET:
-              *(volatile int *) uaddr2 = oparg;
-              break;
-          case FUTEX_OP_ADD:
-              *(volatile int *) uaddr2 += oparg;
-              break;
-          case FUTEX_OP_OR:
-              *(volatile int *) uaddr2 |= oparg;
-              break;
-          case FUTEX_OP_ANDN:
-              *(volatile int *) uaddr2 &= ~oparg;
-              break;
-          case FUTEX_OP_XOR:
-              *(volatile int *) uaddr2 ^= oparg;
-              break;
-      }
-
-      ret = tux_futex(nbr, uaddr, FUTEX_WAKE, val, 0, 0, 0);
-
-      int cmpflag = 0;
-      switch(FUTEX_GET_CMP(val3)) {
-          case FUTEX_OP_CMP_EQ:
-              cmpflag = (oldval == FUTEX_GET_CMPARG(val3));
-              break;
-          case FUTEX_OP_CMP_NE:
-              cmpflag = (oldval != FUTEX_GET_CMPARG(val3));
-              break;
-          case FUTEX_OP_CMP_LT:
-              cmpflag = (oldval < FUTEX_GET_CMPARG(val3));
-              break;
-          case FUTEX_OP_CMP_LE:
-              cmpflag = (oldval <= FUTEX_GET_CMPARG(val3));
-              break;
-          case FUTEX_OP_CMP_GT:
-              cmpflag = (oldval > FUTEX_GET_CMPARG(val3));
-              break;
-          case FUTEX_OP_CMP_GE:
-              cmpflag = (oldval >= FUTEX_GET_CMPARG(val3));
-              break;
-      }
-      if(cmpflag)
-          ret += tux_futex(nbr, uaddr2, FUTEX_WAKE, val2, 0, 0, 0);
-      leave_critical_section(flags);
+    case FUTEX_LOCK_PI:
+      svcinfo("T: %d LT: %d FUTEX_LOCK_PI at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, uaddr, paddr);
+      if(timeout) futex_deadline(timeout, true, CLOCK_REALTIME, &deadline);
+      ret = futex_lock_pi((uint64_t)paddr, uaddr, timeout ? &deadline : NULL, false);
+      break;
 
-      return ret;
+    case FUTEX_TRYLOCK_PI:
+      ret = futex_lock_pi((uint64_t)paddr, uaddr, NULL, true);
+      break;
 
+    case FUTEX_UNLOCK_PI:
+      svcinfo("T: %d LT: %d FUTEX_UNLOCK_PI at %llx -> %llx\n", tcb->pid, tcb->xcp.linux_pid, uaddr, paddr);
+      ret = futex_unlock_pi((uint64_t)paddr, uaddr);
       break;
+
     default:
       _alert("Futex got unfriendly opcode: %d\n", opcode);
-      PANIC();
-    }
-}
+      return -ENOSYS;
+  }
 
+  tux_errno_sanitaizer(&ret);
+  return ret;
+}
@@ -5,8 +5,13 @@
 #include <nuttx/sched.h>
 #include <nuttx/kmalloc.h>
 #include <nuttx/mm/gran.h>
+#include <nuttx/signal.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
 #include "up_internal.h"
@@ -14,10 +19,126 @@
 #include "tux.h"
 #include "sched/sched.h"
 
+#ifndef CONFIG_TUX_MM_FAULT_RESERVE
+#  define CONFIG_TUX_MM_FAULT_RESERVE 64
+#endif
+
+#ifndef CONFIG_TUX_MM_HUGE_THRESHOLD
+#  define CONFIG_TUX_MM_HUGE_THRESHOLD 2048
+#endif
+
+#ifndef CONFIG_TUX_MM_HUGE_POOL
+#  define CONFIG_TUX_MM_HUGE_POOL 32
+#endif
+
+#define TUX_MM_POOL_START     0x1000000
+#define TUX_MM_POOL_END       0x34000000
+#define TUX_MM_PAGE(pa)       (((pa) - TUX_MM_POOL_START) >> 12)
+
+#define TUX_MM_RELEASE_BATCH  32
+
+#define TUX_PTE_PRESENT       0x1
+#define TUX_PTE_RW            0x2
+#define TUX_PTE_MIRRORED      (1 << 9)  /* Software bit, known to the shadow process */
+#define TUX_PTE_COW           (1 << 10) /* Software bit, shared with a forked process */
+#define TUX_PTE_ADDR          0x000ffffffffff000ULL
+#define TUX_PTE_NX            (1ULL << 63)
+#define TUX_PTE_PROT          (TUX_PTE_PRESENT | TUX_PTE_RW | TUX_PTE_NX)
+
+#define TUX_PDE_HUGE          (1 << 7)
+#define TUX_PDE_ADDR          0x000fffffffe00000ULL
+
+#define TUX_PF_PRESENT        0x1
+#define TUX_PF_WRITE          0x2
+
+#define TUX_MLOCK_ONFAULT     0x1
+#define TUX_MCL_ONFAULT       0x4
+
+#define TUX_PROT_GROWSDOWN    0x01000000
+#define TUX_PROT_GROWSUP      0x02000000
+
+#define TUX_MM_USER_END       0x34000000
+#define TUX_SIGSEGV           11
+
 GRAN_HANDLE tux_mm_hnd;
 
+/* Zeroed pages for the page fault handler, which cannot wait for the
+ * granule allocator.  They are handed out in allocation order, so that
+ * neighbouring faults tend to get physically contiguous pages. */
+static uintptr_t tux_mm_reserve[CONFIG_TUX_MM_FAULT_RESERVE];
+static int tux_mm_reserve_head;
+static int tux_mm_reserve_count;
+
+/* References to pool pages besides the first one, taken when fork shares
+ * them copy-on-write.  The last one to drop the page frees it. */
+static uint8_t tux_mm_refs[(TUX_MM_POOL_END - TUX_MM_POOL_START) / PAGE_SIZE];
+
+/* Free 2 MiB aligned pages.  They are carved out of the granule allocator
+ * and remain ordinary pool memory, so a huge page split into page tables
+ * is freed 4 KiB at a time. */
+static uintptr_t tux_mm_huge_pool[CONFIG_TUX_MM_HUGE_POOL];
+static int tux_mm_huge_count;
+
+static uintptr_t tux_mm_huge_carve(void) {
+  uint64_t size = 2 * HUGE_PAGE_SIZE - PAGE_SIZE;
+  uintptr_t chunk;
+  uintptr_t page;
+
+  chunk = (uintptr_t)gran_alloc(tux_mm_hnd, size);
+  if(!chunk) return 0;
+
+  // Keep the aligned part only
+  page = (chunk + HUGE_PAGE_SIZE - 1) & HUGE_PAGE_MASK;
+  if(page > chunk)
+    gran_free(tux_mm_hnd, (void*)chunk, page - chunk);
+  if(chunk + size > page + HUGE_PAGE_SIZE)
+    gran_free(tux_mm_hnd, (void*)(page + HUGE_PAGE_SIZE), chunk + size - page - HUGE_PAGE_SIZE);
+
+  return page;
+}
+
+static uintptr_t tux_mm_huge_alloc(void) {
+  irqstate_t flags;
+  uintptr_t page = 0;
+
+  flags = enter_critical_section();
+  if(tux_mm_huge_count)
+    page = tux_mm_huge_pool[--tux_mm_huge_count];
+  leave_critical_section(flags);
+
+  if(!page)
+    page = tux_mm_huge_carve();
+
+  return page;
+}
+
+static void tux_mm_huge_free(uintptr_t page) {
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+  if(tux_mm_huge_count < CONFIG_TUX_MM_HUGE_POOL)
+    {
+      tux_mm_huge_pool[tux_mm_huge_count++] = page;
+      page = 0;
+    }
+  leave_critical_section(flags);
+
+  if(page)
+    gran_free(tux_mm_hnd, (void*)page, HUGE_PAGE_SIZE);
+}
+
 void tux_mm_init(void) {
-  tux_mm_hnd = gran_initialize((void*)0x1000000, (0x34000000 - 0x1000000), 12, 12); // 2^12 is 4KB, the PAGE_SIZE
+  tux_mm_hnd = gran_initialize((void*)TUX_MM_POOL_START, (TUX_MM_POOL_END - TUX_MM_POOL_START), 12, 12); // 2^12 is 4KB, the PAGE_SIZE
+
+#ifdef CONFIG_TUX_MM_HUGE
+  // Set the huge pages aside before the pool gets fragmented
+  while(tux_mm_huge_count < CONFIG_TUX_MM_HUGE_POOL)
+    {
+      tux_mm_huge_pool[tux_mm_huge_count] = tux_mm_huge_carve();
+      if(!tux_mm_huge_pool[tux_mm_huge_count]) break;
+      tux_mm_huge_count++;
+    }
+#endif
 }
 
 uint64_t* tux_mm_new_pd1(void) {
@@ -48,294 +169,1129 @@ void tux_mm_del_pd1(uint64_t* pd1) {
   return;
 }
 
-void revoke_vma(struct vma_s* vma){
-  struct tcb_s *tcb = this_task();
-  struct vma_s* ptr;
-  struct vma_s** pptr;
+/* The address space of the calling process, created on first use */
+struct vm_map_s* tux_mm_vm(struct tcb_s *tcb) {
+  if(!tcb->xcp.vm)
+    tcb->xcp.vm = kmm_zalloc(sizeof(struct vm_map_s));
 
-  if(vma == NULL) return;
+  return tcb->xcp.vm;
+}
+
+/* Keep the list heads of the tcb pointing at the lowest entries */
+static void tux_mm_sync(struct tcb_s *tcb) {
+  tcb->xcp.vma = tcb->xcp.vm->vmas.first;
+  tcb->xcp.pda = tcb->xcp.vm->pdas.first;
+}
+
+static inline void tux_mm_invlpg(uintptr_t va) {
+  asm volatile("invlpg (%0)"::"r"(va):"memory");
+}
+
+/* Map the huge page around pa at the window of this CPU, interrupts must
+ * be disabled.  The code we interrupted may be using the window, so the old
+ * entry is returned to be put back by tux_mm_window_close. */
+static uint64_t tux_mm_window_open(uintptr_t pa) {
+  uintptr_t window = tux_mm_window_base();
+  uint64_t saved = pd[(window >> 21) & 0x7ff];
+
+  pd[(window >> 21) & 0x7ff] = (pa & HUGE_PAGE_MASK) | 0x9b; // No cache
+  tux_mm_invlpg(window);
+
+  return saved;
+}
+
+static void tux_mm_window_close(uint64_t saved) {
+  uintptr_t window = tux_mm_window_base();
+
+  pd[(window >> 21) & 0x7ff] = saved;
+  tux_mm_invlpg(window);
+}
+
+static inline uint64_t* tux_mm_window_at(uintptr_t pa) {
+  return (uint64_t*)(tux_mm_window_base() + (pa & ~HUGE_PAGE_MASK));
+}
+
+/* Read the paging entry at pa, replacing it if val is given */
+static uint64_t tux_mm_entry(uintptr_t pa, uint64_t* val) {
+  irqstate_t flags;
+  uint64_t saved;
+  uint64_t ret;
+
+  flags = up_irq_save();
+  saved = tux_mm_window_open(pa);
+
+  ret = *tux_mm_window_at(pa);
+  if(val)
+    *tux_mm_window_at(pa) = *val;
+
+  tux_mm_window_close(saved);
+  up_irq_restore(flags);
+
+  return ret;
+}
+
+/* Read the page table entry of va, replacing it if val is given */
+static uint64_t tux_mm_pte(struct vma_s* pda, uint64_t va, uint64_t* val) {
+  return tux_mm_entry(pda->pa_start + (((va - pda->va_start) >> 12) & 0x3ffff) * sizeof(uint64_t), val);
+}
+
+/* Read the page directory entry of va, replacing it if val is given */
+static uint64_t tux_mm_pde(struct tcb_s *tcb, uint64_t va, uint64_t* val) {
+  return tux_mm_entry((uintptr_t)tcb->xcp.pd1 + ((va >> 21) & 0x1ff) * sizeof(uint64_t), val);
+}
+
+/* Point the page directory entry of va back at its page table, if any */
+static void tux_mm_pde_reset(struct tcb_s *tcb, uint64_t va) {
+  struct vma_s* pda = vma_tree_lookup(&tcb->xcp.vm->pdas, va);
+  uint64_t pde = 0;
+
+  if(pda)
+    pde = ((((va & HUGE_PAGE_MASK) - pda->va_start) >> 9) + pda->pa_start) | pda->proto;
+
+  tux_mm_pde(tcb, va, &pde);
+}
 
-  for(pptr = &tcb->xcp.vma, ptr = tcb->xcp.vma; ptr; pptr = &(ptr->next), ptr = ptr->next) {
-    if(ptr == vma){
-      *pptr = ptr->next;
-      kmm_free(ptr);
+/* The physical address of va in a huge page, 0 if it is not in one */
+uintptr_t tux_mm_huge_pa(struct tcb_s *tcb, uint64_t va) {
+  uint64_t pde = tux_mm_pde(tcb, va, NULL);
+
+  if(!(pde & TUX_PDE_HUGE)) return 0;
+
+  return (pde & TUX_PDE_ADDR) + (va & ~HUGE_PAGE_MASK);
+}
+
+static void tux_mm_zero(uintptr_t pa, uint64_t size) {
+  irqstate_t flags;
+  uint64_t saved;
+  uint64_t len;
+
+  for(; size; pa += len, size -= len)
+    {
+      len = HUGE_PAGE_SIZE - (pa & ~HUGE_PAGE_MASK);
+      if(len > size) len = size;
+
+      flags = up_irq_save();
+      saved = tux_mm_window_open(pa);
+      memset(tux_mm_window_at(pa), 0, len);
+      tux_mm_window_close(saved);
+      up_irq_restore(flags);
     }
-  }
+}
 
-  return;
+/* Fill frames with a file of the local mounts, Linux cannot see it.  The
+ * mapping may be read only, so the data goes through the window. */
+static int tux_mm_fill_local(uintptr_t pa, uint64_t size, int fd, off_t offset) {
+  irqstate_t flags;
+  uint64_t saved;
+  uint8_t *buf;
+  ssize_t len;
+
+  // The file system may block, read to the side first
+  buf = kmm_malloc(PAGE_SIZE);
+  if(!buf) return -ENOMEM;
+
+  for(; size; pa += PAGE_SIZE, offset += PAGE_SIZE, size -= PAGE_SIZE)
+    {
+      len = pread(fd, buf, PAGE_SIZE, offset);
+      if(len < 0)
+        {
+          kmm_free(buf);
+          return -get_errno();
+        }
+
+      // The pages past the end of the file stay zero
+      if(!len) break;
+
+      flags = up_irq_save();
+      saved = tux_mm_window_open(pa);
+      memcpy(tux_mm_window_at(pa), buf, len);
+      tux_mm_window_close(saved);
+      up_irq_restore(flags);
+    }
+
+  kmm_free(buf);
+
+  return OK;
+}
+
+/* Must be called in a critical section, the fault handler of another CPU
+ * may be taking from the reserve too */
+static uintptr_t tux_mm_reserve_get(void) {
+  uintptr_t page;
+
+  if(!tux_mm_reserve_count) return 0;
+
+  page = tux_mm_reserve[tux_mm_reserve_head];
+  tux_mm_reserve_head = (tux_mm_reserve_head + 1) % CONFIG_TUX_MM_FAULT_RESERVE;
+  tux_mm_reserve_count--;
+
+  return page;
+}
+
+static void tux_mm_refill(void) {
+  irqstate_t flags;
+  uintptr_t chunk;
+  uint64_t n, i;
+
+  while(tux_mm_reserve_count < CONFIG_TUX_MM_FAULT_RESERVE)
+    {
+      // One contiguous chunk if possible, the pages are freed one by one
+      n = CONFIG_TUX_MM_FAULT_RESERVE - tux_mm_reserve_count;
+      chunk = (uintptr_t)gran_alloc(tux_mm_hnd, n * PAGE_SIZE);
+      if(!chunk)
+        {
+          n = 1;
+          chunk = (uintptr_t)gran_alloc(tux_mm_hnd, PAGE_SIZE);
+          if(!chunk) return;
+        }
+
+      tux_mm_zero(chunk, n * PAGE_SIZE);
+
+      flags = enter_critical_section();
+      for(i = 0; i < n && tux_mm_reserve_count < CONFIG_TUX_MM_FAULT_RESERVE; i++)
+        {
+          tux_mm_reserve[(tux_mm_reserve_head + tux_mm_reserve_count) % CONFIG_TUX_MM_FAULT_RESERVE] = chunk + i * PAGE_SIZE;
+          tux_mm_reserve_count++;
+        }
+      leave_critical_section(flags);
+
+      // Somebody else refilled meanwhile
+      if(i < n)
+        gran_free(tux_mm_hnd, (void*)(chunk + i * PAGE_SIZE), (n - i) * PAGE_SIZE);
+    }
 }
 
-void get_free_vma(struct vma_s* ret, uint64_t size) {
+/* Take one more reference to a pool page, unless it has too many */
+bool tux_mm_page_get(uintptr_t page) {
+  irqstate_t flags;
+  bool ret = false;
+
+  flags = enter_critical_section();
+  if(tux_mm_refs[TUX_MM_PAGE(page)] < UINT8_MAX)
+    {
+      tux_mm_refs[TUX_MM_PAGE(page)]++;
+      ret = true;
+    }
+  leave_critical_section(flags);
+
+  return ret;
+}
+
+/* Drop a reference to a pool page, the last one frees it */
+void tux_mm_page_put(uintptr_t page) {
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+  if(tux_mm_refs[TUX_MM_PAGE(page)])
+    {
+      tux_mm_refs[TUX_MM_PAGE(page)]--;
+      page = 0;
+    }
+  leave_critical_section(flags);
+
+  if(page)
+    gran_free(tux_mm_hnd, (void*)page, PAGE_SIZE);
+}
+
+/* Must be called in a critical section */
+static void tux_mm_unmirrored(struct vm_map_s* vm, uint64_t va) {
+  if(vm->unmirrored_start >= vm->unmirrored_end)
+    {
+      vm->unmirrored_start = va;
+      vm->unmirrored_end = va + PAGE_SIZE;
+      return;
+    }
+
+  if(va < vm->unmirrored_start) vm->unmirrored_start = va;
+  if(va + PAGE_SIZE > vm->unmirrored_end) vm->unmirrored_end = va + PAGE_SIZE;
+}
+
+/* Give the faulting process its own copy of a page shared by fork, in a
+ * critical section.  Returns the new entry, or 0 if a copy is needed and
+ * the reserve is empty.  *moved tells whether the entry now points at
+ * another page, other CPUs running the process must then drop theirs
+ * once the critical section is left. */
+static uint64_t tux_mm_cow(struct vm_map_s* vm, struct vma_s* vma, struct vma_s* pda, uint64_t va, uint64_t pte, bool* moved) {
+  uintptr_t page = pte & TUX_PTE_ADDR;
+  uintptr_t copy;
+  uint64_t saved;
+
+  *moved = false;
+
+  if(!tux_mm_refs[TUX_MM_PAGE(page)])
+    {
+      // Everybody else let go, the page is ours
+      pte = (pte & ~(TUX_PTE_PROT | TUX_PTE_COW)) | vma->proto;
+    }
+  else
+    {
+      copy = tux_mm_reserve_get();
+      if(!copy) return 0;
+
+      saved = tux_mm_window_open(copy);
+      memcpy(tux_mm_window_at(copy), (void*)va, PAGE_SIZE);
+      tux_mm_window_close(saved);
+
+      tux_mm_refs[TUX_MM_PAGE(page)]--;
+
+      // The shadow process still maps the shared page
+      pte = copy | vma->proto;
+      tux_mm_unmirrored(vm, va);
+      *moved = true;
+    }
+
+  tux_mm_pte(pda, va, &pte);
+  tux_mm_invlpg(va);
+
+  return pte;
+}
+
+/* Copy the mapping around va into copy, false if there is none.  The
+ * fault handlers of other CPUs and the other threads of the process may
+ * change the tree meanwhile, the mapping is only safe to use in the
+ * critical section it was looked up in. */
+bool tux_mm_lookup(struct tcb_s *tcb, uint64_t va, struct vma_s* copy) {
+  struct vma_s* vma;
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+
+  vma = vma_tree_lookup(&tux_mm_vm(tcb)->vmas, va);
+  if(vma)
+    *copy = *vma;
+
+  leave_critical_section(flags);
+
+  return vma != NULL;
+}
+
+/* Back the page around va of a lazy mapping, unsharing it if we are about
+ * to write, returns its physical address or 0 if it is not backed lazily
+ * or we are out of memory */
+uintptr_t tux_mm_fault_in(struct tcb_s *tcb, uint64_t va, bool write) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* vma;
+  struct vma_s* pda;
+  irqstate_t flags;
+  uintptr_t page;
+  uint64_t pte;
+  bool moved = false;
+
+  va &= PAGE_MASK;
+
+  for(;;)
+    {
+      // The mappings may go away under us, look them up every time
+      flags = enter_critical_section();
+
+      vma = vma_tree_lookup(&vm->vmas, va);
+      pda = vma_tree_lookup(&vm->pdas, va);
+
+      // Nothing may touch an inaccessible page, not even on our behalf
+      if(!vma || !pda || !(vma->flags & VMA_LAZY) || !(vma->proto & TUX_PTE_PRESENT))
+        {
+          leave_critical_section(flags);
+          return 0;
+        }
+
+      pte = tux_mm_pte(pda, va, NULL);
+      if(pte && write && (pte & TUX_PTE_COW))
+        {
+          pte = tux_mm_cow(vm, vma, pda, va, pte, &moved);
+        }
+      else if(!pte && (page = tux_mm_reserve_get()))
+        {
+          pte = page | vma->proto;
+          tux_mm_pte(pda, va, &pte);
+          tux_mm_unmirrored(vm, va);
+        }
+
+      leave_critical_section(flags);
+
+      if(moved && tcb == this_task())
+        up_tlb_shootdown();
+
+      if(pte) return pte & TUX_PTE_ADDR;
+
+      tux_mm_refill();
+      if(!tux_mm_reserve_count) return 0;
+    }
+}
+
+/* Runs in the faulting task when the reserve ran dry, with the faulting
+ * state saved in xcp.regs */
+static void tux_mm_fault_slow(uint64_t addr) {
+  struct tcb_s *rtcb = this_task();
+  uint64_t regs_area[XCPTCONTEXT_REGS + 2];
+  uint64_t* regs;
+
+  regs = (uint64_t*)(((uint64_t)(regs_area) + 15) & (~(uint64_t)15)); // align regs to 16byte boundary for SSE instrucitons
+  up_copystate(regs, rtcb->xcp.regs);
+
+  up_irq_restore(regs[REG_RFLAGS]);
+
+  tux_mm_refill();
+
+  if(!tux_mm_reserve_count)
+    {
+      _alert("TUX: Out of memory backing 0x%llx\n", addr);
+      PANIC();
+    }
+
+  // Retry the access, the fault handler takes it from here
+  (void)up_irq_save();
+  up_fullcontextrestore(regs);
+}
+
+/* Runs in the faulting task when it broke the protection of its mappings,
+ * with the faulting state saved in xcp.regs.  A handler may fix the
+ * mapping and have the access retried, otherwise the process dies. */
+static void tux_mm_segv(uint64_t addr) {
+  struct tcb_s *rtcb = this_task();
+  uint64_t regs_area[XCPTCONTEXT_REGS + 2];
+  uint64_t* regs;
+  struct sigaction sa;
+
+  regs = (uint64_t*)(((uint64_t)(regs_area) + 15) & (~(uint64_t)15)); // align regs to 16byte boundary for SSE instrucitons
+  up_copystate(regs, rtcb->xcp.regs);
+
+  up_irq_restore(regs[REG_RFLAGS]);
+
+  if(sigaction(TUX_SIGSEGV, NULL, &sa) ||
+     sa.sa_handler == SIG_DFL || sa.sa_handler == SIG_IGN ||
+     sigismember(&rtcb->sigprocmask, TUX_SIGSEGV))
+    {
+      _alert("TUX: Segmentation fault of %d at 0x%llx, rip 0x%llx\n", rtcb->xcp.linux_pid, addr, regs[REG_RIP]);
+      tux_abnormal_termination(TUX_SIGSEGV);
+    }
+
+  // Delivered right away, we are signalling ourselves
+  nxsig_kill(rtcb->pid, TUX_SIGSEGV);
+
+  (void)up_irq_save();
+  up_fullcontextrestore(regs);
+}
+
+/* Called by the page fault handler.  Missing pages of lazy mappings are
+ * backed from the reserve and writes to pages shared by fork are given a
+ * copy.  Other faults of a Linux process on its own address space raise
+ * SIGSEGV, any other fault is not ours. */
+int tux_mm_fault(uint64_t *regs) {
   struct tcb_s *tcb = this_task();
-  struct vma_s* ptr;
-  struct vma_s* pptr;
-  if(!ret) return;
+  struct vm_map_s* vm = tcb->xcp.vm;
+  void (*handler)(uint64_t);
+  struct vma_s* vma;
+  struct vma_s* pda;
+  irqstate_t flags;
+  uint64_t addr;
+  uint64_t va;
+  uint64_t pte;
+  uint64_t rsp;
+  uint64_t kstack;
+  bool moved;
+
+  asm volatile("mov %%cr2, %0":"=r"(addr));
 
-  ret->next = NULL;
+  if(!tcb->xcp.is_linux || !vm) return -1;
+
+  va = addr & PAGE_MASK;
+  handler = tux_mm_segv;
+
+  // Other CPUs may be faulting on the same pages, or changing the trees
+  flags = enter_critical_section();
 
-  if(tcb->xcp.vma == NULL)
+  vma = vma_tree_lookup(&vm->vmas, addr);
+  pda = vma_tree_lookup(&vm->pdas, addr);
+  if(!vma || !pda || !(vma->flags & VMA_LAZY))
     {
-      tcb->xcp.vma = ret;
-      ret->va_start = PAGE_SIZE;
+      leave_critical_section(flags);
+      goto redirect;
+    }
+
+  pte = tux_mm_pte(pda, va, NULL);
+
+  if((pte & TUX_PTE_PRESENT) &&
+     (!(regs[REG_ERRCODE] & TUX_PF_PRESENT) ||
+      ((regs[REG_ERRCODE] & TUX_PF_WRITE) && (pte & TUX_PTE_RW) && !(pte & TUX_PTE_COW))))
+    {
+      // Somebody backed or unshared it meanwhile, our TLB was stale
+      leave_critical_section(flags);
+      tux_mm_invlpg(va);
+      return OK;
+    }
+
+  if(regs[REG_ERRCODE] & TUX_PF_PRESENT)
+    {
+      // Protection violation, unless the page is only shared
+      if(!(regs[REG_ERRCODE] & TUX_PF_WRITE) || !(pte & TUX_PTE_COW) || !(vma->proto & TUX_PTE_RW))
+        {
+          leave_critical_section(flags);
+          goto redirect;
+        }
+
+      pte = tux_mm_cow(vm, vma, pda, va, pte, &moved);
+      leave_critical_section(flags);
+
+      if(pte)
+        {
+          // Interrupts are off, the IPIs are sent but not waited for
+          if(moved)
+            up_tlb_shootdown();
+          return OK;
+        }
+
+      handler = tux_mm_fault_slow;
     }
-  else if (tcb->xcp.vma->next == NULL)
+  else if(vma->proto & TUX_PTE_PRESENT)
     {
-      tcb->xcp.vma->next = ret;
-      ret->va_start = tcb->xcp.vma->va_end;
+      pte = tux_mm_reserve_get();
+      if(pte)
+        {
+          pte |= vma->proto;
+          tux_mm_pte(pda, va, &pte);
+          tux_mm_unmirrored(vm, va);
+        }
+
+      leave_critical_section(flags);
+
+      if(pte)
+        return OK;
+
+      handler = tux_mm_fault_slow;
     }
   else
     {
-      for(pptr = tcb->xcp.vma, ptr = tcb->xcp.vma->next; ptr; pptr = ptr, ptr = ptr->next) {
-        if(ptr->va_start - pptr->va_end >= size)
-          {
-            // Find a large enough hole
-            ret->next = ptr;
-            break;
-          }
-      }
+      leave_critical_section(flags);
+    }
+
+  // Guard pages and PROT_NONE reservations are never backed
+
+redirect:
+  // Faults beyond the Linux address space are bugs of ours
+  if(handler == tux_mm_segv && addr >= TUX_MM_USER_END)
+    return -1;
+
+  // Let the faulting task handle it, the same way a signal is delivered
+  up_savestate(tcb->xcp.regs);
+
+  kstack = (uint64_t)tcb->adj_stack_ptr;
+  rsp = regs[REG_RSP];
+  if(!(rsp < kstack && rsp > kstack - tcb->adj_stack_size))
+    rsp = kstack - 16; // Not in a syscall, the kernel stack is free
+
+  // Stay clear of the red zone, enter as if called
+  regs[REG_RSP] = ((rsp - 128) & ~(uint64_t)15) - 8;
+  regs[REG_RIP] = (uint64_t)handler;
+  regs[REG_RDI] = addr;
+  regs[REG_RFLAGS] = 0;
+
+  return OK;
+}
+
+/* Back the lazy pages of [start, end) up front */
+static long tux_mm_populate(struct tcb_s *tcb, uint64_t start, uint64_t end) {
+  struct vma_s* vma;
+  uint64_t va;
+
+  for(vma = vma_tree_next(&tux_mm_vm(tcb)->vmas, start); vma && vma->va_start < end; vma = vma->next)
+    {
+      if(!(vma->flags & VMA_LAZY)) continue;
+
+      for(va = start > vma->va_start ? start & PAGE_MASK : vma->va_start; va < end && va < vma->va_end; va += PAGE_SIZE)
+        {
+          if(!tux_mm_fault_in(tcb, va, false))
+            return -ENOMEM;
+        }
+    }
+
+  return OK;
+}
+
+/* Tell the shadow process where the pages faulted in or mapped huge since
+ * the last delegated call are, so that it can follow pointers into them.
+ * Runs of pages contiguous in both spaces are mirrored at once. */
+void tux_mm_mirror(struct tcb_s *tcb) {
+  struct vm_map_s* vm = tcb->xcp.vm;
+  struct vma_s* vma;
+  struct vma_s* pda;
+  irqstate_t flags;
+  uint64_t start, end;
+  uint64_t va, pte, len;
+  uintptr_t pa;
+  uint64_t run_va = 0, run_pa = 0, run_len = 0;
+
+  if(!vm || vm->unmirrored_start >= vm->unmirrored_end) return;
+
+  // A vfork child leaves them to the shadow process of its parent
+  if(tcb->xcp.vfork_done) return;
+
+  flags = enter_critical_section();
+  start = vm->unmirrored_start;
+  end = vm->unmirrored_end;
+  vm->unmirrored_start = vm->unmirrored_end = 0;
+  leave_critical_section(flags);
+
+  // Mappings are looked up again for every page, we sleep in between
+  for(va = start; va < end; va += len)
+    {
+      len = PAGE_SIZE;
+
+      vma = vma_tree_next(&vm->vmas, va);
+      if(!vma) break;
+
+      if(va < vma->va_start) va = vma->va_start;
+      if(va >= end) break;
+
+      if(vma->flags & VMA_HUGE)
+        {
+          // A huge page at once, it is known to the shadow as a whole
+          va &= HUGE_PAGE_MASK;
+          len = HUGE_PAGE_SIZE;
+
+          flags = enter_critical_section();
+          pte = tux_mm_pde(tcb, va, NULL);
+          if((pte & TUX_PDE_HUGE) && !(pte & TUX_PTE_MIRRORED))
+            {
+              pte |= TUX_PTE_MIRRORED;
+              tux_mm_pde(tcb, va, &pte);
+              pa = pte & TUX_PDE_ADDR;
+            }
+          else
+            {
+              pa = 0;
+            }
+          leave_critical_section(flags);
+        }
+      else if(vma->flags & VMA_LAZY)
+        {
+          pda = vma_tree_lookup(&vm->pdas, va);
+          if(!pda) continue;
+
+          flags = enter_critical_section();
+          pte = tux_mm_pte(pda, va, NULL);
+          if(pte && !(pte & TUX_PTE_MIRRORED))
+            {
+              pte |= TUX_PTE_MIRRORED;
+              tux_mm_pte(pda, va, &pte);
+              pa = pte & TUX_PTE_ADDR;
+            }
+          else
+            {
+              pa = 0;
+            }
+          leave_critical_section(flags);
+        }
+      else
+        {
+          len = vma->va_end - va;
+          continue;
+        }
+
+      if(!pa) continue;
+
+      if(run_len && run_va + run_len == va && run_pa + run_len == pa)
+        {
+          run_len += len;
+          continue;
+        }
+
+      if(run_len)
+        tux_delegate(9, (run_pa << 32) | run_va, run_len, 0, MAP_ANONYMOUS, 0, 0);
+
+      run_va = va;
+      run_pa = pa;
+      run_len = len;
+    }
+
+  if(run_len)
+    tux_delegate(9, (run_pa << 32) | run_va, run_len, 0, MAP_ANONYMOUS, 0, 0);
+}
+
+/* Give back the memory backing [start, end) of vma.  Pages of lazy
+ * mappings are found through the page tables and unmapped, those still
+ * shared with another process only lose a reference.  Huge pages go
+ * whole, partial ones are split by the caller. */
+void tux_mm_release(struct tcb_s *tcb, struct vma_s* vma, uint64_t start, uint64_t end) {
+  struct vm_map_s* vm = tcb->xcp.vm;
+  uintptr_t pages[TUX_MM_RELEASE_BATCH];
+  uintptr_t page;
+  struct vma_s* pda;
+  irqstate_t flags;
+  uint64_t zero = 0;
+  uint64_t pte;
+  uint64_t va;
+  int n, i;
+
+  if(start < vma->va_start) start = vma->va_start;
+  if(end > vma->va_end) end = vma->va_end;
+  if(start >= end) return;
+
+  if(vma->flags & VMA_HUGE)
+    {
+      for(va = start & HUGE_PAGE_MASK; va < end; va += HUGE_PAGE_SIZE)
+        {
+          flags = enter_critical_section();
+          pte = tux_mm_pde(tcb, va, NULL);
+          tux_mm_pde_reset(tcb, va);
+          leave_critical_section(flags);
+
+          if(pte & TUX_PDE_HUGE)
+            {
+              // No CPU may still reach the page once it is reused
+              set_pcid(this_task()->pid);
+              up_tlb_shootdown();
+              tux_mm_huge_free(pte & TUX_PDE_ADDR);
+            }
+        }
+
+      // Drop the huge translations at once
+      set_pcid(this_task()->pid);
+      up_tlb_shootdown();
+      return;
+    }
+
+  if(!(vma->flags & VMA_LAZY))
+    {
+      if(vma->pa_start != 0xffffffff)
+        gran_free(tux_mm_hnd, (void*)(vma->pa_start + start - vma->va_start), end - start);
+      return;
+    }
+
+  for(va = start; va < end;)
+    {
+      pda = vma_tree_next(&vm->pdas, va);
+      if(!pda || pda->va_start >= end) break;
+
+      if(va < pda->va_start) va = pda->va_start;
 
-      pptr->next = ret;
-      ret->va_start = pptr->va_end;
+      // Unmap a batch, the allocator may sleep
+      n = 0;
+      flags = enter_critical_section();
+      for(; va < end && va < pda->va_end && n < TUX_MM_RELEASE_BATCH; va += PAGE_SIZE)
+        {
+          pte = tux_mm_pte(pda, va, NULL);
+          if(!pte) continue;
+
+          tux_mm_pte(pda, va, &zero);
+          tux_mm_invlpg(va);
+
+          page = pte & TUX_PTE_ADDR;
+          if(tux_mm_refs[TUX_MM_PAGE(page)])
+            tux_mm_refs[TUX_MM_PAGE(page)]--;
+          else
+            pages[n++] = page;
+        }
+      leave_critical_section(flags);
+
+      // The other CPUs running this address space unmap them as well
+      up_tlb_shootdown();
+
+      for(i = 0; i < n; i++)
+        gran_free(tux_mm_hnd, (void*)pages[i], PAGE_SIZE);
     }
+}
+
+/* A page directory covering [start, end), both huge page aligned */
+static struct vma_s* tux_mm_new_pda(struct tcb_s *tcb, uint64_t start, uint64_t end) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* pda;
+  irqstate_t flags;
+  uint64_t *tmp_pd;
+  uint64_t j;
+
+  pda = kmm_zalloc(sizeof(struct vma_s));
+  if(!pda) return NULL;
+
+  // Permissions are enforced by the page tables below
+  pda->proto = 0x3;
+  pda->_backing = "";
+  pda->va_start = start;
+  pda->va_end = end;
+
+  pda->pa_start = (uintptr_t)gran_alloc(tux_mm_hnd, PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
+  if(!pda->pa_start)
+    {
+      svcinfo("TUX: mmap failed to allocate 0x%llx bytes for new pda\n", PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
+      kmm_free(pda);
+      return NULL;
+    }
+
+  svcinfo("New pda: %llx - %llx %llx\n", pda->va_start, pda->va_end, pda->pa_start);
+
+  // Clear the page directories
+  flags = enter_critical_section();
+  tmp_pd = temp_map_at_0xc0000000(pda->pa_start, pda->pa_start + PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
+  memset(tmp_pd, 0, PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
+  leave_critical_section(flags);
+
+  vma_tree_insert(&vm->pdas, pda);
+  tux_mm_sync(tcb);
+
+  // Map it via page directories, huge pages stay until they are split
+  flags = enter_critical_section();
+  tmp_pd = temp_map_at_0xc0000000((uintptr_t)tcb->xcp.pd1, (uintptr_t)tcb->xcp.pd1 + PAGE_SIZE);
+  for(j = pda->va_start; j < pda->va_end; j += HUGE_PAGE_SIZE) {
+    if(!(tmp_pd[(j >> 21) & 0x7ffffff] & TUX_PDE_HUGE))
+      tmp_pd[(j >> 21) & 0x7ffffff] = (((j - pda->va_start) >> 9) + pda->pa_start) | pda->proto;
+  }
+  leave_critical_section(flags);
+
+  return pda;
+}
+
+/* Map the huge pages of vma with page tables again, so that they can be
+ * unmapped or shared 4 KiB at a time.  The memory stays where it is. */
+static int tux_mm_demote(struct tcb_s *tcb, struct vma_s* vma) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* pda;
+  irqstate_t flags;
+  uintptr_t pt;
+  uint64_t saved;
+  uint64_t pde;
+  uint64_t va;
+  int i;
+
+  for(va = vma->va_start; va < vma->va_end; va += HUGE_PAGE_SIZE)
+    {
+      pda = vma_tree_lookup(&vm->pdas, va);
+      if(!pda)
+        pda = tux_mm_new_pda(tcb, va, va + HUGE_PAGE_SIZE);
+      if(!pda)
+        return -ENOMEM;
+
+      pt = pda->pa_start + ((va - pda->va_start) >> 9);
+
+      flags = enter_critical_section();
+
+      pde = tux_mm_pde(tcb, va, NULL);
+      if(pde & TUX_PDE_HUGE)
+        {
+          saved = tux_mm_window_open(pt);
+          for(i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+            tux_mm_window_at(pt)[i] = ((pde & TUX_PDE_ADDR) + i * PAGE_SIZE) | vma->proto | (pde & TUX_PTE_MIRRORED);
+          tux_mm_window_close(saved);
+
+          tux_mm_pde_reset(tcb, va);
+        }
+
+      leave_critical_section(flags);
+    }
+
+  // Tracked page by page from now on
+  vma->flags = (vma->flags & ~VMA_HUGE) | VMA_LAZY;
+  set_pcid(this_task()->pid);
+  up_tlb_shootdown();
+
+  return OK;
+}
+
+/* Back vma with zeroed huge pages, mapped by the page directory alone */
+static int tux_mm_map_huge(struct tcb_s *tcb, struct vma_s* vma) {
+  uintptr_t page;
+  uint64_t pde;
+  uint64_t va;
+
+  for(va = vma->va_start; va < vma->va_end; va += HUGE_PAGE_SIZE)
+    {
+      page = tux_mm_huge_alloc();
+      if(!page)
+        {
+          tux_mm_release(tcb, vma, vma->va_start, va);
+          return -ENOMEM;
+        }
+
+      // Through the window, the mapping may be read only
+      tux_mm_zero(page, HUGE_PAGE_SIZE);
+
+      pde = page | vma->proto | TUX_PDE_HUGE;
+      tux_mm_pde(tcb, va, &pde);
+    }
+
+  // Whatever was cached for the range is stale
+  set_pcid(this_task()->pid);
+  up_tlb_shootdown();
+
+  return OK;
+}
+
+void revoke_vma(struct vma_s* vma){
+  struct tcb_s *tcb = this_task();
+
+  if(vma == NULL) return;
+
+  vma_tree_remove(&tux_mm_vm(tcb)->vmas, vma);
+  kmm_free(vma);
+
+  tux_mm_sync(tcb);
 
-  ret->va_end = ret->va_start + size;
   return;
 }
 
-void make_vma_free(struct vma_s* ret) {
+int get_free_vma(struct vma_s* ret, uint64_t size, uint64_t align) {
   struct tcb_s *tcb = this_task();
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  uint64_t addr;
+
+  if(!ret) return -1;
+
+  // Room to slide up to the alignment
+  if(vma_tree_find_gap(&vm->vmas, size + align - PAGE_SIZE, PAGE_SIZE, 0x34000000, &addr))
+    return -1;
+
+  addr = (addr + align - 1) & ~(align - 1);
+
+  ret->va_start = addr;
+  ret->va_end = addr + size;
+
+  vma_tree_insert(&vm->vmas, ret);
+  tux_mm_sync(tcb);
+
+  return 0;
+}
+
+/* Demote the huge mappings whose huge pages [start, end) cuts in the
+ * middle, nothing is lost on failure */
+static int tux_mm_split_huge(struct tcb_s *tcb, uint64_t start, uint64_t end) {
+  struct vma_s* ptr;
+
+  for(ptr = vma_tree_next(&tux_mm_vm(tcb)->vmas, start); ptr && ptr->va_start < end; ptr = ptr->next) {
+    if(!(ptr->flags & VMA_HUGE))
+      continue;
+
+    if((start > ptr->va_start && (start & ~HUGE_PAGE_MASK)) ||
+       (end < ptr->va_end && (end & ~HUGE_PAGE_MASK)))
+      {
+        if(tux_mm_demote(tcb, ptr))
+          return -ENOMEM;
+      }
+  }
+
+  return OK;
+}
+
+/* Unmap whatever overlaps ret and link ret in its place */
+int make_vma_free(struct vma_s* ret) {
+  struct tcb_s *tcb = this_task();
+  struct vm_map_s* vm = tux_mm_vm(tcb);
   struct vma_s* ptr;
-  struct vma_s** pptr;
-  uint64_t prev_end = 0;
-  int linked = 0;
+  struct vma_s* next;
+  struct vma_s* new_mapping;
+  uint64_t start = ret->va_start;
+  uint64_t end = ret->va_end;
 
-  ret->next = NULL;
+  if(tux_mm_split_huge(tcb, start, end))
+    return -ENOMEM;
 
-  for(prev_end = 0, pptr = &tcb->xcp.vma, ptr = tcb->xcp.vma; ptr; prev_end = ptr->va_end, pptr = &(ptr->next), ptr = ptr->next) {
-    if(ptr == &g_vm_full_map) continue;
-    if(ptr == ret) continue;
+  for(ptr = vma_tree_next(&vm->vmas, start); ptr && ptr->va_start < end; ptr = next) {
+    next = ptr->next;
 
-    if(ret->va_start <= ptr->va_start && ret->va_end >= ptr->va_end)
+    if(start <= ptr->va_start && end >= ptr->va_end)
       {
         // Whole covered, remove this mapping
-        *pptr = ret;
-        ret->next = ptr->next;
-
         svcinfo("removing covered\n");
 
-        gran_free(tux_mm_hnd, (void*)(ptr->pa_start), ptr->va_end - ptr->va_start);
+        vma_tree_remove(&vm->vmas, ptr);
+        tux_mm_release(tcb, ptr, ptr->va_start, ptr->va_end);
         kmm_free(ptr);
-
-        ptr = ret;
-
-        linked = 1;
       }
-    else if(ret->va_start > ptr->va_start && ret->va_start < ptr->va_end)
+    else if(start > ptr->va_start && end < ptr->va_end)
       {
-        if(ret->va_end < ptr->va_end)
-          {
-            // Break to 2
-            svcinfo("Break2\n");
-            struct vma_s* new_mapping = kmm_malloc(sizeof(struct vma_s));
-            memcpy(new_mapping, ptr, sizeof(struct vma_s));
-            ptr->va_end = ret->va_start;
-            new_mapping->va_start = ret->va_end;
-            new_mapping->pa_start += ret->va_end - ptr->va_start;
-            ptr->next = ret;
-            ret->next = new_mapping;
-
-            gran_free(tux_mm_hnd, (void*)(ptr->pa_start + ptr->va_end - ptr->va_start), VMA_SIZE(ret));
-            return;
-          }
-        else
-          {
-            // Shrink End
-            svcinfo("Shrink End\n");
-            gran_free(tux_mm_hnd, (void*)(ptr->pa_start + ret->va_start - ptr->va_start), ptr->va_end - ret->va_start);
-            ptr->va_end = ret->va_start;
-            ret->next = ptr->next;
-            ptr->next = ret;
-
-            linked = 1;
-          }
+        // Break to 2
+        svcinfo("Break2\n");
+        new_mapping = kmm_zalloc(sizeof(struct vma_s));
+        new_mapping->va_start = end;
+        new_mapping->va_end = ptr->va_end;
+        new_mapping->pa_start = ptr->pa_start == 0xffffffff ? 0xffffffff : ptr->pa_start + end - ptr->va_start;
+        new_mapping->proto = ptr->proto;
+        new_mapping->flags = ptr->flags;
+        new_mapping->_backing = ptr->_backing;
+
+        tux_mm_release(tcb, ptr, start, end);
+
+        ptr->va_end = start;
+        vma_tree_update(&vm->vmas, ptr);
+        vma_tree_insert(&vm->vmas, new_mapping);
+        break;
       }
-    else if(ret->va_end > ptr->va_start && ret->va_end <= ptr->va_end)
+    else if(start > ptr->va_start)
       {
-        if(ret->va_start <= ptr->va_start)
-          {
-
-            svcinfo("Shrink Head\n");
-            // Shrink Head
-            gran_free(tux_mm_hnd, (void*)(ptr->pa_start), ret->va_end - ptr->va_start);
-            ptr->pa_start = ptr->pa_start + ret->va_end - ptr->va_start;
-            ptr->va_start = ret->va_end;
-            *pptr = ret;
-            ret->next = ptr;
-            // In strictly increasing order, we end here
-            return;
-          }
+        // Shrink End
+        svcinfo("Shrink End\n");
+        tux_mm_release(tcb, ptr, start, ptr->va_end);
+        ptr->va_end = start;
+        vma_tree_update(&vm->vmas, ptr);
       }
-    else if((ret->va_start >= prev_end) && ret->va_end <= ptr->va_start)
+    else
       {
-        // Hole
-        *pptr = ret;
-        ret->next = ptr;
-        return;
+        // Shrink Head
+        svcinfo("Shrink Head\n");
+        tux_mm_release(tcb, ptr, ptr->va_start, end);
+        if(ptr->pa_start != 0xffffffff)
+          ptr->pa_start = ptr->pa_start + end - ptr->va_start;
+        ptr->va_start = end;
+        vma_tree_update(&vm->vmas, ptr);
       }
   }
 
-  if(!linked) *pptr = ret;
+  vma_tree_insert(&vm->vmas, ret);
+  tux_mm_sync(tcb);
 
-  return;
+  return OK;
 }
 
 long map_pages(struct vma_s* vma){
   struct tcb_s *tcb = this_task();
+  struct vm_map_s* vm = tux_mm_vm(tcb);
   irqstate_t flags;
-  uint64_t i, j, k;
-  uint64_t prev_end;
+  uint64_t i, j;
+  uint64_t end;
   struct vma_s* pda;
-  struct vma_s* ptr;
-  struct vma_s** pptr;
   uint64_t *tmp_pd;
 
-  int pg_index = (uint64_t)vma->va_start / PAGE_SIZE;
-
   if(vma->va_start >= 0x34000000) return -1; // Mapping out of bound
   if(vma->va_end - vma->va_start > 0x34000000) return -1; // Mapping out of bound
 
-  svcinfo("Creating mapping %llx %llx\n", vma->va_start, vma->va_end);
-
-  // Search the pdas for insertion, map the un mapped pd duriong the creation of new pda
   svcinfo("Mapping: %llx - %llx\n", vma->va_start, vma->va_end);
-  i = vma->va_start;
-  for(prev_end = 0, pptr = &tcb->xcp.pda, ptr = tcb->xcp.pda; ptr; prev_end = ptr->va_end, pptr = &(ptr->next), ptr = ptr->next)
+
+  // Only the page directories around the mapping are visited
+  for(i = vma->va_start; i < vma->va_end; i = j)
     {
-      if(i < ptr->va_start && i >= prev_end)
+      pda = vma_tree_next(&vm->pdas, i);
+
+      if(!pda || i < pda->va_start)
         {
-          // Fall between 2 pda
-          svcinfo("%llx, Between: %llx, and %llx - %llx\n", i, prev_end, ptr->va_start, ptr->va_end);
+          // Fall in a hole, the new pda covers as much of it as needed
+          end = (pda && pda->va_start < vma->va_end) ? pda->va_start : vma->va_end;
 
-          pda = kmm_malloc(sizeof(struct vma_s));
+          pda = tux_mm_new_pda(tcb, i & HUGE_PAGE_MASK, (end + HUGE_PAGE_SIZE - 1) & HUGE_PAGE_MASK);
           if(!pda) return -1;
-          pda->proto = vma->proto;
-          pda->_backing = vma->_backing;
-
-          // pda's size should cover sufficient size of the Hole
-          pda->va_start = i & HUGE_PAGE_MASK;
-          for(pda->va_end = i; pda->va_end < ptr->va_start && pda->va_end < vma->va_end; pda->va_end += PAGE_SIZE); // Scan the hole size;
-          pda->va_end = (pda->va_end + HUGE_PAGE_SIZE - 1) & HUGE_PAGE_MASK;
-
-          pda->pa_start = (void*)gran_alloc(tux_mm_hnd, PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
-          if(!pda->pa_start)
-            {
-              svcinfo("TUX: mmap failed to allocate 0x%llx bytes for new pda\n", PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
-              return -1;
-            }
-
-          svcinfo("New pda: %llx - %llx %llx\n", pda->va_start, pda->va_end, pda->pa_start);
-
-          // Temporary map the memory for writing
-          flags = enter_critical_section();
-          tmp_pd = temp_map_at_0xc0000000(pda->pa_start, pda->pa_start + PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
-
-          // Clear the page directories
-          memset(tmp_pd, 0, PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
+        }
 
-          // Fill in the new mappings to page directories
-          for(j = i; j < ptr->va_start && j < vma->va_end; j += PAGE_SIZE) // Scan the hole size;
-            tmp_pd[((j - pda->va_start) >> 12) & 0x3ffff] = (vma->pa_start + j - vma->va_start) | vma->proto;
-          leave_critical_section(flags);
+      // Temporary map the memory for writing
+      flags = enter_critical_section();
+      tmp_pd = temp_map_at_0xc0000000(pda->pa_start, pda->pa_start + PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
 
-          up_invalid_TLB(i, j);
+      // Unbacked ranges are not present, lazy pages are filled on fault
+      for(j = i; j < pda->va_end && j < vma->va_end; j += PAGE_SIZE)
+        tmp_pd[((j - pda->va_start) >> 12) & 0x3ffff] = vma->pa_start == 0xffffffff ? 0 : (vma->pa_start + j - vma->va_start) | vma->proto;
+      leave_critical_section(flags);
 
-          // Link it to the pdas list
-          *pptr = pda;
-          pda->next = ptr;
+      up_invalid_TLB(i, j);
+    }
 
-          // Temporary map the memory for writing
-          flags = enter_critical_section();
-          tmp_pd = temp_map_at_0xc0000000(tcb->xcp.pd1, (uintptr_t)tcb->xcp.pd1 + PAGE_SIZE);
+  svcinfo("TUX: mmap maped 0x%llx bytes at 0x%llx, backed by 0x%llx\n", vma->va_end - vma->va_start, vma->va_start, vma->pa_start);
 
-          // Map it via page directories
-          for(j = pda->va_start; j < pda->va_end; j += HUGE_PAGE_SIZE) {
-            tmp_pd[(j >> 21) & 0x7ffffff] = (((j - pda->va_start) >> 9) + pda->pa_start) | pda->proto;
-          }
-          leave_critical_section(flags);
+  return OK;
+}
 
-          i = ptr->va_start < vma->va_end ? ptr->va_start : vma->va_end;
-        }
+/* Give the forked child the address space of the calling task.  Backed
+ * pages are shared read only and copied by whoever writes to them first,
+ * so both sides track their memory page by page from now on. */
+int tux_mm_fork(struct tcb_s *child) {
+  struct tcb_s *rtcb = this_task();
+  struct vm_map_s* pvm = tux_mm_vm(rtcb);
+  struct vm_map_s* vm;
+  struct vma_s* ptr;
+  struct vma_s* curr;
+  struct vma_s* ppda;
+  struct vma_s* cpda;
+  irqstate_t flags;
+  uintptr_t page;
+  uint64_t saved;
+  uint64_t pte;
+  uint64_t va;
 
-      if(i >= ptr->va_start && i < ptr->va_end)
-        {
-          svcinfo("%llx Overlapping: %llx - %llx\n", i, ptr->va_start, ptr->va_end);
-          // In this pda
+  // Sharing works on 4 KiB pages, split the huge ones
+  for(ptr = pvm->vmas.first; ptr; ptr = ptr->next)
+    {
+      if((ptr->flags & VMA_HUGE) && tux_mm_demote(rtcb, ptr))
+        return -ENOMEM;
+    }
 
-          // Temporary map the memory for writing
-          flags = enter_critical_section();
-          tmp_pd = temp_map_at_0xc0000000(ptr->pa_start, ptr->pa_start + PAGE_SIZE * VMA_SIZE(ptr) / HUGE_PAGE_SIZE);
+  vm = child->xcp.vm = kmm_zalloc(sizeof(struct vm_map_s));
+  if(!vm) return -ENOMEM;
 
-          // Map it via page directories
-          for(; i < ptr->va_end && i < vma->va_end; i += PAGE_SIZE)
-              tmp_pd[((i - ptr->va_start) >> 12) & 0x3ffff] = (vma->pa_start + i - vma->va_start) | vma->proto;
-          leave_critical_section(flags);
-        }
+  child->xcp.pd1 = tux_mm_new_pd1();
 
-      if(i == vma->va_end) break;
+  for(ppda = pvm->pdas.first; ppda; ppda = ppda->next)
+    {
+      if(!tux_mm_new_pda(child, ppda->va_start, ppda->va_end))
+        return -ENOMEM;
     }
 
-  if(i < vma->va_end)
+  for(ptr = pvm->vmas.first; ptr; ptr = ptr->next)
     {
-      svcinfo("Insert at End\n");
-      // Fall after all pdas
-      // Preserving the starting addr
-      pda = kmm_malloc(sizeof(struct vma_s));
-      if(!pda) return -1;
-      pda->proto = vma->proto;
-      pda->_backing = vma->_backing;
+      if(ptr->pa_start == 0xffffffff && !(ptr->flags & VMA_LAZY)) continue;
 
-      // pda's size should cover sufficient size of the Hole
-      pda->va_start = i & HUGE_PAGE_MASK;
-      pda->va_end = (vma->va_end + HUGE_PAGE_SIZE - 1) & HUGE_PAGE_MASK;
+      curr = kmm_zalloc(sizeof(struct vma_s));
+      if(!curr) return -ENOMEM;
 
-      pda->pa_start = (void*)gran_alloc(tux_mm_hnd, PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
-      if(!pda->pa_start)
-        {
-          svcinfo("TUX: mmap failed to allocate 0x%llx bytes for new pda\n", PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
-          return -1;
-        }
+      curr->va_start = ptr->va_start;
+      curr->va_end = ptr->va_end;
+      curr->proto = ptr->proto;
+      curr->flags = VMA_LAZY;
+      curr->pa_start = 0xffffffff;
 
-      svcinfo("New pda: %llx - %llx %llx\n", pda->va_start, pda->va_end, pda->pa_start);
+      curr->_backing = kmm_zalloc(strlen(ptr->_backing) + 1);
+      strcpy(curr->_backing, ptr->_backing);
 
-      // Temporary map the memory for writing
-      flags = enter_critical_section();
-      tmp_pd = temp_map_at_0xc0000000(pda->pa_start, pda->pa_start + VMA_SIZE(pda));
+      ptr->flags |= VMA_LAZY;
+      ptr->pa_start = 0xffffffff;
 
-      // Clear the page directories
-      memset(tmp_pd, 0, PAGE_SIZE * VMA_SIZE(pda) / HUGE_PAGE_SIZE);
+      vma_tree_insert(&vm->vmas, curr);
 
-      // Fill in the new mappings to page directories
-      for(j = i; j < vma->va_end; j += PAGE_SIZE) // Scan the hole size;
-        tmp_pd[((j - pda->va_start) >> 12) & 0x3ffff] = (vma->pa_start + j - vma->va_start) | vma->proto;
-      leave_critical_section(flags);
+      for(va = ptr->va_start; va < ptr->va_end; va += PAGE_SIZE)
+        {
+          ppda = vma_tree_lookup(&pvm->pdas, va);
+          cpda = vma_tree_lookup(&vm->pdas, va);
+          if(!ppda || !cpda) continue;
 
-      up_invalid_TLB(i, j);
+          flags = enter_critical_section();
 
-      // Link it to the pdas list
-      *pptr = pda;
-      pda->next = NULL;
+          pte = tux_mm_pte(ppda, va, NULL);
+          page = pte & TUX_PTE_ADDR;
 
-      flags = enter_critical_section();
-      tmp_pd = temp_map_at_0xc0000000(tcb->xcp.pd1, (uintptr_t)tcb->xcp.pd1 + PAGE_SIZE);
+          if(pte && tux_mm_refs[TUX_MM_PAGE(page)] < UINT8_MAX)
+            {
+              tux_mm_refs[TUX_MM_PAGE(page)]++;
 
-      // Map it via page directories
-      for(j = pda->va_start; j < pda->va_end; j += HUGE_PAGE_SIZE) {
-        tmp_pd[(j >> 21) & 0x7ffffff] = (((j - pda->va_start) >> 9) + pda->pa_start) | pda->proto;
-      }
-      leave_critical_section(flags);
+              // The shadow process of the child inherits the mirror
+              pte = (pte & ~TUX_PTE_RW) | TUX_PTE_COW;
+              tux_mm_pte(ppda, va, &pte);
+              tux_mm_pte(cpda, va, &pte);
+            }
+          else if(pte)
+            {
+              // Too popular to share once more, the child gets a copy
+              while(!(page = tux_mm_reserve_get()))
+                {
+                  leave_critical_section(flags);
+                  tux_mm_refill();
+                  if(!tux_mm_reserve_count) return -ENOMEM;
+                  flags = enter_critical_section();
+                }
+
+              saved = tux_mm_window_open(page);
+              memcpy(tux_mm_window_at(page), (void*)va, PAGE_SIZE);
+              tux_mm_window_close(saved);
+
+              pte = page | ptr->proto;
+              tux_mm_pte(cpda, va, &pte);
+              tux_mm_unmirrored(vm, va);
+            }
+
+          leave_critical_section(flags);
+        }
     }
 
-  svcinfo("TUX: mmap maped 0x%llx bytes at 0x%llx, backed by 0x%llx\n", vma->va_end - vma->va_start, vma->va_start, vma->pa_start);
+  vm->unmirrored_start = pvm->unmirrored_start;
+  vm->unmirrored_end = pvm->unmirrored_end;
+
+  tux_mm_sync(child);
+
+  // Our writable entries may still be cached
+  set_pcid(rtcb->pid);
+  up_tlb_shootdown();
 
   return OK;
 }
@@ -349,7 +1305,7 @@ void print_mapping(void) {
   uint64_t p = 0;
 
   _alert("Current Map: \n");
-  for(ptr = tcb->xcp.vma; ptr && p < 512; ptr = ptr->next, p++)
+  for(ptr = tux_mm_vm(tcb)->vmas.first; ptr && p < 512; ptr = ptr->next, p++)
     {
       if(ptr == &g_vm_full_map) continue;
       _alert("0x%08llx - 0x%08llx : backed by 0x%08llx 0x%08llx %s\n", ptr->va_start, ptr->va_end, ptr->pa_start, ptr->pa_start + VMA_SIZE(ptr), ptr->_backing);
@@ -357,7 +1313,7 @@ void print_mapping(void) {
 
   p = 0;
   _alert("Current PDAS: \n");
-  for(ptr = tcb->xcp.pda; ptr && p < 64; ptr = ptr->next, p++)
+  for(ptr = tux_mm_vm(tcb)->pdas.first; ptr && p < 64; ptr = ptr->next, p++)
     {
       if(ptr == &g_vm_full_map) continue;
       _alert("0x%08llx - 0x%08llx : 0x%08llx 0x%08llx\n", ptr->va_start, ptr->va_end, ptr->pa_start, ptr->pa_start + VMA_SIZE(ptr));
@@ -434,10 +1390,159 @@ char* retrive_path(int fd, off_t offset) {
 #endif
 }
 
+/* Track the pages of a mapping one by one, so that they can move on
+ * their own.  Contiguous mappings were mirrored as a whole by mmap. */
+static int tux_mm_track(struct tcb_s *tcb, struct vma_s* vma) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* pda;
+  irqstate_t flags;
+  uint64_t pte;
+  uint64_t va;
+
+  if(vma->flags & VMA_HUGE)
+    return tux_mm_demote(tcb, vma);
+
+  if(vma->flags & VMA_LAZY)
+    return OK;
+
+  for(va = vma->va_start; va < vma->va_end; va += PAGE_SIZE)
+    {
+      pda = vma_tree_lookup(&vm->pdas, va);
+      if(!pda) continue;
+
+      flags = enter_critical_section();
+      pte = tux_mm_pte(pda, va, NULL);
+      if(pte)
+        {
+          pte |= TUX_PTE_MIRRORED;
+          tux_mm_pte(pda, va, &pte);
+        }
+      leave_critical_section(flags);
+    }
+
+  vma->flags |= VMA_LAZY;
+  vma->pa_start = 0xffffffff;
+
+  return OK;
+}
+
+/* Map npages cached pages of file from pgoff on at the start of vma, all
+ * of them or none.  The rest of vma is left to the fault handler. */
+int tux_mm_map_cached(struct tcb_s *tcb, struct vma_s* vma, struct tux_pgcache_file *file, uint64_t pgoff, uint64_t npages) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* pda;
+  irqstate_t flags;
+  uintptr_t page;
+  uint64_t pte;
+  uint64_t va;
+
+  for(va = vma->va_start; va < vma->va_end && npages; va += PAGE_SIZE, pgoff++, npages--)
+    {
+      pda = vma_tree_lookup(&vm->pdas, va);
+      page = pda ? tux_pgcache_lookup(file, pgoff) : 0;
+      if(!page)
+        {
+          tux_mm_release(tcb, vma, vma->va_start, va);
+          return -1;
+        }
+
+      // Shared with the cache, whoever writes first gets a copy
+      pte = ((page | vma->proto) & ~TUX_PTE_RW) | TUX_PTE_COW;
+
+      flags = enter_critical_section();
+      tux_mm_pte(pda, va, &pte);
+      tux_mm_unmirrored(vm, va);
+      leave_critical_section(flags);
+    }
+
+  return OK;
+}
+
+/* Hand the first npages pages of vma to the page cache as pgoff on of
+ * file, they are copied on write from now on */
+void tux_mm_cache_pages(struct tcb_s *tcb, struct vma_s* vma, struct tux_pgcache_file *file, uint64_t pgoff, uint64_t npages) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* pda;
+  irqstate_t flags;
+  uint64_t pte;
+  uint64_t va;
+
+  if(tux_mm_track(tcb, vma)) return;
+
+  for(va = vma->va_start; va < vma->va_end && npages; va += PAGE_SIZE, pgoff++, npages--)
+    {
+      pda = vma_tree_lookup(&vm->pdas, va);
+      if(!pda) continue;
+
+      flags = enter_critical_section();
+      pte = tux_mm_pte(pda, va, NULL);
+      leave_critical_section(flags);
+
+      if(!pte) continue;
+
+      tux_pgcache_insert(file, pgoff, pte & TUX_PTE_ADDR);
+
+      flags = enter_critical_section();
+      pte = (tux_mm_pte(pda, va, NULL) & ~TUX_PTE_RW) | TUX_PTE_COW;
+      tux_mm_pte(pda, va, &pte);
+      leave_critical_section(flags);
+    }
+
+  set_pcid(this_task()->pid);
+  up_tlb_shootdown();
+}
+
+/* Anonymous memory is only reserved, unless it must not fault */
+static bool tux_mm_lazy(struct vm_map_s* vm, int flags) {
+#ifdef CONFIG_TUX_MM_LAZY
+  if(!(flags & MAP_ANONYMOUS)) return false;
+  if(flags & (MAP_POPULATE | MAP_LOCKED)) return false;
+  if(vm->flags & VM_LOCKED) return false;
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* Large anonymous memory made of whole huge pages skips the page tables */
+static bool tux_mm_huge(int flags, void* addr, uint64_t length) {
+#ifdef CONFIG_TUX_MM_HUGE
+  if(!(flags & MAP_ANONYMOUS)) return false;
+  if(length < CONFIG_TUX_MM_HUGE_THRESHOLD * 1024ULL) return false;
+  if(length & ~HUGE_PAGE_MASK) return false;
+  if((flags & MAP_FIXED) && ((uintptr_t)addr & ~HUGE_PAGE_MASK)) return false;
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* Page table bits granting prot, none at all for PROT_NONE */
+static uint64_t tux_mm_proto(int prot) {
+  uint64_t proto = 0;
+
+  if(prot & (PROT_READ | PROT_WRITE | PROT_EXEC))
+    proto |= TUX_PTE_PRESENT;
+  if(prot & PROT_WRITE)
+    proto |= TUX_PTE_RW;
+  if(proto && !(prot & PROT_EXEC))
+    proto |= TUX_PTE_NX;
+
+  return proto;
+}
+
 void* tux_mmap(unsigned long nbr, void* addr, long length, int prot, int flags, int fd, off_t offset){
   struct tcb_s *tcb = this_task();
   int i, j;
   struct vma_s* vma;
+  irqstate_t irqflags;
+  struct tux_pgcache_file file;
+  uint64_t file_pages;
+  bool cached;
+  bool lazy;
+  bool huge;
 
   /* Round to page boundary */
   /* adjust length to accomdate change in size */
@@ -449,38 +1554,72 @@ void* tux_mmap(unsigned long nbr, void* addr, long length, int prot, int flags,
 
   svcinfo("TUX: mmap with flags: %x\n", flags);
 
-  if(((flags & MAP_NORESERVE)) && (prot == 0)) return (void*)-1; // Why glibc require large amount of non accessible memory?
+  if(flags & ~(MAP_FIXED | MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_DENYWRITE | MAP_STACK |
+               MAP_NORESERVE | MAP_POPULATE | MAP_LOCKED)) PANIC();
+
+  // Inaccessible memory is only a reservation, it is never backed as such
+  huge = prot != PROT_NONE && tux_mm_huge(flags, addr, num_of_pages * PAGE_SIZE);
+  lazy = !huge && (((flags & MAP_ANONYMOUS) && prot == PROT_NONE) || tux_mm_lazy(tux_mm_vm(tcb), flags));
 
-  if(flags & ~(MAP_FIXED | MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_DENYWRITE | MAP_STACK)) PANIC();
+  // Read only file pages may be mapped by another process already,
+  // the cache is filled by Linux so only for its files
+  cached = !(flags & MAP_ANONYMOUS) && !(prot & PROT_WRITE) && !(offset & ~PAGE_MASK) &&
+           fd < CONFIG_TUX_FD_RESERVE && !tux_pgcache_file(fd, &file);
+  if(cached)
+    {
+      lazy = true;
+      file_pages = file.size > offset ? (file.size - offset + PAGE_SIZE - 1) / PAGE_SIZE : 0;
+    }
 
   svcinfo("TUX: mmap get vma\n");
 
   vma = kmm_malloc(sizeof(struct vma_s));
   if(!vma) return (void*)-1;
 
-  // TODO: process proto
-  vma->proto = 0x3;
+  vma->proto = tux_mm_proto(prot);
+  vma->flags = 0;
   vma->_backing = "[Memory]";
 
-  svcinfo("TUX: mmap get mem\n");
-  // Create backing memory
-  // The allocated physical memory is non-accessible from this process, must be mapped
-  vma->pa_start = gran_alloc(tux_mm_hnd, num_of_pages * PAGE_SIZE);
-  if(!vma->pa_start)
+  if(huge)
     {
-      svcinfo("TUX: mmap failed to allocate 0x%llx bytes\n", num_of_pages * PAGE_SIZE);
-      kmm_free(vma);
-      return -1;
+      // Backed by the page directory once placed
+      vma->flags = VMA_HUGE;
+      vma->pa_start = 0xffffffff;
+    }
+  else if(lazy)
+    {
+      // Backed page by page on first touch
+      vma->flags = VMA_LAZY;
+      vma->pa_start = 0xffffffff;
     }
+  else
+    {
+      svcinfo("TUX: mmap get mem\n");
+      // Create backing memory
+      // The allocated physical memory is non-accessible from this process, must be mapped
+      vma->pa_start = gran_alloc(tux_mm_hnd, num_of_pages * PAGE_SIZE);
+      if(!vma->pa_start)
+        {
+          svcinfo("TUX: mmap failed to allocate 0x%llx bytes\n", num_of_pages * PAGE_SIZE);
+          kmm_free(vma);
+          return -1;
+        }
 
-  svcinfo("TUX: mmap allocated 0x%llx bytes at 0x%llx\n", num_of_pages * PAGE_SIZE, vma->pa_start);
+      svcinfo("TUX: mmap allocated 0x%llx bytes at 0x%llx\n", num_of_pages * PAGE_SIZE, vma->pa_start);
+    }
 
   if(!(flags & MAP_FIXED)) // Fixed mapping?
     {
       svcinfo("TUX: mmap trying to allocate 0x%llx bytes\n", length);
 
       // Free page_table entries
-      get_free_vma(vma, num_of_pages * PAGE_SIZE);
+      if(get_free_vma(vma, num_of_pages * PAGE_SIZE, huge ? HUGE_PAGE_SIZE : PAGE_SIZE))
+        {
+          if(vma->pa_start != 0xffffffff)
+            gran_free(tux_mm_hnd, (void*)(vma->pa_start), num_of_pages * PAGE_SIZE);
+          kmm_free(vma);
+          return (void*)-1;
+        }
       addr = vma->va_start;
     }
   else
@@ -490,21 +1629,84 @@ void* tux_mmap(unsigned long nbr, void* addr, long length, int prot, int flags,
       // Free page_table entries
       vma->va_start = addr;
       vma->va_end = addr + num_of_pages * PAGE_SIZE;
-      make_vma_free(vma);
+      if(make_vma_free(vma))
+        {
+          if(vma->pa_start != 0xffffffff)
+            gran_free(tux_mm_hnd, (void*)(vma->pa_start), num_of_pages * PAGE_SIZE);
+          kmm_free(vma);
+          return (void*)-1;
+        }
+    }
+
+  if(huge)
+    {
+      if(tux_mm_map_huge(tcb, vma) == OK)
+        {
+          // Mirrored along with the lazy pages by the next delegated call
+          irqflags = enter_critical_section();
+          tux_mm_unmirrored(tux_mm_vm(tcb), vma->va_start);
+          tux_mm_unmirrored(tux_mm_vm(tcb), vma->va_end - PAGE_SIZE);
+          leave_critical_section(irqflags);
+
+          return addr;
+        }
+
+      // Out of huge pages, fall back to page tables
+      vma->flags = VMA_LAZY;
+      lazy = true;
     }
 
   if(map_pages(vma))
     {
-      gran_free(tux_mm_hnd, (void*)(vma->pa_start), VMA_SIZE(vma));
+      if(!lazy)
+        gran_free(tux_mm_hnd, (void*)(vma->pa_start), VMA_SIZE(vma));
       revoke_vma(vma);
       return (void*)-1;
     }
 
-  // Zero fill the newly mapped page via virtual memory
-  memset(vma->va_start, 0, VMA_SIZE(vma));
+  if(cached)
+    {
+      if(tux_mm_map_cached(tcb, vma, &file, offset / PAGE_SIZE, file_pages) == OK)
+        {
+          vma->_backing = retrive_path(fd, offset);
+          return addr;
+        }
+
+      // Not all there, have Linux fill the mapping and keep its pages
+      vma->flags = 0;
+      vma->pa_start = gran_alloc(tux_mm_hnd, VMA_SIZE(vma));
+      if(!vma->pa_start)
+        {
+          revoke_vma(vma);
+          return (void*)-1;
+        }
+
+      lazy = false;
+      if(map_pages(vma))
+        {
+          gran_free(tux_mm_hnd, (void*)(vma->pa_start), VMA_SIZE(vma));
+          revoke_vma(vma);
+          return (void*)-1;
+        }
+    }
+
+  if(lazy)
+    {
+      // Nothing to zero or mirror yet, have pages ready for the first touches
+      tux_mm_refill();
+
+      // Unless it was meant to be backed up front
+      if(vma->proto && !tux_mm_lazy(tux_mm_vm(tcb), flags))
+        tux_mm_populate(tcb, vma->va_start, vma->va_end);
+
+      return addr;
+    }
+
+  // Zero fill the newly mapped page via the window, it may be read only
+  tux_mm_zero(vma->pa_start, VMA_SIZE(vma));
 
-  // Trigger the shadow process to gain the same mapping
-  // TODO: Pass proto
+  // Trigger the shadow process to gain the same mapping, writable as it
+  // fills in the file data and the results of delegated calls
   if(tux_delegate(9, (((uint64_t)vma->pa_start) << 32) | (uint64_t)vma->va_start, vma->va_end - vma->va_start,
               0, MAP_ANONYMOUS, 0, 0) == -1)
     {
@@ -516,12 +1718,27 @@ void* tux_mmap(unsigned long nbr, void* addr, long length, int prot, int flags,
       /* get debug friendly name */
       vma->_backing = retrive_path(fd, offset);
 
+      /* Files of the local mounts are not known to the shadow process */
+      if(fd >= CONFIG_TUX_FD_RESERVE)
+        {
+          if(tux_mm_fill_local(vma->pa_start, VMA_SIZE(vma), fd - CONFIG_TUX_FD_RESERVE, offset))
+            {
+              revoke_vma(vma);
+              return (void*)-1;
+            }
+
+          return addr;
+        }
+
       /* Tell shadow process to fill the file data */
       if(tux_delegate(nbr, (uint64_t)addr, length, prot, flags, fd, offset) == -1)
         {
           revoke_vma(vma);
           return (void*)-1;
         }
+
+      if(cached)
+        tux_mm_cache_pages(tcb, vma, &file, offset / PAGE_SIZE, file_pages);
     }
 
   /*print_mapping();*/
@@ -542,6 +1759,7 @@ long tux_munmap(unsigned long nbr, void* addr, size_t length){
   if(!vma) return (void*)-1;
 
   vma->proto = 0x0;
+  vma->flags = 0;
   vma->_backing = "[None]";
 
   // Free page_table entries
@@ -549,37 +1767,309 @@ long tux_munmap(unsigned long nbr, void* addr, size_t length){
   vma->va_end = addr + num_of_pages * PAGE_SIZE;
   vma->pa_start = 0xffffffff;
 
-  make_vma_free(vma);
+  if(make_vma_free(vma))
+    {
+      kmm_free(vma);
+      return -ENOMEM;
+    }
   map_pages(vma);
 
+  // Nothing is left behind, the range may be reused
+  revoke_vma(vma);
+
   /*print_mapping();*/
 
   return 0;
 }
 
+/* Cut vma in two at the page boundary at, the upper part follows it */
+static int tux_mm_split(struct tcb_s *tcb, struct vma_s* vma, uint64_t at) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* upper;
+  irqstate_t flags;
+
+  upper = kmm_zalloc(sizeof(struct vma_s));
+  if(!upper) return -ENOMEM;
+
+  upper->va_start = at;
+  upper->va_end = vma->va_end;
+  upper->pa_start = vma->pa_start == 0xffffffff ? 0xffffffff : vma->pa_start + at - vma->va_start;
+  upper->proto = vma->proto;
+  upper->flags = vma->flags;
+  upper->_backing = vma->_backing;
+
+  // The fault handler must never see the upper part unmapped
+  flags = enter_critical_section();
+  vma->va_end = at;
+  vma_tree_update(&vm->vmas, vma);
+  vma_tree_insert(&vm->vmas, upper);
+  leave_critical_section(flags);
+
+  return OK;
+}
+
+/* Give the mappings of [start, end) the permissions proto, splitting them
+ * at the bounds.  Pages still shared by fork stay read only, the first
+ * write copies them as usual. */
+static long tux_mm_protect(struct tcb_s *tcb, uint64_t start, uint64_t end, uint64_t proto) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* ptr;
+  struct vma_s* pda;
+  irqstate_t flags;
+  uint64_t pte;
+  uint64_t va;
+
+  // Like Linux, a hole in the range fails the whole call
+  va = start;
+  for(ptr = vma_tree_next(&vm->vmas, start); ptr && ptr->va_start < end; ptr = ptr->next)
+    {
+      if(ptr->va_start > va) return -ENOMEM;
+      va = ptr->va_end;
+    }
+  if(va < end) return -ENOMEM;
+
+  if(tux_mm_split_huge(tcb, start, end))
+    return -ENOMEM;
+
+  for(ptr = vma_tree_next(&vm->vmas, start); ptr && ptr->va_start < end; ptr = ptr->next)
+    {
+      if(ptr->proto == proto) continue;
+
+      if(ptr->va_start < start)
+        {
+          if(tux_mm_split(tcb, ptr, start)) return -ENOMEM;
+          continue;
+        }
+
+      if(ptr->va_end > end && tux_mm_split(tcb, ptr, end))
+        return -ENOMEM;
+
+      ptr->proto = proto;
+
+      if(ptr->flags & VMA_HUGE)
+        {
+          for(va = ptr->va_start; va < ptr->va_end; va += HUGE_PAGE_SIZE)
+            {
+              flags = enter_critical_section();
+              pte = tux_mm_pde(tcb, va, NULL);
+              pte = (pte & ~TUX_PTE_PROT) | proto;
+              tux_mm_pde(tcb, va, &pte);
+              leave_critical_section(flags);
+            }
+
+          continue;
+        }
+
+      // Backed pages keep their frame even while inaccessible
+      for(va = ptr->va_start; va < ptr->va_end; va += PAGE_SIZE)
+        {
+          pda = vma_tree_lookup(&vm->pdas, va);
+          if(!pda) continue;
+
+          flags = enter_critical_section();
+          pte = tux_mm_pte(pda, va, NULL);
+          if(pte)
+            {
+              pte = (pte & ~TUX_PTE_PROT) | proto;
+              if(pte & TUX_PTE_COW)
+                pte &= ~TUX_PTE_RW;
+              tux_mm_pte(pda, va, &pte);
+            }
+          leave_critical_section(flags);
+        }
+    }
+
+  // Drop whatever permissions were cached
+  set_pcid(this_task()->pid);
+  up_tlb_shootdown();
+
+  return OK;
+}
+
+long tux_mprotect(unsigned long nbr, void* addr, size_t len, int prot){
+  uint64_t start = (uintptr_t)addr;
+  uint64_t end = ((uintptr_t)addr + len + PAGE_SIZE - 1) & PAGE_MASK;
+
+  svcinfo("TUX: mprotect %llx - %llx to %x\n", start, end, prot);
+
+  if(start & ~PAGE_MASK) return -EINVAL;
+  // We never grow mappings behind the back of the process
+  prot &= ~(TUX_PROT_GROWSDOWN | TUX_PROT_GROWSUP);
+  if(prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) return -EINVAL;
+  if(end < start || end > TUX_MM_USER_END) return -ENOMEM;
+  if(start == end) return 0;
+
+  return tux_mm_protect(this_task(), start, end, tux_mm_proto(prot));
+}
+
+
+long tux_mlock(unsigned long nbr, void* addr, size_t len){
+  uint64_t start = (uintptr_t)addr & PAGE_MASK;
+  uint64_t end = ((uintptr_t)addr + len + PAGE_SIZE - 1) & PAGE_MASK;
+
+  return tux_mm_populate(this_task(), start, end);
+}
+
+long tux_mlock2(unsigned long nbr, void* addr, size_t len, int flags){
+  // Locked anyway, we never swap
+  if(flags & TUX_MLOCK_ONFAULT) return 0;
+
+  return tux_mlock(nbr, addr, len);
+}
+
+long tux_mlockall(unsigned long nbr, int flags){
+  struct tcb_s *tcb = this_task();
+
+  if(flags & MCL_FUTURE)
+    tux_mm_vm(tcb)->flags |= VM_LOCKED;
+
+  if((flags & MCL_CURRENT) && !(flags & TUX_MCL_ONFAULT))
+    return tux_mm_populate(tcb, 0, 0x34000000);
+
+  return 0;
+}
+
+long tux_munlockall(unsigned long nbr){
+  tux_mm_vm(this_task())->flags &= ~VM_LOCKED;
+
+  return 0;
+}
+
+/* Move the pages of [from, from + len) to [to, to + len) by their page
+ * table entries, the page tables of both must exist.  The shadow process
+ * learns the new addresses on the next delegated call. */
+static void tux_mm_move(struct tcb_s *tcb, uint64_t from, uint64_t to, uint64_t len) {
+  struct vm_map_s* vm = tux_mm_vm(tcb);
+  struct vma_s* spda;
+  struct vma_s* dpda;
+  irqstate_t flags;
+  uint64_t zero = 0;
+  uint64_t pte;
+  uint64_t off;
+
+  for(off = 0; off < len; off += PAGE_SIZE)
+    {
+      spda = vma_tree_lookup(&vm->pdas, from + off);
+      dpda = vma_tree_lookup(&vm->pdas, to + off);
+      if(!spda || !dpda) continue;
+
+      flags = enter_critical_section();
+      pte = tux_mm_pte(spda, from + off, NULL);
+      if(pte)
+        {
+          tux_mm_pte(spda, from + off, &zero);
+          tux_mm_invlpg(from + off);
+
+          pte &= ~TUX_PTE_MIRRORED;
+          tux_mm_pte(dpda, to + off, &pte);
+          tux_mm_unmirrored(vm, to + off);
+        }
+      leave_critical_section(flags);
+    }
+
+  // Other threads must not keep writing to the old addresses
+  up_tlb_shootdown();
+}
 
 void* tux_mremap(unsigned long nbr, void *old_address, size_t old_size, size_t new_size, int flags, void *new_address){
   struct tcb_s *tcb = this_task();
+  struct vm_map_s* vm = tux_mm_vm(tcb);
   struct vma_s* vma;
+  struct vma_s* new;
+  struct vma_s ext;
+  uint64_t old_start = (uintptr_t)old_address;
+  uint64_t old_len = (old_size + PAGE_SIZE - 1) & PAGE_MASK;
+  uint64_t new_len = (new_size + PAGE_SIZE - 1) & PAGE_MASK;
+  uint64_t dst = (uintptr_t)new_address;
 
-  if(flags & MREMAP_FIXED) return (void*)-1;
+  svcinfo("TUX: mremap %llx - %llx to 0x%llx bytes, flags %x\n", old_start, old_start + old_len, new_len, flags);
 
-  if(!(flags & MREMAP_MAYMOVE)) return (void*)-1;
+  if(old_start & ~PAGE_MASK) return (void*)-EINVAL;
+  if(flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED)) return (void*)-EINVAL;
+  if((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE)) return (void*)-EINVAL;
+  if(!old_len || !new_len) return (void*)-EINVAL;
 
-  // Calculate page to be mapped
-  uint64_t old_num_of_pages = (uint64_t)(old_size + PAGE_SIZE - 1) / PAGE_SIZE;
-  uint64_t new_num_of_pages = (uint64_t)(new_size + PAGE_SIZE - 1) / PAGE_SIZE;
+  // Only a single mapping can be remapped
+  vma = vma_tree_lookup(&vm->vmas, old_start);
+  if(!vma || old_start + old_len > vma->va_end) return (void*)-EFAULT;
+
+  if(flags & MREMAP_FIXED)
+    {
+      if(dst & ~PAGE_MASK) return (void*)-EINVAL;
+      if(dst < old_start + old_len && old_start < dst + new_len) return (void*)-EINVAL;
+      if(dst + new_len > TUX_MM_USER_END) return (void*)-ENOMEM;
+    }
+  else if(new_len <= old_len)
+    {
+      if(new_len < old_len)
+        tux_munmap(nbr, (void*)(old_start + new_len), old_len - new_len);
+
+      return old_address;
+    }
+  else if(old_start + old_len == vma->va_end &&
+          (!vma->next || vma->next->va_start >= old_start + new_len) &&
+          old_start + new_len <= TUX_MM_USER_END)
+    {
+      // Room behind, the new pages are backed on first touch
+      if(tux_mm_track(tcb, vma)) return (void*)-ENOMEM;
+
+      memset(&ext, 0, sizeof(ext));
+      ext.va_start = vma->va_end;
+      ext.va_end = old_start + new_len;
+      ext.pa_start = 0xffffffff;
+      if(map_pages(&ext)) return (void*)-ENOMEM;
+
+      vma->va_end = ext.va_end;
+      vma_tree_update(&vm->vmas, vma);
+
+      return old_address;
+    }
+  else if(!(flags & MREMAP_MAYMOVE))
+    {
+      return (void*)-ENOMEM;
+    }
+
+  // Move the page table entries, not the data
+  if(tux_mm_track(tcb, vma)) return (void*)-ENOMEM;
 
-  // XXX: PROT and flags should be copied
-  void* new = tux_mmap(nbr, NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+  new = kmm_zalloc(sizeof(struct vma_s));
+  if(!new) return (void*)-ENOMEM;
 
-  if(new == (void*)-1) return (void*)-1;
+  new->proto = vma->proto;
+  new->flags = VMA_LAZY;
+  new->pa_start = 0xffffffff;
+  new->_backing = vma->_backing;
+
+  if(flags & MREMAP_FIXED)
+    {
+      new->va_start = dst;
+      new->va_end = dst + new_len;
+      if(make_vma_free(new))
+        {
+          kmm_free(new);
+          return (void*)-ENOMEM;
+        }
+    }
+  else
+    {
+      if(get_free_vma(new, new_len, PAGE_SIZE))
+        {
+          kmm_free(new);
+          return (void*)-ENOMEM;
+        }
+      dst = new->va_start;
+    }
 
-  memcpy(new, old_address, old_size > new_size ? new_size : old_size);
+  if(map_pages(new))
+    {
+      revoke_vma(new);
+      return (void*)-ENOMEM;
+    }
 
-  svcinfo("TUX: mremap %llx - %llx -> %llx - %llx\n", old_address, old_address + old_num_of_pages * PAGE_SIZE, new, new + new_num_of_pages * PAGE_SIZE);
+  tux_mm_move(tcb, old_start, dst, old_len < new_len ? old_len : new_len);
 
-  tux_munmap(nbr, old_address, old_size);
+  // Whatever did not move goes with the old range
+  tux_munmap(nbr, old_address, old_len);
 
-  return new;
+  return (void*)dst;
 }
@@ -0,0 +1,163 @@
+#include <nuttx/arch.h>
+#include <string.h>
+
+#include "tux.h"
+#include "up_internal.h"
+#include "sched/sched.h"
+
+#ifndef CONFIG_TUX_PAGE_CACHE_PAGES
+#  define CONFIG_TUX_PAGE_CACHE_PAGES 4096
+#endif
+
+#define TUX_PGCACHE_WAYS 4
+#define TUX_PGCACHE_SETS ((CONFIG_TUX_PAGE_CACHE_PAGES + TUX_PGCACHE_WAYS - 1) / TUX_PGCACHE_WAYS)
+
+#define TUX_S_IFMT  0170000
+#define TUX_S_IFREG 0100000
+
+/* The cache holds a reference to every page it knows, each mapping of a
+ * cached page holds one more.  Whoever lets go last frees the page. */
+struct tux_pgcache_entry {
+    struct tux_pgcache_file file;
+    uint64_t pgoff;
+    uintptr_t page;
+    uint32_t stamp;
+};
+
+#if CONFIG_TUX_PAGE_CACHE_PAGES > 0
+
+static struct tux_pgcache_entry tux_pgcache_table[TUX_PGCACHE_SETS * TUX_PGCACHE_WAYS];
+static uint32_t tux_pgcache_clock;
+
+/* Identify the file behind fd, fails for anything but regular files */
+int tux_pgcache_file(int fd, struct tux_pgcache_file *file)
+{
+    struct tux_stat st;
+
+    if(tux_file_delegate(5, fd, (uintptr_t)&st, 0, 0, 0, 0) < 0)
+        return -1;
+
+    if((st.st_mode & TUX_S_IFMT) != TUX_S_IFREG)
+        return -1;
+
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->mtime_sec = st.st_mtime_sec;
+    file->mtime_nsec = st.st_mtime_nsec;
+    file->size = st.st_size;
+
+    return 0;
+}
+
+static struct tux_pgcache_entry *tux_pgcache_set(struct tux_pgcache_file *file, uint64_t pgoff)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    h = (h ^ file->dev) * 1099511628211ULL;
+    h = (h ^ file->ino) * 1099511628211ULL;
+    h = (h ^ pgoff) * 1099511628211ULL;
+
+    return &tux_pgcache_table[(h % TUX_PGCACHE_SETS) * TUX_PGCACHE_WAYS];
+}
+
+static bool tux_pgcache_same(struct tux_pgcache_entry *e, struct tux_pgcache_file *file, uint64_t pgoff)
+{
+    return e->page && e->file.dev == file->dev && e->file.ino == file->ino && e->pgoff == pgoff;
+}
+
+/* The cached page at pgoff of file, with a reference taken for the
+ * caller, or 0.  Pages of older versions of the file are dropped. */
+uintptr_t tux_pgcache_lookup(struct tux_pgcache_file *file, uint64_t pgoff)
+{
+    struct tux_pgcache_entry *e;
+    irqstate_t flags;
+    uintptr_t stale = 0;
+    uintptr_t page = 0;
+    int i;
+
+    e = tux_pgcache_set(file, pgoff);
+
+    flags = enter_critical_section();
+
+    for(i = 0; i < TUX_PGCACHE_WAYS; i++, e++) {
+        if(!tux_pgcache_same(e, file, pgoff))
+            continue;
+
+        if(e->file.size != file->size || e->file.mtime_sec != file->mtime_sec ||
+           e->file.mtime_nsec != file->mtime_nsec) {
+            stale = e->page;
+            e->page = 0;
+        } else if(tux_mm_page_get(e->page)) {
+            page = e->page;
+            e->stamp = ++tux_pgcache_clock;
+        }
+
+        break;
+    }
+
+    leave_critical_section(flags);
+
+    if(stale)
+        tux_mm_page_put(stale);
+
+    return page;
+}
+
+/* Remember page as pgoff of file, evicting the least recently used page
+ * of its set if needed */
+void tux_pgcache_insert(struct tux_pgcache_file *file, uint64_t pgoff, uintptr_t page)
+{
+    struct tux_pgcache_entry *set;
+    struct tux_pgcache_entry *e;
+    irqstate_t flags;
+    uintptr_t old;
+    int i;
+
+    if(!tux_mm_page_get(page))
+        return;
+
+    set = tux_pgcache_set(file, pgoff);
+
+    flags = enter_critical_section();
+
+    e = set;
+    for(i = 0; i < TUX_PGCACHE_WAYS; i++) {
+        if(tux_pgcache_same(&set[i], file, pgoff) || !set[i].page) {
+            e = &set[i];
+            break;
+        }
+
+        if((int32_t)(set[i].stamp - e->stamp) < 0)
+            e = &set[i];
+    }
+
+    old = e->page;
+
+    e->file = *file;
+    e->pgoff = pgoff;
+    e->page = page;
+    e->stamp = ++tux_pgcache_clock;
+
+    leave_critical_section(flags);
+
+    if(old)
+        tux_mm_page_put(old);
+}
+
+#else
+
+int tux_pgcache_file(int fd, struct tux_pgcache_file *file)
+{
+    return -1;
+}
+
+uintptr_t tux_pgcache_lookup(struct tux_pgcache_file *file, uint64_t pgoff)
+{
+    return 0;
+}
+
+void tux_pgcache_insert(struct tux_pgcache_file *file, uint64_t pgoff, uintptr_t page)
+{
+}
+
+#endif
@@ -166,96 +166,71 @@ int pollfd_translate2tux(struct tux_pollfd* out, struct pollfd* in, tux_nfds_t n
 
 long tux_poll(unsigned long nbr, struct tux_pollfd *fds, tux_nfds_t nfds, int timeout) {
   int ret;
-  int i, j, k;
+  int i, j;
   struct tcb_s* rtcb = this_task();
 
   int local_count = 0;
   int tux_count = 0;
-  int mixing = 0;
 
   svcinfo("Poll on %d FDs\n", nfds);
   for(i = 0; i < nfds; i++)
     {
         svcinfo("FD #%d: %d\n", i, fds[i].fd);
-        // If user is mixing the fds
-        if(((fds[i].fd > 2) && (fds[i].fd < CONFIG_TUX_FD_RESERVE)) ||
-                 ((fds[i].fd >= 0) && (fds[i].fd <= 2) && (rtcb->xcp.fd[fds[i].fd] == fds[i].fd)))
-        {
-              tux_count++;
-        }
-    }
-
-  for(i = 0; i < nfds; i++)
-    {
         if(fds[i].fd >= CONFIG_TUX_FD_RESERVE) {
-          local_count++;
+            local_count++;
         } else if(fds[i].fd >= 0 && fds[i].fd <= 2) {
             if(rtcb->xcp.fd[fds[i].fd] != fds[i].fd) {
                 local_count++;
+            } else {
+                tux_count++;
             }
+        } else if(fds[i].fd > 2) {
+            tux_count++;
         }
     }
 
+  // Mixing the realms, epoll already waits on both of them at once
   if(local_count && tux_count)
-    {
-      svcwarn("WARN: Poll mixing fd!\n");
-      local_count++;
-      tux_count++;
-      mixing = 1;
-    }
+      return tux_epoll_poll(fds, nfds, timeout);
+
+  // Only Linux fds, Linux blocks on its own
+  if(!local_count)
+      return tux_delegate(nbr, (uintptr_t)fds, (uintptr_t)nfds, (uintptr_t)timeout, 0, 0, 0);
 
-  struct tux_pollfd* tux_fds = NULL;
   struct tux_pollfd* tux_local_fds = NULL;
   struct pollfd* local_fds = NULL;
 
   ret = -ENOMEM;
 
-  // Allocating necessary memory for separating the translating the fds
-  if(tux_count) {
-      tux_fds = (struct tux_pollfd*)kmm_malloc(sizeof(struct tux_pollfd) * (tux_count));
-      if(!tux_fds) {
-        _err("Failed to allocate tux_fds!\n");
-        goto out;
-      }
+  tux_local_fds = (struct tux_pollfd*)kmm_malloc(sizeof(struct tux_pollfd) * (local_count));
+  if(!tux_local_fds) {
+    _err("Failed to allocate %dx tux_local_fds!\n", local_count);
+    goto out;
+  }
 
-      memset(tux_fds, 0, sizeof(struct tux_pollfd) * (tux_count));
+  local_fds = (struct pollfd*)kmm_malloc(sizeof(struct pollfd) * (local_count));
+  if(!local_fds) {
+    _err("Failed to allocate local_fds!\n");
+    goto out;
   }
 
-  if(local_count) {
-      tux_local_fds = (struct tux_pollfd*)kmm_malloc(sizeof(struct tux_pollfd) * (local_count));
-      if(!tux_local_fds) {
-        _err("Failed to allocate %dx tux_local_fds!\n", local_count);
-        goto out;
-      }
+  memset(tux_local_fds, 0, sizeof(struct tux_pollfd) * (local_count));
+  memset(local_fds, 0, sizeof(struct pollfd) * (local_count));
 
-      local_fds = (struct pollfd*)kmm_malloc(sizeof(struct pollfd) * (local_count));
-      if(!local_fds) {
-        _err("Failed to allocate local_fds!\n");
-        goto out;
-      }
+  // Pick our fds, negative ones are ignored as poll() does
+  for(i = 0, j = 0; i < nfds; i++)
+    {
+        if(fds[i].fd < 0)
+            continue;
 
-      memset(tux_local_fds, 0, sizeof(struct tux_pollfd) * (local_count));
-      memset(local_fds, 0, sizeof(struct pollfd) * (local_count));
-  }
+        tux_local_fds[j].fd = fds[i].fd;
+        tux_local_fds[j].events = fds[i].events;
 
-  // Separate the fds according to the realm it belongs to
-  for(i = 0, j = 0, k = 0; i < nfds; i++)
-    {
-        if(fds[i].fd >= CONFIG_TUX_FD_RESERVE) {
-          memcpy(tux_local_fds + j++, fds + i, sizeof(fds[i]));
-        } else if(fds[i].fd >= 0 && fds[i].fd <= 2) {
-            if(rtcb->xcp.fd[fds[i].fd] != fds[i].fd) {
-                memcpy(tux_local_fds + j, fds + i, sizeof(fds[i]));
+        // This require some faking
+        if(fds[i].fd <= 2)
+            tux_local_fds[j].fd = rtcb->xcp.fd[fds[i].fd] + CONFIG_TUX_FD_RESERVE;
 
-                // This require some faking
-                tux_local_fds[j++].fd = rtcb->xcp.fd[fds[i].fd];
-            } else {
-                // Straight forward implementation
-                memcpy(tux_fds + k++, fds + i, sizeof(fds[i]));
-           }
-        } else {
-            memcpy(tux_fds + k++, fds + i, sizeof(fds[i]));
-        }
+        j++;
     }
 
   if(pollfd_translate2local(local_fds, tux_local_fds, local_count))
@@ -264,83 +239,10 @@ long tux_poll(unsigned long nbr, struct tux_pollfd *fds, tux_nfds_t nfds, int ti
         goto out;
     }
 
-  uint64_t params[7];
-
-  if(tux_count) {
-    // Has tux fd
-    // Do some mixing fd hack
-
-    params[0] = nbr;
-    params[1] = (uintptr_t)tux_fds;
-    params[2] = (uintptr_t)tux_count;
-
-    // Don't let Linux handle time if mixing
-    if(mixing)
-        params[3] = (uintptr_t)-1;
-    else
-        params[3] = (uintptr_t)timeout;
-
-    // Clear these, just in-case
-    params[4] = 0;
-    params[5] = 0;
-    params[6] = 0;
-
-    // Let shadow process block and poll
-    ret = write(rtcb->xcp.linux_sock, params, sizeof(params));
-    /*return tux_delegate(nbr, , (uintptr_t)nfds, (uintptr_t)timeout, 0, 0, 0);*/
-  }
-
-  if(local_count) {
-    if(mixing) {
-      // Poll on the shadow process locally
-      local_fds[local_count - 1].fd = rtcb->xcp.linux_sock;
-      local_fds[local_count - 1].events = POLLIN;
-    }
-
-    // Nuttx local poll
-    ret = tux_local(nbr, (uintptr_t)local_fds, (uintptr_t)(local_count), (uintptr_t)timeout, 0, 0, 0);
-    if(ret < 0)
-      goto out;
-  }
-
-  // Either what the user want to poll have returned locally or remotely
-  if(tux_count) {
-      uint64_t rret;
-
-      // Some remote fds are involved, but none of them are polled!
-      if(mixing && !(local_fds[local_count - 1].revents & POLLIN)){
-
-        // The shadow process was yet blocking, we need to do something about it
-        // However, it might be unblocked now
-        // Try to unblock it
-
-        params[0] = nbr;
-        params[1] = 0;
-        params[2] = 0;
-        params[3] = 0;
-        params[4] = 0xdeadbeef;
-        params[5] = 0xdeadbeef;
-        params[6] = 0xdeadbeef;
-
-        svcinfo("canceling poll\n");
-        ret = write(rtcb->xcp.linux_sock, params, sizeof(params));
-
-        // The cancellation will generate an additional packet
-        // Furthermore, having a single buffer, but a semaphore is used
-        // Read once is not enough, need to read twice to clear the semaphore
-        // This looks idiotic, try to make the shadow not transmitting the additional packet XXX
-
-        svcinfo("Wait for cancellation\n");
-        read(rtcb->xcp.linux_sock, &rret, sizeof(uint64_t));
-      }
-
-      svcinfo("Wait for ret\n");
-
-      // This is from the original poll remote system call
-      read(rtcb->xcp.linux_sock, &rret, sizeof(uint64_t));
-
-      // The shadow process should now be freed
-  }
+  // Nuttx local poll
+  ret = tux_local(nbr, (uintptr_t)local_fds, (uintptr_t)(local_count), (uintptr_t)timeout, 0, 0, 0);
+  if(ret < 0)
+    goto out;
 
   // Translate the local structure back to Linux structure
   pollfd_translate2tux(tux_local_fds, local_fds, local_count);
@@ -348,30 +250,18 @@ long tux_poll(unsigned long nbr, struct tux_pollfd *fds, tux_nfds_t nfds, int ti
   ret = 0;
 
   // Merge the fds back, this must conserve the order given by the user
-  for(i = 0, j = 0, k = 0; i < nfds; i++)
+  for(i = 0, j = 0; i < nfds; i++)
     {
         fds[i].revents = 0;
 
-        if(fds[i].fd >= CONFIG_TUX_FD_RESERVE) {
+        if(fds[i].fd >= 0)
             fds[i].revents = tux_local_fds[j++].revents;
-        } else if(fds[i].fd >= 0 && fds[i].fd <= 2) {
-            if(rtcb->xcp.fd[fds[i].fd] != fds[i].fd) {
-                fds[i].revents = tux_local_fds[j++].revents;
-            } else {
-                // Straight forward implementation
-                fds[i].revents = tux_fds[k++].revents;
-            }
-        } else {
-            fds[i].revents = tux_fds[k++].revents;
-        }
 
         if(fds[i].revents) ret++;
     }
 
 out:
   // Recycle the memory
-  if(tux_fds)
-      kmm_free(tux_fds);
   if(tux_local_fds)
       kmm_free(tux_local_fds);
   if(local_fds)
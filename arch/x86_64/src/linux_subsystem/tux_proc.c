@@ -7,115 +7,134 @@
 #include <sched/sched.h>
 #include <group/group.h>
 #include <task/task.h>
-#include <nuttx/wqueue.h>
 #include <sys/wait.h>
 
-#define TUX_PROC_HT_SIZE 256
+/* Linux pid of every NuttX task and back.  Each entry is a single word
+ * holding both pids, written under a critical section and read without
+ * any lock, from interrupt handlers too.  Nothing is allocated. */
 
-struct proc_node {
-    int lpid;
-    int rpid;
-    int retain;
-    struct proc_node* next;
-};
+/* Open addressing on the Linux pid, at most CONFIG_MAX_TASKS are in use */
+#define TUX_PROC_MAP_SIZE (2 * CONFIG_MAX_TASKS)
+
+/* Indexed like g_pidhash, no two live tasks share a slot */
+#define TUX_PROC_RMAP_SIZE CONFIG_MAX_TASKS
+
+#define TUX_PROC_EMPTY     0
+#define TUX_PROC_TOMBSTONE ((uint64_t)-1)
 
-struct proc_node* tux_proc_hashtable[TUX_PROC_HT_SIZE];
-struct work_s tux_proc_deletework;
+#define TUX_PROC_ENTRY(lpid, rpid) (((uint64_t)(uint32_t)(rpid) << 32) | (uint32_t)(lpid))
+#define TUX_PROC_LPID(e)           ((int)(uint32_t)(e))
+#define TUX_PROC_RPID(e)           ((int)((e) >> 32))
+
+static volatile uint64_t tux_proc_map[TUX_PROC_MAP_SIZE];
+
+/* Kept after the task is gone, wait4 reports the Linux pid of an exited
+ * child until NuttX hands the slot to another task */
+static volatile uint64_t tux_proc_rmap[TUX_PROC_RMAP_SIZE];
+
+static inline int tux_proc_slot(int rpid, int i) {
+    return (rpid + i) & (TUX_PROC_MAP_SIZE - 1);
+}
+
+/* Slot of rpid in the map, or -1 */
+static int tux_proc_find(int rpid) {
+    uint64_t e;
+    int i;
+
+    for(i = 0; i < TUX_PROC_MAP_SIZE; i++) {
+        e = tux_proc_map[tux_proc_slot(rpid, i)];
+        if(e == TUX_PROC_EMPTY)
+            break;
+        if(e != TUX_PROC_TOMBSTONE && TUX_PROC_RPID(e) == rpid)
+            return tux_proc_slot(rpid, i);
+    }
+
+    return -1;
+}
 
 int insert_proc_node(int lpid, int rpid) {
-    struct proc_node **ptr= &tux_proc_hashtable[rpid % TUX_PROC_HT_SIZE];
-    while(*ptr != NULL) {
-        if((*ptr)->rpid == rpid) {
-            if((*ptr)->retain != 0){
-                return -EEXIST;
-            } else {
-                (*ptr)->retain = 1;
-                (*ptr)->lpid = lpid;
-                (*ptr)->rpid = rpid;
-                return 0;
-            }
+    irqstate_t flags;
+    int slot = -1;
+    int ret = 0;
+    uint64_t e;
+    int i;
+
+    if(rpid <= 0)
+        return -EINVAL;
+
+    flags = enter_critical_section();
+
+    if(tux_proc_find(rpid) >= 0) {
+        ret = -EEXIST;
+        goto out;
+    }
+
+    // First free slot on the probe sequence, gaps left by deletions too
+    for(i = 0; i < TUX_PROC_MAP_SIZE; i++) {
+        e = tux_proc_map[tux_proc_slot(rpid, i)];
+        if(e == TUX_PROC_EMPTY || e == TUX_PROC_TOMBSTONE) {
+            slot = tux_proc_slot(rpid, i);
+            break;
         }
-        ptr = &((*ptr)->next);
     }
 
-    *ptr = kmm_zalloc(sizeof(struct proc_node));
-    if(!*ptr) {
-        return -ENOMEM;
+    if(slot < 0) {
+        ret = -ENOMEM;
+        goto out;
     }
 
-    (*ptr)->lpid = lpid;
-    (*ptr)->rpid = rpid;
-    (*ptr)->retain = 1;
-    (*ptr)->next = NULL;
+    tux_proc_map[slot] = TUX_PROC_ENTRY(lpid, rpid);
+    tux_proc_rmap[lpid & (TUX_PROC_RMAP_SIZE - 1)] = TUX_PROC_ENTRY(lpid, rpid);
 
-    return 0;
+out:
+    leave_critical_section(flags);
+
+    return ret;
 }
 
 void print_proc_nodes(void) {
-    struct proc_node **ptr;
+    uint64_t e;
     int i;
 
-    for (i = 0; i < TUX_PROC_HT_SIZE; i++) {
-        if (!tux_proc_hashtable[i]) continue;
+    for (i = 0; i < TUX_PROC_MAP_SIZE; i++) {
+        e = tux_proc_map[i];
+        if (e == TUX_PROC_EMPTY || e == TUX_PROC_TOMBSTONE) continue;
 
-        _info("head: %llx\n", tux_proc_hashtable[i]);
-        ptr = &tux_proc_hashtable[i];
-        while(*ptr != NULL) {
-            _info("on: %llx\n", *ptr);
-            ptr = &((*ptr)->next);
-        }
+        _info("%d: linux %d -> nuttx %d\n", i, TUX_PROC_RPID(e), TUX_PROC_LPID(e));
     }
 }
 
+int delete_proc_node(int rpid) {
+    irqstate_t flags;
+    int slot;
 
-void _delete_proc_nodes(void* arg) {
-    struct proc_node **ptr;
-    struct proc_node *to_free;
-    int i;
+    flags = enter_critical_section();
 
-    for (i = 0; i < TUX_PROC_HT_SIZE; i++) {
-        if (!tux_proc_hashtable[i]) continue;
-
-        ptr = &tux_proc_hashtable[i];
-        while(*ptr != NULL) {
-            if((*ptr)->retain == 0) {
-                to_free = *ptr;
-                *ptr = (*ptr)->next;
-                kmm_free(to_free);
-            }
-
-            /* necessary additional check
-             * *ptr might become NULL when removing the last node */
-            if(*ptr)
-                ptr = &((*ptr)->next);
-        }
+    slot = tux_proc_find(rpid);
+    if(slot >= 0) {
+        // Ends the probe sequence if nothing follows
+        if(tux_proc_map[(slot + 1) & (TUX_PROC_MAP_SIZE - 1)] == TUX_PROC_EMPTY)
+            tux_proc_map[slot] = TUX_PROC_EMPTY;
+        else
+            tux_proc_map[slot] = TUX_PROC_TOMBSTONE;
     }
-}
 
-int delete_proc_node(int rpid) {
-    struct proc_node **ptr= &tux_proc_hashtable[rpid % TUX_PROC_HT_SIZE];
-    while(*ptr != NULL) {
-        if((*ptr)->rpid == rpid) {
-            (*ptr)->retain = 0;
-            work_queue(LPWORK, &tux_proc_deletework, _delete_proc_nodes, NULL, 0);
-            return 0;
-        };
-        ptr = &((*ptr)->next);
-    }
+    leave_critical_section(flags);
 
-    return -EEXIST;
+    return slot >= 0 ? 0 : -EEXIST;
 }
 
 long get_nuttx_pid(int rpid) {
-    struct proc_node **ptr= &tux_proc_hashtable[rpid % TUX_PROC_HT_SIZE];
-    while(*ptr != NULL) {
-        if((*ptr)->rpid == rpid) {
-            return (*ptr)->lpid;
-        };
-        ptr = &((*ptr)->next);
-    }
+    int slot;
 
-    return -EEXIST;
+    if(rpid <= 0)
+        return -EEXIST;
+
+    slot = tux_proc_find(rpid);
+    if(slot < 0)
+        return -EEXIST;
+
+    return TUX_PROC_LPID(tux_proc_map[slot]);
 }
 
 long get_linux_pid(int lpid) {
@@ -130,25 +149,16 @@ long get_linux_pid(int lpid) {
 }
 
 long search_linux_pid(int lpid) {
-    struct proc_node **ptr;
-    int i;
+    uint64_t e;
 
     if(lpid == 0)
         lpid = this_task()->pid;
 
-    for (i = 0; i < TUX_PROC_HT_SIZE; i++) {
-        if (!tux_proc_hashtable[i]) continue;
-
-        ptr = &tux_proc_hashtable[i];
-        while(*ptr != NULL) {
-            if((*ptr)->lpid == lpid) {
-                return (*ptr)->rpid;
-            }
-            ptr = &((*ptr)->next);
-        }
-    }
+    e = tux_proc_rmap[lpid & (TUX_PROC_RMAP_SIZE - 1)];
+    if(e == TUX_PROC_EMPTY || TUX_PROC_LPID(e) != lpid)
+        return -EEXIST;
 
-    return -EEXIST;
+    return TUX_PROC_RPID(e);
 }
 
 long tux_getppid(unsigned long nbr){
@@ -193,10 +203,8 @@ long tux_waithook(unsigned long nbr, uintptr_t param1, uintptr_t param2, uintptr
     /* waitid and wait4 return the pid exited
      * We need to hook it and return the linux pid to fake it
      * The problem here is that tcb is already freed
-     * We do the reserve lookup by searching in the pid mapping table
-     * The Entry is delayed to be freed in LP WQ
-     * This make any task running lower or equal priority against LP WG
-     * Might not get the right pid */
+     * We do the reserve lookup in the pid mapping table
+     * The entry stays until NuttX reuses the pid slot for another task */
 
     /* Also, the flags are not identical in the 2 systems,
      * We need to translate them.
@@ -223,7 +231,7 @@ long tux_waithook(unsigned long nbr, uintptr_t param1, uintptr_t param2, uintptr
 
     long pid = tux_pidhook(nbr, param1, param2, param3, param4, param5, param6);
     if(pid > 0)
-        pid = search_linux_pid(pid); // This is a O(n) search might be slow
+        pid = search_linux_pid(pid);
 
     /* For wait4, the status flags are not identical too, translate them
      * The LSB is the cause of exist, mutxed with signal
@@ -254,11 +262,79 @@ long tux_gettid(unsigned long nbr) {
     return this_task()->xcp.linux_tid;
 }
 
+/* The NuttX task a Linux pid names, 0 is the caller */
+static long tux_affinity_lpid(long pid) {
+    long lpid;
+
+    if(pid == 0)
+        return 0;
+
+    lpid = get_nuttx_pid(pid);
+    return lpid < 0 ? -ESRCH : lpid;
+}
+
+/* Linux masks are arrays of longs, one bit per cpu */
 long tux_sched_getaffinity(unsigned long nbr, long pid, unsigned int len, unsigned long *mask) {
+    long lpid;
+    int cpu;
+#ifdef CONFIG_SMP
+    cpu_set_t cpuset;
+    int ret;
+#endif
+
+    if(len < sizeof(tux_cpu_mask) || (len & (sizeof(tux_cpu_mask) - 1)))
+        return -EINVAL;
+
+    lpid = tux_affinity_lpid(pid);
+    if(lpid < 0)
+        return lpid;
 
     TUX_CPU_ZERO_S(len, mask);
-    TUX_CPU_SET_S(0, len, mask);
 
-    return 0;
+#ifdef CONFIG_SMP
+    ret = nxsched_getaffinity(lpid, sizeof(cpu_set_t), &cpuset);
+    if(ret < 0)
+        return ret;
+
+    for(cpu = 0; cpu < CONFIG_SMP_NCPUS; cpu++)
+        if(CPU_ISSET(cpu, &cpuset))
+            TUX_CPU_SET_S(cpu, len, mask);
+#else
+    cpu = 0;
+    TUX_CPU_SET_S(cpu, len, mask);
+#endif
+
+    // The size of the kernel mask, as Linux does
+    return sizeof(tux_cpu_mask);
+}
+
+long tux_sched_setaffinity(unsigned long nbr, long pid, unsigned int len, unsigned long *mask) {
+    long lpid;
+    int cpu;
+#ifdef CONFIG_SMP
+    cpu_set_t cpuset;
+#endif
+
+    lpid = tux_affinity_lpid(pid);
+    if(lpid < 0)
+        return lpid;
+
+#ifdef CONFIG_SMP
+    CPU_ZERO(&cpuset);
+    for(cpu = 0; cpu < CONFIG_SMP_NCPUS && cpu / 8 < len; cpu++)
+        if(mask[TUX_CPUELT(cpu)] & TUX_CPUMASK(cpu))
+            CPU_SET(cpu, &cpuset);
+
+    // None of the cpus we have
+    if(!cpuset)
+        return -EINVAL;
+
+    return nxsched_setaffinity(lpid, sizeof(cpu_set_t), &cpuset);
+#else
+    cpu = 0;
+    if(!len || !(mask[TUX_CPUELT(cpu)] & TUX_CPUMASK(cpu)))
+        return -EINVAL;
 
+    return 0;
+#endif
 }
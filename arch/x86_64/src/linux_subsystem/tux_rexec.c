@@ -138,6 +138,7 @@ long rexec(const char* path, int policy, int priority,
 
     tcb->cmn.xcp.vma = NULL;
     tcb->cmn.xcp.pda = NULL;
+    tcb->cmn.xcp.vm = kmm_zalloc(sizeof(struct vm_map_s));
 
     // We have to copy the path, argv, envp on to kheap
     // Other wise they will be freed by the program loader daemon
@@ -193,6 +194,16 @@ long rexec(const char* path, int policy, int priority,
 
     tcb->cmn.xcp.signal_stack_flag = TUX_SS_DISABLE;
 
+    if(up_xstate_alloc((FAR struct tcb_s *)tcb, false) < 0) {
+        ret = -ENOMEM;
+        goto errout_with_tcbinit;
+    }
+
+    if(tux_stats_alloc((FAR struct tcb_s *)tcb) < 0) {
+        ret = -ENOMEM;
+        goto errout_with_tcbinit;
+    }
+
     sinfo("activate: new task=%d\n", tcb->cmn.pid);
     /* Then activate the task at the provided priority */
     ret = task_activate((FAR struct tcb_s *)tcb);
@@ -0,0 +1,223 @@
+#include <nuttx/arch.h>
+#include <nuttx/irq.h>
+#include <nuttx/kmalloc.h>
+#include <nuttx/fs/procfs.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tux.h"
+#include "up_internal.h"
+#include "sched/sched.h"
+
+/* The threads of a process count their syscalls together, in counters
+ * allocated with the process and shared by every thread it creates, so
+ * they are updated atomically.  The slots are an open addressed table keyed
+ * by the syscall number.  Calls served by the fast syscall path in
+ * syscall_entry never reach linux_interface() and are not counted. */
+
+#ifdef CONFIG_TUX_SYSCALL_STATS
+
+#define TUX_STATS_LINELEN 80
+
+static struct tux_sysstat_s *tux_stats_slot(unsigned long nbr)
+{
+  struct tux_sysstats_s *stats = this_task()->xcp.syscall_stats;
+  struct tux_sysstat_s *slot;
+  uint16_t key;
+  int i;
+
+  if(!stats)
+    return NULL;
+
+  for(i = 0; i < CONFIG_TUX_SYSCALL_STATS_SLOTS; i++) {
+    slot = &stats->slot[(nbr + i) % CONFIG_TUX_SYSCALL_STATS_SLOTS];
+
+    // Another thread may be claiming the same slot
+    key = 0;
+    if(__atomic_compare_exchange_n(&slot->key, &key, nbr + 1, false,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+       key == nbr + 1)
+      return slot;
+  }
+
+  __atomic_fetch_add(&stats->dropped, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* A new process, its threads will share the counters */
+int tux_stats_alloc(struct tcb_s *tcb)
+{
+  struct tux_sysstats_s *stats;
+
+  stats = kmm_zalloc(sizeof(struct tux_sysstats_s));
+  if(!stats)
+    return -ENOMEM;
+
+  stats->refs = 1;
+  tcb->xcp.syscall_stats = stats;
+
+  return OK;
+}
+
+/* A new thread of the process of parent */
+void tux_stats_share(struct tcb_s *parent, struct tcb_s *tcb)
+{
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+  tcb->xcp.syscall_stats = parent->xcp.syscall_stats;
+  if(tcb->xcp.syscall_stats)
+    tcb->xcp.syscall_stats->refs++;
+  leave_critical_section(flags);
+}
+
+/* A call to linux_interface() started at tsc returned */
+void tux_stats_syscall(unsigned long nbr, uint64_t tsc)
+{
+  struct tux_sysstat_s *slot;
+  uint64_t cycles = rdtsc() - tsc;
+  uint64_t max;
+  int bucket;
+
+  slot = tux_stats_slot(nbr);
+  if(!slot)
+    return;
+
+  bucket = 63 - __builtin_clzll(cycles | 1);
+  if(bucket >= TUX_STATS_BUCKETS)
+    bucket = TUX_STATS_BUCKETS - 1;
+
+  __atomic_fetch_add(&slot->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&slot->cycles, cycles, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&slot->hist[bucket], 1, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&slot->max, __ATOMIC_RELAXED);
+  while(cycles > max &&
+        !__atomic_compare_exchange_n(&slot->max, &max, cycles, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void tux_stats_local(unsigned long nbr)
+{
+  struct tux_sysstat_s *slot = tux_stats_slot(nbr);
+
+  if(slot)
+    __atomic_fetch_add(&slot->local, 1, __ATOMIC_RELAXED);
+}
+
+/* A round trip to Linux, from submission to the wakeup of the caller */
+void tux_stats_delegate(unsigned long nbr, uint64_t cycles)
+{
+  struct tux_sysstat_s *slot = tux_stats_slot(nbr);
+
+  if(slot) {
+    __atomic_fetch_add(&slot->delegated, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->delegate_cycles, cycles, __ATOMIC_RELAXED);
+  }
+}
+
+/* The last thread out frees the counters, procfs may be looking at them
+ * from another task or CPU */
+void tux_stats_release(struct tcb_s *tcb)
+{
+  struct tux_sysstats_s *stats;
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+  stats = tcb->xcp.syscall_stats;
+  tcb->xcp.syscall_stats = NULL;
+  if(stats && --stats->refs)
+    stats = NULL;
+  leave_critical_section(flags);
+
+  kmm_free(stats);
+}
+
+static bool tux_stats_copy(const char *line, size_t linesize, char **buffer,
+                           size_t *remaining, off_t *offset, size_t *total)
+{
+  size_t copysize = procfs_memcpy(line, linesize, *buffer, *remaining, offset);
+
+  *total += copysize;
+  *buffer += copysize;
+  *remaining -= copysize;
+
+  return *remaining > 0;
+}
+
+/* One line per syscall of the process of tcb: the counts, the average and
+ * worst latency, the average round trip to Linux, then the non-empty
+ * histogram buckets as log2(cycles):calls.  The process may exit under us,
+ * we format a snapshot taken before it could free its counters. */
+ssize_t tux_syscall_stats_read(FAR struct tcb_s *tcb, FAR char *buffer,
+                               size_t buflen, off_t offset)
+{
+  struct tux_sysstats_s *stats;
+  struct tux_sysstat_s *slot;
+  char line[TUX_STATS_LINELEN];
+  size_t remaining = buflen;
+  size_t total = 0;
+  size_t linesize;
+  irqstate_t flags;
+  bool found;
+  int i, j;
+
+  stats = kmm_malloc(sizeof(struct tux_sysstats_s));
+  if(!stats)
+    return -ENOMEM;
+
+  flags = enter_critical_section();
+  found = tcb->xcp.syscall_stats != NULL;
+  if(found)
+    memcpy(stats, tcb->xcp.syscall_stats, sizeof(struct tux_sysstats_s));
+  leave_critical_section(flags);
+
+  linesize = snprintf(line, TUX_STATS_LINELEN,
+                      "%3s %9s %9s %9s %9s %9s %9s %s\n", "NR", "CALLS",
+                      "LOCAL", "DELEGATED", "AVG", "MAX", "LINUX", "HIST");
+  if(!tux_stats_copy(line, linesize, &buffer, &remaining, &offset, &total) ||
+     !found)
+    goto out;
+
+  for(i = 0; i < CONFIG_TUX_SYSCALL_STATS_SLOTS; i++) {
+    slot = &stats->slot[i];
+    if(!slot->key)
+      continue;
+
+    linesize = snprintf(line, TUX_STATS_LINELEN,
+                        "%3d %9llu %9llu %9llu %9llu %9llu %9llu",
+                        slot->key - 1, slot->calls, slot->local,
+                        slot->delegated,
+                        slot->calls ? slot->cycles / slot->calls : 0,
+                        slot->max,
+                        slot->delegated ?
+                          slot->delegate_cycles / slot->delegated : 0);
+    if(!tux_stats_copy(line, linesize, &buffer, &remaining, &offset, &total))
+      goto out;
+
+    for(j = 0; j < TUX_STATS_BUCKETS; j++) {
+      if(!slot->hist[j])
+        continue;
+
+      linesize = snprintf(line, TUX_STATS_LINELEN, " %d:%u", j, slot->hist[j]);
+      if(!tux_stats_copy(line, linesize, &buffer, &remaining, &offset, &total))
+        goto out;
+    }
+
+    if(!tux_stats_copy("\n", 1, &buffer, &remaining, &offset, &total))
+      goto out;
+  }
+
+  if(stats->dropped) {
+    linesize = snprintf(line, TUX_STATS_LINELEN, "dropped %llu\n",
+                        stats->dropped);
+    tux_stats_copy(line, linesize, &buffer, &remaining, &offset, &total);
+  }
+
+out:
+  kmm_free(stats);
+  return total;
+}
+
+#endif
@@ -11,4 +11,10 @@
 extern syscall_t linux_syscall_action_table[500];
 extern uint64_t linux_syscall_number_table[500];
 
+/* Handlers of the fast path, Linux arguments in and Linux values out */
+typedef long (*tux_fast_t)(uintptr_t parm1, uintptr_t parm2, uintptr_t parm3,
+                           uintptr_t parm4, uintptr_t parm5, uintptr_t parm6);
+
+extern tux_fast_t tux_fast_table[TUX_FAST_NR];
+
 #endif//__LINUX_SUBSYSTEM_TUX_SYSCALL_TABLE_H
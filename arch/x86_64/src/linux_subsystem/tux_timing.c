@@ -12,6 +12,19 @@ long tux_nanosleep(unsigned long nbr, const struct timespec *rqtp, struct timesp
   return nanosleep(rqtp, rmtp);
 }
 
-long tux_gettimeofday(unsigned long nbr, struct timeval *tv, struct timezone *tz){
-  return gettimeofday(tv, tz);
+/* The same code as the vDSO, for programs calling the kernel anyway */
+long tux_gettimeofday(unsigned long nbr, struct tux_timeval *tv, struct timezone *tz){
+  return tux_vdso_gettimeofday(tv, tz);
+}
+
+long tux_clock_gettime(unsigned long nbr, int clk, struct tux_timespec *ts){
+  return tux_vdso_clock_gettime(clk, ts);
+}
+
+long tux_clock_getres(unsigned long nbr, int clk, struct tux_timespec *res){
+  return tux_vdso_clock_getres(clk, res);
+}
+
+long tux_time(unsigned long nbr, int64_t *t){
+  return tux_vdso_time(t);
 }
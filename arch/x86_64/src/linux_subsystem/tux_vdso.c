@@ -0,0 +1,273 @@
+#include <nuttx/arch.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "tux.h"
+#include "elf64.h"
+#include "up_internal.h"
+#include "sched/sched.h"
+#include "clock/clock.h"
+
+/* The clocks are read straight from the TSC, the way up_timer_gettime()
+ * does, so time seen by Linux processes agrees with NuttX.  The vDSO is an
+ * ELF image in kernel memory, which every process maps 1:1.  Its symbols
+ * resolve to the functions below, run in place by the caller. */
+
+#define TUX_VDSO_SHIFT 48
+
+#define TUX_CLOCK_REALTIME         0
+#define TUX_CLOCK_MONOTONIC        1
+#define TUX_CLOCK_MONOTONIC_RAW    4
+#define TUX_CLOCK_REALTIME_COARSE  5
+#define TUX_CLOCK_MONOTONIC_COARSE 6
+#define TUX_CLOCK_BOOTTIME         7
+
+#define TUX_VDSO_NSYMS 5  /* Including the null symbol */
+
+extern unsigned long tsc_freq;
+extern uint64_t g_start_tsc;
+
+/* Nanoseconds per TSC cycle, as a fixed point number */
+static uint64_t g_vdso_mult;
+
+#ifdef CONFIG_TUX_VDSO
+static const char tux_vdso_strings[] =
+  "\0linux-vdso.so.1"
+  "\0__vdso_clock_gettime"
+  "\0__vdso_gettimeofday"
+  "\0__vdso_time"
+  "\0__vdso_getcpu";
+
+struct tux_vdso_image {
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr phdr[2];
+  Elf64_Dyn dyn[7];
+  Elf64_Word hash[2 + 1 + TUX_VDSO_NSYMS];
+  Elf64_Sym sym[TUX_VDSO_NSYMS];
+  char str[sizeof(tux_vdso_strings)];
+};
+
+static struct tux_vdso_image g_vdso __attribute__((aligned(PAGE_SIZE)));
+static bool g_vdso_ready;
+#endif
+
+static inline uint64_t tux_vdso_tsc(void)
+{
+  uint32_t lo, hi;
+
+  asm volatile("lfence; rdtsc" : "=a" (lo), "=d" (hi)::"memory");
+  return (uint64_t)lo | (((uint64_t)hi) << 32);
+}
+
+/* Time since up_timer_initialize(), a multiplication instead of the
+ * divisions of up_tick2ts() */
+static inline uint64_t tux_vdso_ns(void)
+{
+  uint64_t diff = tux_vdso_tsc() - g_start_tsc;
+
+  return ((unsigned __int128)diff * g_vdso_mult) >> TUX_VDSO_SHIFT;
+}
+
+static inline void tux_vdso_ns2ts(uint64_t ns, struct tux_timespec *ts)
+{
+  ts->tv_sec = ns / NSEC_PER_SEC;
+  ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/* Time of day as clock_gettime(CLOCK_REALTIME) computes it.  The base only
+ * moves by clock_settime(), read it again until it holds still. */
+static inline uint64_t tux_vdso_realtime_ns(void)
+{
+  volatile struct timespec *base = &g_basetime;
+  uint64_t sec, nsec;
+
+  do {
+    sec = (uint32_t)base->tv_sec;
+    nsec = (uint32_t)base->tv_nsec;
+  } while(sec != (uint32_t)base->tv_sec || nsec != (uint32_t)base->tv_nsec);
+
+  return sec * NSEC_PER_SEC + nsec + tux_vdso_ns();
+}
+
+long tux_vdso_clock_gettime(int clk, struct tux_timespec *ts)
+{
+  switch(clk) {
+    case TUX_CLOCK_REALTIME:
+    case TUX_CLOCK_REALTIME_COARSE:
+      tux_vdso_ns2ts(tux_vdso_realtime_ns(), ts);
+      return 0;
+    case TUX_CLOCK_MONOTONIC:
+    case TUX_CLOCK_MONOTONIC_RAW:
+    case TUX_CLOCK_MONOTONIC_COARSE:
+    case TUX_CLOCK_BOOTTIME:
+      tux_vdso_ns2ts(tux_vdso_ns(), ts);
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+/* Not in the vDSO, but it takes the same clock ids.  All of them read the
+ * TSC the way CLOCK_REALTIME does. */
+long tux_vdso_clock_getres(int clk, struct tux_timespec *res)
+{
+  struct timespec ts;
+
+  switch(clk) {
+    case TUX_CLOCK_REALTIME:
+    case TUX_CLOCK_REALTIME_COARSE:
+    case TUX_CLOCK_MONOTONIC:
+    case TUX_CLOCK_MONOTONIC_RAW:
+    case TUX_CLOCK_MONOTONIC_COARSE:
+    case TUX_CLOCK_BOOTTIME:
+      clock_getres(CLOCK_REALTIME, &ts);
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  if(res) {
+    res->tv_sec = ts.tv_sec;
+    res->tv_nsec = ts.tv_nsec;
+  }
+
+  return 0;
+}
+
+long tux_vdso_gettimeofday(struct tux_timeval *tv, struct timezone *tz)
+{
+  uint64_t ns = tux_vdso_realtime_ns();
+
+  if(tv) {
+    tv->tv_sec = ns / NSEC_PER_SEC;
+    tv->tv_usec = (ns % NSEC_PER_SEC) / 1000;
+  }
+
+  if(tz)
+    memset(tz, 0, sizeof(struct timezone));
+
+  return 0;
+}
+
+long tux_vdso_time(int64_t *t)
+{
+  int64_t sec = tux_vdso_realtime_ns() / NSEC_PER_SEC;
+
+  if(t)
+    *t = sec;
+
+  return sec;
+}
+
+long tux_vdso_getcpu(unsigned *cpu, unsigned *node, void *unused)
+{
+  if(cpu)
+    *cpu = up_cpu_index();
+  if(node)
+    *node = 0;
+
+  return 0;
+}
+
+#ifdef CONFIG_TUX_VDSO
+static void tux_vdso_sym(int idx, const char *name, uintptr_t func)
+{
+  const char *s;
+
+  for(s = tux_vdso_strings + 1; strcmp(s, name); s += strlen(s) + 1);
+
+  g_vdso.sym[idx].st_name = s - tux_vdso_strings;
+  g_vdso.sym[idx].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+  g_vdso.sym[idx].st_shndx = 1;
+  // Relative to the image, wraps around to the kernel text
+  g_vdso.sym[idx].st_value = func - (uintptr_t)&g_vdso;
+}
+
+static void tux_vdso_build(void)
+{
+  Elf64_Ehdr *ehdr = &g_vdso.ehdr;
+  Elf64_Dyn *dyn = g_vdso.dyn;
+  int i;
+
+  memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+  ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr->e_ident[EI_OSABI] = ELFOSABI_NONE;
+  ehdr->e_type = ET_DYN;
+  ehdr->e_machine = EM_X86_64;
+  ehdr->e_version = EV_CURRENT;
+  ehdr->e_phoff = offsetof(struct tux_vdso_image, phdr);
+  ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr->e_phentsize = sizeof(Elf64_Phdr);
+  ehdr->e_phnum = 2;
+
+  g_vdso.phdr[0].p_type = PT_LOAD;
+  g_vdso.phdr[0].p_flags = PF_R | PF_X;
+  g_vdso.phdr[0].p_filesz = sizeof(g_vdso);
+  g_vdso.phdr[0].p_memsz = sizeof(g_vdso);
+  g_vdso.phdr[0].p_align = PAGE_SIZE;
+
+  g_vdso.phdr[1].p_type = PT_DYNAMIC;
+  g_vdso.phdr[1].p_flags = PF_R;
+  g_vdso.phdr[1].p_offset = offsetof(struct tux_vdso_image, dyn);
+  g_vdso.phdr[1].p_vaddr = offsetof(struct tux_vdso_image, dyn);
+  g_vdso.phdr[1].p_filesz = sizeof(g_vdso.dyn);
+  g_vdso.phdr[1].p_memsz = sizeof(g_vdso.dyn);
+  g_vdso.phdr[1].p_align = 8;
+
+  dyn[0].d_tag = DT_SONAME;
+  dyn[0].d_un.d_val = 1;
+  dyn[1].d_tag = DT_HASH;
+  dyn[1].d_un.d_ptr = offsetof(struct tux_vdso_image, hash);
+  dyn[2].d_tag = DT_SYMTAB;
+  dyn[2].d_un.d_ptr = offsetof(struct tux_vdso_image, sym);
+  dyn[3].d_tag = DT_STRTAB;
+  dyn[3].d_un.d_ptr = offsetof(struct tux_vdso_image, str);
+  dyn[4].d_tag = DT_STRSZ;
+  dyn[4].d_un.d_val = sizeof(g_vdso.str);
+  dyn[5].d_tag = DT_SYMENT;
+  dyn[5].d_un.d_val = sizeof(Elf64_Sym);
+  dyn[6].d_tag = DT_NULL;
+
+  // A single bucket chaining every symbol
+  g_vdso.hash[0] = 1;
+  g_vdso.hash[1] = TUX_VDSO_NSYMS;
+  g_vdso.hash[2] = TUX_VDSO_NSYMS - 1;
+  for(i = 0; i < TUX_VDSO_NSYMS; i++)
+    g_vdso.hash[3 + i] = i ? i - 1 : 0;
+
+  memcpy(g_vdso.str, tux_vdso_strings, sizeof(tux_vdso_strings));
+
+  tux_vdso_sym(1, "__vdso_clock_gettime", (uintptr_t)tux_vdso_clock_gettime);
+  tux_vdso_sym(2, "__vdso_gettimeofday", (uintptr_t)tux_vdso_gettimeofday);
+  tux_vdso_sym(3, "__vdso_time", (uintptr_t)tux_vdso_time);
+  tux_vdso_sym(4, "__vdso_getcpu", (uintptr_t)tux_vdso_getcpu);
+}
+#endif
+
+/* The address of the vDSO for AT_SYSINFO_EHDR, or 0 without one.  Called
+ * by every exec, before any Linux code reads a clock. */
+uintptr_t tux_vdso_base(void)
+{
+  uint64_t q, r;
+
+  if(!g_vdso_mult) {
+    // NSEC_PER_SEC << 48 does not fit, divide in two steps
+    q = ((uint64_t)NSEC_PER_SEC << 24) / tsc_freq;
+    r = ((uint64_t)NSEC_PER_SEC << 24) % tsc_freq;
+    g_vdso_mult = (q << 24) + (r << 24) / tsc_freq;
+  }
+
+#ifdef CONFIG_TUX_VDSO
+  if(!g_vdso_ready) {
+    tux_vdso_build();
+    g_vdso_ready = true;
+  }
+
+  return (uintptr_t)&g_vdso;
+#else
+  return 0;
+#endif
+}
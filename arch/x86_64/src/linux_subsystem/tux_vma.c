@@ -0,0 +1,344 @@
+#include <nuttx/config.h>
+#include <nuttx/compiler.h>
+
+#include <nuttx/arch.h>
+#include <nuttx/irq.h>
+#include <stdint.h>
+
+#include "up_internal.h"
+#include "tux.h"
+
+/* AVL tree of non-overlapping mappings, keyed by va_start.  Each node also
+ * tracks the largest hole in front of any mapping of its subtree, so a free
+ * range of a given size is found without walking the mappings.
+ *
+ * The page fault handlers of all CPUs look mappings up, so the tree is only
+ * changed in a critical section.  Readers racing with other threads of the
+ * process look up and use a mapping in one critical section as well, or
+ * work on a copy (tux_mm_lookup), removed mappings are freed right away. */
+
+static inline int vma_height(struct vma_s *n)
+{
+  return n ? n->height : 0;
+}
+
+static inline uint64_t vma_gap(struct vma_s *n)
+{
+  return n ? n->gap : 0;
+}
+
+/* Only the holes between mappings are handed out, never the space below
+ * the first one */
+static inline uint64_t vma_hole(struct vma_s *n)
+{
+  return n->prev ? n->va_start - n->prev->va_end : 0;
+}
+
+static void vma_fix(struct vma_s *n)
+{
+  int hl = vma_height(n->left);
+  int hr = vma_height(n->right);
+  uint64_t g = vma_hole(n);
+
+  n->height = (hl > hr ? hl : hr) + 1;
+
+  if(vma_gap(n->left) > g)  g = vma_gap(n->left);
+  if(vma_gap(n->right) > g) g = vma_gap(n->right);
+  n->gap = g;
+}
+
+static void vma_fix_up(struct vma_s *n)
+{
+  for(; n; n = n->parent)
+    vma_fix(n);
+}
+
+static void vma_set_child(struct vma_tree_s *t, struct vma_s *parent,
+                          struct vma_s *old, struct vma_s *new)
+{
+  if(!parent)
+    t->root = new;
+  else if(parent->left == old)
+    parent->left = new;
+  else
+    parent->right = new;
+}
+
+static struct vma_s *vma_rotate_left(struct vma_tree_s *t, struct vma_s *x)
+{
+  struct vma_s *y = x->right;
+
+  x->right = y->left;
+  if(y->left) y->left->parent = x;
+
+  y->parent = x->parent;
+  vma_set_child(t, x->parent, x, y);
+
+  y->left = x;
+  x->parent = y;
+
+  vma_fix(x);
+  vma_fix(y);
+
+  return y;
+}
+
+static struct vma_s *vma_rotate_right(struct vma_tree_s *t, struct vma_s *x)
+{
+  struct vma_s *y = x->left;
+
+  x->left = y->right;
+  if(y->right) y->right->parent = x;
+
+  y->parent = x->parent;
+  vma_set_child(t, x->parent, x, y);
+
+  y->right = x;
+  x->parent = y;
+
+  vma_fix(x);
+  vma_fix(y);
+
+  return y;
+}
+
+/* Walk up to the root, restoring the balance and the gaps */
+static void vma_rebalance(struct vma_tree_s *t, struct vma_s *n)
+{
+  int bal;
+
+  while(n)
+    {
+      vma_fix(n);
+
+      bal = vma_height(n->left) - vma_height(n->right);
+
+      if(bal > 1)
+        {
+          if(vma_height(n->left->left) < vma_height(n->left->right))
+            vma_rotate_left(t, n->left);
+          n = vma_rotate_right(t, n);
+        }
+      else if(bal < -1)
+        {
+          if(vma_height(n->right->right) < vma_height(n->right->left))
+            vma_rotate_right(t, n->right);
+          n = vma_rotate_left(t, n);
+        }
+
+      n = n->parent;
+    }
+}
+
+void vma_tree_insert(struct vma_tree_s *t, struct vma_s *vma)
+{
+  struct vma_s **link = &t->root;
+  struct vma_s *parent = NULL;
+  struct vma_s *prev = NULL;
+  struct vma_s *next = NULL;
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+
+  while(*link)
+    {
+      parent = *link;
+      if(vma->va_start < parent->va_start)
+        {
+          next = parent;
+          link = &parent->left;
+        }
+      else
+        {
+          prev = parent;
+          link = &parent->right;
+        }
+    }
+
+  vma->parent = parent;
+  vma->left = NULL;
+  vma->right = NULL;
+  vma->height = 1;
+  *link = vma;
+
+  vma->prev = prev;
+  vma->next = next;
+  if(prev)
+    prev->next = vma;
+  else
+    t->first = vma;
+  if(next)
+    next->prev = vma;
+
+  vma_rebalance(t, vma);
+
+  // The hole in front of the next mapping just shrunk
+  vma_fix_up(next);
+
+  leave_critical_section(flags);
+}
+
+void vma_tree_remove(struct vma_tree_s *t, struct vma_s *vma)
+{
+  struct vma_s *next = vma->next;
+  struct vma_s *child;
+  struct vma_s *start;
+  struct vma_s *s;
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+
+  if(vma->prev)
+    vma->prev->next = next;
+  else
+    t->first = next;
+  if(next)
+    next->prev = vma->prev;
+
+  if(vma->left && vma->right)
+    {
+      // Put the successor, which has no left child, in our place
+      s = next;
+
+      if(s->parent != vma)
+        {
+          start = s->parent;
+          vma_set_child(t, s->parent, s, s->right);
+          if(s->right) s->right->parent = s->parent;
+
+          s->right = vma->right;
+          vma->right->parent = s;
+        }
+      else
+        {
+          start = s;
+        }
+
+      s->left = vma->left;
+      vma->left->parent = s;
+
+      vma_set_child(t, vma->parent, vma, s);
+      s->parent = vma->parent;
+    }
+  else
+    {
+      child = vma->left ? vma->left : vma->right;
+      start = vma->parent;
+
+      vma_set_child(t, vma->parent, vma, child);
+      if(child) child->parent = vma->parent;
+    }
+
+  vma_rebalance(t, start);
+
+  // The hole in front of the next mapping just grew
+  vma_fix_up(next);
+
+  vma->parent = vma->left = vma->right = NULL;
+  vma->prev = vma->next = NULL;
+
+  leave_critical_section(flags);
+}
+
+/* The bounds of vma changed without passing a neighbour */
+void vma_tree_update(struct vma_tree_s *t, struct vma_s *vma)
+{
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+  vma_fix_up(vma);
+  vma_fix_up(vma->next);
+  leave_critical_section(flags);
+}
+
+struct vma_s *vma_tree_lookup(struct vma_tree_s *t, uint64_t addr)
+{
+  struct vma_s *n = t->root;
+
+  while(n)
+    {
+      if(addr < n->va_start)
+        n = n->left;
+      else if(addr >= n->va_end)
+        n = n->right;
+      else
+        return n;
+    }
+
+  return NULL;
+}
+
+/* The first mapping ending above addr */
+struct vma_s *vma_tree_next(struct vma_tree_s *t, uint64_t addr)
+{
+  struct vma_s *n = t->root;
+  struct vma_s *best = NULL;
+
+  while(n)
+    {
+      if(n->va_end > addr)
+        {
+          best = n;
+          n = n->left;
+        }
+      else
+        {
+          n = n->right;
+        }
+    }
+
+  return best;
+}
+
+struct vma_s *vma_tree_last(struct vma_tree_s *t)
+{
+  struct vma_s *n = t->root;
+
+  while(n && n->right)
+    n = n->right;
+
+  return n;
+}
+
+/* Lowest hole of at least size between the mappings, or after the last
+ * one as long as it ends below high.  An empty tree starts at low. */
+int vma_tree_find_gap(struct vma_tree_s *t, uint64_t size, uint64_t low,
+                      uint64_t high, uint64_t *addr)
+{
+  struct vma_s *n = t->root;
+
+  if(!n)
+    {
+      if(low + size > high)
+        return -1;
+      *addr = low;
+      return 0;
+    }
+
+  if(n->gap >= size)
+    {
+      while(n)
+        {
+          if(vma_gap(n->left) >= size)
+            {
+              n = n->left;
+            }
+          else if(vma_hole(n) >= size)
+            {
+              *addr = n->prev->va_end;
+              return 0;
+            }
+          else
+            {
+              n = n->right;
+            }
+        }
+    }
+
+  n = vma_tree_last(t);
+  if(n->va_end + size > high)
+    return -1;
+
+  *addr = n->va_end;
+  return 0;
+}
@@ -14,16 +14,128 @@
 
 #include "sched/sched.h"
 
+#include <nuttx/mm/gran.h>
+
 #include <arch/board/jailhouse_ivshmem.h>
 #include <arch/board/virtio_ring.h>
 
 #define SHADOW_PROC_FLAG_RUN	1
 
+#ifndef CONFIG_SHADOW_PROC_NR_QUEUES
+#  define CONFIG_SHADOW_PROC_NR_QUEUES 2
+#endif
+
 #define SHADOW_PROC_STATE_RESET		0
 #define SHADOW_PROC_STATE_INIT		1
 #define SHADOW_PROC_STATE_READY		2
 #define SHADOW_PROC_STATE_RUN		3
 
+/* Tags carried in the second word of a rx frame.  A signal from Linux has
+ * bit 63 set, a completion of a shadow_proc_req has bit 62 set and carries
+ * the request address, a cache invalidation has bit 61 set and carries the
+ * Linux pid concerned (0 for all), an epoll readiness event has bit 60 set
+ * and carries the cookie given to SHADOW_PROC_EPOLL_ARM in the first word,
+ * anything else is the legacy tcb of a blocking write()/read() caller.
+ */
+
+#define SHADOW_PROC_TAG_SIGNAL		(1ULL << 63)
+#define SHADOW_PROC_TAG_REQ		(1ULL << 62)
+#define SHADOW_PROC_TAG_INVAL		(1ULL << 61)
+#define SHADOW_PROC_TAG_EVENT		(1ULL << 60)
+#define SHADOW_PROC_TAG_MASK		(SHADOW_PROC_TAG_SIGNAL | SHADOW_PROC_TAG_REQ | \
+					 SHADOW_PROC_TAG_INVAL | SHADOW_PROC_TAG_EVENT)
+
+/* Pseudo syscall (epfd, cookie): watch the Linux epoll fd once and send a
+ * SHADOW_PROC_TAG_EVENT frame with the cookie as soon as it is readable.
+ * Returns at once, the watch is re-armed by calling it again.
+ */
+
+#define SHADOW_PROC_EPOLL_ARM		511
+
+/* Scatter-gather descriptors appended to a tx frame after the 10 fixed
+ * words: one word holding the number of entries followed by the entries.
+ * Each entry describes a buffer argument either by its physical address in
+ * the RT cell or by an offset into the bulk region, so the shadow process
+ * never has to resolve our virtual addresses itself.
+ */
+
+#define SHADOW_PROC_SG_IN		(1 << 0) /* Linux reads it, e.g. write() */
+#define SHADOW_PROC_SG_OUT		(1 << 1) /* Linux fills it, e.g. read() */
+#define SHADOW_PROC_SG_BULK		(1 << 2) /* addr is an offset in the bulk region */
+
+#define SHADOW_PROC_MAX_SG		8
+
+struct shadow_proc_sg {
+  uint64_t addr;
+  uint32_t len;
+  uint32_t flags;
+};
+
+/* Trace ring of delegated calls, at the same offset in both regions just
+ * in front of the bulk region.  We fill the submit and wakeup stamps of a
+ * record in the TX region, the shadow process fills the pickup and
+ * completion stamps of the record in the same slot of its own region.
+ * The slot is named by the tag carried in bits 8..31 of the scheduling
+ * word of a request frame, 0 if the call is not traced.  A record is being
+ * written while its seq is 0, the RT side stores the sequence number + 1,
+ * the Linux side the tag.  All stamps are raw TSC values, both cells share
+ * the same invariant TSC.
+ */
+
+#define SHADOW_PROC_TRACE_MAGIC		0x45434152545053ULL /* "SPTRACE" */
+#define SHADOW_PROC_TRACE_VALID		(1 << 23)
+#define SHADOW_PROC_TRACE_TAG(seq)	(((seq) & (SHADOW_PROC_TRACE_VALID - 1)) | \
+					 SHADOW_PROC_TRACE_VALID)
+
+struct shadow_proc_trace_hdr {
+  uint64_t magic;
+  uint32_t nr;                     /* Records, a power of two */
+  uint32_t reserved;
+  volatile uint64_t head;          /* Next sequence number, RT side only */
+  uint64_t pad[5];
+};
+
+struct shadow_proc_trace_rec {
+  volatile uint64_t seq;
+  uint64_t nr;                     /* Syscall number */
+  uint64_t tcb;                    /* RT: submitter, Linux: its linux_tcb */
+  uint64_t submit_tsc;             /* RT */
+  uint64_t pickup_tsc;             /* Linux */
+  uint64_t complete_tsc;           /* Linux */
+  uint64_t wakeup_tsc;             /* RT */
+  uint64_t reserved;
+};
+
+/* A delegated syscall in flight.  Requests are posted to the tx ring with
+ * shadow_proc_submit() without ringing the doorbell, published together
+ * with shadow_proc_kick() and reaped in batches by the rx interrupt.
+ * The request must stay valid until done is set.
+ */
+
+struct shadow_proc_qpair;
+
+struct shadow_proc_req {
+  uint64_t params[7];
+  uint64_t ret;
+  struct tcb_s *tcb;
+  uint64_t submit_tsc;
+  uint64_t trace_seq;              /* Trace record + 1, 0 if none */
+  uint8_t prio;
+  uint8_t blocking;                /* Waits on other calls, not capped */
+  struct shadow_proc_req *flink;   /* Pending list, by priority */
+  struct shadow_proc_qpair *qp;
+  volatile uint32_t done;
+  volatile uint32_t waiting;
+  uint32_t nsg;
+  struct shadow_proc_sg sg[SHADOW_PROC_MAX_SG];
+
+  /* Bounce buffer in the bulk region, if any */
+
+  int stage_off;
+  uint32_t stage_len;
+  void *stage_buf;
+};
+
 /* Abstracted vring structure */
 
 struct shadow_proc_queue {
@@ -41,6 +153,16 @@ struct shadow_proc_queue {
   uint32_t tail;
 };
 
+/* A tx/rx vring pair, the shadow process services each with its own thread */
+
+struct shadow_proc_qpair {
+  struct shadow_proc_queue rx;
+  struct shadow_proc_queue tx;
+
+  struct shadow_proc_req *pending; /* Not yet on the ring, by priority */
+  uint32_t inflight;               /* On the ring, not yet completed */
+};
+
 /* The shadow_proc_driver_s encapsulates all state information for a single hardware
  * interface
  */
@@ -55,12 +177,29 @@ struct shadow_proc_driver_s
 
   uint32_t bdf;
 
-  struct shadow_proc_queue rx;
-  struct shadow_proc_queue tx;
+  struct shadow_proc_qpair qp[CONFIG_SHADOW_PROC_NR_QUEUES];
 
   uint32_t vrsize;
   uint32_t qlen;
   uint32_t qsize;
+  uint32_t qstride;
+
+  /* Bulk region, at the same offset in both the TX and RX regions */
+
+  uint32_t bulkoff;
+  uint32_t bulksize;
+  GRAN_HANDLE bulk_hnd;
+
+  /* Trace ring, in front of the bulk region */
+
+  uint32_t traceoff;
+  uint32_t tracesize;
+  struct shadow_proc_trace_hdr *trace;
+
+  /* Priorities of the requests not yet completed */
+
+  uint16_t wait_cnt[SCHED_PRIORITY_MAX + 1];
+  uint64_t wait_map[(SCHED_PRIORITY_MAX + 64) / 64];
 
   uint32_t lstate;
   uint32_t *rstate, last_rstate;
@@ -94,6 +233,8 @@ void shadow_proc_check_state(struct shadow_proc_driver_s *in);
 /* Common TX logic */
 
 uint64_t  shadow_proc_transmit(FAR struct shadow_proc_driver_s *priv, uint64_t *buf);
+int  shadow_proc_submit(FAR struct shadow_proc_driver_s *priv, struct shadow_proc_req *req);
+void shadow_proc_kick(FAR struct shadow_proc_driver_s *priv);
 int  shadow_proc_txpoll(FAR struct net_driver_s *dev);
 
 /* Interrupt handling */
@@ -101,12 +242,19 @@ int  shadow_proc_txpoll(FAR struct net_driver_s *dev);
 void shadow_proc_reply(struct shadow_proc_driver_s *priv);
 void shadow_proc_receive(FAR struct shadow_proc_driver_s *priv, uint64_t *buf);
 void shadow_proc_txdone(FAR struct shadow_proc_driver_s *priv);
+struct tcb_s *shadow_proc_dispatch(FAR struct shadow_proc_driver_s *priv, uint64_t *buf);
 
 int  shadow_proc_interrupt(int irq, FAR void *context, FAR void *arg);
 int  shadow_proc_ok(int irq, FAR void *context, FAR void *arg);
 
+int  shadow_proc_reap(FAR struct shadow_proc_driver_s *priv);
+
 bool shadow_proc_rx_avail(struct shadow_proc_driver_s *in);
+bool shadow_proc_rx_avail_q(struct shadow_proc_qpair *qp);
+struct shadow_proc_qpair *shadow_proc_select_queue(struct shadow_proc_driver_s *in,
+                                                   struct tcb_s *tcb);
 void shadow_proc_enable_rx_irq(struct shadow_proc_driver_s *in);
+void shadow_proc_disable_rx_irq(struct shadow_proc_driver_s *in);
 
 /* Watchdog timer expirations */
 
@@ -123,8 +271,22 @@ int  shadow_proc_ifdown(FAR struct net_driver_s *dev);
 
 void shadow_proc_txavail_work(FAR void *arg);
 
+/* Bulk region */
+
+int   shadow_proc_bulk_alloc(struct shadow_proc_driver_s *in, size_t size);
+void  shadow_proc_bulk_free(struct shadow_proc_driver_s *in, int off, size_t size);
+void *shadow_proc_bulk_tx(struct shadow_proc_driver_s *in, int off);
+void *shadow_proc_bulk_rx(struct shadow_proc_driver_s *in, int off);
+
+/* Trace ring */
+
+void shadow_proc_init_trace(struct shadow_proc_driver_s *in);
+void shadow_proc_trace_submit(struct shadow_proc_driver_s *in, struct shadow_proc_req *req);
+void shadow_proc_trace_wakeup(struct shadow_proc_driver_s *in, struct shadow_proc_req *req);
+
 void shadow_proc_set_prio(struct shadow_proc_driver_s *in, uint64_t prio);
 int shadow_proc_get_prio(struct shadow_proc_driver_s *in);
+int shadow_proc_get_wait_prio(struct shadow_proc_driver_s *in);
 
 struct shadow_proc_driver_s *gshadow;
 
@@ -73,6 +73,8 @@
 
 #define SMP_CACHE_BYTES 64
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
 #define JAILHOUSE_SHMEM_PROTO_VETH 0x1
 
 #define SHADOW_PROC_RSTATE_WRITE_ENABLE	(1ULL << 0)
@@ -94,8 +96,42 @@
 
 #define SHADOW_PROC_NUM_VECTORS		2
 
+#ifndef CONFIG_SHADOW_PROC_BULK_SIZE
+#  define CONFIG_SHADOW_PROC_BULK_SIZE (1024 * 1024)
+#endif
+
+#define SHADOW_PROC_BULK_GRAN		12
+
+#ifndef CONFIG_SHADOW_PROC_TRACE_ENTRIES
+#  define CONFIG_SHADOW_PROC_TRACE_ENTRIES 0
+#endif
+
+#if CONFIG_SHADOW_PROC_TRACE_ENTRIES & (CONFIG_SHADOW_PROC_TRACE_ENTRIES - 1)
+#  error CONFIG_SHADOW_PROC_TRACE_ENTRIES must be a power of two
+#endif
+
+#define SHADOW_PROC_TRACE_SIZE \
+  IVSHM_ALIGN(sizeof(struct shadow_proc_trace_hdr) + \
+              CONFIG_SHADOW_PROC_TRACE_ENTRIES * \
+              sizeof(struct shadow_proc_trace_rec), PAGE_SIZE)
+
+#ifndef CONFIG_SHADOW_PROC_INFLIGHT
+#  define CONFIG_SHADOW_PROC_INFLIGHT 8
+#endif
+
+#ifdef CONFIG_SHADOW_PROC_NO_EVENT_IDX
+#  undef CONFIG_SHADOW_PROC_EVENT_IDX
+#elif !defined(CONFIG_SHADOW_PROC_EVENT_IDX)
+#  define CONFIG_SHADOW_PROC_EVENT_IDX 1
+#endif
+
 /*struct shadow_proc_driver_s *aux_shadow = 0;*/
 
+/* Provided by the Linux subsystem */
+
+void tux_cache_invalidate(int linux_pid);
+void tux_epoll_notify(uint64_t cookie);
+
 /*****************************************
  *  ivshmem-net vring support functions  *
  *****************************************/
@@ -141,31 +177,41 @@ void shadow_proc_init_queue(
     q->size = in->qsize;
 }
 
+/* Queue pair q lives at 4 + q * qstride in both regions, queue 0 serves
+ * the highest priority band */
+
 void shadow_proc_init_queues(struct shadow_proc_driver_s *in)
 {
+    struct shadow_proc_qpair *qp;
     void *tx;
     void *rx;
-    int i;
+    int i, q;
     void* tmp;
 
-    tx = in->shm[SHADOW_PROC_REGION_TX] + 4;
-    rx = in->shm[SHADOW_PROC_REGION_RX] + 4;
+    memset(in->shm[SHADOW_PROC_REGION_TX] + 4, 0, in->shmlen - 4);
+
+    for (q = 0; q < CONFIG_SHADOW_PROC_NR_QUEUES; q++) {
+        qp = &in->qp[q];
 
-    memset(tx, 0, in->shmlen - 4);
+        tx = in->shm[SHADOW_PROC_REGION_TX] + 4 + q * in->qstride;
+        rx = in->shm[SHADOW_PROC_REGION_RX] + 4 + q * in->qstride;
 
-    shadow_proc_init_queue(in, &in->tx, tx, in->qlen);
-    shadow_proc_init_queue(in, &in->rx, rx, in->qlen);
+        shadow_proc_init_queue(in, &qp->tx, tx, in->qlen);
+        shadow_proc_init_queue(in, &qp->rx, rx, in->qlen);
 
-    tmp = in->rx.vr.used;
-    in->rx.vr.used = in->tx.vr.used;
-    in->tx.vr.used = tmp;
+        tmp = qp->rx.vr.used;
+        qp->rx.vr.used = qp->tx.vr.used;
+        qp->tx.vr.used = tmp;
 
-    in->tx.num_free = in->tx.vr.num;
+        qp->tx.num_free = qp->tx.vr.num;
 
-    _info("TX free: %d\n", in->tx.num_free);
+        _info("Queue %d TX free: %d\n", q, qp->tx.num_free);
+
+        for (i = 0; i < qp->tx.vr.num - 1; i++)
+            qp->tx.vr.desc[i].next = i + 1;
+    }
 
-    for (i = 0; i < in->tx.vr.num - 1; i++)
-        in->tx.vr.desc[i].next = i + 1;
+    shadow_proc_init_trace(in);
 }
 
 int shadow_proc_calc_qsize(struct shadow_proc_driver_s *in)
@@ -173,18 +219,41 @@ int shadow_proc_calc_qsize(struct shadow_proc_driver_s *in)
     unsigned int vrsize;
     unsigned int qsize;
     unsigned int qlen;
+    unsigned int bulksize;
+    unsigned int tracesize;
+    unsigned int avail;
+    unsigned int stride;
+
+    /* The bulk region sits page aligned at the tail of each region,
+     * the vrings and frame queues get whatever is in front of it */
+    bulksize = CONFIG_SHADOW_PROC_BULK_SIZE & ~(PAGE_SIZE - 1);
+    if (bulksize > (in->shmlen / 2))
+        bulksize = (in->shmlen / 2) & ~(PAGE_SIZE - 1);
+
+    avail = in->shmlen - bulksize;
+
+    /* The trace ring goes right in front of it, if it leaves enough */
+    tracesize = 0;
+    if (CONFIG_SHADOW_PROC_TRACE_ENTRIES &&
+        SHADOW_PROC_TRACE_SIZE < avail / 4)
+        tracesize = SHADOW_PROC_TRACE_SIZE;
+
+    avail -= tracesize;
+
+    /* Every queue pair gets an equal, aligned slice */
+    stride = ((avail - 4) / CONFIG_SHADOW_PROC_NR_QUEUES) & ~(SHADOW_PROC_VQ_ALIGN - 1);
 
     for (qlen = 4096; qlen > 32; qlen >>= 1) {
         vrsize = vring_size(qlen, SHADOW_PROC_VQ_ALIGN);
         vrsize = IVSHM_ALIGN(vrsize, SHADOW_PROC_VQ_ALIGN);
-        if (vrsize < (in->shmlen - 4) / 8)
+        if (vrsize < stride / 8)
             break;
     }
 
-    if (vrsize > in->shmlen - 4)
+    if (vrsize > stride)
         return -EINVAL;
 
-    qsize = in->shmlen - 4 - vrsize;
+    qsize = stride - vrsize;
 
     if (qsize < 4 * SHADOW_PROC_MTU_DEF)
         return -EINVAL;
@@ -192,54 +261,216 @@ int shadow_proc_calc_qsize(struct shadow_proc_driver_s *in)
     in->vrsize = vrsize;
     in->qlen = qlen;
     in->qsize = qsize;
+    in->qstride = stride;
+
+    in->traceoff = avail;
+    in->tracesize = tracesize;
+
+    in->bulkoff = avail + tracesize;
+    in->bulksize = bulksize;
 
     return 0;
 }
 
+/*****************************************
+ *  Trace ring support functions         *
+ *****************************************/
+
+/* The TX region was just cleared, nothing may trace before this */
+
+void shadow_proc_init_trace(struct shadow_proc_driver_s *in)
+{
+    struct shadow_proc_trace_hdr *hdr;
+
+    if (!in->tracesize)
+        return;
+
+    hdr = in->shm[SHADOW_PROC_REGION_TX] + in->traceoff;
+    hdr->nr = CONFIG_SHADOW_PROC_TRACE_ENTRIES;
+    hdr->head = 0;
+    wmb();
+    hdr->magic = SHADOW_PROC_TRACE_MAGIC;
+
+    in->trace = hdr;
+}
+
+static struct shadow_proc_trace_rec *
+shadow_proc_trace_rec(struct shadow_proc_trace_hdr *hdr, uint64_t seq)
+{
+    struct shadow_proc_trace_rec *recs = (struct shadow_proc_trace_rec *)(hdr + 1);
+
+    return &recs[seq & (hdr->nr - 1)];
+}
+
+/* Claim a record for the request, any CPU may be doing the same */
+
+void shadow_proc_trace_submit(struct shadow_proc_driver_s *in,
+                              struct shadow_proc_req *req)
+{
+    struct shadow_proc_trace_hdr *hdr = in->trace;
+    struct shadow_proc_trace_rec *rec;
+    uint64_t seq;
+
+    req->trace_seq = 0;
+
+    if (!hdr)
+        return;
+
+    seq = __atomic_fetch_add(&hdr->head, 1, __ATOMIC_RELAXED);
+    rec = shadow_proc_trace_rec(hdr, seq);
+
+    rec->seq = 0;
+    wmb();
+    rec->nr = req->params[0];
+    rec->tcb = (uint64_t)req->tcb;
+    rec->submit_tsc = req->submit_tsc;
+    rec->wakeup_tsc = 0;
+    wmb();
+    rec->seq = seq + 1;
+
+    req->trace_seq = seq + 1;
+}
+
+/* The submitter is back, unless the ring went round in the meantime */
+
+void shadow_proc_trace_wakeup(struct shadow_proc_driver_s *in,
+                              struct shadow_proc_req *req)
+{
+    struct shadow_proc_trace_rec *rec;
+    uint64_t tsc = rdtsc();
+
+    if (!req->trace_seq)
+        return;
+
+    rec = shadow_proc_trace_rec(in->trace, req->trace_seq - 1);
+    if (rec->seq == req->trace_seq)
+        rec->wakeup_tsc = tsc;
+}
+
+/*****************************************
+ *  Bulk region support functions        *
+ *****************************************/
+
+void shadow_proc_init_bulk(struct shadow_proc_driver_s *in)
+{
+    in->bulk_hnd = NULL;
+
+    if (!in->bulksize)
+        return;
+
+    in->bulk_hnd = gran_initialize(in->shm[SHADOW_PROC_REGION_TX] + in->bulkoff,
+                                   in->bulksize, SHADOW_PROC_BULK_GRAN,
+                                   SHADOW_PROC_BULK_GRAN);
+}
+
+/* Returns the offset of the allocation, usable in both regions */
+
+int shadow_proc_bulk_alloc(struct shadow_proc_driver_s *in, size_t size)
+{
+    void *p;
+
+    if (!in->bulk_hnd)
+        return -ENOMEM;
+
+    p = gran_alloc(in->bulk_hnd, size);
+    if (!p)
+        return -ENOMEM;
+
+    return p - in->shm[SHADOW_PROC_REGION_TX];
+}
+
+void shadow_proc_bulk_free(struct shadow_proc_driver_s *in, int off, size_t size)
+{
+    gran_free(in->bulk_hnd, in->shm[SHADOW_PROC_REGION_TX] + off, size);
+}
+
+/* RT writes to its copy, Linux answers in the same offset of its own */
+
+void *shadow_proc_bulk_tx(struct shadow_proc_driver_s *in, int off)
+{
+    return in->shm[SHADOW_PROC_REGION_TX] + off;
+}
+
+void *shadow_proc_bulk_rx(struct shadow_proc_driver_s *in, int off)
+{
+    return in->shm[SHADOW_PROC_REGION_RX] + off;
+}
+
 /*****************************************
  *  ivshmem-net IRQ support functions  *
  *****************************************/
 
-void shadow_proc_notify_tx(struct shadow_proc_driver_s *in, unsigned int num)
+void shadow_proc_notify_tx(struct shadow_proc_driver_s *in,
+                           struct shadow_proc_qpair *qp, unsigned int num)
 {
-    /*uint16_t evt, old, new;*/
+#ifdef CONFIG_SHADOW_PROC_EVENT_IDX
+    uint16_t evt, old, new;
 
-    /*mb();*/
+    mb();
 
-    /*evt = READ_ONCE(vring_avail_event(&in->tx.vr));*/
-    /*old = in->tx.last_avail_idx - num;*/
-    /*new = in->tx.last_avail_idx;*/
+    /* Only ring if the shadow process asked for it, it does not while it
+     * is still busy draining the ring */
+    evt = READ_ONCE(vring_avail_event(&qp->tx.vr));
+    old = qp->tx.last_avail_idx - num;
+    new = qp->tx.last_avail_idx;
 
-    /*if (vring_need_event(evt, new, old)) {*/
+    if (vring_need_event(evt, new, old)) {
+        in->ivshm_regs->doorbell = SHADOW_PROC_VECTOR_TX_RX;
+    }
+#else
     in->ivshm_regs->doorbell = SHADOW_PROC_VECTOR_TX_RX;
-    /*}*/
+#endif
 }
 
 void shadow_proc_enable_rx_irq(struct shadow_proc_driver_s *in)
 {
-    vring_avail_event(&in->rx.vr) = in->rx.last_avail_idx;
+    int q;
+
+    for (q = 0; q < CONFIG_SHADOW_PROC_NR_QUEUES; q++)
+        vring_avail_event(&in->qp[q].rx.vr) = in->qp[q].rx.last_avail_idx;
     wmb();
 }
 
-void shadow_proc_notify_rx(struct shadow_proc_driver_s *in, unsigned int num)
+/* Park the event index just behind what we have consumed, the shadow
+ * process will not ring for new completions until it is re-armed */
+
+void shadow_proc_disable_rx_irq(struct shadow_proc_driver_s *in)
 {
+    int q;
+
+    for (q = 0; q < CONFIG_SHADOW_PROC_NR_QUEUES; q++)
+        vring_avail_event(&in->qp[q].rx.vr) = in->qp[q].rx.last_avail_idx - 1;
+    wmb();
+}
+
+void shadow_proc_notify_rx(struct shadow_proc_driver_s *in,
+                           struct shadow_proc_qpair *qp, unsigned int num)
+{
+#ifdef CONFIG_SHADOW_PROC_EVENT_IDX
     uint16_t evt, old, new;
 
-    /*mb();*/
+    mb();
 
-    /*evt = vring_used_event(&in->rx.vr);*/
-    /*old = in->rx.last_used_idx - num;*/
-    /*new = in->rx.last_used_idx;*/
+    evt = READ_ONCE(vring_used_event(&qp->rx.vr));
+    old = qp->rx.last_used_idx - num;
+    new = qp->rx.last_used_idx;
 
-    /*if (vring_need_event(evt, new, old)) {*/
+    if (vring_need_event(evt, new, old)) {
+        in->ivshm_regs->doorbell = SHADOW_PROC_VECTOR_TX_RX;
+        mb();
+    }
+#else
     in->ivshm_regs->doorbell = SHADOW_PROC_VECTOR_TX_RX;
     mb();
-    /*}*/
+#endif
 }
 
 void shadow_proc_enable_tx_irq(struct shadow_proc_driver_s *in)
 {
-    vring_used_event(&in->tx.vr) = in->tx.last_used_idx;
+    int q;
+
+    for (q = 0; q < CONFIG_SHADOW_PROC_NR_QUEUES; q++)
+        vring_used_event(&in->qp[q].tx.vr) = in->qp[q].tx.last_used_idx;
     wmb();
 }
 
@@ -261,9 +492,10 @@ int shadow_proc_get_prio(struct shadow_proc_driver_s *in)
  *  ivshmem-net vring syntax sugars  *
  *************************************/
 
-struct vring_desc *shadow_proc_rx_desc(struct shadow_proc_driver_s *in)
+struct vring_desc *shadow_proc_rx_desc(struct shadow_proc_driver_s *in,
+                                       struct shadow_proc_qpair *qp)
 {
-    struct shadow_proc_queue *rx = &in->rx;
+    struct shadow_proc_queue *rx = &qp->rx;
     struct vring *vr = &rx->vr;
     unsigned int avail;
     uint16_t avail_idx;
@@ -282,15 +514,27 @@ struct vring_desc *shadow_proc_rx_desc(struct shadow_proc_driver_s *in)
     return &vr->desc[avail];
 }
 
+bool shadow_proc_rx_avail_q(struct shadow_proc_qpair *qp)
+{
+    return READ_ONCE(qp->rx.vr.avail->idx) != qp->rx.last_avail_idx;
+}
+
 bool shadow_proc_rx_avail(struct shadow_proc_driver_s *in)
 {
+    int q;
+
     mb();
-    return READ_ONCE(in->rx.vr.avail->idx) != in->rx.last_avail_idx;
+    for (q = 0; q < CONFIG_SHADOW_PROC_NR_QUEUES; q++)
+        if (shadow_proc_rx_avail_q(&in->qp[q]))
+            return true;
+
+    return false;
 }
 
-void shadow_proc_rx_finish(struct shadow_proc_driver_s *in, struct vring_desc *desc)
+void shadow_proc_rx_finish(struct shadow_proc_driver_s *in,
+                           struct shadow_proc_qpair *qp, struct vring_desc *desc)
 {
-    struct shadow_proc_queue *rx = &in->rx;
+    struct shadow_proc_queue *rx = &qp->rx;
     struct vring *vr = &rx->vr;
     unsigned int desc_id = desc - vr->desc;
     unsigned int used;
@@ -302,9 +546,10 @@ void shadow_proc_rx_finish(struct shadow_proc_driver_s *in, struct vring_desc *d
     virt_store_release(&vr->used->idx, rx->last_used_idx);
 }
 
-size_t shadow_proc_tx_space(struct shadow_proc_driver_s *in)
+size_t shadow_proc_tx_space(struct shadow_proc_driver_s *in,
+                           struct shadow_proc_qpair *qp)
 {
-    struct shadow_proc_queue *tx = &in->tx;
+    struct shadow_proc_queue *tx = &qp->tx;
     uint32_t tail = tx->tail;
     uint32_t head = tx->head;
     uint32_t space;
@@ -317,10 +562,11 @@ size_t shadow_proc_tx_space(struct shadow_proc_driver_s *in)
     return space;
 }
 
-bool shadow_proc_tx_ok(struct shadow_proc_driver_s *in, unsigned int mtu)
+bool shadow_proc_tx_ok(struct shadow_proc_driver_s *in,
+                       struct shadow_proc_qpair *qp, unsigned int mtu)
 {
-    return in->tx.num_free >= 2 &&
-        shadow_proc_tx_space(in) >= 2 * SHADOW_PROC_FRAME_SIZE(mtu);
+    return qp->tx.num_free >= 2 &&
+        shadow_proc_tx_space(in, qp) >= 2 * SHADOW_PROC_FRAME_SIZE(mtu);
 }
 
 uint32_t shadow_proc_tx_advance(struct shadow_proc_queue *q, uint32_t *pos, uint32_t len)
@@ -336,9 +582,13 @@ uint32_t shadow_proc_tx_advance(struct shadow_proc_queue *q, uint32_t *pos, uint
     return p;
 }
 
-int shadow_proc_tx_frame(struct shadow_proc_driver_s *in, void* data, int len)
+void shadow_proc_tx_clean(struct shadow_proc_driver_s *in,
+                          struct shadow_proc_qpair *qp);
+
+int shadow_proc_tx_post(struct shadow_proc_driver_s *in,
+                        struct shadow_proc_qpair *qp, void* data, int len)
 {
-    struct shadow_proc_queue *tx = &in->tx;
+    struct shadow_proc_queue *tx = &qp->tx;
     struct vring *vr = &tx->vr;
     struct vring_desc *desc;
     unsigned int desc_idx;
@@ -347,23 +597,22 @@ int shadow_proc_tx_frame(struct shadow_proc_driver_s *in, void* data, int len)
     void *buf;
     irqstate_t flags;
 
+    shadow_proc_tx_clean(in, qp);
+
+    /* Posting may come from several tasks, the whole slot must be taken
+     * and published atomically */
+    flags = enter_critical_section();
 
-    shadow_proc_tx_clean(in);
     if(tx->num_free < 1) {
-        _err("tx exhausted!\n");
-        _err("%d %d %d\n", tx->num_free, vr->used->idx, tx->last_used_idx);
-        ASSERT(0);
+        leave_critical_section(flags);
+        return -EAGAIN;
     }
 
-    flags = enter_critical_section();
-
     desc_idx = tx->free_head;
     desc = &vr->desc[desc_idx];
     tx->free_head = desc->next;
     tx->num_free--;
 
-    leave_critical_section(flags);
-
     head = shadow_proc_tx_advance(tx, &tx->head, len);
 
     buf = tx->data + head;
@@ -378,15 +627,74 @@ int shadow_proc_tx_frame(struct shadow_proc_driver_s *in, void* data, int len)
     tx->num_added++;
 
     virt_store_release(&vr->avail->idx, tx->last_avail_idx);
-    shadow_proc_notify_tx(in, tx->num_added);
-    tx->num_added = 0;
+
+    leave_critical_section(flags);
 
     return 0;
 }
 
-void shadow_proc_tx_clean(struct shadow_proc_driver_s *in)
+void shadow_proc_kick(struct shadow_proc_driver_s *in)
 {
-    struct shadow_proc_queue *tx = &in->tx;
+    struct shadow_proc_queue *tx;
+    irqstate_t flags;
+    int q;
+
+    flags = enter_critical_section();
+
+    for (q = 0; q < CONFIG_SHADOW_PROC_NR_QUEUES; q++) {
+        tx = &in->qp[q].tx;
+        if (tx->num_added) {
+            shadow_proc_notify_tx(in, &in->qp[q], tx->num_added);
+            tx->num_added = 0;
+        }
+    }
+
+    leave_critical_section(flags);
+}
+
+int shadow_proc_tx_frame(struct shadow_proc_driver_s *in,
+                         struct shadow_proc_qpair *qp, void* data, int len)
+{
+    struct shadow_proc_queue *tx = &qp->tx;
+
+    if(shadow_proc_tx_post(in, qp, data, len)) {
+        _err("tx exhausted!\n");
+        _err("%d %d %d\n", tx->num_free, tx->vr.used->idx, tx->last_used_idx);
+        ASSERT(0);
+    }
+
+    shadow_proc_kick(in);
+
+    return 0;
+}
+
+/* Map a task to its queue pair, either by the CPU it runs on or by its
+ * priority band with queue 0 taking the most urgent tasks, so that a busy
+ * low priority task never queues in front of a high priority one */
+
+struct shadow_proc_qpair *shadow_proc_select_queue(struct shadow_proc_driver_s *in,
+                                                   struct tcb_s *tcb)
+{
+#ifdef CONFIG_SHADOW_PROC_QUEUE_BY_CPU
+    return &in->qp[this_cpu() % CONFIG_SHADOW_PROC_NR_QUEUES];
+#else
+    int band;
+
+    band = (SCHED_PRIORITY_MAX - tcb->sched_priority) * CONFIG_SHADOW_PROC_NR_QUEUES /
+           (SCHED_PRIORITY_MAX - SCHED_PRIORITY_MIN + 1);
+
+    /* The idle priority is below SCHED_PRIORITY_MIN */
+    if (band >= CONFIG_SHADOW_PROC_NR_QUEUES)
+        band = CONFIG_SHADOW_PROC_NR_QUEUES - 1;
+
+    return &in->qp[band];
+#endif
+}
+
+void shadow_proc_tx_clean(struct shadow_proc_driver_s *in,
+                          struct shadow_proc_qpair *qp)
+{
+    struct shadow_proc_queue *tx = &qp->tx;
     struct vring_used_elem *used;
     struct vring *vr = &tx->vr;
     struct vring_desc *desc;
@@ -424,7 +732,7 @@ void shadow_proc_tx_clean(struct shadow_proc_driver_s *in)
 
         desc = &vr->desc[used->id];
 
-        data = shadow_proc_desc_data(in, &in->tx, SHADOW_PROC_REGION_TX,
+        data = shadow_proc_desc_data(in, tx, SHADOW_PROC_REGION_TX,
                        desc, &len);
         if (!data) {
             _err("bad tx descriptor, data == NULL\n");
@@ -641,7 +949,166 @@ uint64_t shadow_proc_transmit(FAR struct shadow_proc_driver_s *priv, uint64_t *d
 
   buf[9] = rtcb->xcp.linux_tcb;
 
-  shadow_proc_tx_frame(priv, buf, sizeof(buf));
+  shadow_proc_tx_frame(priv, shadow_proc_select_queue(priv, rtcb), buf, sizeof(buf));
+
+  return OK;
+}
+
+/* Track the priority of every request not yet completed, the highest one
+ * is published next to the running priority so that the shadow process
+ * can boost the thread servicing us */
+
+void shadow_proc_wait_add(struct shadow_proc_driver_s *in, int prio)
+{
+  if (!in->wait_cnt[prio]++)
+    in->wait_map[prio / 64] |= 1ULL << (prio % 64);
+}
+
+void shadow_proc_wait_del(struct shadow_proc_driver_s *in, int prio)
+{
+  if (!--in->wait_cnt[prio])
+    in->wait_map[prio / 64] &= ~(1ULL << (prio % 64));
+}
+
+void shadow_proc_publish_wait_prio(struct shadow_proc_driver_s *in)
+{
+  uint64_t prio = 0;
+  int i;
+
+  for (i = ARRAY_SIZE(in->wait_map) - 1; i >= 0; i--) {
+    if (in->wait_map[i]) {
+      prio = i * 64 + 63 - __builtin_clzll(in->wait_map[i]);
+      break;
+    }
+  }
+
+  *((volatile uint64_t*)(in->shm[SHADOW_PROC_REGION_TX] + in->shmlen + 8)) = prio;
+  wmb();
+}
+
+int shadow_proc_get_wait_prio(struct shadow_proc_driver_s *in)
+{
+  int prio = *((volatile uint64_t*)(in->shm[SHADOW_PROC_REGION_TX] + in->shmlen + 8));
+  rmb();
+  return prio;
+}
+
+int shadow_proc_post_req(FAR struct shadow_proc_driver_s *priv,
+                         struct shadow_proc_qpair *qp, struct shadow_proc_req *req)
+{
+  uint64_t buf[11 + 2 * SHADOW_PROC_MAX_SG];
+  struct tcb_s *rtcb = req->tcb;
+  int len = sizeof(uint64_t) * 10;
+
+  memcpy(buf, req->params, sizeof(uint64_t) * 7);
+  buf[7] = (uint64_t)req | SHADOW_PROC_TAG_REQ;
+
+  uint64_t policy = ((rtcb->flags & TCB_FLAG_POLICY_MASK) >> TCB_FLAG_POLICY_SHIFT) + 1;
+  uint64_t prio = req->prio;
+  uint64_t tag = req->trace_seq ? SHADOW_PROC_TRACE_TAG(req->trace_seq - 1) : 0;
+  buf[8] = (policy << 32) | (tag << 8) | prio;
+
+  buf[9] = rtcb->xcp.linux_tcb;
+
+  /* Frames longer than the fixed part carry the scatter-gather list */
+  if (req->nsg) {
+    DEBUGASSERT(req->nsg <= SHADOW_PROC_MAX_SG);
+    buf[10] = req->nsg;
+    memcpy(&buf[11], req->sg, sizeof(struct shadow_proc_sg) * req->nsg);
+    len += sizeof(uint64_t) + sizeof(struct shadow_proc_sg) * req->nsg;
+  }
+
+  return shadow_proc_tx_post(priv, qp, buf, len);
+}
+
+/****************************************************************************
+ * Name: shadow_proc_schedule
+ *
+ * Description:
+ *   Move pending requests of a queue pair onto its tx ring, most urgent
+ *   first, keeping at most CONFIG_SHADOW_PROC_INFLIGHT of them in flight.
+ *   The shadow process serves its ring in order, so a newly submitted
+ *   urgent request waits for at most that many calls ahead of it.
+ *   Requests which wait on other delegated work are never held back nor
+ *   counted, the call they wait for may be the one held back.
+ *
+ ****************************************************************************/
+
+void shadow_proc_schedule(FAR struct shadow_proc_driver_s *priv,
+                          struct shadow_proc_qpair *qp)
+{
+  struct shadow_proc_req **pp;
+  struct shadow_proc_req *req;
+  irqstate_t flags;
+
+  flags = enter_critical_section();
+
+  pp = &qp->pending;
+  while ((req = *pp)) {
+    if (!req->blocking && CONFIG_SHADOW_PROC_INFLIGHT &&
+        qp->inflight >= CONFIG_SHADOW_PROC_INFLIGHT) {
+      pp = &req->flink;
+      continue;
+    }
+
+    if (shadow_proc_post_req(priv, qp, req))
+      break;
+
+    *pp = req->flink;
+    req->flink = NULL;
+    if (!req->blocking)
+      qp->inflight++;
+  }
+
+  leave_critical_section(flags);
+}
+
+/****************************************************************************
+ * Name: shadow_proc_submit
+ *
+ * Description:
+ *   Queue a delegated syscall without ringing the doorbell.  Any number of
+ *   requests, from one or many tasks, may be queued before they are
+ *   published to the shadow process with shadow_proc_kick().  Requests
+ *   are kept ordered by the priority of their submitter and fed to the tx
+ *   ring by shadow_proc_schedule().  The completion is matched back to the
+ *   request by its address.
+ *
+ * Input Parameters:
+ *   priv - Reference to the driver state structure
+ *   req  - The request, params and tcb filled in
+ *
+ * Returned Value:
+ *   OK
+ *
+ ****************************************************************************/
+
+int shadow_proc_submit(FAR struct shadow_proc_driver_s *priv, struct shadow_proc_req *req)
+{
+  struct shadow_proc_qpair *qp;
+  struct shadow_proc_req **pp;
+  irqstate_t flags;
+
+  req->done = 0;
+  req->waiting = 0;
+  req->submit_tsc = rdtsc();
+  req->prio = req->tcb->sched_priority;
+  shadow_proc_trace_submit(priv, req);
+  req->qp = qp = shadow_proc_select_queue(priv, req->tcb);
+
+  flags = enter_critical_section();
+
+  /* FIFO among equals */
+  for (pp = &qp->pending; *pp && (*pp)->prio >= req->prio; pp = &(*pp)->flink);
+  req->flink = *pp;
+  *pp = req;
+
+  shadow_proc_wait_add(priv, req->prio);
+  shadow_proc_publish_wait_prio(priv);
+
+  leave_critical_section(flags);
+
+  shadow_proc_schedule(priv, qp);
 
   return OK;
 }
@@ -665,15 +1132,28 @@ uint64_t shadow_proc_transmit(FAR struct shadow_proc_driver_s *priv, uint64_t *d
 
 void shadow_proc_receive(FAR struct shadow_proc_driver_s *priv, uint64_t *buf)
 {
+  struct shadow_proc_qpair *qp = NULL;
   struct vring_desc *desc;
   void *data;
   uint32_t len;
+  int q;
+
+  /* Serve the most urgent queue first */
+  for (q = 0; q < CONFIG_SHADOW_PROC_NR_QUEUES; q++) {
+    if (shadow_proc_rx_avail_q(&priv->qp[q])) {
+      qp = &priv->qp[q];
+      break;
+    }
+  }
 
-  desc = shadow_proc_rx_desc(priv); /* get next avail rx descriptor from avail ring */
+  if (!qp)
+    return;
+
+  desc = shadow_proc_rx_desc(priv, qp); /* get next avail rx descriptor from avail ring */
   if (!desc)
     return;
 
-  data = shadow_proc_desc_data(priv, &priv->rx, SHADOW_PROC_REGION_RX,
+  data = shadow_proc_desc_data(priv, &qp->rx, SHADOW_PROC_REGION_RX,
                desc, &len); /* Unpack descriptor and get the physical address in SHMEM and fill in len */
   if (!data) {
     _err("bad rx descriptor\n");
@@ -682,10 +1162,93 @@ void shadow_proc_receive(FAR struct shadow_proc_driver_s *priv, uint64_t *buf)
 
   memcpy(buf, data, sizeof(uint64_t) * 2);
 
-  shadow_proc_rx_finish(priv, desc); /* Release the read descriptor in to the used ring */
+  shadow_proc_rx_finish(priv, qp, desc); /* Release the read descriptor in to the used ring */
   return;
 }
 
+/****************************************************************************
+ * Name: shadow_proc_dispatch
+ *
+ * Description:
+ *   Consume one rx frame: forward a signal, complete a shadow_proc_req or
+ *   hand back the return value of a legacy blocking caller.
+ *
+ * Returned Value:
+ *   The tcb blocked on its syscall_lock which should be woken, or NULL
+ *
+ ****************************************************************************/
+
+struct tcb_s *shadow_proc_dispatch(FAR struct shadow_proc_driver_s *priv, uint64_t *buf)
+{
+  struct shadow_proc_req *req;
+  struct tcb_s *rtcb;
+
+  if(buf[1] & SHADOW_PROC_TAG_SIGNAL) {
+      // It is a signal
+      buf[1] &= ~SHADOW_PROC_TAG_SIGNAL;
+
+      if(buf[0]){
+        int lpid;
+        lpid = get_nuttx_pid(buf[1]);
+        if(lpid > 0)
+        nxsig_kill(lpid, buf[0]);
+      }
+
+      return NULL;
+  }
+
+  if(buf[1] & SHADOW_PROC_TAG_INVAL) {
+      // Linux changed something our syscall cache may hold
+      tux_cache_invalidate(buf[1] & ~SHADOW_PROC_TAG_MASK);
+
+      return NULL;
+  }
+
+  if(buf[1] & SHADOW_PROC_TAG_EVENT) {
+      // Linux fds of an epoll instance are ready
+      tux_epoll_notify(buf[0]);
+
+      return NULL;
+  }
+
+  if(buf[1] & SHADOW_PROC_TAG_REQ) {
+      req = (struct shadow_proc_req *)(buf[1] & ~SHADOW_PROC_TAG_MASK);
+
+      req->ret = buf[0];
+      req->done = 1;
+
+      /* A slot in flight is free, let the next most urgent one in */
+      if(!req->blocking)
+        req->qp->inflight--;
+      shadow_proc_wait_del(priv, req->prio);
+      shadow_proc_publish_wait_prio(priv);
+
+      shadow_proc_schedule(priv, req->qp);
+      shadow_proc_kick(priv);
+
+      /* Only wake the submitter if it is sleeping on this very request,
+       * otherwise it will find it done when it comes to wait */
+      if(!req->waiting)
+        return NULL;
+
+      req->waiting = 0;
+      return req->tcb;
+  }
+
+  rtcb = (struct tcb_s *)buf[1];
+
+  if(rtcb){
+      rtcb->xcp.syscall_ret = buf[0];
+
+      if(rtcb->xcp.syscall_pollfd) {
+        // Someone is waiting
+        rtcb->xcp.syscall_pollfd->revents |= POLLIN;
+      }
+  }
+
+  return rtcb;
+}
+
 /****************************************************************************
  * Name: shadow_proc_interrupt
  *
@@ -708,43 +1271,59 @@ void shadow_proc_receive(FAR struct shadow_proc_driver_s *priv, uint64_t *buf)
 int shadow_proc_interrupt(int irq, FAR void *context, FAR void *arg)
 {
   FAR struct shadow_proc_driver_s *priv = (FAR struct shadow_proc_driver_s *)arg;
-  uint64_t buf[2];
-  struct tcb_s *rtcb;
 
   DEBUGASSERT(priv != NULL);
 
-  memset(buf, 0, sizeof(buf));
-  shadow_proc_receive(priv, buf);
+  shadow_proc_reap(priv);
 
   shadow_proc_enable_rx_irq(priv);
 
-  if(buf[1] & (1ULL << 63)) {
-      // It is a signal
-      buf[1] &= ~(1ULL << 63);
+  return OK;
+}
 
-      if(buf[0]){
-        int lpid;
-        lpid = get_nuttx_pid(buf[1]);
-        if(lpid > 0)
-        nxsig_kill(lpid, buf[0]);
-      }
+/****************************************************************************
+ * Name: shadow_proc_reap
+ *
+ * Description:
+ *   Drain every completion pending on the rx ring and wake their owners.
+ *   Used by the interrupt handler and by callers polling for a reply with
+ *   the rx interrupt suppressed.
+ *
+ * Returned Value:
+ *   The number of frames consumed
+ *
+ ****************************************************************************/
+
+int shadow_proc_reap(FAR struct shadow_proc_driver_s *priv)
+{
+  uint64_t buf[2];
+  struct tcb_s *rtcb;
+  irqstate_t flags;
+  int n = 0;
+
+  flags = enter_critical_section();
 
-  } else {
-      rtcb = (struct tcb_s *)buf[1];
+  /* The shadow process may complete several requests per doorbell,
+   * reap them all */
+  while(shadow_proc_rx_avail(priv)) {
+      memset(buf, 0, sizeof(buf));
+      shadow_proc_receive(priv, buf);
+      n++;
 
+      rtcb = shadow_proc_dispatch(priv, buf);
       if(rtcb){
-          rtcb->xcp.syscall_ret = buf[0];
           nxsem_post(&rtcb->xcp.syscall_lock);
 
           if(rtcb->xcp.syscall_pollfd) {
             // Someone is waiting
-            rtcb->xcp.syscall_pollfd->revents |= POLLIN;
             nxsem_post(rtcb->xcp.syscall_pollfd->sem);
           }
       }
   }
 
-  return OK;
+  leave_critical_section(flags);
+
+  return n;
 }
 
 int shadow_proc_ok(int irq, FAR void *context, FAR void *arg)
@@ -968,6 +1547,8 @@ int shadow_proc_probe(uint16_t bdf)
   if (shadow_proc_calc_qsize(priv))
       return -EINVAL;
 
+  shadow_proc_init_bulk(priv);
+
   /* init states here */
   /* Changing the lstate will kick start the sequence of INIT in state machine */
   /* Initialize PHYs, the Ethernet interface, and setup up Ethernet interrupts */
@@ -107,6 +107,9 @@ enum proc_node_e
   PROC_LOADAVG,                       /* Average CPU utilization */
 #endif
   PROC_STACK,                         /* Task stack info */
+#ifdef CONFIG_TUX_SYSCALL_STATS
+  PROC_TUX_SYSCALLS,                  /* Linux syscall statistics */
+#endif
   PROC_GROUP,                         /* Group directory */
   PROC_GROUP_STATUS,                  /* Task group status */
   PROC_GROUP_FD                       /* Group file descriptors */
@@ -278,6 +281,13 @@ static const struct proc_node_s g_stack =
   "stack",        "stack",   (uint8_t)PROC_STACK,        DTYPE_FILE        /* Task stack info */
 };
 
+#ifdef CONFIG_TUX_SYSCALL_STATS
+static const struct proc_node_s g_tuxsyscalls =
+{
+  "tux_syscalls", "tux_syscalls", (uint8_t)PROC_TUX_SYSCALLS, DTYPE_FILE  /* Linux syscall statistics */
+};
+#endif
+
 static const struct proc_node_s g_group =
 {
   "group",        "group",   (uint8_t)PROC_GROUP,        DTYPE_DIRECTORY   /* Group directory */
@@ -311,6 +321,9 @@ static FAR const struct proc_node_s * const g_nodeinfo[] =
   &g_loadavg,      /* Average CPU utilization */
 #endif
   &g_stack,        /* Task stack info */
+#ifdef CONFIG_TUX_SYSCALL_STATS
+  &g_tuxsyscalls,  /* Linux syscall statistics */
+#endif
   &g_group,        /* Group directory */
   &g_groupstatus,  /* Task group status */
   &g_groupfd       /* Group file descriptors */
@@ -331,6 +344,9 @@ static const struct proc_node_s * const g_level0info[] =
   &g_loadavg,      /* Average CPU utilization */
 #endif
   &g_stack,        /* Task stack info */
+#ifdef CONFIG_TUX_SYSCALL_STATS
+  &g_tuxsyscalls,  /* Linux syscall statistics */
+#endif
   &g_group,        /* Group directory */
 };
 #define PROC_NLEVEL0NODES (sizeof(g_level0info)/sizeof(FAR const struct proc_node_s * const))
@@ -1329,6 +1345,12 @@ static ssize_t proc_read(FAR struct file *filep, FAR char *buffer,
       ret = proc_stack(procfile, tcb, buffer, buflen, filep->f_pos);
       break;
 
+#ifdef CONFIG_TUX_SYSCALL_STATS
+    case PROC_TUX_SYSCALLS: /* Linux syscall statistics */
+      ret = tux_syscall_stats_read(tcb, buffer, buflen, filep->f_pos);
+      break;
+
+#endif
     case PROC_GROUP_STATUS: /* Task group status */
       ret = proc_groupstatus(procfile, tcb, buffer, buflen, filep->f_pos);
       break;
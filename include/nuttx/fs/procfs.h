@@ -212,6 +212,31 @@ size_t procfs_memcpy(FAR const char *src, size_t srclen,
 int procfs_register(FAR const struct procfs_entry_s *entry);
 #endif
 
+/****************************************************************************
+ * Name: tux_syscall_stats_read
+ *
+ * Description:
+ *   Provide the contents of /proc/<pid>/tux_syscalls, the Linux syscalls
+ *   made by a task.  Implemented by the Linux subsystem of the x86_64
+ *   architecture.
+ *
+ * Input Parameters:
+ *   tcb    - The task whose statistics are read.
+ *   buffer - The user's receive buffer.
+ *   buflen - The size (in bytes) of the user's receive buffer.
+ *   offset - The file position to read from.
+ *
+ * Returned Value:
+ *   The number of bytes transferred to the user's buffer.
+ *
+ ****************************************************************************/
+
+#ifdef CONFIG_TUX_SYSCALL_STATS
+struct tcb_s;
+ssize_t tux_syscall_stats_read(FAR struct tcb_s *tcb, FAR char *buffer,
+                               size_t buflen, off_t offset);
+#endif
+
 #undef EXTERN
 #ifdef __cplusplus
 }